@@ -8,6 +8,14 @@ class AbstractSender {
  public:
   virtual ~AbstractSender() {}
   virtual void Send(const std::string& message) = 0;
+
+  /**
+   * Send a message held in a caller owned buffer, only valid during the call.
+   * Override it to take the bytes without building a std::string.
+   */
+  virtual void Send(const char* message, size_t size) {
+    Send(std::string(message, size));
+  }
 };
 }
 }
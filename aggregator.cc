@@ -0,0 +1,462 @@
+#include "./aggregator.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <unordered_map>
+#include <utility>
+#include "base/common/gflags.h"
+#include "base/common/logging.h"
+#include "base/common/closure.h"
+#include "base/strings/string_printf.h"
+#include "./non_blocking_sender.h"
+
+namespace base {
+namespace statsd {
+DEFINE_int32(statsd_aggregate_interval_ms, 1000, "flush interval of the shared statsd aggregator");
+DEFINE_bool(statsd_timer_sketch, false, "aggregate timers into quantile sketches instead of sending every sample");
+DEFINE_double(statsd_timer_relative_accuracy, 0.01, "relative accuracy of timer quantiles");
+DEFINE_int32(statsd_timer_max_buckets, 2048, "max buckets per timer sketch, 8 bytes each");
+DEFINE_string(statsd_timer_aggregates, "count,min,max,mean,p50,p90,p99",
+              "aggregates emitted per timer key: count, sum, min, max, mean and pNN quantiles");
+DEFINE_bool(statsd_set_hll, false,
+            "count distinct set values in process with HyperLogLog and emit the estimate as a gauge per interval");
+DEFINE_int32(statsd_set_hll_precision, 14, "log2 of the registers per set HyperLogLog, 1 byte each");
+
+namespace {
+struct CounterCell {
+  CounterCell(): sum(0), touched(false) {}
+  std::atomic<double> sum;
+  std::atomic<bool> touched;
+};
+
+struct GaugeCell {
+  GaugeCell(): value(0), stamp(0) {}
+  std::atomic<double> value;
+  // monotonic time of the last update, 0 if not updated since last flush
+  std::atomic<uint64_t> stamp;
+};
+
+inline void atomicAdd(std::atomic<double>* target, double delta) {
+  double current = target->load(std::memory_order_relaxed);
+  while (!target->compare_exchange_weak(current, current + delta, std::memory_order_relaxed)) {
+  }
+}
+
+inline uint64_t monotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec + 1;
+}
+
+// 1 / sampleRate, computed from the decimal the rate stands for (0.1f is 0.100000001 in binary),
+// the same value statsd derives from the "|@0.1" annotation
+inline double sampleScale(float sampleRate) {
+  static thread_local float lastRate = 1;
+  static thread_local double lastScale = 1;
+  if (sampleRate != lastRate) {
+    double rate = sampleRate;
+    double unit = pow(10, floor(log10(rate)) - 6);
+    lastScale = 1 / (round(rate / unit) * unit);
+    lastRate = sampleRate;
+  }
+  return lastScale;
+}
+
+std::atomic<uint64_t> nextAggregatorId(1);
+}
+
+struct TimerCell {
+  TimerCell(double relativeAccuracy, size_t maxBuckets): sketch(relativeAccuracy, maxBuckets) {}
+  std::mutex mutex;
+  DDSketch sketch;
+};
+
+struct SetCell {
+  explicit SetCell(int precision): hll(precision) {}
+  std::mutex mutex;
+  HyperLogLog hll;
+};
+
+struct Aggregator::Shard {
+  Shard(): orphaned(false) {}
+
+  // written by the owner thread only, under mutex; read by the owner without lock and by Flush() under mutex
+  std::unordered_map<std::string, std::unique_ptr<CounterCell> > counters;
+  std::unordered_map<std::string, std::unique_ptr<GaugeCell> > gauges;
+  std::unordered_map<std::string, std::unique_ptr<TimerCell> > timers;
+  std::unordered_map<std::string, std::unique_ptr<SetCell> > sets;
+  std::mutex mutex;
+  // set once the owner thread exited, the shard is dropped after its last flush
+  std::atomic<bool> orphaned;
+};
+
+// shards of the calling thread, one per aggregator it has written to
+struct Aggregator::ShardCache {
+  ~ShardCache() {
+    for (size_t i = 0; i < entries.size(); i++) {
+      entries[i].second->orphaned.store(true, std::memory_order_release);
+    }
+  }
+  std::vector<std::pair<uint64_t, std::shared_ptr<Shard> > > entries;
+};
+
+thread_local Aggregator::ShardCache Aggregator::shardCache_;
+
+Aggregator* Aggregator::Instance() {
+  static Aggregator* INSTANCE = NULL;
+  static std::once_flag once;
+  std::call_once(once, []() {
+    INSTANCE = new Aggregator(NonBlockingSender::Instance(), Options());
+    INSTANCE->Start();
+  });
+  return INSTANCE;
+}
+
+Aggregator::Options::Options() {
+  flushIntervalMs = FLAGS_statsd_aggregate_interval_ms;
+  sketchTimers = FLAGS_statsd_timer_sketch;
+  timerRelativeAccuracy = FLAGS_statsd_timer_relative_accuracy;
+  timerMaxBuckets = FLAGS_statsd_timer_max_buckets;
+  timerAggregates = FLAGS_statsd_timer_aggregates;
+  countSets = FLAGS_statsd_set_hll;
+  setPrecision = FLAGS_statsd_set_hll_precision;
+}
+
+Aggregator::Aggregator(AbstractSender* sender, const Options& options) {
+  init(sender, options);
+}
+
+Aggregator::Aggregator(AbstractSender* sender, int flushIntervalMs) {
+  Options options;
+  options.flushIntervalMs = flushIntervalMs;
+  init(sender, options);
+}
+
+void Aggregator::init(AbstractSender* sender, const Options& options) {
+  CHECK(sender != NULL) << "sender is NULL";
+  CHECK(options.flushIntervalMs > 0) << "flush interval must be positive";
+  sender_ = sender;
+  options_ = options;
+  id_ = nextAggregatorId.fetch_add(1);
+  running_ = false;
+
+  std::stringstream names(options.timerAggregates);
+  std::string name;
+  while (std::getline(names, name, ',')) {
+    if (name.empty()) {
+      continue;
+    }
+    TimerAggregate aggregate;
+    aggregate.name = name;
+    aggregate.quantile = 0;
+    if (name == "count") {
+      aggregate.kind = 'c';
+    } else if (name == "sum") {
+      aggregate.kind = 's';
+    } else if (name == "min") {
+      aggregate.kind = 'i';
+    } else if (name == "max") {
+      aggregate.kind = 'a';
+    } else if (name == "mean") {
+      aggregate.kind = 'm';
+    } else if (name[0] == 'p' && name.size() > 1) {
+      char* end = NULL;
+      double percentile = strtod(name.c_str() + 1, &end);
+      if (*end != '\0' || percentile < 0 || percentile > 100) {
+        LOG(ERROR) << "Ignore invalid timer aggregate " << name;
+        continue;
+      }
+      aggregate.kind = 'q';
+      aggregate.quantile = percentile / 100;
+    } else {
+      LOG(ERROR) << "Ignore unknown timer aggregate " << name;
+      continue;
+    }
+    timerAggregates_.push_back(aggregate);
+  }
+
+  int precision = options_.setPrecision;
+  if (precision < HyperLogLog::MIN_PRECISION) {
+    precision = HyperLogLog::MIN_PRECISION;
+  } else if (precision > HyperLogLog::MAX_PRECISION) {
+    precision = HyperLogLog::MAX_PRECISION;
+  }
+  if (options_.countSets && precision != options_.setPrecision) {
+    LOG(ERROR) << "Set HyperLogLog precision " << options_.setPrecision << " is out of range, use " << precision;
+  }
+  options_.setPrecision = precision;
+}
+
+Aggregator::~Aggregator() {
+  Stop();
+  Flush();
+}
+
+Aggregator::Shard* Aggregator::localShard() {
+  std::vector<std::pair<uint64_t, std::shared_ptr<Shard> > >& entries = shardCache_.entries;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].first == id_) {
+      return entries[i].second.get();
+    }
+  }
+  std::shared_ptr<Shard> shard(new Shard());
+  {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    shards_.push_back(shard);
+  }
+  entries.push_back(std::make_pair(id_, shard));
+  return shard.get();
+}
+
+void Aggregator::Count(const std::string& key, int64 value, float sampleRate) {
+  double scaled = value;
+  if (sampleRate > 0 && sampleRate < 1) {
+    scaled *= sampleScale(sampleRate);
+  }
+
+  Shard* shard = localShard();
+  CounterCell* cell = NULL;
+  auto found = shard->counters.find(key);
+  if (found != shard->counters.end()) {
+    cell = found->second.get();
+  } else {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    cell = new CounterCell();
+    shard->counters[key].reset(cell);
+  }
+  atomicAdd(&cell->sum, scaled);
+  cell->touched.store(true, std::memory_order_release);
+}
+
+void Aggregator::Gauge(const std::string& key, double value) {
+  Shard* shard = localShard();
+  GaugeCell* cell = NULL;
+  auto found = shard->gauges.find(key);
+  if (found != shard->gauges.end()) {
+    cell = found->second.get();
+  } else {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    cell = new GaugeCell();
+    shard->gauges[key].reset(cell);
+  }
+  cell->value.store(value, std::memory_order_relaxed);
+  cell->stamp.store(monotonicNanos(), std::memory_order_release);
+}
+
+void Aggregator::Time(const std::string& key, double ms, float sampleRate) {
+  double weight = 1;
+  if (sampleRate > 0 && sampleRate < 1) {
+    weight = sampleScale(sampleRate);
+  }
+
+  Shard* shard = localShard();
+  TimerCell* cell = NULL;
+  auto found = shard->timers.find(key);
+  if (found != shard->timers.end()) {
+    cell = found->second.get();
+  } else {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    cell = new TimerCell(options_.timerRelativeAccuracy, options_.timerMaxBuckets);
+    shard->timers[key].reset(cell);
+  }
+  // only contended while Flush() drains this cell
+  std::lock_guard<std::mutex> lock(cell->mutex);
+  cell->sketch.Add(ms, weight);
+}
+
+void Aggregator::Set(const std::string& key, const std::string& value) {
+  Shard* shard = localShard();
+  SetCell* cell = NULL;
+  auto found = shard->sets.find(key);
+  if (found != shard->sets.end()) {
+    cell = found->second.get();
+  } else {
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    cell = new SetCell(options_.setPrecision);
+    shard->sets[key].reset(cell);
+  }
+  // only contended while Flush() drains this cell
+  std::lock_guard<std::mutex> lock(cell->mutex);
+  cell->hll.Add(value.data(), value.size());
+}
+
+void Aggregator::Flush() {
+  std::lock_guard<std::mutex> flushLock(flushMutex_);
+
+  std::vector<std::shared_ptr<Shard> > shards;
+  {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    shards = shards_;
+  }
+
+  std::map<std::string, double> counters;
+  // key => (stamp, value), the latest update across shards wins
+  std::map<std::string, std::pair<uint64_t, double> > gauges;
+  std::map<std::string, DDSketch> timers;
+  std::map<std::string, HyperLogLog> sets;
+  std::vector<Shard*> drained;
+  for (size_t i = 0; i < shards.size(); i++) {
+    Shard* shard = shards[i].get();
+    // read before draining, so no update of an exited owner can be missed
+    bool orphaned = shard->orphaned.load(std::memory_order_acquire);
+    std::lock_guard<std::mutex> lock(shard->mutex);
+    for (auto it = shard->counters.begin(); it != shard->counters.end(); ++it) {
+      CounterCell* cell = it->second.get();
+      if (cell->touched.exchange(false, std::memory_order_acquire)) {
+        counters[it->first] += cell->sum.exchange(0, std::memory_order_relaxed);
+      }
+    }
+    for (auto it = shard->gauges.begin(); it != shard->gauges.end(); ++it) {
+      GaugeCell* cell = it->second.get();
+      uint64_t stamp = cell->stamp.exchange(0, std::memory_order_acquire);
+      if (stamp == 0) {
+        continue;
+      }
+      std::pair<uint64_t, double>& latest = gauges[it->first];
+      if (stamp > latest.first) {
+        latest = std::make_pair(stamp, cell->value.load(std::memory_order_relaxed));
+      }
+    }
+    for (auto it = shard->timers.begin(); it != shard->timers.end(); ++it) {
+      TimerCell* cell = it->second.get();
+      std::lock_guard<std::mutex> cellLock(cell->mutex);
+      if (cell->sketch.Empty()) {
+        continue;
+      }
+      auto merged = timers.find(it->first);
+      if (merged == timers.end()) {
+        timers.insert(std::make_pair(it->first, cell->sketch));
+      } else {
+        merged->second.Merge(cell->sketch);
+      }
+      cell->sketch.Clear();
+    }
+    for (auto it = shard->sets.begin(); it != shard->sets.end(); ++it) {
+      SetCell* cell = it->second.get();
+      std::lock_guard<std::mutex> cellLock(cell->mutex);
+      if (cell->hll.Empty()) {
+        continue;
+      }
+      auto merged = sets.find(it->first);
+      if (merged == sets.end()) {
+        sets.insert(std::make_pair(it->first, cell->hll));
+      } else {
+        merged->second.Merge(cell->hll);
+      }
+      cell->hll.Clear();
+    }
+    if (orphaned) {
+      drained.push_back(shard);
+    }
+  }
+
+  if (!drained.empty()) {
+    std::lock_guard<std::mutex> lock(shardsMutex_);
+    for (size_t i = 0; i < shards_.size();) {
+      bool dropped = false;
+      for (size_t k = 0; k < drained.size(); k++) {
+        if (shards_[i].get() == drained[k]) {
+          dropped = true;
+          break;
+        }
+      }
+      if (dropped) {
+        shards_.erase(shards_.begin() + i);
+      } else {
+        i++;
+      }
+    }
+  }
+
+  for (auto it = counters.begin(); it != counters.end(); ++it) {
+    sender_->Send(base::StringPrintf("%s:%.15g|c", it->first.c_str(), it->second));
+  }
+  for (auto it = gauges.begin(); it != gauges.end(); ++it) {
+    sender_->Send(base::StringPrintf("%s:%.5g|g", it->first.c_str(), it->second.second));
+  }
+  for (auto it = timers.begin(); it != timers.end(); ++it) {
+    emitTimer(it->first, it->second);
+  }
+  for (auto it = sets.begin(); it != sets.end(); ++it) {
+    sender_->Send(base::StringPrintf("%s:%.0f|g", it->first.c_str(), round(it->second.Estimate())));
+  }
+}
+
+void Aggregator::emitTimer(const std::string& key, const DDSketch& sketch) {
+  // aggregate names go between the metric name and its tags
+  size_t tagsAt = key.find(',');
+  if (tagsAt == std::string::npos) {
+    tagsAt = key.size();
+  }
+  std::string name = key.substr(0, tagsAt);
+  const char* tags = key.c_str() + tagsAt;
+
+  for (size_t i = 0; i < timerAggregates_.size(); i++) {
+    const TimerAggregate& aggregate = timerAggregates_[i];
+    const char* type = "g";
+    double value = 0;
+    switch (aggregate.kind) {
+      case 'c':
+        value = sketch.Count();
+        type = "c";
+        break;
+      case 's':
+        value = sketch.Sum();
+        break;
+      case 'i':
+        value = sketch.Min();
+        break;
+      case 'a':
+        value = sketch.Max();
+        break;
+      case 'm':
+        value = sketch.Mean();
+        break;
+      default:
+        value = sketch.Quantile(aggregate.quantile);
+        break;
+    }
+    const char* format = aggregate.kind == 'c' ? "%s.%s%s:%.15g|%s" : "%s.%s%s:%.5g|%s";
+    sender_->Send(base::StringPrintf(format, name.c_str(), aggregate.name.c_str(), tags, value, type));
+  }
+}
+
+void Aggregator::Start() {
+  std::lock_guard<std::mutex> lock(stateMutex_);
+  if (running_) {
+    return;
+  }
+  running_ = true;
+  worker_.Start(::NewCallback(this, &Aggregator::flushing));
+}
+
+void Aggregator::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(stateMutex_);
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+    stateChanged_.notify_all();
+  }
+  worker_.Join();
+}
+
+void Aggregator::flushing() {
+  std::unique_lock<std::mutex> lock(stateMutex_);
+  while (running_) {
+    stateChanged_.wait_for(lock, std::chrono::milliseconds(options_.flushIntervalMs));
+    if (!running_) {
+      break;
+    }
+    lock.unlock();
+    Flush();
+    lock.lock();
+  }
+}
+}
+}
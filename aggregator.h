@@ -0,0 +1,152 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "base/thread/thread.h"
+#include "./abstract_sender.h"
+#include "./ddsketch.h"
+#include "./hyper_log_log.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Pre-aggregates counters and gauges in process, and emits one line per key every flush interval.
+ *
+ * Counters with the same rendered key (ns + key + tags) are summed, after being scaled by
+ * 1 / sampleRate, and emitted as "key:sum|c". Gauges keep the last value and are emitted as
+ * "key:value|g". Keys without updates in an interval are not emitted.
+ *
+ * Optionally timers are folded into a per key DDSketch, and only the configured aggregates are
+ * emitted, e.g. "ns.rpc.p99,tag=v:12.5|g" for key "ns.rpc,tag=v". "count" is emitted as a counter,
+ * every other aggregate as a gauge. Quantiles are within Options::timerRelativeAccuracy of the
+ * true value, see ddsketch.h.
+ *
+ * Optionally sets are folded into a per key HyperLogLog, and only the estimated number of distinct
+ * values is emitted, as "key:cardinality|g", see hyper_log_log.h for its error.
+ *
+ * Every producing thread writes to its own shard: updating a known key is a hash lookup plus
+ * an atomic add, and the shard lock is only taken to insert a new key or while Flush() merges
+ * the shards. Keys are never evicted, so this is meant for bounded key sets.
+ *
+ * Thread safe.
+ */
+class Aggregator {
+ public:
+  struct Options {
+    /**
+     * Defaults from the --statsd_aggregate_interval_ms and --statsd_timer_* flags
+     */
+    Options();
+
+    /**
+     * how often the background thread flushes once Start() is called
+     */
+    int flushIntervalMs;
+    /**
+     * fold timers into sketches instead of sending every sample
+     */
+    bool sketchTimers;
+    double timerRelativeAccuracy;
+    size_t timerMaxBuckets;
+    /**
+     * comma separated aggregates emitted per timer key: count, sum, min, max, mean and
+     * quantiles as pNN, e.g. "count,mean,p50,p99,p99.9"
+     */
+    std::string timerAggregates;
+    /**
+     * count distinct set values in HyperLogLogs of 2^setPrecision registers instead of sending them
+     */
+    bool countSets;
+    int setPrecision;
+  };
+
+  /**
+   * Shared instance flushing into NonBlockingSender::Instance() with default Options
+   */
+  static Aggregator* Instance();
+
+  /**
+   * @param sender
+   *     where aggregated lines go, not owned
+   */
+  Aggregator(AbstractSender* sender, const Options& options);
+  Aggregator(AbstractSender* sender, int flushIntervalMs);
+
+  /**
+   * Stop the background thread and flush what is left
+   */
+  ~Aggregator();
+
+  void Count(const std::string& key, int64 value, float sampleRate = 1.0);
+  void Gauge(const std::string& key, double value);
+
+  /**
+   * Record a timer sample in milliseconds, only if SketchesTimers()
+   */
+  void Time(const std::string& key, double ms, float sampleRate = 1.0);
+  bool SketchesTimers() const { return options_.sketchTimers; }
+
+  /**
+   * Record a set member, only if CountsSets()
+   */
+  void Set(const std::string& key, const std::string& value);
+  bool CountsSets() const { return options_.countSets; }
+
+  /**
+   * Merge all shards and send one line per updated key.
+   */
+  void Flush();
+
+  /**
+   * Start/Stop flushing every flushIntervalMs on a background thread
+   */
+  void Start();
+  void Stop();
+
+  int FlushIntervalMs() const { return options_.flushIntervalMs; }
+
+ private:
+  struct TimerAggregate {
+    std::string name;
+    // 'c'ount, 's'um, m'i'n, m'a'x, 'm'ean or 'q'uantile
+    char kind;
+    double quantile;
+  };
+
+  struct Shard;
+  struct ShardCache;
+  Shard* localShard();
+  void flushing();
+  void init(AbstractSender* sender, const Options& options);
+  void emitTimer(const std::string& key, const DDSketch& sketch);
+
+ private:
+  AbstractSender* sender_;
+  Options options_;
+  std::vector<TimerAggregate> timerAggregates_;
+  // identifies this aggregator in the thread local shard caches
+  uint64_t id_;
+
+  std::mutex shardsMutex_;
+  std::vector<std::shared_ptr<Shard> > shards_;
+
+  // serializes Flush() calls
+  std::mutex flushMutex_;
+
+  thread::Thread worker_;
+  std::mutex stateMutex_;
+  std::condition_variable stateChanged_;
+  bool running_;
+
+  static thread_local ShardCache shardCache_;
+
+  DISALLOW_COPY_AND_ASSIGN(Aggregator);
+};
+}
+}
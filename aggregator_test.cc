@@ -0,0 +1,227 @@
+#include "./aggregator.h"
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/testing/gtest.h"
+#include "./dummy_sender.h"
+#include "./influxed_statsd_client.h"
+#include "./sampler.h"
+
+namespace base {
+namespace statsd {
+
+class AggregatorTest: public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    FLAGS_statsd_client_side_sampling = false;
+    sender = new DummySender();
+    aggregator = new Aggregator(sender, 1000);
+  }
+  virtual void TearDown() {
+    delete aggregator;
+    delete sender;
+    FLAGS_statsd_client_side_sampling = true;
+  }
+
+  std::vector<std::string> flush() {
+    sender->messages_.clear();
+    aggregator->Flush();
+    std::vector<std::string> messages = sender->messages_;
+    std::sort(messages.begin(), messages.end());
+    return messages;
+  }
+
+  DummySender* sender;
+  Aggregator* aggregator;
+};
+
+TEST_F(AggregatorTest, SumsCounters) {
+  aggregator->Count("a", 1);
+  aggregator->Count("a", 2);
+  aggregator->Count("b,tag=v", -1);
+  std::vector<std::string> messages = flush();
+  ASSERT_EQ(messages.size(), 2u);
+  ASSERT_EQ(messages[0], "a:3|c");
+  ASSERT_EQ(messages[1], "b,tag=v:-1|c");
+}
+
+TEST_F(AggregatorTest, ScalesBySampleRate) {
+  aggregator->Count("a", 1, 0.1);
+  aggregator->Count("a", 2, 0.5);
+  std::vector<std::string> messages = flush();
+  ASSERT_EQ(messages.size(), 1u);
+  ASSERT_EQ(messages[0], "a:14|c");
+}
+
+TEST_F(AggregatorTest, KeepsLastGauge) {
+  aggregator->Gauge("g", 1.5);
+  aggregator->Gauge("g", 0.01);
+  std::vector<std::string> messages = flush();
+  ASSERT_EQ(messages.size(), 1u);
+  ASSERT_EQ(messages[0], "g:0.01|g");
+}
+
+TEST_F(AggregatorTest, OnlyEmitsUpdatedKeys) {
+  aggregator->Count("a", 1);
+  aggregator->Gauge("g", 1);
+  ASSERT_EQ(flush().size(), 2u);
+  ASSERT_EQ(flush().size(), 0u);
+
+  aggregator->Count("a", 5);
+  std::vector<std::string> messages = flush();
+  ASSERT_EQ(messages.size(), 1u);
+  ASSERT_EQ(messages[0], "a:5|c");
+}
+
+TEST_F(AggregatorTest, MergesThreadShards) {
+  const int threads = 8;
+  const int perThread = 10000;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.push_back(std::thread([this, perThread]() {
+      for (int i = 0; i < perThread; i++) {
+        aggregator->Count("hits", 1);
+      }
+    }));
+  }
+  // flushing concurrently must neither lose nor double count
+  double total = 0;
+  for (int round = 0; round < 5; round++) {
+    std::vector<std::string> messages = flush();
+    if (!messages.empty()) {
+      total += std::stod(messages[0].substr(5));
+    }
+  }
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+  std::vector<std::string> messages = flush();
+  if (!messages.empty()) {
+    total += std::stod(messages[0].substr(5));
+  }
+  ASSERT_EQ(total, threads * perThread);
+
+  // shards of exited threads are released once drained
+  ASSERT_EQ(flush().size(), 0u);
+}
+
+TEST_F(AggregatorTest, BackgroundFlush) {
+  Aggregator fast(sender, 10);
+  fast.Start();
+  fast.Count("a", 1);
+  // several intervals pass, the key is emitted only once
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  fast.Stop();
+  ASSERT_EQ(sender->messages_.size(), 1u);
+  ASSERT_EQ(sender->messages_[0], "a:1|c");
+}
+
+TEST_F(AggregatorTest, TimersAreNotSketchedByDefault) {
+  InfluxedStatsdClient client = InfluxedStatsdClient(sender).Aggregated(aggregator);
+  client.Time("latency", 3);
+  ASSERT_EQ(sender->message_, "latency:3|ms");
+}
+
+TEST_F(AggregatorTest, SketchedTimers) {
+  Aggregator::Options options;
+  options.sketchTimers = true;
+  options.timerAggregates = "count,min,max,mean,p50,p99,bogus";
+  Aggregator timers(sender, options);
+
+  InfluxedStatsdClient client = InfluxedStatsdClient(sender).Ns("ns").Tags({ {"tag", "v"} }).Aggregated(&timers);
+  for (int ms = 1; ms <= 100; ms++) {
+    client.Time("rpc", ms);
+  }
+  client.Timer("sampled").Time(10, 0.5);
+  ASSERT_TRUE(sender->messages_.empty());
+
+  timers.Flush();
+  std::vector<std::string> messages = sender->messages_;
+  ASSERT_EQ(messages.size(), 12u);
+  ASSERT_EQ(messages[0], "ns.rpc.count,tag=v:100|c");
+  ASSERT_EQ(messages[1], "ns.rpc.min,tag=v:1|g");
+  ASSERT_EQ(messages[2], "ns.rpc.max,tag=v:100|g");
+  ASSERT_EQ(messages[3], "ns.rpc.mean,tag=v:50.5|g");
+  // within 1% of the exact 50 and 99
+  double p50 = std::stod(messages[4].substr(messages[4].find(':') + 1));
+  ASSERT_NEAR(p50, 50, 0.5);
+  double p99 = std::stod(messages[5].substr(messages[5].find(':') + 1));
+  ASSERT_NEAR(p99, 99, 0.99);
+  ASSERT_EQ(messages[6], "ns.sampled.count,tag=v:2|c");
+}
+
+TEST_F(AggregatorTest, SetsAreNotCountedByDefault) {
+  InfluxedStatsdClient client = InfluxedStatsdClient(sender).Aggregated(aggregator);
+  client.Set("users", "alice");
+  ASSERT_EQ(sender->message_, "users:alice|s");
+}
+
+TEST_F(AggregatorTest, CountedSets) {
+  Aggregator::Options options;
+  options.countSets = true;
+  options.setPrecision = 12;
+  Aggregator sets(sender, options);
+
+  // 4 threads see overlapping ranges of users, each one 10 times: 17500 distinct
+  InfluxedStatsdClient client = InfluxedStatsdClient(sender).Ns("ns").Tags({ {"endpoint", "/a"} }).Aggregated(&sets);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.push_back(std::thread([&client, t]() {
+      for (int i = t * 2500; i < t * 2500 + 10000; i++) {
+        for (int k = 0; k < 10; k++) {
+          client.Set("users", "user" + std::to_string(i));
+        }
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+  client.Set("small", "a");
+  client.Set("small", "b");
+  client.Set("small", "a");
+  ASSERT_TRUE(sender->messages_.empty());
+
+  sets.Flush();
+  std::vector<std::string> messages = sender->messages_;
+  std::sort(messages.begin(), messages.end());
+  ASSERT_EQ(messages.size(), 2u);
+  ASSERT_EQ(messages[0], "ns.small,endpoint=/a:2|g");
+  ASSERT_EQ(messages[1].compare(0, 21, "ns.users,endpoint=/a:"), 0) << messages[1];
+  ASSERT_EQ(messages[1].substr(messages[1].size() - 2), "|g");
+  // 1.6% standard error with 2^12 registers, 3 sigma
+  double estimate = std::stod(messages[1].substr(21));
+  ASSERT_NEAR(estimate, 17500, 17500 * 3 * 1.04 / 64);
+
+  // counted afresh every interval
+  sender->messages_.clear();
+  sets.Flush();
+  ASSERT_TRUE(sender->messages_.empty());
+  client.Set("small", "c");
+  sets.Flush();
+  ASSERT_EQ(sender->message_, "ns.small,endpoint=/a:1|g");
+}
+
+TEST_F(AggregatorTest, AggregatedClient) {
+  InfluxedStatsdClient client = InfluxedStatsdClient(sender).Ns("ns").Aggregated(aggregator);
+  client.ImmutableAddTag({"tag", "v"}).Inc("key");
+  client.ImmutableAddTag({"tag", "v"}).Inc("key");
+  client.Gauge("gauge", 2);
+  // timers are not aggregated
+  client.Time("latency", 3);
+  ASSERT_EQ(sender->messages_.size(), 1u);
+  ASSERT_EQ(sender->message_, "ns.latency:3|ms");
+
+  std::vector<std::string> messages = flush();
+  ASSERT_EQ(messages.size(), 2u);
+  ASSERT_EQ(messages[0], "ns.gauge:2|g");
+  ASSERT_EQ(messages[1], "ns.key,tag=v:2|c");
+
+  // derived clients keep aggregating, unless told otherwise
+  client.Clone().Aggregated(NULL).Inc("key");
+  ASSERT_EQ(sender->message_, "ns.key:1|c");
+}
+}
+}  // namespace base
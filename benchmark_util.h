@@ -0,0 +1,77 @@
+#pragma once
+
+// Minimal harness shared by the *_benchmark binaries, reporting ns/op and heap allocations/op.
+// It replaces the global operator new to count allocations, so include it from exactly one
+// translation unit per binary.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+namespace benchmark {
+
+// heap allocations made by the current thread
+thread_local int64 allocations = 0;
+
+struct Result {
+  double nsPerOp;
+  double allocationsPerOp;
+};
+
+/**
+ * Run body(i) for iterations / 10 warm up calls, then time iterations calls
+ */
+template <typename Body>
+Result Measure(int64 iterations, Body body) {
+  for (int64 i = 0; i < iterations / 10; i++) {
+    body(i);
+  }
+  int64 allocationsBefore = allocations;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (int64 i = 0; i < iterations; i++) {
+    body(i);
+  }
+  double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  Result result;
+  result.nsPerOp = elapsed / iterations;
+  result.allocationsPerOp = static_cast<double>(allocations - allocationsBefore) / iterations;
+  return result;
+}
+
+inline void Report(const char* name, const Result& result) {
+  printf("%-52s %10.1f ns/op %8.2f allocs/op\n", name, result.nsPerOp, result.allocationsPerOp);
+  fflush(stdout);
+}
+
+template <typename Body>
+void Run(const char* name, int64 iterations, Body body) {
+  Report(name, Measure(iterations, body));
+}
+}
+}
+}
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+  base::statsd::benchmark::allocations++;
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
@@ -0,0 +1,256 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include "base/common/basic_types.h"
+#include "base/common/closure.h"
+#include "base/common/logging.h"
+#include "base/thread/thread.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Parses received statsd lines, counting them by metric type and summing counters per key.
+ * InfluxDB line protocol points are counted by field name instead, and their "count" fields
+ * summed per measurement and tags, see line_protocol.h.
+ * Thread safe.
+ */
+class MetricLineCounter {
+ public:
+  MetricLineCounter() : lines_(0), malformedLines_(0) {}
+
+  /**
+   * Count every line of a buffer of whole, newline separated lines, skipping empty ones
+   */
+  void Add(const char* data, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const char* end = data + size;
+    for (const char* line = data; line < end;) {
+      const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+      if (eol == NULL) {
+        eol = end;
+      }
+      // GSO pads the last segments with newlines
+      if (eol > line) {
+        parseLine(line, eol);
+      }
+      line = eol + 1;
+    }
+  }
+
+  int64 Lines() const { return lines_.load(std::memory_order_relaxed); }
+  int64 MalformedLines() const { return malformedLines_.load(std::memory_order_relaxed); }
+
+  /**
+   * Lines received so far by metric type, e.g. "c", "g" or "ms"
+   */
+  std::map<std::string, int64> LinesByType() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return linesByType_;
+  }
+
+  /**
+   * Sum of every counter received so far by key, sample rates applied
+   */
+  std::map<std::string, double> Counters() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return counters_;
+  }
+
+ private:
+  // key:value|type[|@rate]
+  void parseLine(const char* line, const char* end) {
+    lines_.fetch_add(1, std::memory_order_relaxed);
+    const char* space = static_cast<const char*>(memchr(line, ' ', end - line));
+    const char* colon = static_cast<const char*>(memchr(line, ':', end - line));
+    if (space != NULL && (colon == NULL || space < colon)) {
+      parsePoint(line, end);
+      return;
+    }
+    const char* bar = colon == NULL ? NULL : static_cast<const char*>(memchr(colon, '|', end - colon));
+    if (bar == NULL) {
+      malformedLines_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    const char* typeEnd = static_cast<const char*>(memchr(bar + 1, '|', end - bar - 1));
+    if (typeEnd == NULL) {
+      typeEnd = end;
+    }
+    std::string type(bar + 1, typeEnd);
+    linesByType_[type]++;
+    if (type != "c") {
+      return;
+    }
+    std::string value(colon + 1, bar);
+    double count = strtod(value.c_str(), NULL);
+    if (typeEnd + 2 < end && typeEnd[1] == '@') {
+      double rate = strtod(std::string(typeEnd + 2, end).c_str(), NULL);
+      if (rate > 0) {
+        count /= rate;
+      }
+    }
+    counters_[std::string(line, colon)] += count;
+  }
+
+  // measurement[,tags] field=value timestamp, spaces of the measurement and tags escaped
+  void parsePoint(const char* line, const char* end) {
+    std::string key;
+    const char* c = line;
+    for (; c < end && *c != ' '; c++) {
+      if (*c == '\\' && c + 1 < end) {
+        c++;
+      }
+      key.push_back(*c);
+    }
+    const char* field = c + 1;
+    const char* equals = field < end ? static_cast<const char*>(memchr(field, '=', end - field)) : NULL;
+    const char* timestamp = equals == NULL ? NULL : static_cast<const char*>(memrchr(equals, ' ', end - equals));
+    if (key.empty() || equals == NULL || timestamp == NULL) {
+      malformedLines_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    std::string name(field, equals);
+    linesByType_[name]++;
+    if (name == "count") {
+      counters_[key] += strtod(std::string(equals + 1, timestamp).c_str(), NULL);
+    }
+  }
+
+ private:
+  std::atomic<int64> lines_;
+  std::atomic<int64> malformedLines_;
+
+  mutable std::mutex mutex_;
+  std::map<std::string, int64> linesByType_;
+  std::map<std::string, double> counters_;
+
+  DISALLOW_COPY_AND_ASSIGN(MetricLineCounter);
+};
+
+/**
+ * In-process statsd server on a loopback UDP port or a unix datagram socket, for tests, load tests
+ * and benchmarks. It splits every received datagram into lines, counts them by metric type and sums
+ * counters per key, so a driver can check what actually reached the wire against what it sent.
+ */
+class DatagramSink {
+ public:
+  /**
+   * Bind an ephemeral loopback UDP port and start receiving, receiveBufferSize sets SO_RCVBUF.
+   */
+  explicit DatagramSink(int receiveBufferSize = 8 << 20)
+      : port_(0), stopped_(false), readDelayUs_(0), datagrams_(0), bytes_(0) {
+    sock_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    CHECK(sock_ >= 0) << "could not create sink socket";
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(sock_, (struct sockaddr*) &addr, sizeof(addr)) == 0) << "could not bind sink socket";
+    socklen_t len = sizeof(addr);
+    getsockname(sock_, (struct sockaddr*) &addr, &len);
+    port_ = ntohs(addr.sin_port);
+    start(receiveBufferSize);
+  }
+
+  /**
+   * Bind a unix datagram socket at path, replacing any file there, and start receiving.
+   */
+  explicit DatagramSink(const std::string& path, int receiveBufferSize = 8 << 20)
+      : port_(0), path_(path), stopped_(false), readDelayUs_(0), datagrams_(0), bytes_(0) {
+    sock_ = socket(AF_UNIX, SOCK_DGRAM, 0);
+    CHECK(sock_ >= 0) << "could not create sink socket";
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    CHECK(path.size() < sizeof(addr.sun_path)) << "unix socket path too long " << path;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+    unlink(path.c_str());
+    CHECK(bind(sock_, (struct sockaddr*) &addr, sizeof(addr)) == 0) << "could not bind sink socket " << path;
+    start(receiveBufferSize);
+  }
+
+  ~DatagramSink() {
+    Stop();
+    close(sock_);
+    if (!path_.empty()) {
+      unlink(path_.c_str());
+    }
+  }
+
+  /**
+   * Where senders should send to: "127.0.0.1" and Port(), or "unix://" + path with port 0
+   */
+  std::string Host() const { return path_.empty() ? "127.0.0.1" : "unix://" + path_; }
+  int Port() const { return port_; }
+
+  void Stop() {
+    if (!stopped_.exchange(true)) {
+      receiver_.Join();
+    }
+  }
+
+  /**
+   * Sleep this long after every datagram, a sink that falls behind its senders
+   */
+  void SetReadDelayUs(int delayUs) { readDelayUs_.store(delayUs); }
+
+  int64 Datagrams() const { return datagrams_.load(std::memory_order_relaxed); }
+  int64 Bytes() const { return bytes_.load(std::memory_order_relaxed); }
+  int64 Lines() const { return received_.Lines(); }
+  int64 MalformedLines() const { return received_.MalformedLines(); }
+  std::map<std::string, int64> LinesByType() const { return received_.LinesByType(); }
+  std::map<std::string, double> Counters() const { return received_.Counters(); }
+
+ private:
+  void start(int receiveBufferSize) {
+    setsockopt(sock_, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize));
+    // lets the receiving thread notice Stop()
+    struct timeval timeout = {0, 50 * 1000};
+    setsockopt(sock_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    receiver_.Start(::NewCallback(this, &DatagramSink::receiving));
+  }
+
+  void receiving() {
+    char buf[65536];
+    while (!stopped_.load()) {
+      ssize_t ret = recv(sock_, buf, sizeof(buf), 0);
+      if (ret <= 0) {
+        continue;
+      }
+      datagrams_.fetch_add(1, std::memory_order_relaxed);
+      bytes_.fetch_add(ret, std::memory_order_relaxed);
+      received_.Add(buf, ret);
+      int delayUs = readDelayUs_.load();
+      if (delayUs > 0) {
+        usleep(delayUs);
+      }
+    }
+  }
+
+ private:
+  int sock_;
+  int port_;
+  std::string path_;
+  thread::Thread receiver_;
+  std::atomic<bool> stopped_;
+  std::atomic<int> readDelayUs_;
+
+  std::atomic<int64> datagrams_;
+  std::atomic<int64> bytes_;
+  MetricLineCounter received_;
+
+  DISALLOW_COPY_AND_ASSIGN(DatagramSink);
+};
+}
+}
@@ -0,0 +1,344 @@
+#include "./datagram_writer.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+namespace base {
+namespace statsd {
+
+// sendmmsg batch size, it is also the kernel limit of segments per UDP_SEGMENT send
+static const size_t MAX_BATCH = 64;
+// a GSO super buffer must fit into one IP datagram
+static const size_t MAX_GSO_BYTES = 65000;
+static const int WRITABLE_WAIT_MS = 10;
+static const int MAX_EAGAIN_RETRIES = 3;
+// io_uring send buffers, each as large as the packer payload
+static const size_t URING_SLOTS = 256;
+
+static const char PADDING = '\n';
+
+bool ParseSendMode(const std::string& name, SendMode* mode) {
+  if (name == "sendto") {
+    *mode = SEND_TO;
+  } else if (name == "sendmmsg") {
+    *mode = SEND_MMSG;
+  } else if (name == "gso") {
+    *mode = SEND_GSO;
+  } else if (name == "io_uring") {
+    *mode = SEND_URING;
+  } else if (name == "io_uring_sqpoll") {
+    *mode = SEND_URING_SQPOLL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* SendModeName(SendMode mode) {
+  switch (mode) {
+    case SEND_TO: return "sendto";
+    case SEND_MMSG: return "sendmmsg";
+    case SEND_GSO: return "gso";
+    case SEND_URING: return "io_uring";
+    case SEND_URING_SQPOLL: return "io_uring_sqpoll";
+  }
+  return "unknown";
+}
+
+static inline bool isWouldBlock(int err) {
+  return err == EAGAIN || err == EWOULDBLOCK || err == ENOBUFS;
+}
+
+DatagramWriter::DatagramWriter(int sock, const struct sockaddr* addr, socklen_t addrLen, SendMode mode) {
+  sock_ = sock;
+  memset(&addr_, 0, sizeof(addr_));
+  addrLen_ = 0;
+  if (addr != NULL) {
+    memcpy(&addr_, addr, std::min<size_t>(addrLen, sizeof(addr_)));
+    addrLen_ = addrLen;
+  }
+  mode_ = mode;
+  syscalls_ = 0;
+  uring_ = NULL;
+  errmsg_[0] = '\0';
+#if !defined(__linux__)
+  // sendmmsg, UDP_SEGMENT and io_uring are linux only
+  mode_ = SEND_TO;
+#endif
+}
+
+DatagramWriter::~DatagramWriter() {
+  delete uring_;
+}
+
+int64 DatagramWriter::AsyncErrors() const {
+  return uring_ == NULL ? 0 : uring_->FailedCompletions();
+}
+
+const struct sockaddr* DatagramWriter::addr() const {
+  return addrLen_ == 0 ? NULL : (const struct sockaddr*) &addr_;
+}
+
+bool DatagramWriter::waitWritable() {
+  struct pollfd pfd;
+  pfd.fd = sock_;
+  pfd.events = POLLOUT;
+  pfd.revents = 0;
+  return poll(&pfd, 1, WRITABLE_WAIT_MS) > 0;
+}
+
+size_t DatagramWriter::Write(const MetricPacker& packer, size_t* bytes) {
+  size_t ignored = 0;
+  if (bytes == NULL) {
+    bytes = &ignored;
+  }
+  *bytes = 0;
+  switch (mode_) {
+    case SEND_MMSG:
+      return writeMmsg(packer, 0, packer.Size(), bytes);
+    case SEND_GSO:
+      return writeGso(packer, bytes);
+    case SEND_URING:
+    case SEND_URING_SQPOLL:
+      return writeUring(packer, bytes);
+    default:
+      return writeOneByOne(packer, 0, packer.Size(), bytes);
+  }
+}
+
+size_t DatagramWriter::writeOneByOne(const MetricPacker& packer, size_t begin, size_t end, size_t* bytes) {
+  size_t sent = 0;
+  int retries = 0;
+  size_t i = begin;
+  while (i < end) {
+    const std::string& packet = packer.Packet(i);
+    syscalls_++;
+    ssize_t ret = sendto(sock_, packet.data(), packet.size(), 0, addr(), addrLen_);
+    if (ret >= 0) {
+      sent++;
+      *bytes += packet.size();
+      i++;
+      retries = 0;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (isWouldBlock(errno) && retries++ < MAX_EAGAIN_RETRIES && waitWritable()) {
+      continue;
+    }
+    snprintf(errmsg_, sizeof(errmsg_), "sendto fail, err=%m");
+    if (isWouldBlock(errno)) {
+      // socket stays full, give up the rest of this batch
+      break;
+    }
+    // skip the offending datagram only
+    i++;
+    retries = 0;
+  }
+  return sent;
+}
+
+size_t DatagramWriter::writeMmsg(const MetricPacker& packer, size_t begin, size_t end, size_t* bytes) {
+#if defined(__linux__)
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iovs[MAX_BATCH];
+  size_t sent = 0;
+  int retries = 0;
+  size_t i = begin;
+  while (i < end) {
+    size_t batch = std::min(MAX_BATCH, end - i);
+    memset(msgs, 0, sizeof(msgs[0]) * batch);
+    for (size_t k = 0; k < batch; k++) {
+      const std::string& packet = packer.Packet(i + k);
+      iovs[k].iov_base = const_cast<char*>(packet.data());
+      iovs[k].iov_len = packet.size();
+      msgs[k].msg_hdr.msg_name = const_cast<struct sockaddr*>(addr());
+      msgs[k].msg_hdr.msg_namelen = addrLen_;
+      msgs[k].msg_hdr.msg_iov = &iovs[k];
+      msgs[k].msg_hdr.msg_iovlen = 1;
+    }
+
+    syscalls_++;
+    int ret = sendmmsg(sock_, msgs, batch, 0);
+    if (ret > 0) {
+      // a short count means the next datagram failed or would block, resume from there
+      for (int k = 0; k < ret; k++) {
+        *bytes += iovs[k].iov_len;
+      }
+      sent += ret;
+      i += ret;
+      retries = 0;
+      continue;
+    }
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if ((ret == 0 || isWouldBlock(errno)) && retries++ < MAX_EAGAIN_RETRIES && waitWritable()) {
+      continue;
+    }
+    snprintf(errmsg_, sizeof(errmsg_), "sendmmsg fail, err=%m");
+    if (ret == 0 || isWouldBlock(errno)) {
+      break;
+    }
+    // the first datagram of the batch is the one failing, skip it
+    i++;
+    retries = 0;
+  }
+  return sent;
+#else
+  return writeOneByOne(packer, begin, end, bytes);
+#endif
+}
+
+size_t DatagramWriter::writeGso(const MetricPacker& packer, size_t* bytes) {
+#if defined(__linux__)
+  const size_t segment = packer.MaxPayloadSize();
+  const size_t perSend = std::min(MAX_BATCH, MAX_GSO_BYTES / std::max<size_t>(segment, 1));
+  if (perSend < 2) {
+    return writeMmsg(packer, 0, packer.Size(), bytes);
+  }
+
+  size_t sent = 0;
+  int retries = 0;
+  size_t i = 0;
+  const size_t n = packer.Size();
+  while (i < n) {
+    size_t end = std::min(n, i + perSend);
+
+    // every segment but the last one must be exactly `segment` long
+    bool fits = true;
+    gsoBuffer_.clear();
+    size_t payload = 0;
+    for (size_t k = i; k < end; k++) {
+      const std::string& packet = packer.Packet(k);
+      if (packet.size() > segment) {
+        fits = false;
+        break;
+      }
+      gsoBuffer_.append(packet);
+      payload += packet.size();
+      if (k + 1 != end) {
+        gsoBuffer_.append(segment - packet.size(), PADDING);
+      }
+    }
+    if (!fits || end - i == 1) {
+      size_t sentBytes = 0;
+      sent += writeMmsg(packer, i, end, &sentBytes);
+      *bytes += sentBytes;
+      i = end;
+      continue;
+    }
+
+    struct iovec iov;
+    iov.iov_base = const_cast<char*>(gsoBuffer_.data());
+    iov.iov_len = gsoBuffer_.size();
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = const_cast<struct sockaddr*>(addr());
+    msg.msg_namelen = addrLen_;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_UDP;
+    cm->cmsg_type = UDP_SEGMENT;
+    cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t gsoSize = segment;
+    memcpy(CMSG_DATA(cm), &gsoSize, sizeof(gsoSize));
+
+    syscalls_++;
+    ssize_t ret = sendmsg(sock_, &msg, 0);
+    if (ret >= 0) {
+      sent += end - i;
+      *bytes += payload;
+      i = end;
+      retries = 0;
+      continue;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (isWouldBlock(errno) && retries++ < MAX_EAGAIN_RETRIES && waitWritable()) {
+      continue;
+    }
+    snprintf(errmsg_, sizeof(errmsg_), "sendmsg with UDP_SEGMENT fail, err=%m");
+    if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP) {
+      // no GSO support on this kernel, device or socket type, stay on sendmmsg from now on
+      mode_ = SEND_MMSG;
+      size_t sentBytes = 0;
+      sent += writeMmsg(packer, i, n, &sentBytes);
+      *bytes += sentBytes;
+      return sent;
+    }
+    if (isWouldBlock(errno)) {
+      break;
+    }
+    i = end;
+    retries = 0;
+  }
+  return sent;
+#else
+  return writeOneByOne(packer, 0, packer.Size(), bytes);
+#endif
+}
+
+size_t DatagramWriter::writeUring(const MetricPacker& packer, size_t* bytes) {
+  if (uring_ == NULL) {
+    std::string error = "io_uring needs a connected socket";
+    if (addrLen_ == 0) {
+      uring_ = UringWriter::Create(sock_, packer.MaxPayloadSize(), URING_SLOTS, mode_ == SEND_URING_SQPOLL, &error);
+    }
+    if (uring_ == NULL) {
+      snprintf(errmsg_, sizeof(errmsg_), "%s", error.c_str());
+      mode_ = SEND_MMSG;
+      return writeMmsg(packer, 0, packer.Size(), bytes);
+    }
+  }
+
+  int64 syscalls = uring_->Syscalls();
+  int64 failed = uring_->FailedCompletions();
+  size_t sent = 0;
+  size_t i = 0;
+  const size_t n = packer.Size();
+  while (i < n) {
+    // a single metric larger than the payload size gets a packet of its own, too big for a buffer
+    if (packer.Packet(i).size() > uring_->SlotSize()) {
+      sent += writeOneByOne(packer, i, i + 1, bytes);
+      i++;
+      continue;
+    }
+    size_t end = i + 1;
+    while (end < n && packer.Packet(end).size() <= uring_->SlotSize()) {
+      end++;
+    }
+    size_t submitted = uring_->Submit(packer, i, end, bytes);
+    sent += submitted;
+    if (submitted < end - i) {
+      snprintf(errmsg_, sizeof(errmsg_), "%s", uring_->LastError());
+      break;
+    }
+    i = end;
+  }
+  syscalls_ += uring_->Syscalls() - syscalls;
+  if (uring_->FailedCompletions() != failed) {
+    snprintf(errmsg_, sizeof(errmsg_), "%s", uring_->LastError());
+  }
+  return sent;
+}
+}
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <string>
+#include "base/common/basic_types.h"
+#include "./metric_packer.h"
+#include "./uring_writer.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * How prepared datagrams are handed to the kernel
+ * SEND_TO:   one sendto per datagram, the historical path
+ * SEND_MMSG: many datagrams per sendmmsg call
+ * SEND_GSO:  datagrams padded to the packer payload size and glued into UDP_SEGMENT
+ *            super buffers, one sendmsg per 64 datagrams. Padding is made of '\n' which
+ *            statsd skips as empty lines. Falls back to SEND_MMSG if the kernel refuses it.
+ * SEND_URING: datagrams copied into buffers registered with an io_uring and submitted in batches,
+ *            completions reaped on the next Write. Needs a connected socket and falls back to
+ *            SEND_MMSG where io_uring is unavailable, e.g. before linux 5.1 or under seccomp.
+ * SEND_URING_SQPOLL: SEND_URING with a kernel thread polling the submission queue, which saves the
+ *            submit syscalls at the cost of that thread's cpu while it spins.
+ */
+enum SendMode {
+  SEND_TO,
+  SEND_MMSG,
+  SEND_GSO,
+  SEND_URING,
+  SEND_URING_SQPOLL,
+};
+
+/**
+ * Parse "sendto", "sendmmsg", "gso", "io_uring" or "io_uring_sqpoll", return false on unknown names
+ */
+bool ParseSendMode(const std::string& name, SendMode* mode);
+const char* SendModeName(SendMode mode);
+
+/**
+ * Writes packed datagrams to a datagram socket, it does not own the socket.
+ * Not thread safe, meant to be used by a single sender worker.
+ */
+class DatagramWriter {
+ public:
+  /**
+   * @param addr
+   *     destination, NULL if sock is connected
+   */
+  DatagramWriter(int sock, const struct sockaddr* addr, socklen_t addrLen, SendMode mode);
+  ~DatagramWriter();
+
+  /**
+   * Write every packet sealed in packer. Partial sends are resumed, EINTR and EAGAIN are retried
+   * shortly before giving up on the remaining datagrams.
+   *
+   * @param bytes
+   *     if not NULL, receives payload bytes of the accepted datagrams
+   * @return number of datagrams accepted by the kernel, LastError() tells why if it is short.
+   *     With SEND_URING that is datagrams submitted, see AsyncErrors().
+   */
+  size_t Write(const MetricPacker& packer, size_t* bytes);
+
+  /**
+   * Datagrams counted by Write() that the kernel failed to send later on, only SEND_URING
+   * completes sends asynchronously
+   */
+  int64 AsyncErrors() const;
+
+  SendMode Mode() const { return mode_; }
+  const char* LastError() const { return errmsg_; }
+
+  /**
+   * Number of send syscalls issued so far, including failed ones
+   */
+  int64 Syscalls() const { return syscalls_; }
+
+ private:
+  size_t writeOneByOne(const MetricPacker& packer, size_t begin, size_t end, size_t* bytes);
+  size_t writeMmsg(const MetricPacker& packer, size_t begin, size_t end, size_t* bytes);
+  size_t writeGso(const MetricPacker& packer, size_t* bytes);
+  size_t writeUring(const MetricPacker& packer, size_t* bytes);
+  const struct sockaddr* addr() const;
+  bool waitWritable();
+
+ private:
+  int sock_;
+  struct sockaddr_storage addr_;
+  socklen_t addrLen_;
+  SendMode mode_;
+  int64 syscalls_;
+  std::string gsoBuffer_;
+  // created on the first SEND_URING write, once the packet size is known
+  UringWriter* uring_;
+  char errmsg_[1024];
+
+  DISALLOW_COPY_AND_ASSIGN(DatagramWriter);
+};
+}
+}
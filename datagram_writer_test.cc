@@ -0,0 +1,190 @@
+#include "./datagram_writer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+class DatagramWriterTest: public ::testing::TestWithParam<SendMode> {
+ protected:
+  virtual void SetUp() {
+    receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    ASSERT_GE(receiver, 0);
+    struct timeval timeout = {1, 0};
+    setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(receiver, (struct sockaddr*) &addr, sizeof(addr)), 0);
+    socklen_t len = sizeof(addr);
+    getsockname(receiver, (struct sockaddr*) &addr, &len);
+
+    sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    ASSERT_GE(sender, 0);
+  }
+  virtual void TearDown() {
+    close(receiver);
+    close(sender);
+  }
+
+  std::vector<std::string> receiveAll(size_t n) {
+    std::vector<std::string> received;
+    char buf[65536];
+    for (size_t i = 0; i < n; i++) {
+      ssize_t ret = recv(receiver, buf, sizeof(buf), 0);
+      // io_uring completion work run on this thread interrupts a recv with a timeout
+      if (ret < 0 && errno == EINTR) {
+        i--;
+        continue;
+      }
+      if (ret < 0) {
+        break;
+      }
+      received.push_back(std::string(buf, ret));
+    }
+    return received;
+  }
+
+  // io_uring only writes to connected sockets
+  DatagramWriter* newWriter() {
+    if (GetParam() == SEND_URING || GetParam() == SEND_URING_SQPOLL) {
+      connect(sender, (struct sockaddr*) &addr, sizeof(addr));
+      return new DatagramWriter(sender, NULL, 0, GetParam());
+    }
+    return new DatagramWriter(sender, (struct sockaddr*) &addr, sizeof(addr), GetParam());
+  }
+
+  int receiver;
+  int sender;
+  struct sockaddr_in addr;
+};
+
+static std::string stripPadding(std::string datagram) {
+  while (!datagram.empty() && datagram[datagram.size() - 1] == '\n') {
+    datagram.erase(datagram.size() - 1);
+  }
+  return datagram;
+}
+
+TEST_P(DatagramWriterTest, WritesEveryPacket) {
+  MetricPacker packer(100);
+  for (int i = 0; i < 200; i++) {
+    packer.Add("key" + std::to_string(i) + ":1|c");
+  }
+  packer.Finish();
+
+  std::unique_ptr<DatagramWriter> writer(newWriter());
+  size_t bytes = 0;
+  ASSERT_EQ(writer->Write(packer, &bytes), packer.Size());
+
+  size_t expectedBytes = 0;
+  std::vector<std::string> received = receiveAll(packer.Size());
+  ASSERT_EQ(received.size(), packer.Size());
+  for (size_t i = 0; i < packer.Size(); i++) {
+    received[i] = stripPadding(received[i]);
+  }
+  std::vector<std::string> expected;
+  for (size_t i = 0; i < packer.Size(); i++) {
+    expected.push_back(packer.Packet(i));
+    expectedBytes += packer.Packet(i).size();
+  }
+  // io_uring does not order independent writes
+  if (writer->Mode() == SEND_URING || writer->Mode() == SEND_URING_SQPOLL) {
+    std::sort(received.begin(), received.end());
+    std::sort(expected.begin(), expected.end());
+  }
+  ASSERT_EQ(received, expected);
+  ASSERT_EQ(bytes, expectedBytes);
+  ASSERT_EQ(writer->AsyncErrors(), 0);
+
+  if (GetParam() == SEND_TO) {
+    ASSERT_EQ(writer->Syscalls(), static_cast<int64>(packer.Size()));
+  } else {
+    ASSERT_LT(writer->Syscalls(), static_cast<int64>(packer.Size()));
+  }
+}
+
+TEST_P(DatagramWriterTest, OversizedPacketIsSentAlone) {
+  MetricPacker packer(20);
+  packer.Add("a:1|c");
+  packer.Add(std::string(40, 'k') + ":1|c");
+  packer.Add("b:1|c");
+  packer.Finish();
+
+  std::unique_ptr<DatagramWriter> writer(newWriter());
+  ASSERT_EQ(writer->Write(packer, NULL), 3u);
+  std::vector<std::string> received = receiveAll(3);
+  ASSERT_EQ(received.size(), 3u);
+  bool found = false;
+  for (size_t i = 0; i < received.size(); i++) {
+    found = found || stripPadding(received[i]) == packer.Packet(1);
+  }
+  ASSERT_TRUE(found);
+}
+
+TEST_P(DatagramWriterTest, KeepsWritingAcrossBatches) {
+  // more packets than io_uring has buffers, so it has to reuse them while they complete
+  MetricPacker packer(64);
+  std::unique_ptr<DatagramWriter> writer(newWriter());
+  size_t total = 0;
+  for (int round = 0; round < 10; round++) {
+    packer.Clear();
+    for (int i = 0; i < 300; i++) {
+      packer.Add("key" + std::to_string(i) + ":1|c");
+    }
+    packer.Finish();
+    total += writer->Write(packer, NULL);
+    ASSERT_EQ(receiveAll(packer.Size()).size(), packer.Size());
+  }
+  ASSERT_EQ(total, 10 * packer.Size());
+  ASSERT_EQ(writer->AsyncErrors(), 0);
+}
+
+INSTANTIATE_TEST_CASE_P(AllModes, DatagramWriterTest,
+                        ::testing::Values(SEND_TO, SEND_MMSG, SEND_GSO, SEND_URING, SEND_URING_SQPOLL));
+
+TEST(DatagramWriterUringTest, FallsBackWithoutConnectedSocket) {
+  int receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  ASSERT_EQ(bind(receiver, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  socklen_t len = sizeof(addr);
+  getsockname(receiver, (struct sockaddr*) &addr, &len);
+  int sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+  MetricPacker packer(100);
+  packer.Add("a:1|c");
+  packer.Finish();
+  DatagramWriter writer(sender, (struct sockaddr*) &addr, sizeof(addr), SEND_URING);
+  ASSERT_EQ(writer.Write(packer, NULL), 1u);
+  ASSERT_EQ(writer.Mode(), SEND_MMSG);
+  char buf[128];
+  ASSERT_EQ(recv(receiver, buf, sizeof(buf), 0), 5);
+  close(sender);
+  close(receiver);
+}
+
+TEST(SendModeTest, Parse) {
+  SendMode mode;
+  ASSERT_TRUE(ParseSendMode("sendmmsg", &mode));
+  ASSERT_EQ(mode, SEND_MMSG);
+  ASSERT_STREQ(SendModeName(mode), "sendmmsg");
+  ASSERT_TRUE(ParseSendMode("io_uring_sqpoll", &mode));
+  ASSERT_EQ(mode, SEND_URING_SQPOLL);
+  ASSERT_STREQ(SendModeName(mode), "io_uring_sqpoll");
+  ASSERT_FALSE(ParseSendMode("carrier_pigeon", &mode));
+}
+}
+}  // namespace base
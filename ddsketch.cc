@@ -0,0 +1,141 @@
+#include "./ddsketch.h"
+
+#include <math.h>
+#include <algorithm>
+#include "base/common/logging.h"
+
+namespace base {
+namespace statsd {
+
+// values below are counted as zero, it keeps bucket indexes in int range
+static const double MIN_INDEXABLE = 1e-9;
+
+DDSketch::DDSketch(double relativeAccuracy, size_t maxBuckets) {
+  CHECK(relativeAccuracy > 0 && relativeAccuracy < 1) << "relative accuracy must be in (0, 1)";
+  CHECK(maxBuckets > 0) << "max buckets must be positive";
+  relativeAccuracy_ = relativeAccuracy;
+  gamma_ = (1 + relativeAccuracy) / (1 - relativeAccuracy);
+  invLogGamma_ = 1 / log(gamma_);
+  maxBuckets_ = maxBuckets;
+  Clear();
+}
+
+void DDSketch::Clear() {
+  counts_.clear();
+  offset_ = 0;
+  zeroCount_ = 0;
+  count_ = 0;
+  sum_ = 0;
+  min_ = 0;
+  max_ = 0;
+}
+
+int DDSketch::index(double value) const {
+  return static_cast<int>(ceil(log(value) * invLogGamma_));
+}
+
+double DDSketch::value(int index) const {
+  // middle of (gamma^(i-1), gamma^i] in relative terms
+  return 2 * pow(gamma_, index) / (1 + gamma_);
+}
+
+void DDSketch::addToBucket(int i, double weight) {
+  if (counts_.empty()) {
+    counts_.push_back(weight);
+    offset_ = i;
+    return;
+  }
+  if (i < offset_) {
+    int highest = offset_ + static_cast<int>(counts_.size()) - 1;
+    if (static_cast<size_t>(highest - i + 1) > maxBuckets_) {
+      // collapsed into the lowest bucket kept
+      counts_[0] += weight;
+      return;
+    }
+    counts_.insert(counts_.begin(), offset_ - i, 0);
+    offset_ = i;
+  } else if (i >= offset_ + static_cast<int>(counts_.size())) {
+    counts_.resize(i - offset_ + 1, 0);
+    if (counts_.size() > maxBuckets_) {
+      size_t collapse = counts_.size() - maxBuckets_;
+      double collapsed = 0;
+      for (size_t k = 0; k <= collapse; k++) {
+        collapsed += counts_[k];
+      }
+      counts_.erase(counts_.begin(), counts_.begin() + collapse);
+      counts_[0] = collapsed;
+      offset_ += collapse;
+    }
+  }
+  counts_[i - offset_] += weight;
+}
+
+void DDSketch::Add(double value, double weight) {
+  if (weight <= 0 || value != value) {
+    return;
+  }
+  if (count_ == 0) {
+    min_ = value;
+    max_ = value;
+  } else {
+    min_ = std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+  count_ += weight;
+  sum_ += value * weight;
+
+  if (value < MIN_INDEXABLE) {
+    zeroCount_ += weight;
+  } else {
+    addToBucket(index(value), weight);
+  }
+}
+
+void DDSketch::Merge(const DDSketch& other) {
+  CHECK(fabs(other.relativeAccuracy_ - relativeAccuracy_) < 1e-12) << "can not merge sketches of different accuracy";
+  if (other.count_ == 0) {
+    return;
+  }
+  if (count_ == 0) {
+    min_ = other.min_;
+    max_ = other.max_;
+  } else {
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  zeroCount_ += other.zeroCount_;
+  // from the top, so collapsing only ever folds the lowest buckets
+  for (size_t k = other.counts_.size(); k > 0; k--) {
+    if (other.counts_[k - 1] > 0) {
+      addToBucket(other.offset_ + static_cast<int>(k - 1), other.counts_[k - 1]);
+    }
+  }
+}
+
+double DDSketch::Quantile(double q) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  q = std::max(0.0, std::min(1.0, q));
+  double rank = q * (count_ - 1);
+
+  double estimate = max_;
+  double seen = zeroCount_;
+  if (seen > rank) {
+    estimate = 0;
+  } else {
+    for (size_t k = 0; k < counts_.size(); k++) {
+      seen += counts_[k];
+      if (seen > rank) {
+        estimate = value(offset_ + static_cast<int>(k));
+        break;
+      }
+    }
+  }
+  // exact bounds can only make the estimate better
+  return std::max(min_, std::min(max_, estimate));
+}
+}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Mergeable quantile sketch with relative error guarantees (DDSketch, Masson et al. VLDB 2019).
+ *
+ * Positive values are counted in logarithmic buckets (gamma^(i-1), gamma^i] with
+ * gamma = (1 + alpha) / (1 - alpha), so any quantile estimate is within relativeAccuracy (alpha)
+ * of the true value of that rank: |estimate - x_q| <= alpha * x_q. Zero and negative values go to
+ * a dedicated zero bucket. count, sum, min and max are exact.
+ *
+ * Memory is bounded by maxBuckets counters (8 bytes each). Once values span more buckets than that,
+ * the lowest buckets are collapsed together: higher quantiles keep the guarantee, the lowest ones
+ * lose it. With alpha = 1% a span from 1us to 1 day takes about 1300 buckets.
+ *
+ * Not thread safe.
+ */
+class DDSketch {
+ public:
+  DDSketch(double relativeAccuracy, size_t maxBuckets);
+
+  /**
+   * Add a value counted weight times, e.g. 1 / sampleRate
+   */
+  void Add(double value, double weight = 1);
+
+  /**
+   * Fold other into this one, both must have the same relative accuracy
+   */
+  void Merge(const DDSketch& other);
+
+  /**
+   * Estimate of the value at rank q * (Count() - 1), 0 <= q <= 1. Returns 0 if empty.
+   */
+  double Quantile(double q) const;
+
+  void Clear();
+
+  double Count() const { return count_; }
+  double Sum() const { return sum_; }
+  double Min() const { return min_; }
+  double Max() const { return max_; }
+  double Mean() const { return count_ > 0 ? sum_ / count_ : 0; }
+  bool Empty() const { return count_ == 0; }
+
+  double RelativeAccuracy() const { return relativeAccuracy_; }
+  size_t MaxBuckets() const { return maxBuckets_; }
+  size_t Buckets() const { return counts_.size(); }
+
+ private:
+  int index(double value) const;
+  double value(int index) const;
+  void addToBucket(int index, double weight);
+
+ private:
+  double relativeAccuracy_;
+  double gamma_;
+  double invLogGamma_;
+  size_t maxBuckets_;
+
+  // counts_[i] counts values of bucket offset_ + i
+  std::vector<double> counts_;
+  int offset_;
+  double zeroCount_;
+
+  double count_;
+  double sum_;
+  double min_;
+  double max_;
+};
+}
+}
@@ -0,0 +1,120 @@
+#include "./ddsketch.h"
+
+#include <math.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+static const double QUANTILES[] = {0, 0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1};
+
+// every quantile must be within alpha of the exact value of rank q * (n - 1)
+static void expectRelativeError(const DDSketch& sketch, std::vector<double> values, double alpha) {
+  std::sort(values.begin(), values.end());
+  for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+    double q = QUANTILES[i];
+    double exact = values[static_cast<size_t>(floor(q * (values.size() - 1)))];
+    double estimate = sketch.Quantile(q);
+    ASSERT_LE(fabs(estimate - exact), alpha * exact + 1e-12) << "q=" << q << " exact=" << exact
+                                                              << " estimate=" << estimate;
+  }
+}
+
+class DDSketchAccuracyTest: public ::testing::TestWithParam<double> {
+};
+
+TEST_P(DDSketchAccuracyTest, Distributions) {
+  const double alpha = GetParam();
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<double> uniform(1, 1000);
+  std::exponential_distribution<double> exponential(0.05);
+  std::lognormal_distribution<double> lognormal(2, 1.5);
+
+  for (int distribution = 0; distribution < 3; distribution++) {
+    DDSketch sketch(alpha, 2048);
+    std::vector<double> values;
+    for (int i = 0; i < 100000; i++) {
+      double value = distribution == 0 ? uniform(rng) : distribution == 1 ? exponential(rng) : lognormal(rng);
+      sketch.Add(value);
+      values.push_back(value);
+    }
+    ASSERT_EQ(sketch.Count(), values.size());
+    ASSERT_EQ(sketch.Min(), *std::min_element(values.begin(), values.end()));
+    ASSERT_EQ(sketch.Max(), *std::max_element(values.begin(), values.end()));
+    expectRelativeError(sketch, values, alpha);
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(Accuracies, DDSketchAccuracyTest, ::testing::Values(0.01, 0.02, 0.05));
+
+TEST(DDSketchTest, IntegerMillisWithZeros) {
+  DDSketch sketch(0.01, 2048);
+  std::vector<double> values;
+  for (int i = 0; i < 1000; i++) {
+    double ms = i % 10 == 0 ? 0 : i % 250;
+    sketch.Add(ms);
+    values.push_back(ms);
+  }
+  expectRelativeError(sketch, values, 0.01);
+  ASSERT_EQ(sketch.Quantile(0), 0);
+}
+
+TEST(DDSketchTest, MergeEqualsSingleSketch) {
+  std::mt19937 rng(3);
+  std::lognormal_distribution<double> lognormal(3, 1);
+  DDSketch all(0.01, 2048);
+  DDSketch left(0.01, 2048);
+  DDSketch right(0.01, 2048);
+  std::vector<double> values;
+  for (int i = 0; i < 20000; i++) {
+    double value = lognormal(rng);
+    all.Add(value);
+    (i % 2 ? left : right).Add(value);
+    values.push_back(value);
+  }
+  left.Merge(right);
+  ASSERT_EQ(left.Count(), all.Count());
+  ASSERT_NEAR(left.Sum(), all.Sum(), 1e-6 * all.Sum());
+  for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++) {
+    ASSERT_DOUBLE_EQ(left.Quantile(QUANTILES[i]), all.Quantile(QUANTILES[i]));
+  }
+  expectRelativeError(left, values, 0.01);
+}
+
+TEST(DDSketchTest, WeightsScaleCounts) {
+  DDSketch sketch(0.01, 2048);
+  sketch.Add(10, 10);
+  sketch.Add(20, 10);
+  ASSERT_EQ(sketch.Count(), 20);
+  ASSERT_EQ(sketch.Mean(), 15);
+}
+
+TEST(DDSketchTest, BoundedMemoryKeepsHighQuantiles) {
+  const double alpha = 0.01;
+  DDSketch sketch(alpha, 100);
+  std::vector<double> values;
+  // 1e-3 to 1e6 would need ~1000 buckets
+  for (int i = 0; i < 9000; i++) {
+    double value = pow(10, -3 + i / 1000.0);
+    sketch.Add(value);
+    values.push_back(value);
+  }
+  ASSERT_LE(sketch.Buckets(), 100u);
+
+  std::sort(values.begin(), values.end());
+  double exact = values[static_cast<size_t>(0.99 * (values.size() - 1))];
+  ASSERT_LE(fabs(sketch.Quantile(0.99) - exact), alpha * exact);
+  ASSERT_EQ(sketch.Max(), values.back());
+}
+
+TEST(DDSketchTest, Empty) {
+  DDSketch sketch(0.01, 2048);
+  ASSERT_TRUE(sketch.Empty());
+  ASSERT_EQ(sketch.Quantile(0.5), 0);
+  ASSERT_EQ(sketch.Mean(), 0);
+}
+}
+}  // namespace base
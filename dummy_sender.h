@@ -1,6 +1,8 @@
 #pragma once
 
 #include<string>
+#include<vector>
+#include "./abstract_sender.h"
 
 namespace base {
 namespace statsd {
@@ -12,10 +14,15 @@ class DummySender: public AbstractSender {
   ~DummySender() {}
   void Send(const std::string& message) {
     message_ = message;
+    messages_.push_back(message);
+  }
+  void Send(const char* message, size_t size) {
+    Send(std::string(message, size));
   }
 
  public:
   std::string message_;
+  std::vector<std::string> messages_;
 };
 }
 }
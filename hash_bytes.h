@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * 64 bit hash of bytes: FNV-1a, then the MurmurHash3 finalizer so every output bit depends on
+ * every input bit, FNV alone clusters similar keys. Shared by the consistent hash ring of
+ * ShardedSender, HyperLogLog and LoadShedder's key slots, which need no stronger hash.
+ */
+inline uint64 HashBytes(const char* data, size_t size) {
+  uint64 h = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    h ^= static_cast<unsigned char>(data[i]);
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+}
+}
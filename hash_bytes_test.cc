@@ -0,0 +1,26 @@
+#include "./hash_bytes.h"
+
+#include <string>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+TEST(HashBytesTest, SpreadsSimilarValues) {
+  // neighbours differ in about half of their bits
+  int bits = 0;
+  for (int i = 0; i < 1000; i++) {
+    std::string a = std::to_string(i);
+    std::string b = std::to_string(i + 1);
+    bits += __builtin_popcountll(HashBytes(a.data(), a.size()) ^ HashBytes(b.data(), b.size()));
+  }
+  ASSERT_NEAR(bits / 1000.0, 32, 2);
+}
+
+TEST(HashBytesTest, KnownValues) {
+  // ShardedSender ring positions depend on them, a change would move every series to another node
+  ASSERT_EQ(HashBytes("", 0), 17280346270528514342ULL);
+  ASSERT_EQ(HashBytes("statsd", 6), 1942160059212899103ULL);
+}
+}
+}
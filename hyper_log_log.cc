@@ -0,0 +1,64 @@
+#include "./hyper_log_log.h"
+
+#include <math.h>
+#include <string.h>
+#include "base/common/logging.h"
+#include "./hash_bytes.h"
+
+namespace base {
+namespace statsd {
+
+HyperLogLog::HyperLogLog(int precision) : precision_(precision), registers_(1 << precision, 0), empty_(true) {
+  CHECK(precision >= MIN_PRECISION && precision <= MAX_PRECISION) << "HyperLogLog precision must be in ["
+      << MIN_PRECISION << ", " << MAX_PRECISION << "], got " << precision;
+}
+
+void HyperLogLog::Add(const char* data, size_t size) {
+  uint64 h = HashBytes(data, size);
+  size_t index = static_cast<size_t>(h >> (64 - precision_));
+  // rank of the first 1 in the remaining bits, a sentinel bit bounds it when they are all 0
+  uint64 rest = (h << precision_) | (1ULL << (precision_ - 1));
+  uint8 rank = static_cast<uint8>(__builtin_clzll(rest) + 1);
+  if (rank > registers_[index]) {
+    registers_[index] = rank;
+  }
+  empty_ = false;
+}
+
+void HyperLogLog::Merge(const HyperLogLog& other) {
+  CHECK(other.precision_ == precision_) << "can not merge HyperLogLogs of different precisions";
+  for (size_t i = 0; i < registers_.size(); i++) {
+    if (other.registers_[i] > registers_[i]) {
+      registers_[i] = other.registers_[i];
+    }
+  }
+  empty_ = empty_ && other.empty_;
+}
+
+double HyperLogLog::Estimate() const {
+  double m = registers_.size();
+  double sum = 0;
+  size_t zeros = 0;
+  for (size_t i = 0; i < registers_.size(); i++) {
+    sum += ldexp(1, -registers_[i]);
+    zeros += registers_[i] == 0;
+  }
+  double alpha = m == 16 ? 0.673 : m == 32 ? 0.697 : m == 64 ? 0.709 : 0.7213 / (1 + 1.079 / m);
+  double estimate = alpha * m * m / sum;
+  if (estimate <= 2.5 * m && zeros > 0) {
+    return m * log(m / zeros);
+  }
+  // 64 bit hashes, no large range correction needed
+  return estimate;
+}
+
+void HyperLogLog::Clear() {
+  memset(registers_.data(), 0, registers_.size());
+  empty_ = true;
+}
+
+double HyperLogLog::RelativeError() const {
+  return 1.04 / sqrt(static_cast<double>(registers_.size()));
+}
+}
+}
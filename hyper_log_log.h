@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Mergeable estimate of the number of distinct values added (HyperLogLog, Flajolet et al. 2007).
+ *
+ * Each value is hashed to 64 bits: the first precision bits pick one of m = 2^precision one byte
+ * registers, which keeps the longest run of leading zeros seen in the remaining bits. The standard
+ * error of the estimate is 1.04 / sqrt(m), e.g. 0.81% with precision 14 and 16KB of registers,
+ * whatever the number of distinct values. Small cardinalities, up to 2.5 * m, are estimated by
+ * linear counting of the empty registers instead, which is close to exact.
+ *
+ * Not thread safe.
+ */
+class HyperLogLog {
+ public:
+  /**
+   * @param precision
+   *     log2 of the number of registers, between MIN_PRECISION and MAX_PRECISION
+   */
+  explicit HyperLogLog(int precision);
+
+  void Add(const char* data, size_t size);
+
+  /**
+   * Fold other into this one, as if its values had been added here, both must have the same precision
+   */
+  void Merge(const HyperLogLog& other);
+
+  /**
+   * Estimated number of distinct values added since the last Clear()
+   */
+  double Estimate() const;
+
+  void Clear();
+  bool Empty() const { return empty_; }
+
+  int Precision() const { return precision_; }
+  /**
+   * Standard error of Estimate() relative to the true cardinality
+   */
+  double RelativeError() const;
+
+  static const int MIN_PRECISION = 4;
+  static const int MAX_PRECISION = 18;
+
+ private:
+  int precision_;
+  std::vector<uint8> registers_;
+  bool empty_;
+};
+}
+}
@@ -0,0 +1,78 @@
+#include "./hyper_log_log.h"
+
+#include <math.h>
+#include <string>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+static void addRange(HyperLogLog* hll, int from, int to) {
+  for (int i = from; i < to; i++) {
+    std::string value = "user" + std::to_string(i);
+    hll->Add(value.data(), value.size());
+  }
+}
+
+TEST(HyperLogLogTest, EmptyAndClear) {
+  HyperLogLog hll(10);
+  ASSERT_TRUE(hll.Empty());
+  ASSERT_EQ(hll.Estimate(), 0);
+  hll.Add("a", 1);
+  ASSERT_FALSE(hll.Empty());
+  ASSERT_NEAR(hll.Estimate(), 1, 0.01);
+  hll.Clear();
+  ASSERT_TRUE(hll.Empty());
+  ASSERT_EQ(hll.Estimate(), 0);
+}
+
+TEST(HyperLogLogTest, DuplicatesDoNotCount) {
+  HyperLogLog hll(14);
+  for (int k = 0; k < 100; k++) {
+    addRange(&hll, 0, 1000);
+  }
+  // linear counting range, close to exact
+  ASSERT_NEAR(hll.Estimate(), 1000, 10);
+}
+
+class HyperLogLogAccuracyTest: public ::testing::TestWithParam<int> {
+};
+
+// within 3 standard errors over cardinalities spanning both estimators
+TEST_P(HyperLogLogAccuracyTest, WithinErrorBound) {
+  HyperLogLog hll(GetParam());
+  const int cardinalities[] = {100, 1000, 10000, 100000, 1000000};
+  int added = 0;
+  for (size_t i = 0; i < sizeof(cardinalities) / sizeof(cardinalities[0]); i++) {
+    addRange(&hll, added, cardinalities[i]);
+    added = cardinalities[i];
+    double bound = 3 * hll.RelativeError() * added;
+    ASSERT_NEAR(hll.Estimate(), added, bound) << "precision " << GetParam() << ", cardinality " << added;
+  }
+}
+
+INSTANTIATE_TEST_CASE_P(Precisions, HyperLogLogAccuracyTest, testing::Values(10, 12, 14, 16));
+
+TEST(HyperLogLogTest, MergeIsUnion) {
+  HyperLogLog a(14);
+  HyperLogLog b(14);
+  HyperLogLog both(14);
+  addRange(&a, 0, 60000);
+  addRange(&b, 40000, 100000);
+  addRange(&both, 0, 100000);
+  a.Merge(b);
+  // registers keep maxima, so the merge is exactly the sketch of the union
+  ASSERT_EQ(a.Estimate(), both.Estimate());
+  ASSERT_NEAR(a.Estimate(), 100000, 3 * a.RelativeError() * 100000);
+
+  HyperLogLog empty(14);
+  empty.Merge(HyperLogLog(14));
+  ASSERT_TRUE(empty.Empty());
+}
+
+TEST(HyperLogLogTest, RelativeError) {
+  ASSERT_NEAR(HyperLogLog(14).RelativeError(), 0.0081, 0.0001);
+  ASSERT_NEAR(HyperLogLog(10).RelativeError(), 0.0325, 0.0001);
+}
+}
+}  // namespace base
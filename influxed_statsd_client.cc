@@ -11,14 +11,15 @@
 #include "base/time/timestamp.h"
 #include "base/common/basic_types.h"
 #include "base/strings/string_printf.h"
+#include "./aggregator.h"
+#include "./metric_formatter.h"
+#include "./sampler.h"
 #include "./non_blocking_sender.h"
 
 namespace base {
 
 std::string InfluxedStatsdClient::EMPTY = "";
 std::string InfluxedStatsdClient::NS_DEL = ".";
-std::string InfluxedStatsdClient::COMMA = ",";
-std::string InfluxedStatsdClient::TAG_EQ = "=";
 
 static inline std::string concat(const std::vector<std::string>& tags, const std::string DEL) {
   std::stringstream ss;
@@ -33,49 +34,50 @@ static inline std::string concat(const std::vector<std::string>& tags, const std
   return ss.str();
 }
 
-inline bool fequal(float a, float b) {
-  const float epsilon = 0.0001;
-  return (fabs(a - b) < epsilon);
-}
-
 
 InfluxedStatsdClient::InfluxedStatsdClient() {
   sender_ = statsd::NonBlockingSender::Instance();
   ns_ = EMPTY;
-  tags_ = {};
+  tags_ = statsd::TagSet::Empty();
+  aggregator_ = NULL;
 }
 InfluxedStatsdClient::InfluxedStatsdClient(std::string ns) {
   sender_ = statsd::NonBlockingSender::Instance();
   ns_ = ns;
-  tags_ = {};
+  tags_ = statsd::TagSet::Empty();
+  aggregator_ = NULL;
 }
 InfluxedStatsdClient::~InfluxedStatsdClient() {
 }
 
-InfluxedStatsdClient::InfluxedStatsdClient(Sender* sender, const std::string& ns, const TAGS& tags) {
+InfluxedStatsdClient::InfluxedStatsdClient(Sender* sender, const std::string& ns,
+                                           const std::shared_ptr<const statsd::TagSet>& tags,
+                                           statsd::Aggregator* aggregator) {
   CHECK(sender != NULL)<< "sender is NULL";
   sender_ = sender;
   ns_ = ns;
   tags_ = tags;
+  aggregator_ = aggregator;
 }
 
 InfluxedStatsdClient::InfluxedStatsdClient(Sender* sender) {
   sender_ = sender;
   ns_ = EMPTY;
-  tags_ = {};
+  tags_ = statsd::TagSet::Empty();
+  aggregator_ = NULL;
 }
 
 InfluxedStatsdClient InfluxedStatsdClient::Clone() const{
-  return InfluxedStatsdClient(sender_, ns_, tags_);
+  return InfluxedStatsdClient(sender_, ns_, tags_, aggregator_);
 }
 
 InfluxedStatsdClient InfluxedStatsdClient::Ns(std::string ns) const{
-  return InfluxedStatsdClient(sender_, ns, tags_);
+  return InfluxedStatsdClient(sender_, ns, tags_, aggregator_);
 }
 InfluxedStatsdClient InfluxedStatsdClient::ImmutableApendSubNs(std::string subNs) const{
   CHECK(ns_!= EMPTY) << "Please make sure namespace is not empty";
   std::string newNs = concat({ns_, subNs}, NS_DEL);
-  return InfluxedStatsdClient(sender_, newNs, tags_);
+  return InfluxedStatsdClient(sender_, newNs, tags_, aggregator_);
 }
 InfluxedStatsdClient& InfluxedStatsdClient::ApendSubNs(std::string subNs) {
   CHECK(ns_!= EMPTY) << "Please make sure namespace is not empty";
@@ -83,20 +85,34 @@ InfluxedStatsdClient& InfluxedStatsdClient::ApendSubNs(std::string subNs) {
   return *(this);
 }
 InfluxedStatsdClient InfluxedStatsdClient::Tags(TAGS tags) const{
-  return InfluxedStatsdClient(sender_, ns_, tags);
+  return InfluxedStatsdClient(sender_, ns_, statsd::TagSet::Of(tags), aggregator_);
 }
 
 InfluxedStatsdClient InfluxedStatsdClient::ImmutableAddTag(TAG tag) const{
-  TAGS newTags = tags_;
-  newTags.push_back(tag);
-  return InfluxedStatsdClient(sender_, ns_, newTags);
+  return InfluxedStatsdClient(sender_, ns_, tags_->With(tag), aggregator_);
 }
 
 InfluxedStatsdClient& InfluxedStatsdClient::AddTag(TAG tag) {
-  tags_.push_back(tag);
+  tags_ = tags_->With(tag);
   return *(this);
 }
 
+InfluxedStatsdClient InfluxedStatsdClient::Aggregated(statsd::Aggregator* aggregator) const{
+  return InfluxedStatsdClient(sender_, ns_, tags_, aggregator);
+}
+
+CounterHandle InfluxedStatsdClient::Counter(const std::string& key) const{
+  return CounterHandle(sender_, aggregator_, makeInfluxedKey(key));
+}
+
+GaugeHandle InfluxedStatsdClient::Gauge(const std::string& key) const{
+  return GaugeHandle(sender_, aggregator_, makeInfluxedKey(key));
+}
+
+TimerHandle InfluxedStatsdClient::Timer(const std::string& key) const{
+  return TimerHandle(sender_, aggregator_, makeInfluxedKey(key));
+}
+
 void InfluxedStatsdClient::Dec(const std::string& key,  float sampleRate) const{
   Count(key, -1, sampleRate);
 }
@@ -107,76 +123,160 @@ void InfluxedStatsdClient::Inc(const std::string& key,  float sampleRate) const{
 }
 
 void InfluxedStatsdClient::Count(const std::string& key, int64 value, float sampleRate) const{
-  Send(key, value, "c", sampleRate);
+  static const std::string COUNTER = "c";
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  if (aggregator_ != NULL) {
+    aggregator_->Count(localInfluxedKey(key), value, sampleRate);
+    return;
+  }
+  sendInt64(key, value, COUNTER, sampleRate);
 }
 
 void InfluxedStatsdClient::Gauge(const std::string& key, double value, float sampleRate) const{
-  Send(key, base::StringPrintf("%.5g", value), "g", sampleRate);
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  if (aggregator_ != NULL) {
+    aggregator_->Gauge(localInfluxedKey(key), value);
+    return;
+  }
+  static const std::string GAUGE = "g";
+  char buf[statsd::MAX_NUMBER_SIZE];
+  size_t size = statsd::FormatG5(value, buf);
+  send(key, buf, size, GAUGE, sampleRate);
 }
 
 void InfluxedStatsdClient::Time(const std::string& key, int64 ms, float sampleRate) const{
-  Send(key, ms, "ms", sampleRate);
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  time(key, ms, sampleRate);
+}
+
+void InfluxedStatsdClient::time(const std::string& key, int64 ms, float sampleRate) const{
+  static const std::string TIMER = "ms";
+  if (aggregator_ != NULL && aggregator_->SketchesTimers()) {
+    aggregator_->Time(localInfluxedKey(key), ms, sampleRate);
+    return;
+  }
+  sendInt64(key, ms, TIMER, sampleRate);
 }
 
 
 void InfluxedStatsdClient::TimeMillisToNow(const std::string& key, int64 systemTimeMillisAtStart,
      float sampleRate) const{
-  int64 now = base::GetTimestamp() / 1000;
-  size_t ms = now - systemTimeMillisAtStart;
-  ms = ms > 0 ? ms : 0;
-  Time(key, ms, sampleRate);
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  int64 ms = base::GetTimestamp() / 1000 - systemTimeMillisAtStart;
+  time(key, ms > 0 ? ms : 0, sampleRate);
 }
 
 
 void InfluxedStatsdClient::TimeMicrosToNow(const std::string& key, int64 systemTimeMicrosAtStart,
      float sampleRate) const{
-  int64 now = base::GetTimestamp();
-  size_t ms = (now - systemTimeMicrosAtStart) / 1000;
-  ms = ms > 0 ? ms : 0;
-  Time(key, ms, sampleRate);
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  int64 us = base::GetTimestamp() - systemTimeMicrosAtStart;
+  timeMicros(key, us > 0 ? us : 0, sampleRate);
 }
 
 
-std::string InfluxedStatsdClient::makeInfluxedKey(const std::string& key) const{
-  std::string influxedKey = key;
+void InfluxedStatsdClient::TimeMicros(const std::string& key, int64 us, float sampleRate) const{
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  timeMicros(key, us, sampleRate);
+}
 
-  if (ns_ != EMPTY) {
-    influxedKey = ns_ + NS_DEL + influxedKey;
+void InfluxedStatsdClient::timeMicros(const std::string& key, int64 us, float sampleRate) const{
+  static const std::string TIMER = "ms";
+  if (aggregator_ != NULL && aggregator_->SketchesTimers()) {
+    aggregator_->Time(localInfluxedKey(key), us / 1000.0, sampleRate);
+    return;
   }
+  char buf[statsd::MAX_NUMBER_SIZE];
+  size_t size = statsd::FormatMicrosAsMillis(us, buf);
+  send(key, buf, size, TIMER, sampleRate);
+}
 
-  int size = tags_.size();
-  if (size == 0) {
-    return influxedKey;
+
+void InfluxedStatsdClient::Set(const std::string& key, const std::string& value) const{
+  if (aggregator_ != NULL && aggregator_->CountsSets()) {
+    aggregator_->Set(localInfluxedKey(key), value);
+    return;
   }
+  static const std::string SET = "s";
+  send(key, value.data(), value.size(), SET, 1.0);
+}
+
 
-  std::vector<std::string> formatTags;
-  for (int i = 0; i < size; i++) {
-    std::string formated = tags_[i].first + TAG_EQ + tags_[i].second;
-    formatTags.push_back(formated);
+void InfluxedStatsdClient::appendInfluxedKey(statsd::MetricFormatter* line, const std::string& key) const{
+  if (ns_ != EMPTY) {
+    line->Append(ns_);
+    line->Append(NS_DEL);
   }
+  line->Append(key);
+  line->Append(tags_->Rendered());
+}
 
-  return influxedKey + COMMA + concat(formatTags, COMMA);
+std::string InfluxedStatsdClient::makeInfluxedKey(const std::string& key) const{
+  statsd::MetricFormatter& line = statsd::MetricFormatter::Local();
+  line.Clear();
+  appendInfluxedKey(&line, key);
+  return line.ToString();
 }
 
-void InfluxedStatsdClient::Send(const std::string& key, std::string value, const std::string &type,
+const std::string& InfluxedStatsdClient::localInfluxedKey(const std::string& key) const{
+  static thread_local std::string influxedKey;
+  statsd::MetricFormatter& line = statsd::MetricFormatter::Local();
+  line.Clear();
+  appendInfluxedKey(&line, key);
+  influxedKey.assign(line.Data(), line.Size());
+  return influxedKey;
+}
+
+void InfluxedStatsdClient::send(const std::string& key, const char* value, size_t size, const std::string& type,
      float sampleRate) const{
   CHECK(sender_ != NULL) << "please do not send metrics before setting sender ";
 
-  std::string influxedKey = makeInfluxedKey(key);
+  statsd::MetricFormatter& line = statsd::MetricFormatter::Local();
+  line.Clear();
+  appendInfluxedKey(&line, key);
+  line.Append(':');
+  line.Append(value, size);
+  line.Append('|');
+  line.Append(type);
+  line.AppendSampleRate(sampleRate);
 
-  std::string message = base::StringPrintf("%s:%s|%s", influxedKey.c_str(), value.c_str(), type.c_str());
-  if (!fequal(sampleRate, 1.0)) {
-    message = base::StringPrintf("%s|@%.5g", message.c_str(), sampleRate);
-  }
+  sender_->Send(line.Data(), line.Size());
+}
 
-  sender_->Send(message);
+void InfluxedStatsdClient::sendInt64(const std::string& key, int64 value, const std::string& type,
+     float sampleRate) const{
+  char buf[statsd::MAX_NUMBER_SIZE];
+  size_t size = statsd::FormatInt64(value, buf);
+  send(key, buf, size, type, sampleRate);
+}
+
+void InfluxedStatsdClient::Send(const std::string& key, std::string value, const std::string &type,
+     float sampleRate) const{
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  send(key, value.data(), value.size(), type, sampleRate);
 }
 
 void InfluxedStatsdClient::Send(const std::string& key,
                                 const int64 value,
                                 const std::string& type,
                                 float sampleRate) const{
-  Send(key, base::StringPrintf("%jd", value), type, sampleRate);
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  sendInt64(key, value, type, sampleRate);
 }
 }
-
@@ -1,13 +1,18 @@
 #pragma once
 
+#include <memory>
 #include <string>
-#include <utility>
 #include <vector>
+#include "./metric_handle.h"
 #include "./non_blocking_sender.h"
+#include "./tag_set.h"
 
 namespace base {
-typedef std::pair<std::string, std::string> TAG;
-typedef std::vector<TAG> TAGS;
+namespace statsd {
+class Aggregator;
+class MetricFormatter;
+}
+
 typedef statsd::AbstractSender Sender;
 
 /**
@@ -40,7 +45,8 @@ class InfluxedStatsdClient {
    *     the amount to adjust the counter by
    * @param sampleRate
    *     the sampling rate being employed. For example, a rate of 0.1 would tell StatsD that this counter is being sent
-   *     sampled every 1/10th of the time.
+   *     sampled every 1/10th of the time. Unless --statsd_client_side_sampling is off, the call is dropped with
+   *     probability 1 - sampleRate before anything gets rendered, the same holds for every api taking a sampleRate.
    */
   void Count(const std::string& key, int64 value, float sampleRate = 1.0) const;
 
@@ -85,14 +91,32 @@ class InfluxedStatsdClient {
   void Time(const std::string& key, int64 ms, float sampleRate = 1.0) const;
 
   /**
-   * Records an execution time in milliseconds for the specified named operation and systemTimeMillisAtStart.
+   * Records an execution time given in microseconds for the specified named operation, sent as fractional
+   * milliseconds, e.g. "key:0.125|ms", so sub-millisecond operations do not all report 0.
    *
    * This method is non-blocking and is guaranteed not to throw an exception.
    *
    * @param key
    *     the name of the timed operation
-   * @param ms
-   *     the time in milliseconds
+   * @param us
+   *     the time in microseconds
+   * @param sampleRate
+   *     the sampling rate being employed. For example, a rate of 0.1 would tell StatsD that this counter is being sent
+   *     sampled every 1/10th of the time.
+   */
+  void TimeMicros(const std::string& key, int64 us, float sampleRate = 1.0) const;
+
+  /**
+   * Records the time elapsed since systemTimeMillisAtStart, a base::GetTimestamp() / 1000 taken by the caller,
+   * in whole milliseconds. Wall clock based, so an NTP step in between skews it, negative spans report 0.
+   * Prefer ScopedTimer.
+   *
+   * This method is non-blocking and is guaranteed not to throw an exception.
+   *
+   * @param key
+   *     the name of the timed operation
+   * @param systemTimeMillisAtStart
+   *     wall clock time in milliseconds when the operation started
    * @param sampleRate
    *     the sampling rate being employed. For example, a rate of 0.1 would tell StatsD that this counter is being sent
    *     sampled every 1/10th of the time.
@@ -100,28 +124,60 @@ class InfluxedStatsdClient {
   void TimeMillisToNow(const std::string& key, int64 systemTimeMillisAtStart, float sampleRate = 1.0) const;
 
   /**
-   * Records an execution time in milliseconds for the specified named operation and systemTimeMicrosAtStart.
+   * Records the time elapsed since systemTimeMicrosAtStart, a base::GetTimestamp() taken by the caller,
+   * as fractional milliseconds like TimeMicros(). Wall clock based, so an NTP step in between skews it,
+   * negative spans report 0. Prefer ScopedTimer.
    *
    * This method is non-blocking and is guaranteed not to throw an exception.
    *
    * @param key
    *     the name of the timed operation
-   * @param ms
-   *     the time in milliseconds
+   * @param systemTimeMicrosAtStart
+   *     wall clock time in microseconds when the operation started
    * @param sampleRate
    *     the sampling rate being employed. For example, a rate of 0.1 would tell StatsD that this counter is being sent
    *     sampled every 1/10th of the time.
    */
   void TimeMicrosToNow(const std::string& key, int64 systemTimeMicrosAtStart, float sampleRate = 1.0) const;
 
+  /**
+   * Adds a member to the specified named set, whose number of distinct members is reported per flush interval,
+   * e.g. unique users per endpoint.
+   *
+   * Sent as "key:value|s" for the statsd server to count. Through an Aggregated() client whose aggregator
+   * CountsSets() members are counted in process instead, in a fixed size HyperLogLog per key, and only the
+   * estimated count is emitted, as the gauge "key:count|g", once per flush interval.
+   *
+   * This method is non-blocking and is guaranteed not to throw an exception.
+   *
+   * @param key
+   *     the name of the set
+   * @param value
+   *     the member, e.g. a user id, without ':', '|' or newlines
+   */
+  void Set(const std::string& key, const std::string& value) const;
+
 // statsd low level apis
  public:
   /* (Low Level Api) manually send a message, all high level apis will eventually invoke this  api
-   * type = "c", "g" or "ms"
+   * type = "c", "g", "ms" or "s"
    */
   void Send(const std::string& key, const std::string value, const std::string& type, float sampleRate = 1.0) const;
   void Send(const std::string& key, const int64 value, const std::string& type, float sampleRate = 1.0) const;
 
+// pre-bound metric handles
+ public:
+  /**
+   * Bind a counter/gauge/timer to @param key. The handle renders ns, key and tags once and only
+   * formats the value per call, prefer it for keys hit on hot paths:
+   *
+   *   CounterHandle requests = client.Counter("requests");
+   *   requests.Inc();
+   */
+  CounterHandle Counter(const std::string& key) const;
+  GaugeHandle Gauge(const std::string& key) const;
+  TimerHandle Timer(const std::string& key) const;
+
 // helpers
  public:
   /**
@@ -148,6 +204,8 @@ class InfluxedStatsdClient {
 
   /**
    * Make a new InfluxedStatsdClient with a new @param tags based on current one.
+   * Tags are rendered sorted by name, a repeated name keeps its last value, so clients with the same
+   * tags in any order report the same series.
    */
   InfluxedStatsdClient Tags(TAGS tags) const;
 
@@ -163,9 +221,38 @@ class InfluxedStatsdClient {
    */
   InfluxedStatsdClient& AddTag(TAG tag);
 
+  /**
+   * Identity of the current tag set, equal for clients with equal tags, see statsd::TagSet
+   */
+  uint32 TagSetId() const { return tags_->Id(); }
+
+  /**
+   * Make a new InfluxedStatsdClient whose counters (Count/Inc/Dec) and gauges go through @param aggregator,
+   * which sums counters and keeps the last gauge per key, and emits them every flush interval.
+   * Timers go through it only if it sketches timers, sets only if it counts sets. Low level Send() is never
+   * aggregated.
+   * Pass NULL to stop aggregating.
+   */
+  InfluxedStatsdClient Aggregated(statsd::Aggregator* aggregator) const;
+
  private:
+  friend class InfluxedStatsdClientPeer;
+  friend class ScopedTimer;
+
   std::string makeInfluxedKey(const std::string& key) const;
-  InfluxedStatsdClient(Sender* sender_, const std::string& ns, const TAGS& tags);
+  void appendInfluxedKey(statsd::MetricFormatter* line, const std::string& key) const;
+  /**
+   * Rendered key in a thread local string, valid until the next call on this thread
+   */
+  const std::string& localInfluxedKey(const std::string& key) const;
+  void send(const std::string& key, const char* value, size_t size, const std::string& type,
+            float sampleRate) const;
+  void sendInt64(const std::string& key, int64 value, const std::string& type, float sampleRate) const;
+  // Time() once the call is sampled in
+  void time(const std::string& key, int64 ms, float sampleRate) const;
+  void timeMicros(const std::string& key, int64 us, float sampleRate) const;
+  InfluxedStatsdClient(Sender* sender_, const std::string& ns, const std::shared_ptr<const statsd::TagSet>& tags,
+                       statsd::Aggregator* aggregator);
 
  private:
   Sender* sender_;
@@ -174,15 +261,17 @@ class InfluxedStatsdClient {
    */
   std::string ns_;
   /**
-   * extend keys with tags_ to support influxdb protocol
+   * extend keys with tags_ to support influxdb protocol, an interned set shared by every client with the same tags
    * PS: ',' and '=' is not allowed in tag name and its value
    */
-  TAGS tags_;
+  std::shared_ptr<const statsd::TagSet> tags_;
+  /**
+   * counters and gauges are aggregated in process if not NULL
+   */
+  statsd::Aggregator* aggregator_;
 
   static std::string NS_DEL;
-  static std::string COMMA;
   static std::string EMPTY;
-  static std::string TAG_EQ;
 };
 }
 // end namespace
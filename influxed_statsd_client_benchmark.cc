@@ -0,0 +1,227 @@
+// Microbenchmarks of the client hot path: key rendering, Send per metric type, sets, static metrics,
+// client derivation, timers and NonBlockingSender::Send under contention. Each one reports ns/op
+// and heap allocations/op.
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/common/gflags.h"
+#include "base/time/timestamp.h"
+#include "./abstract_sender.h"
+#include "./aggregator.h"
+#include "./benchmark_util.h"
+#include "./influxed_statsd_client.h"
+#include "./monotonic_clock.h"
+#include "./non_blocking_sender.h"
+#include "./scoped_timer.h"
+#include "./static_metric.h"
+
+DEFINE_int32(iterations, 1000000, "calls per single threaded benchmark");
+DEFINE_int32(sender_metrics, 500000,
+             "metrics sent per contended NonBlockingSender benchmark, split over threads. Its queue holds them all");
+
+namespace base {
+
+// reaches into the client for the key rendering benchmark
+class InfluxedStatsdClientPeer {
+ public:
+  static std::string MakeInfluxedKey(const InfluxedStatsdClient& client, const std::string& key) {
+    return client.makeInfluxedKey(key);
+  }
+};
+
+namespace statsd {
+
+class NullSender: public AbstractSender {
+ public:
+  void Send(const std::string& message) {
+    bytes_ += message.size();
+  }
+  void Send(const char*, size_t size) {
+    bytes_ += size;
+  }
+  size_t bytes_ = 0;
+};
+
+static TAGS makeTags(int n) {
+  TAGS tags;
+  for (int i = 0; i < n; i++) {
+    tags.push_back(TAG("tag" + std::to_string(i), "value" + std::to_string(i)));
+  }
+  return tags;
+}
+
+static void benchmarkKeys(InfluxedStatsdClient base) {
+  const int tagCounts[] = {0, 2, 8};
+  for (size_t i = 0; i < sizeof(tagCounts) / sizeof(tagCounts[0]); i++) {
+    InfluxedStatsdClient client = base.Tags(makeTags(tagCounts[i]));
+    std::string key = "requests";
+    std::string name = "makeInfluxedKey, " + std::to_string(tagCounts[i]) + " tags";
+    benchmark::Run(name.c_str(), FLAGS_iterations, [&](int64) {
+      InfluxedStatsdClientPeer::MakeInfluxedKey(client, key);
+    });
+  }
+}
+
+static void benchmarkSend(InfluxedStatsdClient base) {
+  InfluxedStatsdClient client = base.Tags(makeTags(2));
+  std::string key = "requests";
+  std::string stringValue = "121.2";
+  benchmark::Run("Count, 2 tags", FLAGS_iterations, [&](int64 n) { client.Count(key, n); });
+  benchmark::Run("Gauge, 2 tags", FLAGS_iterations, [&](int64 n) { client.Gauge(key, n & 1023); });
+  benchmark::Run("Gauge fractional, 2 tags", FLAGS_iterations, [&](int64 n) { client.Gauge(key, n * 1e-3); });
+  benchmark::Run("Time, 2 tags", FLAGS_iterations, [&](int64 n) { client.Time(key, n); });
+  benchmark::Run("Send string value, 2 tags", FLAGS_iterations, [&](int64) {
+    client.Send(key, stringValue, "c");
+  });
+  benchmark::Run("Inc, sampleRate 0.01, 2 tags", FLAGS_iterations, [&](int64) { client.Inc(key, 0.01); });
+  std::vector<std::string> members;
+  for (int i = 0; i < 1024; i++) {
+    members.push_back("user" + std::to_string(i));
+  }
+  benchmark::Run("Set, 2 tags", FLAGS_iterations, [&](int64 n) { client.Set(key, members[n & 1023]); });
+  NullSender flushed;
+  Aggregator::Options options;
+  options.countSets = true;
+  Aggregator sets(&flushed, options);
+  InfluxedStatsdClient counted = client.Aggregated(&sets);
+  benchmark::Run("Set into HyperLogLog, 2 tags", FLAGS_iterations, [&](int64 n) {
+    counted.Set(key, members[n & 1023]);
+  });
+
+  CounterHandle counter = client.Counter(key);
+  benchmark::Run("CounterHandle::Count, 2 tags", FLAGS_iterations, [&](int64 n) { counter.Count(n); });
+  GaugeHandle gauge = client.Gauge(key);
+  benchmark::Run("GaugeHandle::Set, 2 tags", FLAGS_iterations, [&](int64 n) { gauge.Set(n & 1023); });
+  TimerHandle timer = client.Timer(key);
+  benchmark::Run("TimerHandle::Time, 2 tags", FLAGS_iterations, [&](int64 n) { timer.Time(n); });
+  benchmark::Run("TimerHandle::TimeMicros, 2 tags", FLAGS_iterations, [&](int64 n) { timer.TimeMicros(n); });
+}
+
+// same series as benchmarkSend, with everything but the value rendered at compile time
+static void benchmarkStatic(AbstractSender* sender) {
+  typedef StaticTag<STATSD_STR("tag0"), STATSD_STR("value0")> Tag0;
+  typedef StaticTag<STATSD_STR("tag1"), STATSD_STR("value1")> Tag1;
+  StaticCounter<STATSD_STR("service"), STATSD_STR("requests"), Tag0, Tag1> counter(sender);
+  benchmark::Run("StaticCounter::Count, 2 tags", FLAGS_iterations, [&](int64 n) { counter.Count(n); });
+  StaticGauge<STATSD_STR("service"), STATSD_STR("requests"), Tag0, Tag1> gauge(sender);
+  benchmark::Run("StaticGauge::Set, 2 tags", FLAGS_iterations, [&](int64 n) { gauge.Set(n & 1023); });
+  StaticTimer<STATSD_STR("service"), STATSD_STR("requests"), Tag0, Tag1> timer(sender);
+  benchmark::Run("StaticTimer::Time, 2 tags", FLAGS_iterations, [&](int64 n) { timer.Time(n); });
+}
+
+static void benchmarkTimers(InfluxedStatsdClient base) {
+  InfluxedStatsdClient client = base.Tags(makeTags(2));
+  TimerHandle timer = client.Timer("lookup");
+  std::string clock = MonotonicClock::UsesTsc() ? "tsc" : "CLOCK_MONOTONIC";
+  int64 sink = 0;
+  benchmark::Run(("MonotonicClock::Ticks, " + clock).c_str(), FLAGS_iterations, [&](int64) {
+    sink += MonotonicClock::Ticks();
+  });
+  benchmark::Run("base::GetTimestamp", FLAGS_iterations, [&](int64) { sink += base::GetTimestamp(); });
+  benchmark::Run("ScopedTimer start and Cancel", FLAGS_iterations, [&](int64) {
+    ScopedTimer scoped(timer);
+    scoped.Cancel();
+  });
+  benchmark::Run("ScopedTimer on a TimerHandle, 2 tags", FLAGS_iterations, [&](int64) { ScopedTimer scoped(timer); });
+  benchmark::Run("ScopedTimer sampleRate 0.01", FLAGS_iterations, [&](int64) { ScopedTimer scoped(timer, 0.01); });
+  benchmark::Run("ScopedTimer on client and key, 2 tags", FLAGS_iterations, [&](int64) {
+    ScopedTimer scoped(client, "lookup");
+  });
+  if (sink == 42) {
+    printf("\n");
+  }
+}
+
+static void benchmarkDerivation(InfluxedStatsdClient base) {
+  InfluxedStatsdClient client = base.Tags(makeTags(2));
+  TAGS tags = makeTags(2);
+  benchmark::Run("Clone, 2 tags", FLAGS_iterations, [&](int64) { client.Clone(); });
+  benchmark::Run("Tags, 2 tags", FLAGS_iterations, [&](int64) { client.Tags(tags); });
+  benchmark::Run("ImmutableAddTag, 2 + 1 tags", FLAGS_iterations, [&](int64) {
+    client.ImmutableAddTag(TAG("dc", "sh"));
+  });
+}
+
+static void benchmarkContendedSender(NonBlockingSender* sender, const std::string& label) {
+  const int threadCounts[] = {1, 2, 4, 8, 16, 32, 64};
+  const char metric[] = "bench.requests,dc=sh,host=web01:1|c";
+  for (size_t t = 0; t < sizeof(threadCounts) / sizeof(threadCounts[0]); t++) {
+    int threads = threadCounts[t];
+    int64 perThread = FLAGS_sender_metrics / threads;
+    int64 droppedBefore = sender->DroppedMetrics();
+    std::vector<benchmark::Result> results(threads);
+    std::vector<std::thread> producers;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < threads; i++) {
+      producers.push_back(std::thread([&results, i, perThread, sender, &metric]() {
+        results[i] = benchmark::Measure(perThread, [&](int64) { sender->Send(metric, sizeof(metric) - 1); });
+      }));
+    }
+    benchmark::Result total = {0, 0};
+    for (int i = 0; i < threads; i++) {
+      producers[i].join();
+      total.nsPerOp += results[i].nsPerOp / threads;
+      total.allocationsPerOp += results[i].allocationsPerOp / threads;
+    }
+    double elapsedNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    std::string name = "NonBlockingSender::Send" + label + ", " + std::to_string(threads) + " producers";
+    benchmark::Report(name.c_str(), total);
+    // the queue holds a whole round, warm up included, so what is timed is the enqueue: drops
+    // here mean the numbers above are partly those of rejections. And how many metrics per second
+    // got through, which is what staging buys
+    int64 sends = perThread * threads * 11 / 10;
+    int64 dropped = sender->DroppedMetrics() - droppedBefore;
+    printf("%52s %10.1f%% dropped %8.2f M accepted/s\n", "", 100.0 * dropped / sends,
+           1e3 * (sends - dropped) / elapsedNs);
+    while (sender->QueueSize() > 0 || sender->Stats().stagedBytes > 0) {
+      usleep(1000);
+    }
+  }
+}
+}
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  // a loopback sink nobody reads, so NonBlockingSender has somewhere to write to
+  int sink = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(sink, (struct sockaddr*) &addr, sizeof(addr));
+  socklen_t len = sizeof(addr);
+  getsockname(sink, (struct sockaddr*) &addr, &len);
+  base::statsd::FLAGS_statsd_host = "127.0.0.1";
+  base::statsd::FLAGS_statsd_port = ntohs(addr.sin_port);
+
+  base::statsd::NullSender sender;
+  base::InfluxedStatsdClient client = base::InfluxedStatsdClient(&sender).Ns("service");
+  base::statsd::benchmarkKeys(client);
+  base::statsd::benchmarkSend(client);
+  base::statsd::benchmarkStatic(&sender);
+  base::statsd::benchmarkDerivation(client);
+  base::statsd::benchmarkTimers(client);
+  // room for every metric of a round, so producers time the enqueue rather than the drop. Slots
+  // just fit the benchmark metric, or the ring would take gigabytes
+  base::statsd::NonBlockingSender::Options contended;
+  contended.queueCapacity = FLAGS_sender_metrics / 10 * 11 + 64;
+  contended.maxMetricSize = 48;
+  base::statsd::NonBlockingSender contendedSender(contended);
+  base::statsd::benchmarkContendedSender(&contendedSender, "");
+  base::statsd::NonBlockingSender::Options staged = contended;
+  staged.threadBufferSize = 4096;
+  base::statsd::NonBlockingSender stagedSender(staged);
+  base::statsd::benchmarkContendedSender(&stagedSender, " thread buffers");
+
+  close(sink);
+  return 0;
+}
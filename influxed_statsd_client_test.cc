@@ -1,9 +1,13 @@
 #include "./influxed_statsd_client.h"
 
+#include <math.h>
 #include <iostream>
+#include "base/strings/string_printf.h"
+#include "base/time/timestamp.h"
 #include "base/testing/gmock.h"
 #include "base/testing/gtest.h"
 #include "./dummy_sender.h"
+#include "./sampler.h"
 
 namespace base {
 namespace statsd {
@@ -11,9 +15,14 @@ namespace statsd {
 class InfluxedStatsdClientTest: public ::testing::Test {
  protected:
   virtual void SetUp() {
+    // formatting tests expect every call to be sent, whatever its sample rate
+    FLAGS_statsd_client_side_sampling = false;
     sender = new DummySender();
     client = new InfluxedStatsdClient(sender);
   }
+  virtual void TearDown() {
+    FLAGS_statsd_client_side_sampling = true;
+  }
   DummySender* sender;
   InfluxedStatsdClient* client;
 };
@@ -88,6 +97,22 @@ TEST_F(InfluxedStatsdClientTest, Tags) {
   ASSERT_EQ(sender->message_, "key:1|c");
 }
 
+TEST_F(InfluxedStatsdClientTest, TagsAreSortedByName) {
+  InfluxedStatsdClient unordered = client->Tags({ {"host", "web01"}, {"dc", "sh"} });
+  unordered.Send("key", 1, "c");
+  ASSERT_EQ(sender->message_, "key,dc=sh,host=web01:1|c");
+
+  InfluxedStatsdClient added = client->ImmutableAddTag({"host", "web01"}).ImmutableAddTag({"dc", "sh"});
+  added.Send("key", 1, "c");
+  ASSERT_EQ(sender->message_, "key,dc=sh,host=web01:1|c");
+  ASSERT_EQ(added.TagSetId(), unordered.TagSetId());
+  ASSERT_NE(added.TagSetId(), client->TagSetId());
+
+  // a repeated tag name keeps its last value
+  added.AddTag({"dc", "bj"}).Send("key", 1, "c");
+  ASSERT_EQ(sender->message_, "key,dc=bj,host=web01:1|c");
+}
+
 TEST_F(InfluxedStatsdClientTest, AddTag) {
   client->AddTag({"tag", "value"}).Send("key", 1, "c");
   ASSERT_EQ(sender->message_, "key,tag=value:1|c");
@@ -149,24 +174,117 @@ TEST_F(InfluxedStatsdClientTest, Time) {
   ASSERT_EQ(sender->message_, "key:279172897979|ms");
 }
 
-// FIXME: a dummy test
+TEST_F(InfluxedStatsdClientTest, TimeMicros) {
+  client->TimeMicros("key", 125);
+  ASSERT_EQ(sender->message_, "key:0.125|ms");
+  client->TimeMicros("key", 2000, 0.01);
+  ASSERT_EQ(sender->message_, "key:2|ms|@0.01");
+}
+
+TEST_F(InfluxedStatsdClientTest, Set) {
+  client->Ns("ns").Tags({ {"endpoint", "/a"} }).Set("users", "42");
+  ASSERT_EQ(sender->message_, "ns.users,endpoint=/a:42|s");
+}
+
 TEST_F(InfluxedStatsdClientTest, TimeMillisToNow) {
-  ASSERT_EQ(sender->message_.size() == 0, true);
-  client->TimeMillisToNow("key", 0, 0.01);
-  ASSERT_EQ(sender->message_.size() > 0, true);
-  // std::cout<<"sender->message_:"<<sender->message_<<"\n";
+  client->TimeMillisToNow("key", base::GetTimestamp() / 1000 - 5000, 0.01);
+  int64 ms = strtoll(sender->message_.c_str() + 4, NULL, 10);
+  ASSERT_GE(ms, 5000);
+  ASSERT_LT(ms, 60000);
+  ASSERT_NE(sender->message_.find("|ms|@0.01"), std::string::npos);
 }
 
-// FIXME: a dummy test
 TEST_F(InfluxedStatsdClientTest, TimeMicrosToNow) {
-  ASSERT_EQ(sender->message_.size() == 0, true);
-  client->TimeMicrosToNow("key", 0, 0.01);
-  ASSERT_EQ(sender->message_.size() > 0, true);
-  // std::cout<<"sender->message_:"<<sender->message_<<"\n";
+  client->TimeMicrosToNow("key", base::GetTimestamp() - 1500, 0.01);
+  double ms = strtod(sender->message_.c_str() + 4, NULL);
+  ASSERT_GE(ms, 1.5);
+  ASSERT_LT(ms, 60000);
+  ASSERT_NE(sender->message_.find("|ms|@0.01"), std::string::npos);
+}
+
+TEST_F(InfluxedStatsdClientTest, ToNowClampsStartsInTheFuture) {
+  client->TimeMillisToNow("key", base::GetTimestamp() / 1000 + 60000);
+  ASSERT_EQ(sender->message_, "key:0|ms");
+  client->TimeMicrosToNow("key", base::GetTimestamp() + 60000000);
+  ASSERT_EQ(sender->message_, "key:0|ms");
 }
 
 // END: high level apis
 
+// BEGIN: metric handles
+TEST_F(InfluxedStatsdClientTest, CounterHandle) {
+  CounterHandle counter = client->Ns("ns").Tags({ {"tag1", "value1"} }).Counter("key");
+  ASSERT_EQ(counter.Key(), "ns.key,tag1=value1");
+
+  counter.Count(10);
+  ASSERT_EQ(sender->message_, "ns.key,tag1=value1:10|c");
+  counter.Inc(0.01);
+  ASSERT_EQ(sender->message_, "ns.key,tag1=value1:1|c|@0.01");
+  counter.Dec();
+  ASSERT_EQ(sender->message_, "ns.key,tag1=value1:-1|c");
+}
+
+TEST_F(InfluxedStatsdClientTest, GaugeHandle) {
+  GaugeHandle gauge = client->Gauge("key");
+  gauge.Set(0.0100000, 0.01);
+  ASSERT_EQ(sender->message_, "key:0.01|g|@0.01");
+  gauge.Set(1000);
+  ASSERT_EQ(sender->message_, "key:1000|g");
+}
+
+TEST_F(InfluxedStatsdClientTest, TimerHandle) {
+  TimerHandle timer = client->Timer("key");
+  timer.Time(279172897979, 0.01);
+  ASSERT_EQ(sender->message_, "key:279172897979|ms|@0.01");
+}
+
+TEST_F(InfluxedStatsdClientTest, HandleIsBoundAtCreation) {
+  CounterHandle counter = client->Counter("key");
+  client->AddTag({"tag", "value"});
+  counter.Inc();
+  ASSERT_EQ(sender->message_, "key:1|c");
+}
+// END: metric handles
+
+// BEGIN: client side sampling
+TEST_F(InfluxedStatsdClientTest, SampledRateConverges) {
+  FLAGS_statsd_client_side_sampling = true;
+  const int calls = 1000000;
+  const float rates[] = {0.5, 0.1, 0.01};
+  for (size_t r = 0; r < sizeof(rates) / sizeof(rates[0]); r++) {
+    sender->messages_.clear();
+    for (int i = 0; i < calls; i++) {
+      client->Inc("key", rates[r]);
+    }
+    // within 5 standard deviations of the binomial mean
+    double expected = calls * rates[r];
+    double sigma = sqrt(calls * rates[r] * (1 - rates[r]));
+    ASSERT_NEAR(sender->messages_.size(), expected, 5 * sigma) << "rate " << rates[r];
+    ASSERT_EQ(sender->messages_.back(), base::StringPrintf("key:1|c|@%.5g", rates[r]));
+  }
+}
+
+TEST_F(InfluxedStatsdClientTest, SamplingSkipsEverySendPath) {
+  FLAGS_statsd_client_side_sampling = true;
+  CounterHandle counter = client->Counter("key");
+  for (int i = 0; i < 1000; i++) {
+    client->Count("key", 1, 0);
+    client->Gauge("key", 1, 0);
+    client->Time("key", 1, 0);
+    client->TimeMillisToNow("key", 0, 0);
+    client->Send("key", 1, "c", 0);
+    counter.Inc(0);
+  }
+  ASSERT_TRUE(sender->messages_.empty());
+
+  // full rate is never dropped
+  for (int i = 0; i < 1000; i++) {
+    client->Inc("key");
+  }
+  ASSERT_EQ(sender->messages_.size(), 1000u);
+}
+// END: client side sampling
+
 // BEGIN test combination
 TEST_F(InfluxedStatsdClientTest, ALittleComplexTest) {
   TAGS tags = { {"tag1", "value1"} };
@@ -0,0 +1,155 @@
+#include "./line_protocol.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include "./sampler.h"
+
+namespace base {
+namespace statsd {
+DEFINE_string(statsd_output_format, "statsd",
+              "what the senders write: statsd lines, or influx for InfluxDB line protocol points");
+
+bool ParseOutputFormat(const std::string& name, OutputFormat* format) {
+  if (name == "statsd") {
+    *format = STATSD;
+  } else if (name == "influx") {
+    *format = LINE_PROTOCOL;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* OutputFormatName(OutputFormat format) {
+  return format == LINE_PROTOCOL ? "influx" : "statsd";
+}
+
+// Parse a number of a statsd line, which is not '\0' terminated
+static bool parseNumber(const char* data, size_t size, double* value) {
+  char number[MAX_NUMBER_SIZE];
+  if (size == 0 || size >= sizeof(number)) {
+    return false;
+  }
+  memcpy(number, data, size);
+  number[size] = '\0';
+  char* parsed = NULL;
+  *value = strtod(number, &parsed);
+  return parsed == number + size && isfinite(*value);
+}
+
+// floor(value), plus one with probability value - floor(value): counters scaled by a sample rate
+// sum to the right total on average, where rounding each point to nearest would bias them all
+static int64 roundStochastic(double value) {
+  double whole = floor(value);
+  double fraction = value - whole;
+  // top 53 bits, uniform in [0, 1)
+  if (fraction > 0 && static_cast<double>(NextRandom() >> 11) * (1.0 / 9007199254740992.0) < fraction) {
+    whole += 1;
+  }
+  return static_cast<int64>(whole);
+}
+
+static bool isType(const char* type, size_t size, const char* name) {
+  return strlen(name) == size && memcmp(type, name, size) == 0;
+}
+
+LineProtocolEncoder::LineProtocolEncoder() : nextNs_(0) {}
+
+void LineProtocolEncoder::StartBatch() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  StartBatch(static_cast<int64>(ts.tv_sec) * 1000000000 + ts.tv_nsec);
+}
+
+void LineProtocolEncoder::StartBatch(int64 nowNs) {
+  // the previous batch may have stamped past now
+  nextNs_ = std::max(nowNs, nextNs_);
+}
+
+bool LineProtocolEncoder::appendFloat(const char* value, size_t size) {
+  double parsed = 0;
+  if (!parseNumber(value, size, &parsed)) {
+    return false;
+  }
+  // the client's "%.5g" rendering is valid as it is, "+1" or ".5" are not
+  bool plain = (value[0] >= '0' && value[0] <= '9') ||
+      (value[0] == '-' && size > 1 && value[1] >= '0' && value[1] <= '9');
+  if (plain) {
+    point_.Append(value, size);
+  } else {
+    point_.AppendG5(parsed);
+  }
+  return true;
+}
+
+bool LineProtocolEncoder::Encode(const char* line, size_t size) {
+  // key:value|type, optionally followed by |@rate
+  const char* end = line + size;
+  const char* colon = static_cast<const char*>(memchr(line, ':', size));
+  const char* bar = colon == NULL ? NULL : static_cast<const char*>(memchr(colon, '|', end - colon));
+  if (bar == NULL || colon == line || bar + 1 == end) {
+    return false;
+  }
+  const char* typeEnd = static_cast<const char*>(memchr(bar + 1, '|', end - bar - 1));
+  if (typeEnd == NULL) {
+    typeEnd = end;
+  }
+  const char* type = bar + 1;
+  size_t typeSize = typeEnd - type;
+  const char* value = colon + 1;
+  size_t valueSize = bar - value;
+
+  point_.Clear();
+  // the measurement and tags are the key, line protocol only needs its spaces escaped
+  if (memchr(line, ' ', colon - line) == NULL) {
+    point_.Append(line, colon - line);
+  } else {
+    for (const char* c = line; c < colon; c++) {
+      if (*c == ' ') {
+        point_.Append('\\');
+      }
+      point_.Append(*c);
+    }
+  }
+  point_.Append(' ');
+  if (isType(type, typeSize, "c")) {
+    double count = 0;
+    if (!parseNumber(value, valueSize, &count)) {
+      return false;
+    }
+    double rate = 1;
+    if (end - typeEnd > 2 && typeEnd[1] == '@' && parseNumber(typeEnd + 2, end - typeEnd - 2, &rate) && rate > 0 &&
+        rate < 1) {
+      count /= rate;
+    }
+    point_.Append("count=", 6);
+    point_.AppendInt64(roundStochastic(count));
+    point_.Append('i');
+  } else if (isType(type, typeSize, "s")) {
+    point_.Append("member=\"", 8);
+    for (const char* c = value; c < bar; c++) {
+      if (*c == '"' || *c == '\\') {
+        point_.Append('\\');
+      }
+      point_.Append(*c);
+    }
+    point_.Append('"');
+  } else {
+    if (isType(type, typeSize, "ms")) {
+      point_.Append("ms=", 3);
+    } else {
+      point_.Append("value=", 6);
+    }
+    if (!appendFloat(value, valueSize)) {
+      return false;
+    }
+  }
+  point_.Append(' ');
+  point_.AppendInt64(nextNs_++);
+  return true;
+}
+}
+}
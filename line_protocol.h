@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include "base/common/basic_types.h"
+#include "base/common/gflags.h"
+#include "./metric_formatter.h"
+
+namespace base {
+namespace statsd {
+DECLARE_string(statsd_output_format);
+
+/**
+ * What the senders put on the wire
+ * STATSD:        lines as the client renders them, e.g. "ns.requests,host=a:1|c"
+ * LINE_PROTOCOL: InfluxDB line protocol points, e.g. "ns.requests,host=a count=1i 1700000000000000000",
+ *                for an InfluxDB UDP or socket listener without statsd in between
+ */
+enum OutputFormat {
+  STATSD,
+  LINE_PROTOCOL,
+};
+
+/**
+ * Parse "statsd" or "influx", return false on unknown names
+ */
+bool ParseOutputFormat(const std::string& name, OutputFormat* format);
+const char* OutputFormatName(OutputFormat format);
+
+/**
+ * Renders statsd lines as InfluxDB line protocol points. The client's "ns.key,tag=value" keys
+ * already are a measurement and its tag set, only the value becomes a field, typed by metric:
+ *
+ *   ns.key,tag=v:5|c|@0.5   ns.key,tag=v count=10i   integer, scaled by 1 / sample rate
+ *   ns.key,tag=v:2.5|g      ns.key,tag=v value=2.5   float
+ *   ns.key,tag=v:12|ms      ns.key,tag=v ms=12       float
+ *   ns.key,tag=v:alice|s    ns.key,tag=v member="alice"
+ *
+ * and any other type gives a float "value" field. A field keeps one type per measurement, so
+ * counters are always integers, whatever their sample rate, and the other numbers always floats.
+ * A scaled count with a fraction is rounded up with the probability of that fraction, down
+ * otherwise, so summed counts are unbiased: 1|c|@0.3 is 3 or 4, 3.33 on average.
+ *
+ * Points carry nanosecond timestamps taken once per batch, on the sending worker: the n-th point
+ * of a batch is stamped with the batch time plus n nanoseconds, so points of one series sent in
+ * the same batch do not overwrite each other, and stamps never go backwards.
+ *
+ * Not thread safe, one per worker.
+ */
+class LineProtocolEncoder {
+ public:
+  LineProtocolEncoder();
+
+  /**
+   * Start a batch at the current wall clock time, the only clock read per batch
+   */
+  void StartBatch();
+  void StartBatch(int64 nowNs);
+
+  /**
+   * Render one statsd line as a point into Data() and Size(), valid until the next call.
+   * Return false if the line does not parse or its value is not a finite number.
+   */
+  bool Encode(const char* line, size_t size);
+
+  const char* Data() const { return point_.Data(); }
+  size_t Size() const { return point_.Size(); }
+
+ private:
+  bool appendFloat(const char* value, size_t size);
+
+ private:
+  MetricFormatter point_;
+  // stamp of the next point
+  int64 nextNs_;
+
+  DISALLOW_COPY_AND_ASSIGN(LineProtocolEncoder);
+};
+}
+}
@@ -0,0 +1,94 @@
+#include "./line_protocol.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+// the point line renders to, "" if it does not encode
+static std::string encode(LineProtocolEncoder* encoder, const std::string& line) {
+  return encoder->Encode(line.data(), line.size()) ? std::string(encoder->Data(), encoder->Size()) : "";
+}
+
+TEST(LineProtocolTest, ParsesOutputFormats) {
+  OutputFormat format = STATSD;
+  ASSERT_TRUE(ParseOutputFormat("influx", &format));
+  ASSERT_EQ(format, LINE_PROTOCOL);
+  ASSERT_STREQ(OutputFormatName(format), "influx");
+  ASSERT_TRUE(ParseOutputFormat("statsd", &format));
+  ASSERT_EQ(format, STATSD);
+  ASSERT_STREQ(OutputFormatName(format), "statsd");
+  ASSERT_FALSE(ParseOutputFormat("graphite", &format));
+}
+
+TEST(LineProtocolTest, TypesFieldsByMetric) {
+  LineProtocolEncoder encoder;
+  encoder.StartBatch(1000);
+  ASSERT_EQ(encode(&encoder, "ns.requests,host=a:5|c"), "ns.requests,host=a count=5i 1000");
+  // counters stay integers once scaled by their sample rate
+  ASSERT_EQ(encode(&encoder, "ns.requests,host=a:5|c|@0.5"), "ns.requests,host=a count=10i 1001");
+  ASSERT_EQ(encode(&encoder, "ns.load,host=a:2.5|g"), "ns.load,host=a value=2.5 1002");
+  ASSERT_EQ(encode(&encoder, "ns.load:-3|g"), "ns.load value=-3 1003");
+  ASSERT_EQ(encode(&encoder, "ns.load:1e+06|g"), "ns.load value=1e+06 1004");
+  // line protocol floats take no sign or bare fraction
+  ASSERT_EQ(encode(&encoder, "ns.load:+7|g"), "ns.load value=7 1005");
+  ASSERT_EQ(encode(&encoder, "ns.load:.5|g"), "ns.load value=0.5 1006");
+  ASSERT_EQ(encode(&encoder, "ns.rpc,method=get:0.125|ms"), "ns.rpc,method=get ms=0.125 1007");
+  ASSERT_EQ(encode(&encoder, "ns.users:al\"ice\\|s"), "ns.users member=\"al\\\"ice\\\\\" 1008");
+  ASSERT_EQ(encode(&encoder, "ns.sizes:12|h"), "ns.sizes value=12 1009");
+  ASSERT_EQ(encode(&encoder, "ns.with space,host=a b:1|c"), "ns.with\\ space,host=a\\ b count=1i 1010");
+}
+
+TEST(LineProtocolTest, ScaledCountsSumToTheirTotal) {
+  const char* lines[] = {"ns.requests:1|c|@0.3", "ns.requests:1|c|@0.4", "ns.requests:-2|c|@0.7"};
+  const double expected[] = {1 / 0.3, 1 / 0.4, -2 / 0.7};
+  const int points = 200000;
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    LineProtocolEncoder encoder;
+    encoder.StartBatch(0);
+    double sum = 0;
+    for (int n = 0; n < points; n++) {
+      std::string point = encode(&encoder, lines[i]);
+      size_t count = point.find("count=");
+      ASSERT_NE(count, std::string::npos) << point;
+      int64 value = strtoll(point.c_str() + count + 6, NULL, 10);
+      // only ever the integers around the scaled count
+      ASSERT_LE(fabs(value - expected[i]), 1.0) << point;
+      sum += value;
+    }
+    // within 0.5% of the total, rounding each point to nearest was off by 10% or more
+    ASSERT_NEAR(sum / points, expected[i], fabs(expected[i]) * 0.005) << lines[i];
+  }
+}
+
+TEST(LineProtocolTest, RejectsWhatIsNotAFiniteNumber) {
+  LineProtocolEncoder encoder;
+  encoder.StartBatch(0);
+  const char* lines[] = {"", "no colon", ":1|c", "k:1", "k:1|", "k:abc|c", "k:|g", "k:nan|g", "k:inf|ms", "k:1x|c"};
+  for (size_t i = 0; i < sizeof(lines) / sizeof(lines[0]); i++) {
+    ASSERT_EQ(encode(&encoder, lines[i]), "") << lines[i];
+  }
+}
+
+TEST(LineProtocolTest, StampsNeverGoBackwards) {
+  LineProtocolEncoder encoder;
+  encoder.StartBatch(1000);
+  ASSERT_EQ(encode(&encoder, "a:1|c"), "a count=1i 1000");
+  ASSERT_EQ(encode(&encoder, "a:1|c"), "a count=1i 1001");
+  // a batch started within the previous one's stamps goes on after them
+  encoder.StartBatch(1001);
+  ASSERT_EQ(encode(&encoder, "a:1|c"), "a count=1i 1002");
+  encoder.StartBatch(5000);
+  ASSERT_EQ(encode(&encoder, "a:1|c"), "a count=1i 5000");
+
+  // the wall clock, in nanoseconds
+  LineProtocolEncoder now;
+  now.StartBatch();
+  std::string point = encode(&now, "a:1|c");
+  ASSERT_EQ(point.size(), std::string("a count=1i ").size() + 19);
+}
+}
+}  // namespace base
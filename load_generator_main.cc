@@ -0,0 +1,282 @@
+// End-to-end load test of NonBlockingSender, or TcpSender with --transport=tcp: producer threads drive
+// InfluxedStatsdClient against an in-process loopback sink, then the accepted, dropped and received
+// metrics are reconciled.
+//
+//   load_generator --threads=16 --metrics_per_thread=1000000 --keys=1000 --tags=4 --mix=c:70,g:20,ms:10
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/common/gflags.h"
+#include "./influxed_statsd_client.h"
+#include "./non_blocking_sender.h"
+#include "./datagram_sink.h"
+#include "./tcp_sender.h"
+#include "./tcp_sink.h"
+
+DEFINE_int32(threads, 4, "producer threads");
+DEFINE_int64(metrics_per_thread, 1000000, "metrics each producer sends");
+DEFINE_int32(rate_per_thread, 0, "metrics per second per producer, 0 sends as fast as possible");
+DEFINE_int32(keys, 100, "distinct metric keys");
+DEFINE_int32(tags, 2, "tags per metric");
+DEFINE_string(mix, "c:70,g:20,ms:10", "percentage of counters, gauges and timers");
+DEFINE_string(transport, "udp", "udp through NonBlockingSender, or tcp through TcpSender");
+DEFINE_int32(latency_sample_every, 64, "time one in this many Send calls for the enqueue latency");
+
+namespace base {
+namespace statsd {
+
+typedef std::chrono::steady_clock Clock;
+
+struct Mix {
+  int counters;
+  int gauges;
+  int timers;
+};
+
+static bool parseMix(const std::string& mix, Mix* out) {
+  out->counters = out->gauges = out->timers = 0;
+  size_t start = 0;
+  while (start < mix.size()) {
+    size_t end = mix.find(',', start);
+    if (end == std::string::npos) {
+      end = mix.size();
+    }
+    std::string item = mix.substr(start, end - start);
+    size_t colon = item.find(':');
+    if (colon == std::string::npos) {
+      return false;
+    }
+    std::string type = item.substr(0, colon);
+    int percent = atoi(item.c_str() + colon + 1);
+    if (type == "c") {
+      out->counters = percent;
+    } else if (type == "g") {
+      out->gauges = percent;
+    } else if (type == "ms") {
+      out->timers = percent;
+    } else {
+      return false;
+    }
+    start = end + 1;
+  }
+  return out->counters + out->gauges + out->timers == 100;
+}
+
+struct ProducerResult {
+  int64 counters;
+  // expected counter sum by key index
+  std::vector<double> counterSums;
+  std::vector<int64> latenciesNs;
+};
+
+static void produce(const InfluxedStatsdClient& client, const std::vector<std::string>& keys, const Mix& mix,
+                    int seed, ProducerResult* result) {
+  result->counters = 0;
+  result->counterSums.assign(keys.size(), 0);
+  result->latenciesNs.reserve(FLAGS_metrics_per_thread / FLAGS_latency_sample_every + 1);
+  Clock::time_point start = Clock::now();
+  for (int64 i = 0; i < FLAGS_metrics_per_thread; i++) {
+    size_t k = static_cast<size_t>((i * 2654435761LL + seed * 40503LL) % keys.size());
+    int slot = static_cast<int>(i % 100);
+    bool timed = i % FLAGS_latency_sample_every == 0;
+    Clock::time_point before;
+    if (timed) {
+      before = Clock::now();
+    }
+    if (slot < mix.counters) {
+      int64 value = i % 5 + 1;
+      client.Count(keys[k], value);
+      result->counters++;
+      result->counterSums[k] += value;
+    } else if (slot < mix.counters + mix.gauges) {
+      client.Gauge(keys[k], (i & 1023) * 0.5);
+    } else {
+      client.Time(keys[k], i & 511);
+    }
+    if (timed) {
+      result->latenciesNs.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+          Clock::now() - before).count());
+    }
+    if (FLAGS_rate_per_thread > 0 && i % 1000 == 999) {
+      std::this_thread::sleep_until(start + std::chrono::microseconds((i + 1) * 1000000 / FLAGS_rate_per_thread));
+    }
+  }
+}
+
+static int64 percentile(std::vector<int64>* values, double q) {
+  if (values->empty()) {
+    return 0;
+  }
+  size_t rank = std::min(values->size() - 1, static_cast<size_t>(q * values->size()));
+  std::nth_element(values->begin(), values->begin() + rank, values->end());
+  return (*values)[rank];
+}
+
+static double seconds(Clock::duration d) {
+  return std::chrono::duration<double>(d).count();
+}
+
+static void printTransport(NonBlockingSender* sender, const DatagramSink& sink) {
+  printf("datagrams    %12lld received\n", (long long) sink.Datagrams());
+  SenderStats stats = sender->Stats();
+  printf("to the wire  mean %.0fus, max %lldus, over %lld sampled metrics\n", stats.meanLatencyUs,
+         (long long) stats.maxLatencyUs, (long long) stats.latencySamples);
+}
+
+static void printTransport(TcpSender* sender, const TcpSink& sink) {
+  printf("tcp          %12lld bytes, %lld connects, %lld accepted, %lld partial writes\n",
+         (long long) sender->SentBytes(), (long long) sender->Connects(), (long long) sink.Connections(),
+         (long long) sender->PartialWrites());
+}
+
+template <typename Sender, typename Sink>
+static int drive(const Mix& mix, Sender* sender, Sink* sink) {
+  TAGS tags;
+  for (int i = 0; i < FLAGS_tags; i++) {
+    tags.push_back(TAG("tag" + std::to_string(i), "value" + std::to_string(i)));
+  }
+  InfluxedStatsdClient client = InfluxedStatsdClient(sender).Ns("load").Tags(tags);
+  std::vector<std::string> keys;
+  for (int i = 0; i < FLAGS_keys; i++) {
+    keys.push_back("key" + std::to_string(i));
+  }
+
+  // sample the backlog while producers run
+  std::atomic<bool> producing(true);
+  size_t peakQueue = 0;
+  std::thread monitor([&]() {
+    while (producing.load()) {
+      peakQueue = std::max(peakQueue, sender->QueueSize());
+      usleep(1000);
+    }
+  });
+
+  std::vector<ProducerResult> results(FLAGS_threads);
+  std::vector<std::thread> producers;
+  Clock::time_point start = Clock::now();
+  for (int i = 0; i < FLAGS_threads; i++) {
+    producers.push_back(std::thread(produce, std::cref(client), std::cref(keys), std::cref(mix), i, &results[i]));
+  }
+  for (size_t i = 0; i < producers.size(); i++) {
+    producers[i].join();
+  }
+  Clock::time_point produced = Clock::now();
+  producing.store(false);
+  monitor.join();
+
+  // wait for the queue to drain and the sink to go quiet
+  while (sender->QueueSize() > 0) {
+    usleep(1000);
+  }
+  int64 lines = -1;
+  while (lines != sink->Lines()) {
+    lines = sink->Lines();
+    usleep(200 * 1000);
+  }
+  Clock::time_point drained = Clock::now();
+  sink->Stop();
+
+  int64 sent = static_cast<int64>(FLAGS_threads) * FLAGS_metrics_per_thread;
+  int64 dropped = sender->DroppedMetrics();
+  int64 accepted = sent - dropped;
+  std::vector<int64> latencies;
+  std::vector<double> expected(keys.size(), 0);
+  int64 counters = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    latencies.insert(latencies.end(), results[i].latenciesNs.begin(), results[i].latenciesNs.end());
+    for (size_t k = 0; k < keys.size(); k++) {
+      expected[k] += results[i].counterSums[k];
+    }
+    counters += results[i].counters;
+  }
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%s, producers %d, keys %d, tags %d, mix %s\n", FLAGS_transport.c_str(), FLAGS_threads, FLAGS_keys,
+         FLAGS_tags, FLAGS_mix.c_str());
+  printf("sent         %12lld metrics in %.3fs, %.0f metrics/s\n", (long long) sent,
+         seconds(produced - start), sent / seconds(produced - start));
+  printf("accepted     %12lld metrics, %.0f metrics/s\n", (long long) accepted, accepted / seconds(produced - start));
+  printf("dropped      %12lld metrics, %.3f%%\n", (long long) dropped, 100.0 * dropped / sent);
+  printf("on the wire  %12lld metrics, %.0f metrics/s until drained\n", (long long) sink->Lines(),
+         sink->Lines() / seconds(drained - start));
+  printf("lost on wire %12lld metrics\n", (long long) (accepted - sink->Lines()));
+  printf("enqueue      p50 %lldns, p99 %lldns, p99.9 %lldns, max %lldns\n",
+         (long long) percentile(&latencies, 0.5), (long long) percentile(&latencies, 0.99),
+         (long long) percentile(&latencies, 0.999), (long long) percentile(&latencies, 1));
+  printTransport(sender, *sink);
+  printf("peak queue   %12zu of %zu metrics\n", peakQueue, sender->QueueCapacity());
+  printf("peak rss     %12ld KB\n", usage.ru_maxrss);
+
+  // every counter that reached the sink must add up to at most what was sent for its key,
+  // and exactly to it when nothing was dropped or lost
+  std::string prefix = "load.";
+  // rendered sorted by tag name
+  std::string suffix = TagSet::Of(tags)->Rendered();
+  std::map<std::string, double> received = sink->Counters();
+  bool lossless = dropped == 0 && accepted == sink->Lines();
+  int mismatches = 0;
+  double receivedTotal = 0;
+  double expectedTotal = 0;
+  for (size_t k = 0; k < keys.size(); k++) {
+    double got = received[prefix + keys[k] + suffix];
+    receivedTotal += got;
+    expectedTotal += expected[k];
+    if (got > expected[k] || (lossless && got != expected[k])) {
+      if (mismatches++ < 10) {
+        printf("MISMATCH     %s: sent %.0f, received %.0f\n", keys[k].c_str(), expected[k], got);
+      }
+    }
+  }
+  printf("counters     %12lld sent, sum %.0f sent, %.0f received\n", (long long) counters, expectedTotal,
+         receivedTotal);
+  if (received.size() > keys.size() || sink->MalformedLines() > 0) {
+    printf("FAIL         %zu counter keys for %zu sent, %lld malformed lines\n", received.size(), keys.size(),
+           (long long) sink->MalformedLines());
+    return 1;
+  }
+  if (mismatches > 0) {
+    printf("FAIL         %d counter keys do not add up\n", mismatches);
+    return 1;
+  }
+  printf("OK           counters add up%s\n", lossless ? " exactly" : ", within drops and loss");
+  return 0;
+}
+
+static int run() {
+  Mix mix;
+  if (!parseMix(FLAGS_mix, &mix)) {
+    fprintf(stderr, "bad --mix %s, expected e.g. c:70,g:20,ms:10 adding up to 100\n", FLAGS_mix.c_str());
+    return 2;
+  }
+  if (FLAGS_transport == "tcp") {
+    TcpSink sink;
+    TcpSender::Options options;
+    options.host = "127.0.0.1";
+    options.port = sink.Port();
+    TcpSender sender(options);
+    return drive(mix, &sender, &sink);
+  }
+  if (FLAGS_transport != "udp") {
+    fprintf(stderr, "bad --transport %s, expected udp or tcp\n", FLAGS_transport.c_str());
+    return 2;
+  }
+  DatagramSink sink;
+  FLAGS_statsd_host = "127.0.0.1";
+  FLAGS_statsd_port = sink.Port();
+  return drive(mix, NonBlockingSender::Instance(), &sink);
+}
+}
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  return base::statsd::run();
+}
@@ -0,0 +1,144 @@
+#include "./load_shedder.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "base/common/gflags.h"
+#include "base/common/logging.h"
+#include "./hash_bytes.h"
+#include "./metric_formatter.h"
+#include "./sampler.h"
+
+namespace base {
+namespace statsd {
+DEFINE_double(statsd_shed_backlog_high, 0.5,
+              "queue fill ratio above which --statsd_adaptive_sampling halves the rate of high volume metrics");
+DEFINE_double(statsd_shed_backlog_low, 0.1, "queue fill ratio below which the sample rate recovers");
+DEFINE_int32(statsd_shed_latency_ms, 50,
+             "mean enqueue to wire latency above which the sample rate is halved, 0 ignores latency");
+DEFINE_double(statsd_shed_error_ratio, 0.05,
+              "share of datagrams refused by the socket above which the sample rate is halved, 0 ignores errors");
+DEFINE_double(statsd_shed_min_rate, 0.01, "lowest sample rate adaptive sampling goes down to");
+DEFINE_int32(statsd_shed_min_key_hits, 100,
+             "lines of a key per check interval before adaptive sampling considers it high volume");
+DEFINE_int32(statsd_shed_check_interval_ms, 100, "how often adaptive sampling checks the sender's load");
+DEFINE_int32(statsd_shed_recover_checks, 10,
+             "calm checks in a row before adaptive sampling doubles the sample rate again");
+
+// Past this level the factor would be lost in the "%.5g" rendering of rates anyway
+static const int MAX_SHED_LEVEL = 16;
+
+LoadShedder::Options::Options() {
+  backlogHigh = FLAGS_statsd_shed_backlog_high;
+  backlogLow = FLAGS_statsd_shed_backlog_low;
+  maxLatencyMs = FLAGS_statsd_shed_latency_ms;
+  maxErrorRatio = FLAGS_statsd_shed_error_ratio;
+  minRate = FLAGS_statsd_shed_min_rate;
+  minKeyHits = FLAGS_statsd_shed_min_key_hits;
+  checkIntervalMs = FLAGS_statsd_shed_check_interval_ms;
+  recoverChecks = FLAGS_statsd_shed_recover_checks;
+}
+
+LoadShedder::LoadShedder(const Options& options)
+    : options_(options), maxLevel_(0), level_(0), shedLines_(0), calmChecks_(0) {
+  if (options_.backlogLow > options_.backlogHigh) {
+    LOG(ERROR) << "statsd_shed_backlog_low " << options_.backlogLow << " is above statsd_shed_backlog_high "
+               << options_.backlogHigh << ", use the latter for both";
+    options_.backlogLow = options_.backlogHigh;
+  }
+  while (maxLevel_ < MAX_SHED_LEVEL && ldexp(1, -(maxLevel_ + 1)) >= options_.minRate) {
+    maxLevel_++;
+  }
+  options_.checkIntervalMs = std::max(options_.checkIntervalMs, 1);
+  options_.recoverChecks = std::max(options_.recoverChecks, 1);
+  for (size_t i = 0; i < KEY_SLOTS; i++) {
+    keyHits_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+double LoadShedder::RateFactor() const {
+  return ldexp(1, -Level());
+}
+
+void LoadShedder::Update(double backlog, double meanLatencyMs, double errorRatio) {
+  bool latencyIgnored = options_.maxLatencyMs <= 0;
+  bool errorsIgnored = options_.maxErrorRatio <= 0;
+  bool overloaded = backlog > options_.backlogHigh || (!latencyIgnored && meanLatencyMs > options_.maxLatencyMs) ||
+      (!errorsIgnored && errorRatio > options_.maxErrorRatio);
+  bool calm = backlog < options_.backlogLow && (latencyIgnored || meanLatencyMs < options_.maxLatencyMs / 2.0) &&
+      (errorsIgnored || errorRatio < options_.maxErrorRatio / 2);
+  int level = level_.load(std::memory_order_relaxed);
+  if (overloaded) {
+    calmChecks_ = 0;
+    if (level < maxLevel_) {
+      level_.store(level + 1, std::memory_order_relaxed);
+    }
+  } else if (!calm) {
+    // in between, hold the level
+    calmChecks_ = 0;
+  } else if (level > 0 && ++calmChecks_ >= options_.recoverChecks) {
+    calmChecks_ = 0;
+    level_.store(level - 1, std::memory_order_relaxed);
+  }
+  // a new interval, keys have to prove they are high volume again
+  for (size_t i = 0; i < KEY_SLOTS; i++) {
+    keyHits_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+bool LoadShedder::admit(int level, const char** data, size_t* size) {
+  // key:value|c, key:value|ms, optionally followed by |@rate
+  const char* line = *data;
+  const char* end = line + *size;
+  const char* colon = static_cast<const char*>(memchr(line, ':', *size));
+  const char* bar = colon == NULL ? NULL : static_cast<const char*>(memchr(colon, '|', end - colon));
+  if (bar == NULL) {
+    return true;
+  }
+  const char* typeEnd = static_cast<const char*>(memchr(bar + 1, '|', end - bar - 1));
+  if (typeEnd == NULL) {
+    typeEnd = end;
+  }
+  size_t typeSize = typeEnd - bar - 1;
+  if (!(typeSize == 1 && bar[1] == 'c') && !(typeSize == 2 && bar[1] == 'm' && bar[2] == 's')) {
+    return true;
+  }
+  float rate = 1;
+  if (typeEnd != end) {
+    if (end - typeEnd < 3 || typeEnd[1] != '@' || memchr(typeEnd + 1, '|', end - typeEnd - 1) != NULL) {
+      return true;
+    }
+    char number[MAX_NUMBER_SIZE];
+    size_t length = std::min(static_cast<size_t>(end - typeEnd - 2), sizeof(number) - 1);
+    memcpy(number, typeEnd + 2, length);
+    number[length] = '\0';
+    char* parsed = NULL;
+    rate = strtof(number, &parsed);
+    if (parsed == number || !(rate > 0)) {
+      return true;
+    }
+  }
+
+  std::atomic<uint32>& hits = keyHits_[HashBytes(line, colon - line) & (KEY_SLOTS - 1)];
+  uint32 seen = hits.load(std::memory_order_relaxed);
+  if (seen < static_cast<uint32>(options_.minKeyHits)) {
+    hits.store(seen + 1, std::memory_order_relaxed);
+    return true;
+  }
+  // kept with probability exactly 2^-level
+  if ((NextRandom() >> (64 - level)) != 0) {
+    shedLines_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  // the caller's line may live in MetricFormatter::Local(), rewrite into another buffer
+  static thread_local MetricFormatter rewritten;
+  rewritten.Clear();
+  rewritten.Append(line, typeEnd - line);
+  rewritten.AppendSampleRate(std::min(rate, 1.0f) * static_cast<float>(ldexp(1, -level)));
+  *data = rewritten.Data();
+  *size = rewritten.Size();
+  return true;
+}
+}
+}
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Lowers the sample rate of high volume counters and timers while the sender is overloaded.
+ *
+ * The worker calls Update() every check interval with the load it observed. While the backlog,
+ * the enqueue to wire latency or the share of datagrams refused by the socket is above its high
+ * threshold the shed level goes up by one, halving the rate again, down to minRate. It only goes
+ * back down by one once the load stayed below the low thresholds for recoverChecks checks in a
+ * row, so the rate does not flap around the limit.
+ *
+ * At shed level L, Admit() keeps a "key:value|c" or "key:value|ms" line with probability 2^-L and
+ * rewrites its sample rate into "|@rate * 2^-L", so statsd scales what is left back to unbiased
+ * totals. Only keys seen more than minKeyHits times in the current interval are shed: rare keys,
+ * gauges, sets and lines with extra sections always go through unchanged.
+ *
+ * Thread safe, Admit() from any thread and Update() from a single one.
+ */
+class LoadShedder {
+ public:
+  struct Options {
+    /**
+     * Defaults from the --statsd_shed_* flags
+     */
+    Options();
+
+    /**
+     * queue fill ratio, 0 to 1, above which the rate is lowered and below which it may recover
+     */
+    double backlogHigh;
+    double backlogLow;
+    /**
+     * mean enqueue to wire latency of the interval above which the rate is lowered, it may
+     * recover below half of it. 0 ignores latency
+     */
+    int maxLatencyMs;
+    /**
+     * share of datagrams refused by the socket, e.g. a unix socket whose reader falls behind, above
+     * which the rate is lowered, it may recover below half of it. 0 ignores send errors
+     */
+    double maxErrorRatio;
+    /**
+     * lowest effective rate, rounded down to a power of 2 fraction
+     */
+    double minRate;
+    /**
+     * lines of a key per check interval before it counts as high volume
+     */
+    int minKeyHits;
+    int checkIntervalMs;
+    int recoverChecks;
+  };
+
+  explicit LoadShedder(const Options& options);
+
+  /**
+   * Whether to send a metric line, if so data and size point to the line to send: the line itself,
+   * or a copy in a thread local buffer annotated with its lowered rate, valid until the next call.
+   */
+  bool Admit(const char** data, size_t* size) {
+    int level = level_.load(std::memory_order_relaxed);
+    return level == 0 || admit(level, data, size);
+  }
+
+  /**
+   * Worker side, once every checkIntervalMs
+   * @param backlog
+   *     queued metrics over the queue capacity
+   * @param meanLatencyMs
+   *     mean enqueue to wire latency since the last check
+   * @param errorRatio
+   *     datagrams the socket refused over datagrams written since the last check
+   */
+  void Update(double backlog, double meanLatencyMs, double errorRatio);
+
+  /**
+   * Current shed level and the factor it applies to sample rates, 2^-level
+   */
+  int Level() const { return level_.load(std::memory_order_relaxed); }
+  double RateFactor() const;
+  int MaxLevel() const { return maxLevel_; }
+
+  /**
+   * Lines not sent because of shedding so far
+   */
+  int64 ShedLines() const { return shedLines_.load(std::memory_order_relaxed); }
+
+  const Options& GetOptions() const { return options_; }
+
+  // key hit counters, keys colliding in a slot count as one
+  static const size_t KEY_SLOTS = 1024;
+
+ private:
+  bool admit(int level, const char** data, size_t* size);
+
+ private:
+  Options options_;
+  int maxLevel_;
+  std::atomic<int> level_;
+  std::atomic<int64> shedLines_;
+  // worker only
+  int calmChecks_;
+  // lines per key slot in the current interval, plain loads and stores: a lost update only
+  // delays shedding by a line
+  std::atomic<uint32> keyHits_[KEY_SLOTS];
+
+  DISALLOW_COPY_AND_ASSIGN(LoadShedder);
+};
+}
+}
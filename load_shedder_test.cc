@@ -0,0 +1,130 @@
+#include "./load_shedder.h"
+
+#include <math.h>
+#include <string>
+#include "base/testing/gtest.h"
+#include "./datagram_sink.h"
+
+namespace base {
+namespace statsd {
+
+static LoadShedder::Options testOptions() {
+  LoadShedder::Options options;
+  options.backlogHigh = 0.5;
+  options.backlogLow = 0.1;
+  options.maxLatencyMs = 10;
+  options.maxErrorRatio = 0.2;
+  options.minRate = 0.1;
+  options.minKeyHits = 0;
+  options.recoverChecks = 3;
+  return options;
+}
+
+// what Admit() makes of line, "" when shed
+static std::string admit(LoadShedder* shedder, const std::string& line) {
+  const char* data = line.data();
+  size_t size = line.size();
+  return shedder->Admit(&data, &size) ? std::string(data, size) : "";
+}
+
+TEST(LoadShedderTest, LowersFastAndRecoversWithHysteresis) {
+  LoadShedder shedder(testOptions());
+  // 1/8 is the last power of 2 above 0.1
+  ASSERT_EQ(shedder.MaxLevel(), 3);
+  ASSERT_EQ(shedder.RateFactor(), 1);
+  for (int i = 0; i < 5; i++) {
+    shedder.Update(0.9, 0, 0);
+  }
+  ASSERT_EQ(shedder.Level(), 3);
+  ASSERT_EQ(shedder.RateFactor(), 0.125);
+
+  // between the thresholds the level holds, and the calm streak starts over
+  shedder.Update(0.05, 0, 0);
+  shedder.Update(0.05, 0, 0);
+  shedder.Update(0.3, 0, 0);
+  shedder.Update(0.05, 0, 0);
+  shedder.Update(0.05, 0, 0);
+  ASSERT_EQ(shedder.Level(), 3);
+  shedder.Update(0.05, 0, 0);
+  ASSERT_EQ(shedder.Level(), 2);
+  for (int i = 0; i < 6; i++) {
+    shedder.Update(0, 0, 0);
+  }
+  ASSERT_EQ(shedder.Level(), 0);
+
+  // latency and refused datagrams count as load too, and must fall below half their limit to recover
+  shedder.Update(0, 20, 0);
+  ASSERT_EQ(shedder.Level(), 1);
+  shedder.Update(0, 0, 0.5);
+  ASSERT_EQ(shedder.Level(), 2);
+  for (int i = 0; i < 6; i++) {
+    shedder.Update(0, 7, 0.15);
+  }
+  ASSERT_EQ(shedder.Level(), 2);
+  for (int i = 0; i < 3; i++) {
+    shedder.Update(0, 4, 0.05);
+  }
+  ASSERT_EQ(shedder.Level(), 1);
+}
+
+TEST(LoadShedderTest, OnlyShedsHighVolumeCountersAndTimers) {
+  LoadShedder::Options options = testOptions();
+  options.minKeyHits = 5;
+  LoadShedder shedder(options);
+  ASSERT_EQ(admit(&shedder, "hot:1|c"), "hot:1|c");
+  shedder.Update(1, 0, 0);
+  shedder.Update(1, 0, 0);
+  ASSERT_EQ(shedder.Level(), 2);
+
+  // the first hits of a key in the interval go through as they are
+  for (int i = 0; i < 5; i++) {
+    ASSERT_EQ(admit(&shedder, "hot:1|c"), "hot:1|c");
+  }
+  int kept = 0;
+  for (int i = 0; i < 1000; i++) {
+    std::string line = admit(&shedder, "hot:1|c");
+    if (!line.empty()) {
+      ASSERT_EQ(line, "hot:1|c|@0.25");
+      kept++;
+    }
+  }
+  ASSERT_GT(kept, 150);
+  ASSERT_LT(kept, 350);
+  ASSERT_EQ(shedder.ShedLines(), 1000 - kept);
+
+  // a new interval starts counting again
+  shedder.Update(0.3, 0, 0);
+  ASSERT_EQ(admit(&shedder, "hot:1|c"), "hot:1|c");
+
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(admit(&shedder, "level:3|g"), "level:3|g");
+    ASSERT_EQ(admit(&shedder, "users:42|s"), "users:42|s");
+    ASSERT_EQ(admit(&shedder, "tagged:1|c|#a:b"), "tagged:1|c|#a:b");
+    ASSERT_EQ(admit(&shedder, "malformed"), "malformed");
+  }
+}
+
+TEST(LoadShedderTest, RescaledRatesKeepTotalsUnbiased) {
+  LoadShedder shedder(testOptions());
+  for (int i = 0; i < 3; i++) {
+    shedder.Update(1, 0, 0);
+  }
+  const int lines = 100000;
+  MetricLineCounter counter;
+  for (int i = 0; i < lines; i++) {
+    std::string line = admit(&shedder, "requests:1|c");
+    counter.Add(line.data(), line.size());
+    line = admit(&shedder, "bytes:3|c|@0.5");
+    counter.Add(line.data(), line.size());
+    line = admit(&shedder, "rpc:5|ms|@0.5");
+    if (!line.empty()) {
+      ASSERT_EQ(line, "rpc:5|ms|@0.0625");
+    }
+  }
+  // kept with probability 1/8, each one weighs 8: 5 standard deviations
+  ASSERT_NEAR(counter.Counters()["requests"], lines, 5 * 8 * sqrt(lines * 0.125 * 0.875));
+  // the original rate is kept in the product, the bytes weigh 3 / (0.5 / 8) each
+  ASSERT_NEAR(counter.Counters()["bytes"], 2 * 3 * lines, 5 * 16 * 3 * sqrt(lines * 0.125 * 0.875));
+}
+}
+}  // namespace base
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <time.h>
+#include <atomic>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Lets one of a kind of error message through per interval, counting the ones it holds back,
+ * so a broken socket does not cost more in logging than the metrics themselves.
+ *
+ *   int64 suppressed = 0;
+ *   if (limiter.Allow(&suppressed)) {
+ *     LOG(ERROR) << "Fail to send ... (" << suppressed << " similar errors suppressed)";
+ *   }
+ */
+class LogRateLimiter {
+ public:
+  explicit LogRateLimiter(int64 intervalMs) : intervalMs_(intervalMs), nextMs_(0), suppressed_(0) {}
+
+  /**
+   * @param suppressed
+   *     set to the number of calls denied since the last allowed one, when allowing this one
+   */
+  bool Allow(int64* suppressed) {
+    int64 now = nowMs();
+    int64 next = nextMs_.load(std::memory_order_relaxed);
+    if (now < next || !nextMs_.compare_exchange_strong(next, now + intervalMs_, std::memory_order_relaxed)) {
+      suppressed_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    *suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+    return true;
+  }
+
+ private:
+  static int64 nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+  }
+
+ private:
+  int64 intervalMs_;
+  std::atomic<int64> nextMs_;
+  std::atomic<int64> suppressed_;
+
+  DISALLOW_COPY_AND_ASSIGN(LogRateLimiter);
+};
+}
+}
@@ -0,0 +1,173 @@
+#include "./metric_formatter.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+namespace base {
+namespace statsd {
+
+static const float SAMPLE_RATE_EPSILON = 0.0001;
+static const double G5_INTEGER_LIMIT = 1e5;
+// "%.5g" switches to exponent notation below this
+static const double G5_FIXED_LOWER = 1e-4;
+static const int G5_MAX_DECIMALS = 9;
+// far below the 5e-6 relative gap between a 5 digit decimal and a rounding boundary
+static const double G5_ULPS_TOLERANCE = 1e-15;
+static const double POW10[] = {1, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+static const int64 IPOW10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+size_t FormatInt64(int64 value, char* out) {
+  char digits[MAX_NUMBER_SIZE];
+  size_t n = 0;
+  // negate in unsigned space, so INT64_MIN does not overflow
+  uint64 magnitude = value < 0 ? 0 - static_cast<uint64>(value) : static_cast<uint64>(value);
+  do {
+    digits[n++] = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+
+  size_t size = 0;
+  if (value < 0) {
+    out[size++] = '-';
+  }
+  while (n > 0) {
+    out[size++] = digits[--n];
+  }
+  out[size] = '\0';
+  return size;
+}
+
+size_t FormatMicrosAsMillis(int64 micros, char* out) {
+  size_t size = FormatInt64(micros / 1000, out);
+  int64 fraction = micros % 1000;
+  if (fraction == 0) {
+    return size;
+  }
+  if (fraction < 0) {
+    fraction = -fraction;
+    // -0.5 has no sign left in its integral part
+    if (micros > -1000) {
+      memmove(out + 1, out, size + 1);
+      out[0] = '-';
+      size++;
+    }
+  }
+  out[size++] = '.';
+  for (int64 unit = 100; fraction != 0; unit /= 10) {
+    out[size++] = '0' + fraction / unit;
+    fraction %= unit;
+  }
+  out[size] = '\0';
+  return size;
+}
+
+size_t FormatG5(double value, char* out) {
+  // "%.5g" prints integers below 1e5 as plain digits; -0.0 keeps its sign there, so leave it to printf
+  if (value > -G5_INTEGER_LIMIT && value < G5_INTEGER_LIMIT && value == floor(value) &&
+      !(value == 0 && signbit(value))) {
+    return FormatInt64(static_cast<int64>(value), out);
+  }
+
+  // values within a few ulps of a decimal with at most 5 significant digits, like 0.01 or 12.5,
+  // are exactly what "%.5g" rounds them to
+  double magnitude = fabs(value);
+  if (magnitude >= G5_FIXED_LOWER && magnitude < G5_INTEGER_LIMIT) {
+    for (int decimals = 1; decimals <= G5_MAX_DECIMALS; decimals++) {
+      double scaled = magnitude * POW10[decimals];
+      double rounded = floor(scaled + 0.5);
+      if (rounded >= G5_INTEGER_LIMIT) {
+        break;
+      }
+      if (fabs(scaled - rounded) > rounded * G5_ULPS_TOLERANCE) {
+        continue;
+      }
+      int64 digits = static_cast<int64>(rounded);
+      while (decimals > 0 && digits % 10 == 0) {
+        digits /= 10;
+        decimals--;
+      }
+      size_t size = 0;
+      if (value < 0) {
+        out[size++] = '-';
+      }
+      size += FormatInt64(digits / IPOW10[decimals], out + size);
+      if (decimals > 0) {
+        out[size++] = '.';
+        int64 fraction = digits % IPOW10[decimals];
+        for (int i = decimals - 1; i >= 0; i--) {
+          out[size++] = '0' + (fraction / IPOW10[i]) % 10;
+        }
+      }
+      out[size] = '\0';
+      return size;
+    }
+  }
+  return snprintf(out, MAX_NUMBER_SIZE, "%.5g", value);
+}
+
+MetricFormatter::MetricFormatter() {
+  data_ = inline_;
+  size_ = 0;
+  capacity_ = INLINE_SIZE;
+}
+
+MetricFormatter::MetricFormatter(char* buffer, size_t capacity) {
+  data_ = buffer;
+  size_ = 0;
+  capacity_ = capacity;
+}
+
+MetricFormatter& MetricFormatter::Local() {
+  static thread_local MetricFormatter formatter;
+  return formatter;
+}
+
+void MetricFormatter::grow(size_t required) {
+  size_t capacity = capacity_ * 2;
+  if (capacity < required) {
+    capacity = required;
+  }
+  std::string bigger(capacity, '\0');
+  memcpy(&bigger[0], data_, size_);
+  heap_.swap(bigger);
+  data_ = &heap_[0];
+  capacity_ = capacity;
+}
+
+void MetricFormatter::Append(const char* data, size_t size) {
+  reserve(size);
+  memcpy(data_ + size_, data, size);
+  size_ += size;
+}
+
+void MetricFormatter::AppendInt64(int64 value) {
+  reserve(MAX_NUMBER_SIZE);
+  size_ += FormatInt64(value, data_ + size_);
+}
+
+void MetricFormatter::AppendG5(double value) {
+  reserve(MAX_NUMBER_SIZE);
+  size_ += FormatG5(value, data_ + size_);
+}
+
+void MetricFormatter::AppendSampleRate(float sampleRate) {
+  if (fabs(sampleRate - 1.0) < SAMPLE_RATE_EPSILON) {
+    return;
+  }
+  // rates are almost always constants, remember the last one rendered by this thread
+  static thread_local float lastRate = 1;
+  static thread_local char lastText[MAX_NUMBER_SIZE];
+  static thread_local size_t lastSize = 0;
+  if (sampleRate != lastRate || lastSize == 0) {
+    lastSize = FormatG5(sampleRate, lastText);
+    lastRate = sampleRate;
+  }
+  reserve(2 + lastSize);
+  data_[size_++] = '|';
+  data_[size_++] = '@';
+  memcpy(data_ + size_, lastText, lastSize);
+  size_ += lastSize;
+}
+}
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <string>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Value formatting without heap allocations or format string parsing.
+ * Output is byte-identical to the printf formats the client historically used.
+ */
+
+// Enough for any int64 or "%.5g" double, terminating '\0' included
+static const size_t MAX_NUMBER_SIZE = 32;
+
+/**
+ * Same as snprintf(out, MAX_NUMBER_SIZE, "%jd", value), returns the length
+ */
+size_t FormatInt64(int64 value, char* out);
+
+/**
+ * Same as snprintf(out, MAX_NUMBER_SIZE, "%.5g", value), returns the length.
+ * Integral values below 1e5 (the common gauge case) skip printf altogether.
+ */
+size_t FormatG5(double value, char* out);
+
+/**
+ * Microseconds as milliseconds with up to 3 decimals and no trailing zeros, e.g. 1250 gives "1.25"
+ * and 3000 gives "3", returns the length
+ */
+size_t FormatMicrosAsMillis(int64 micros, char* out);
+
+/**
+ * A metric line rendered into a fixed buffer, either its own inline one or a caller provided one.
+ * Lines longer than the buffer move to the heap, so nothing is ever truncated.
+ *
+ * Local() gives each thread a reusable instance, which keeps the steady state free of allocations.
+ */
+class MetricFormatter {
+ public:
+  static const size_t INLINE_SIZE = 1024;
+
+  MetricFormatter();
+  MetricFormatter(char* buffer, size_t capacity);
+
+  /**
+   * Thread local instance, Clear() it before use. Not reentrant: do not hold it across calls
+   * that may format metrics themselves.
+   */
+  static MetricFormatter& Local();
+
+  void Clear() { size_ = 0; }
+
+  void Append(char c) {
+    reserve(1);
+    data_[size_++] = c;
+  }
+  void Append(const char* data, size_t size);
+  void Append(const std::string& s) { Append(s.data(), s.size()); }
+
+  void AppendInt64(int64 value);
+  void AppendG5(double value);
+
+  /**
+   * Append "|@" + "%.5g" formatted sampleRate, unless sampleRate is 1
+   */
+  void AppendSampleRate(float sampleRate);
+
+  const char* Data() const { return data_; }
+  size_t Size() const { return size_; }
+  std::string ToString() const { return std::string(data_, size_); }
+
+ private:
+  void reserve(size_t more) {
+    if (size_ + more > capacity_) {
+      grow(size_ + more);
+    }
+  }
+  void grow(size_t required);
+
+ private:
+  char* data_;
+  size_t size_;
+  size_t capacity_;
+  std::string heap_;
+  char inline_[INLINE_SIZE];
+
+  DISALLOW_COPY_AND_ASSIGN(MetricFormatter);
+};
+}
+}
@@ -0,0 +1,158 @@
+#include "./metric_formatter.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits>
+#include <new>
+#include <string>
+#include "base/testing/gtest.h"
+#include "./abstract_sender.h"
+#include "./influxed_statsd_client.h"
+
+// counts heap allocations of the calling thread, to check the steady state of the formatting path
+static thread_local int64_t allocations = 0;
+
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void* operator new(size_t size) {
+  allocations++;
+  void* p = malloc(size == 0 ? 1 : size);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept {
+  free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+
+namespace base {
+namespace statsd {
+
+static std::string printfInt64(int64 value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%jd", static_cast<intmax_t>(value));
+  return buf;
+}
+
+static std::string printfG5(double value) {
+  char buf[64];
+  snprintf(buf, sizeof(buf), "%.5g", value);
+  return buf;
+}
+
+TEST(MetricFormatterTest, FormatInt64MatchesPrintf) {
+  int64 values[] = {0, 1, -1, 9, 10, 279172897979LL, -279172897979LL,
+                    std::numeric_limits<int64>::max(), std::numeric_limits<int64>::min()};
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    char buf[MAX_NUMBER_SIZE];
+    size_t size = FormatInt64(values[i], buf);
+    ASSERT_EQ(std::string(buf, size), printfInt64(values[i]));
+  }
+}
+
+TEST(MetricFormatterTest, FormatG5MatchesPrintf) {
+  double values[] = {0, -0.0, 1, -1, 0.01, 0.0100000, 1000, 99999, 100000, -99999, 99999.5, 123456,
+                     0.5, -12.25, 0.0001, 0.00012345, 0.000012345, 9999.95, 1234.56, 0.1 + 0.2,
+                     1e-5, 3.14159265, 1.0 / 3, 1e300, -1e-300,
+                     std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+                     std::numeric_limits<double>::quiet_NaN()};
+  for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++) {
+    char buf[MAX_NUMBER_SIZE];
+    size_t size = FormatG5(values[i], buf);
+    ASSERT_EQ(std::string(buf, size), printfG5(values[i])) << "value #" << i;
+  }
+
+  srand(42);
+  for (int i = 0; i < 100000; i++) {
+    double value = (rand() - RAND_MAX / 2) * pow(10, rand() % 20 - 10);
+    if (i % 3 == 0) {
+      value = floor(value);
+    } else if (i % 3 == 1) {
+      // few significant digits, the fixed point fast path
+      value = (rand() % 200000 - 100000) / pow(10, rand() % 10);
+    }
+    char buf[MAX_NUMBER_SIZE];
+    size_t size = FormatG5(value, buf);
+    ASSERT_EQ(std::string(buf, size), printfG5(value));
+  }
+}
+
+TEST(MetricFormatterTest, FormatMicrosAsMillis) {
+  struct {
+    int64 micros;
+    const char* millis;
+  } cases[] = {{0, "0"}, {1, "0.001"}, {10, "0.01"}, {125, "0.125"}, {1000, "1"}, {1250, "1.25"},
+               {123456789, "123456.789"}, {-500, "-0.5"}, {-1500, "-1.5"}};
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    char buf[MAX_NUMBER_SIZE];
+    size_t size = FormatMicrosAsMillis(cases[i].micros, buf);
+    ASSERT_EQ(std::string(buf, size), cases[i].millis);
+    ASSERT_EQ(strtod(buf, NULL), cases[i].micros / 1000.0);
+  }
+}
+
+TEST(MetricFormatterTest, SampleRate) {
+  MetricFormatter line;
+  line.AppendSampleRate(1.0);
+  ASSERT_EQ(line.ToString(), "");
+  line.AppendSampleRate(0.01);
+  ASSERT_EQ(line.ToString(), "|@0.01");
+  line.Clear();
+  line.AppendSampleRate(2.0);
+  ASSERT_EQ(line.ToString(), "|@2");
+}
+
+TEST(MetricFormatterTest, GrowsBeyondCallerBuffer) {
+  char buffer[8];
+  MetricFormatter line(buffer, sizeof(buffer));
+  line.Append("ns.key");
+  ASSERT_EQ(line.Data(), buffer);
+  line.Append(':');
+  line.AppendInt64(279172897979LL);
+  line.Append("|ms");
+  ASSERT_EQ(line.ToString(), "ns.key:279172897979|ms");
+}
+
+class CountingSender: public AbstractSender {
+ public:
+  void Send(const std::string& message) {
+    last_ = message;
+  }
+  void Send(const char*, size_t size) {
+    bytes_ += size;
+  }
+  std::string last_;
+  size_t bytes_ = 0;
+};
+
+TEST(MetricFormatterTest, ClientSendsWithoutAllocating) {
+  CountingSender sender;
+  InfluxedStatsdClient client = InfluxedStatsdClient(&sender).Ns("ns").Tags({ {"tag1", "value1"} });
+  std::string key = "key";
+
+  // first calls warm up the thread local buffers
+  client.Count(key, 10, 0.1);
+  client.Gauge(key, 0.5);
+
+  int64_t before = allocations;
+  for (int i = 0; i < 1000; i++) {
+    client.Count(key, i);
+    client.Inc(key, 0.1);
+    client.Gauge(key, i * 0.5);
+    client.Time(key, i);
+  }
+  ASSERT_EQ(allocations - before, 0);
+  ASSERT_GT(sender.bytes_, 0u);
+}
+}
+}  // namespace base
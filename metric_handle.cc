@@ -0,0 +1,85 @@
+#include "./metric_handle.h"
+
+#include "base/common/logging.h"
+#include "./aggregator.h"
+#include "./metric_formatter.h"
+#include "./sampler.h"
+
+namespace base {
+
+MetricHandle::MetricHandle(statsd::AbstractSender* sender, statsd::Aggregator* aggregator,
+                           const std::string& influxedKey, const std::string& type) {
+  CHECK(sender != NULL) << "sender is NULL";
+  sender_ = sender;
+  aggregator_ = aggregator;
+  key_ = influxedKey;
+  prefix_ = influxedKey + ":";
+  suffix_ = "|" + type;
+}
+
+void MetricHandle::send(const char* value, size_t size, float sampleRate) const {
+  statsd::MetricFormatter& line = statsd::MetricFormatter::Local();
+  line.Clear();
+  line.Append(prefix_);
+  line.Append(value, size);
+  line.Append(suffix_);
+  line.AppendSampleRate(sampleRate);
+  sender_->Send(line.Data(), line.Size());
+}
+
+void CounterHandle::Count(int64 value, float sampleRate) const {
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  if (aggregator_ != NULL) {
+    aggregator_->Count(key_, value, sampleRate);
+    return;
+  }
+  char buf[statsd::MAX_NUMBER_SIZE];
+  size_t size = statsd::FormatInt64(value, buf);
+  send(buf, size, sampleRate);
+}
+
+void GaugeHandle::Set(double value, float sampleRate) const {
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  if (aggregator_ != NULL) {
+    aggregator_->Gauge(key_, value);
+    return;
+  }
+  char buf[statsd::MAX_NUMBER_SIZE];
+  size_t size = statsd::FormatG5(value, buf);
+  send(buf, size, sampleRate);
+}
+
+void TimerHandle::Time(int64 ms, float sampleRate) const {
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  if (aggregator_ != NULL && aggregator_->SketchesTimers()) {
+    aggregator_->Time(key_, ms, sampleRate);
+    return;
+  }
+  char buf[statsd::MAX_NUMBER_SIZE];
+  size_t size = statsd::FormatInt64(ms, buf);
+  send(buf, size, sampleRate);
+}
+
+void TimerHandle::TimeMicros(int64 us, float sampleRate) const {
+  if (!statsd::Sampled(sampleRate)) {
+    return;
+  }
+  timeMicros(us, sampleRate);
+}
+
+void TimerHandle::timeMicros(int64 us, float sampleRate) const {
+  if (aggregator_ != NULL && aggregator_->SketchesTimers()) {
+    aggregator_->Time(key_, us / 1000.0, sampleRate);
+    return;
+  }
+  char buf[statsd::MAX_NUMBER_SIZE];
+  size_t size = statsd::FormatMicrosAsMillis(us, buf);
+  send(buf, size, sampleRate);
+}
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <string>
+#include "base/common/basic_types.h"
+#include "./abstract_sender.h"
+
+namespace base {
+namespace statsd {
+class Aggregator;
+}
+
+/**
+ * Pre-bound metric with its "ns.key,tag=value:" prefix and "|type" suffix rendered once,
+ * so each call only formats the value. Get one from InfluxedStatsdClient::Counter/Gauge/Timer
+ * and keep it around, e.g. as a member of the object doing the work.
+ *
+ * A handle captures the client's namespace, tags, sender and aggregator at creation time,
+ * later changes to the client (AddTag, ApendSubNs) do not affect it.
+ * Handles are cheap to copy and thread-safe.
+ */
+class MetricHandle {
+ public:
+  /**
+   * Rendered key, ns + "." + key + tags
+   */
+  const std::string& Key() const { return key_; }
+
+ protected:
+  MetricHandle(statsd::AbstractSender* sender, statsd::Aggregator* aggregator,
+               const std::string& influxedKey, const std::string& type);
+
+  void send(const char* value, size_t size, float sampleRate) const;
+
+ protected:
+  statsd::AbstractSender* sender_;
+  statsd::Aggregator* aggregator_;
+  std::string key_;
+  std::string prefix_;
+  std::string suffix_;
+};
+
+class CounterHandle: public MetricHandle {
+ public:
+  /**
+   * Same as InfluxedStatsdClient::Count(key, value, sampleRate)
+   */
+  void Count(int64 value, float sampleRate = 1.0) const;
+  void Inc(float sampleRate = 1.0) const { Count(1, sampleRate); }
+  void Dec(float sampleRate = 1.0) const { Count(-1, sampleRate); }
+
+ private:
+  friend class InfluxedStatsdClient;
+  CounterHandle(statsd::AbstractSender* sender, statsd::Aggregator* aggregator, const std::string& influxedKey)
+      : MetricHandle(sender, aggregator, influxedKey, "c") {}
+};
+
+class GaugeHandle: public MetricHandle {
+ public:
+  /**
+   * Same as InfluxedStatsdClient::Gauge(key, value, sampleRate)
+   */
+  void Set(double value, float sampleRate = 1.0) const;
+
+ private:
+  friend class InfluxedStatsdClient;
+  GaugeHandle(statsd::AbstractSender* sender, statsd::Aggregator* aggregator, const std::string& influxedKey)
+      : MetricHandle(sender, aggregator, influxedKey, "g") {}
+};
+
+class TimerHandle: public MetricHandle {
+ public:
+  /**
+   * Same as InfluxedStatsdClient::Time(key, ms, sampleRate)
+   */
+  void Time(int64 ms, float sampleRate = 1.0) const;
+
+  /**
+   * Same as InfluxedStatsdClient::TimeMicros(key, us, sampleRate)
+   */
+  void TimeMicros(int64 us, float sampleRate = 1.0) const;
+
+ private:
+  friend class InfluxedStatsdClient;
+  friend class ScopedTimer;
+  // TimeMicros() once the call is sampled in
+  void timeMicros(int64 us, float sampleRate) const;
+  TimerHandle(statsd::AbstractSender* sender, statsd::Aggregator* aggregator, const std::string& influxedKey)
+      : MetricHandle(sender, aggregator, influxedKey, "ms") {}
+};
+}
+// end namespace
@@ -0,0 +1,62 @@
+#include "./metric_packer.h"
+
+namespace base {
+namespace statsd {
+
+static const char NEWLINE = '\n';
+
+MetricPacker::MetricPacker(size_t maxPayloadSize) {
+  maxPayloadSize_ = maxPayloadSize;
+  count_ = 0;
+  metrics_ = 0;
+  open_ = false;
+}
+
+std::string* MetricPacker::current() {
+  if (!open_) {
+    if (count_ == packets_.size()) {
+      packets_.push_back(std::string());
+      packets_.back().reserve(maxPayloadSize_);
+    }
+    packets_[count_].clear();
+    open_ = true;
+  }
+  return &packets_[count_];
+}
+
+void MetricPacker::Add(const std::string& metric) {
+  Add(metric.data(), metric.size());
+}
+
+void MetricPacker::Add(const char* data, size_t size) {
+  if (size == 0) {
+    return;
+  }
+  std::string* packet = current();
+  if (!packet->empty() && packet->size() + 1 + size > maxPayloadSize_) {
+    Finish();
+    packet = current();
+  }
+  if (!packet->empty()) {
+    packet->push_back(NEWLINE);
+  }
+  packet->append(data, size);
+  metrics_++;
+}
+
+void MetricPacker::Finish() {
+  if (open_) {
+    if (!packets_[count_].empty()) {
+      count_++;
+    }
+    open_ = false;
+  }
+}
+
+void MetricPacker::Clear() {
+  count_ = 0;
+  metrics_ = 0;
+  open_ = false;
+}
+}
+}
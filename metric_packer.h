@@ -0,0 +1,60 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace base {
+namespace statsd {
+
+/**
+ * Packs metrics into newline separated datagram payloads.
+ *
+ * A metric is never split across payloads. A single metric longer than maxPayloadSize is
+ * put alone into its own payload, it is up to the network to deliver or drop it.
+ *
+ * Payload buffers are reused after Clear(), so a packer kept by a worker does not allocate
+ * in steady state.
+ */
+class MetricPacker {
+ public:
+  explicit MetricPacker(size_t maxPayloadSize);
+
+  /**
+   * Append a metric to the current payload, sealing it first if the metric does not fit.
+   */
+  void Add(const std::string& metric);
+  void Add(const char* data, size_t size);
+
+  /**
+   * Seal current payload so it shows up in Packet(i).
+   */
+  void Finish();
+
+  /**
+   * Drop all sealed payloads, keeping their buffers for reuse.
+   */
+  void Clear();
+
+  /**
+   * Number of sealed payloads.
+   */
+  size_t Size() const { return count_; }
+  /**
+   * Number of metrics added since the last Clear().
+   */
+  size_t Metrics() const { return metrics_; }
+  const std::string& Packet(size_t i) const { return packets_[i]; }
+  size_t MaxPayloadSize() const { return maxPayloadSize_; }
+
+ private:
+  std::string* current();
+
+ private:
+  size_t maxPayloadSize_;
+  std::vector<std::string> packets_;
+  size_t count_;
+  size_t metrics_;
+  bool open_;
+};
+}
+}
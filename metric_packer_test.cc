@@ -0,0 +1,63 @@
+#include "./metric_packer.h"
+
+#include <string>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+TEST(MetricPackerTest, PacksSeveralMetricsIntoOnePacket) {
+  MetricPacker packer(1432);
+  packer.Add("a:1|c");
+  packer.Add("b:2|c");
+  packer.Add("c:0.01|g");
+  packer.Finish();
+  ASSERT_EQ(packer.Size(), 1u);
+  ASSERT_EQ(packer.Packet(0), "a:1|c\nb:2|c\nc:0.01|g");
+}
+
+TEST(MetricPackerTest, NeverSplitsMetrics) {
+  // "key0:1|c" is 8 bytes, two of them plus a newline make 17
+  MetricPacker packer(17);
+  for (int i = 0; i < 5; i++) {
+    packer.Add("key" + std::to_string(i) + ":1|c");
+  }
+  packer.Finish();
+  ASSERT_EQ(packer.Size(), 3u);
+  ASSERT_EQ(packer.Packet(0), "key0:1|c\nkey1:1|c");
+  ASSERT_EQ(packer.Packet(1), "key2:1|c\nkey3:1|c");
+  ASSERT_EQ(packer.Packet(2), "key4:1|c");
+  ASSERT_EQ(packer.Metrics(), 5u);
+  packer.Clear();
+  ASSERT_EQ(packer.Metrics(), 0u);
+}
+
+TEST(MetricPackerTest, OversizedMetricGoesAlone) {
+  MetricPacker packer(10);
+  packer.Add("a:1|c");
+  packer.Add("a_very_long_key:1|c");
+  packer.Add("b:1|c");
+  packer.Finish();
+  ASSERT_EQ(packer.Size(), 3u);
+  ASSERT_EQ(packer.Packet(0), "a:1|c");
+  ASSERT_EQ(packer.Packet(1), "a_very_long_key:1|c");
+  ASSERT_EQ(packer.Packet(2), "b:1|c");
+}
+
+TEST(MetricPackerTest, ClearReusesBuffers) {
+  MetricPacker packer(1432);
+  packer.Add("a:1|c");
+  packer.Finish();
+  packer.Clear();
+  ASSERT_EQ(packer.Size(), 0u);
+
+  packer.Finish();
+  ASSERT_EQ(packer.Size(), 0u);
+
+  packer.Add("b:1|c");
+  packer.Finish();
+  ASSERT_EQ(packer.Size(), 1u);
+  ASSERT_EQ(packer.Packet(0), "b:1|c");
+}
+}
+}  // namespace base
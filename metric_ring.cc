@@ -0,0 +1,75 @@
+#include "./metric_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "base/common/logging.h"
+
+namespace base {
+namespace statsd {
+
+MetricRing::MetricRing(size_t capacity, size_t slotSize) {
+  CHECK(capacity > 0) << "ring capacity must be positive";
+  size_t rounded = 1;
+  while (rounded < capacity) {
+    rounded <<= 1;
+  }
+  mask_ = rounded - 1;
+  slotSize_ = slotSize;
+  stride_ = (sizeof(Slot) + slotSize + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+
+  void* memory = NULL;
+  CHECK(posix_memalign(&memory, CACHE_LINE, stride_ * rounded) == 0) << "fail to allocate metric ring";
+  slots_ = static_cast<char*>(memory);
+  for (uint64 i = 0; i < rounded; i++) {
+    Slot* s = new (slots_ + i * stride_) Slot;
+    s->seq.store(i, std::memory_order_relaxed);
+    s->size = 0;
+    s->tag = 0;
+  }
+  enqueuePos_.store(0, std::memory_order_relaxed);
+  dequeuePos_.store(0, std::memory_order_relaxed);
+}
+
+MetricRing::~MetricRing() {
+  for (uint64 i = 0; i <= mask_; i++) {
+    slot(i)->~Slot();
+  }
+  free(slots_);
+}
+
+bool MetricRing::TryPush(const char* data, size_t size, uint32 tag) {
+  if (size > slotSize_) {
+    return false;
+  }
+  uint64 pos = enqueuePos_.load(std::memory_order_relaxed);
+  Slot* s = NULL;
+  while (true) {
+    s = slot(pos);
+    uint64 seq = s->seq.load(std::memory_order_acquire);
+    int64 diff = static_cast<int64>(seq) - static_cast<int64>(pos);
+    if (diff == 0) {
+      if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // the slot one lap ahead is still in use, ring is full
+      return false;
+    } else {
+      pos = enqueuePos_.load(std::memory_order_relaxed);
+    }
+  }
+  memcpy(payload(s), data, size);
+  s->size = size;
+  s->tag = tag;
+  s->seq.store(pos + 1, std::memory_order_release);
+  return true;
+}
+
+size_t MetricRing::Size() const {
+  uint64 dequeue = dequeuePos_.load(std::memory_order_acquire);
+  uint64 enqueue = enqueuePos_.load(std::memory_order_acquire);
+  return enqueue > dequeue ? static_cast<size_t>(enqueue - dequeue) : 0;
+}
+}
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Bounded ring of fixed-size slots holding metric bytes inline, so pushing does not allocate.
+ *
+ * Producers and consumers claim slots with a CAS on their own cache line padded cursor and
+ * hand them over through a per-slot sequence number (Vyukov's bounded queue). It is meant for
+ * many producers and one consumer, popping from several threads is safe as well.
+ */
+class MetricRing {
+ public:
+  /**
+   * @param capacity
+   *     number of slots, rounded up to a power of two
+   * @param slotSize
+   *     max bytes of a single metric, longer metrics are rejected by TryPush
+   */
+  MetricRing(size_t capacity, size_t slotSize);
+  ~MetricRing();
+
+  /**
+   * Copy a metric into the next free slot, along with an opaque tag handed back by ConsumeTagged().
+   * @return false if the ring is full or the metric is longer than SlotSize()
+   */
+  bool TryPush(const char* data, size_t size, uint32 tag = 0);
+  bool TryPush(const std::string& metric) { return TryPush(metric.data(), metric.size()); }
+
+  /**
+   * Pop the oldest metric and pass it to consume(const char* data, size_t size), the bytes
+   * are only valid during the call.
+   * @return false if the ring is empty
+   */
+  template <typename Consumer>
+  bool Consume(Consumer consume);
+
+  /**
+   * Same as Consume(), passing the tag given to TryPush as well: consume(data, size, uint32 tag)
+   */
+  template <typename Consumer>
+  bool ConsumeTagged(Consumer consume);
+
+  size_t Capacity() const { return mask_ + 1; }
+  size_t SlotSize() const { return slotSize_; }
+
+  /**
+   * Number of metrics currently queued, a snapshot which may be stale right away
+   */
+  size_t Size() const;
+  bool Empty() const { return Size() == 0; }
+
+  /**
+   * Number of metrics ever pushed, a snapshot as well
+   */
+  uint64 Pushed() const { return enqueuePos_.load(std::memory_order_relaxed); }
+
+ private:
+  struct Slot {
+    std::atomic<uint64> seq;
+    uint32 size;
+    uint32 tag;
+  };
+
+  Slot* slot(uint64 pos) const {
+    return reinterpret_cast<Slot*>(slots_ + (pos & mask_) * stride_);
+  }
+  char* payload(Slot* s) const { return reinterpret_cast<char*>(s) + sizeof(Slot); }
+
+ private:
+  static const size_t CACHE_LINE = 64;
+
+  char* slots_;
+  size_t stride_;
+  size_t slotSize_;
+  uint64 mask_;
+
+  char pad0_[CACHE_LINE];
+  std::atomic<uint64> enqueuePos_;
+  char pad1_[CACHE_LINE - sizeof(std::atomic<uint64>)];
+  std::atomic<uint64> dequeuePos_;
+  char pad2_[CACHE_LINE - sizeof(std::atomic<uint64>)];
+
+  DISALLOW_COPY_AND_ASSIGN(MetricRing);
+};
+
+template <typename Consumer>
+bool MetricRing::Consume(Consumer consume) {
+  return ConsumeTagged([&consume](const char* data, size_t size, uint32 /*tag*/) { consume(data, size); });
+}
+
+template <typename Consumer>
+bool MetricRing::ConsumeTagged(Consumer consume) {
+  uint64 pos = dequeuePos_.load(std::memory_order_relaxed);
+  Slot* s = NULL;
+  while (true) {
+    s = slot(pos);
+    uint64 seq = s->seq.load(std::memory_order_acquire);
+    int64 diff = static_cast<int64>(seq) - static_cast<int64>(pos + 1);
+    if (diff == 0) {
+      if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = dequeuePos_.load(std::memory_order_relaxed);
+    }
+  }
+  consume(static_cast<const char*>(payload(s)), static_cast<size_t>(s->size), s->tag);
+  s->seq.store(pos + mask_ + 1, std::memory_order_release);
+  return true;
+}
+}
+}
@@ -0,0 +1,114 @@
+#include "./metric_ring.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+static std::string pop(MetricRing* ring) {
+  std::string metric = "<empty>";
+  ring->Consume([&metric](const char* data, size_t size) { metric.assign(data, size); });
+  return metric;
+}
+
+TEST(MetricRingTest, FifoOrder) {
+  MetricRing ring(4, 32);
+  ASSERT_TRUE(ring.Empty());
+  ASSERT_TRUE(ring.TryPush("a:1|c"));
+  ASSERT_TRUE(ring.TryPush(std::string("b:2|c")));
+  ASSERT_EQ(ring.Size(), 2u);
+  ASSERT_EQ(pop(&ring), "a:1|c");
+  ASSERT_EQ(pop(&ring), "b:2|c");
+  ASSERT_EQ(pop(&ring), "<empty>");
+  ASSERT_TRUE(ring.Empty());
+}
+
+TEST(MetricRingTest, TagsTravelWithMetrics) {
+  MetricRing ring(4, 32);
+  ASSERT_TRUE(ring.TryPush("a", 1, 7));
+  ASSERT_TRUE(ring.TryPush("b"));
+  ASSERT_EQ(ring.Pushed(), 2u);
+
+  std::string metric;
+  uint32 tag = 0;
+  auto consume = [&metric, &tag](const char* data, size_t size, uint32 t) {
+    metric.assign(data, size);
+    tag = t;
+  };
+  ASSERT_TRUE(ring.ConsumeTagged(consume));
+  ASSERT_EQ(metric, "a");
+  ASSERT_EQ(tag, 7u);
+  ASSERT_TRUE(ring.ConsumeTagged(consume));
+  ASSERT_EQ(metric, "b");
+  ASSERT_EQ(tag, 0u);
+  ASSERT_FALSE(ring.ConsumeTagged(consume));
+  ASSERT_EQ(ring.Pushed(), 2u);
+}
+
+TEST(MetricRingTest, CapacityRoundsUpToPowerOfTwo) {
+  MetricRing ring(5, 32);
+  ASSERT_EQ(ring.Capacity(), 8u);
+  ASSERT_EQ(ring.SlotSize(), 32u);
+}
+
+TEST(MetricRingTest, RejectsWhenFull) {
+  MetricRing ring(2, 32);
+  ASSERT_TRUE(ring.TryPush("a"));
+  ASSERT_TRUE(ring.TryPush("b"));
+  ASSERT_FALSE(ring.TryPush("c"));
+  ASSERT_EQ(ring.Size(), 2u);
+
+  ASSERT_EQ(pop(&ring), "a");
+  ASSERT_TRUE(ring.TryPush("c"));
+  ASSERT_EQ(pop(&ring), "b");
+  ASSERT_EQ(pop(&ring), "c");
+}
+
+TEST(MetricRingTest, RejectsOversizedMetric) {
+  MetricRing ring(2, 4);
+  ASSERT_TRUE(ring.TryPush("1234"));
+  ASSERT_FALSE(ring.TryPush("12345"));
+}
+
+TEST(MetricRingTest, ConcurrentProducers) {
+  const int producers = 4;
+  const int perProducer = 100000;
+  MetricRing ring(1024, 32);
+
+  std::vector<std::thread> threads;
+  for (int p = 0; p < producers; p++) {
+    threads.push_back(std::thread([&ring, p, perProducer]() {
+      for (int i = 0; i < perProducer; i++) {
+        std::string metric = std::to_string(p) + ":" + std::to_string(i);
+        while (!ring.TryPush(metric)) {
+          std::this_thread::yield();
+        }
+      }
+    }));
+  }
+
+  // metrics of one producer must come out in the order they went in
+  std::vector<int> next(producers, 0);
+  int received = 0;
+  while (received < producers * perProducer) {
+    bool ok = ring.Consume([&next](const char* data, size_t size) {
+      std::string metric(data, size);
+      size_t colon = metric.find(':');
+      int p = std::stoi(metric.substr(0, colon));
+      ASSERT_EQ(std::stoi(metric.substr(colon + 1)), next[p]);
+      next[p]++;
+    });
+    if (ok) {
+      received++;
+    }
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+  ASSERT_TRUE(ring.Empty());
+}
+}
+}  // namespace base
@@ -0,0 +1,59 @@
+#include "./monotonic_clock.h"
+
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace base {
+namespace statsd {
+DEFINE_bool(statsd_timer_tsc, true,
+            "time code sections with the TSC when the cpu has an invariant one, instead of CLOCK_MONOTONIC");
+
+// long enough for clock_gettime jitter to stay below 1e-5 of the measured rate
+static const int CALIBRATION_US = 5000;
+
+static int64 monotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// a TSC ticking at a constant rate whatever the power state, synchronized across cores
+static bool hasInvariantTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) == 0 || eax < 0x80000007) {
+    return false;
+  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return (edx & (1 << 8)) != 0;
+#else
+  return false;
+#endif
+}
+
+const MonotonicClock::Calibration& MonotonicClock::calibration() {
+  static const Calibration CALIBRATION = []() {
+    Calibration calibration;
+    calibration.tsc = false;
+    calibration.nanosPerTick = 1;
+#if defined(__x86_64__) || defined(__i386__)
+    if (FLAGS_statsd_timer_tsc && hasInvariantTsc()) {
+      int64 startNanos = monotonicNanos();
+      int64 startTicks = __rdtsc();
+      usleep(CALIBRATION_US);
+      int64 nanos = monotonicNanos() - startNanos;
+      int64 ticks = __rdtsc() - startTicks;
+      if (ticks > 0 && nanos > 0) {
+        calibration.tsc = true;
+        calibration.nanosPerTick = static_cast<double>(nanos) / ticks;
+      }
+    }
+#endif
+    return calibration;
+  }();
+  return CALIBRATION;
+}
+}
+}
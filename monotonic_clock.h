@@ -0,0 +1,50 @@
+#pragma once
+
+#include <time.h>
+#include "base/common/basic_types.h"
+#include "base/common/gflags.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace base {
+namespace statsd {
+DECLARE_bool(statsd_timer_tsc);
+
+/**
+ * Cheap monotonic timestamps for timing code sections, unaffected by NTP steps unlike
+ * base::GetTimestamp(). Ticks come from the TSC on x86 CPUs with an invariant TSC, calibrated
+ * against CLOCK_MONOTONIC once per process, and are CLOCK_MONOTONIC nanoseconds everywhere else.
+ * Ticks are only meaningful as differences, convert those with TicksToNanos/TicksToMicros.
+ */
+class MonotonicClock {
+ public:
+  static int64 Ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    if (calibration().tsc) {
+      return static_cast<int64>(__rdtsc());
+    }
+#endif
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  }
+
+  static int64 TicksToNanos(int64 ticks) { return static_cast<int64>(ticks * calibration().nanosPerTick); }
+  static int64 TicksToMicros(int64 ticks) { return static_cast<int64>(ticks * calibration().nanosPerTick / 1000); }
+
+  /**
+   * Whether Ticks() reads the TSC, see --statsd_timer_tsc
+   */
+  static bool UsesTsc() { return calibration().tsc; }
+
+ private:
+  struct Calibration {
+    bool tsc;
+    double nanosPerTick;
+  };
+  // measured on first use, which takes a few milliseconds when the TSC is used
+  static const Calibration& calibration();
+};
+}
+}
@@ -4,127 +4,798 @@
 #include <time.h>
 #include <stdlib.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <limits>
 #include <iostream>
 #include <string>
+#include <thread>
 #include "base/common/gflags.h"
 #include "base/common/basic_types.h"
 #include "base/common/logging.h"
 #include "base/common/closure.h"
 #include "./influxed_statsd_client.h"
+#include "./aggregator.h"
+#include "./datagram_writer.h"
+#include "./line_protocol.h"
+#include "./metric_formatter.h"
+#include "./metric_packer.h"
 
 namespace base {
 namespace statsd {
 DEFINE_int32(statsd_port, 8125, "statsd port");
-DEFINE_string(statsd_host, "127.0.0.1", "statsd host");
+DEFINE_string(statsd_host, "127.0.0.1", "statsd host, or unix:///path of a unix datagram socket");
+DEFINE_int32(statsd_max_packet_size, 1432,
+             "max udp payload in bytes when packing metrics, e.g. 1432 for ethernet, 8932 for jumbo frames");
+DEFINE_string(statsd_send_mode, "sendto",
+              "how packed datagrams are written: sendto, sendmmsg, gso (sendmmsg with UDP_SEGMENT offload), "
+              "io_uring (registered buffers submitted in batches) or io_uring_sqpoll (io_uring polled by a kernel "
+              "thread)");
+DEFINE_int32(statsd_queue_capacity, 8192, "max metrics waiting to be sent, further ones are dropped");
+DEFINE_int32(statsd_max_metric_size, 512, "max bytes of a single metric line, longer ones are dropped");
+DEFINE_int32(statsd_self_metrics_interval_ms, 0,
+             "how often the sender emits its own counters as metrics, 0 disables it");
+DEFINE_string(statsd_self_metrics_namespace, "statsd.client", "reserved namespace of the sender's own metrics");
+DEFINE_int32(statsd_error_log_interval_ms, 10000, "min interval between two logs of the same sender error");
+DEFINE_string(statsd_overflow_policy, "drop_newest",
+              "what Send() does when the queue is full: drop_newest, drop_oldest, block (up to "
+              "--statsd_block_timeout_ms) or spill (fold counters into an aggregate table)");
+DEFINE_int32(statsd_resolve_interval_ms, 60000,
+             "how often statsd_host is resolved again, the socket follows when its address changes");
+DEFINE_int32(statsd_block_timeout_ms, 10, "how long Send() waits for room with --statsd_overflow_policy=block");
+DEFINE_int32(statsd_thread_buffer_size, 0,
+             "bytes of each producer thread's staging buffer, handed to the sender whole, 0 queues metric by metric");
+DEFINE_int32(statsd_thread_buffer_max_age_ms, 5,
+             "how often the sender collects partially filled thread buffers, with --statsd_thread_buffer_size");
+DEFINE_bool(statsd_adaptive_sampling, false,
+            "lower the sample rate of high volume counters and timers while the sender falls behind, see "
+            "--statsd_shed_* for the thresholds");
+
+// Upper bound of datagrams packed per drain, so a long backlog is flushed progressively
+static const size_t MAX_PACKETS_PER_BATCH = 64;
+// A parked worker re-checks the queue at least this often, in case a wakeup slipped through
+static const int MAX_PARK_MS = 100;
+
+// DROP_OLDEST gives up after evicting this many metrics for one Send(), when other producers
+// keep taking the freed slots
+static const int MAX_EVICTIONS = 4;
+// BLOCK yields this many times before sleeping between attempts
+static const int BLOCK_SPINS = 16;
+static const int BLOCK_SLEEP_US = 50;
+
+// Host prefix selecting a unix datagram socket, e.g. unix:///var/run/statsd.sock
+static const char UNIX_PREFIX[] = "unix://";
+
+// A sender whose host did not resolve yet retries at least this often
+static const int UNHEALTHY_RETRY_MS = 1000;
+
+// Keeps a latency stamp from being 0, which means not stamped
+static const uint32 STAMPED = 1;
+
+// Microseconds on the monotonic clock, truncated, differences stay right across wrap around
+static uint32 nowMicros32() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint32>(static_cast<uint64>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+}
+
+static int64 nowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
 
 // For testing socket not healthy manually
 // DEFINE_string(statsd_host, "can_not_be_resolved", "statsd host");
 
 struct SocketData {
   int sock;
+  // address the socket is connected to, if connected
   struct sockaddr_in server;
+  bool connected;
+  // host is a dotted quad, no need to resolve it again
+  bool numeric;
+  // host is unix:///path, path is connected instead of server
+  bool unixSocket;
+  struct sockaddr_un unixServer;
 
   std::string host;
   unsigned short port;
 
+  DatagramWriter* writer;
   char errmsg[1024];
 };
 
+// Add a metric to the batch, as a point when encoder is set. False if it does not encode
+static bool pack(MetricPacker* packer, LineProtocolEncoder* encoder, const char* data, size_t size) {
+  if (encoder == NULL) {
+    packer->Add(data, size);
+    return true;
+  }
+  if (!encoder->Encode(data, size)) {
+    return false;
+  }
+  packer->Add(encoder->Data(), encoder->Size());
+  return true;
+}
+
+// Packs the lines flushed by the spill aggregator straight into the worker's batch,
+// whatever is left once the worker is gone is discarded
+class PackingSender: public AbstractSender {
+ public:
+  PackingSender() : packer(NULL), encoder(NULL), unencoded(0) {}
+  void Send(const std::string& message) {
+    if (packer != NULL && !pack(packer, encoder, message.data(), message.size())) {
+      unencoded++;
+    }
+  }
+  MetricPacker* packer;
+  LineProtocolEncoder* encoder;
+  int64 unencoded;
+};
+
+struct SpillData {
+  PackingSender target;
+  Aggregator aggregator;
+  int64 nextFlushMs;
+
+  SpillData() : aggregator(&target, Aggregator::Options()), nextFlushMs(0) {}
+};
+
+bool ParseOverflowPolicy(const std::string& name, OverflowPolicy* policy) {
+  if (name == "drop_newest") {
+    *policy = DROP_NEWEST;
+  } else if (name == "drop_oldest") {
+    *policy = DROP_OLDEST;
+  } else if (name == "block") {
+    *policy = BLOCK;
+  } else if (name == "spill") {
+    *policy = SPILL_TO_AGGREGATE;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char* OverflowPolicyName(OverflowPolicy policy) {
+  switch (policy) {
+    case DROP_OLDEST:
+      return "drop_oldest";
+    case BLOCK:
+      return "block";
+    case SPILL_TO_AGGREGATE:
+      return "spill";
+    default:
+      return "drop_newest";
+  }
+}
+
+NonBlockingSender::Options::Options() {
+  host = FLAGS_statsd_host;
+  port = FLAGS_statsd_port;
+  resolveIntervalMs = FLAGS_statsd_resolve_interval_ms;
+  resolver = ResolveHost;
+  maxPacketSize = FLAGS_statsd_max_packet_size;
+  sendMode = SEND_TO;
+  if (!ParseSendMode(FLAGS_statsd_send_mode, &sendMode)) {
+    LOG(ERROR) << "Unknown statsd_send_mode " << FLAGS_statsd_send_mode << ", fall back to sendto";
+  }
+  queueCapacity = FLAGS_statsd_queue_capacity;
+  maxMetricSize = FLAGS_statsd_max_metric_size;
+  overflowPolicy = DROP_NEWEST;
+  if (!ParseOverflowPolicy(FLAGS_statsd_overflow_policy, &overflowPolicy)) {
+    LOG(ERROR) << "Unknown statsd_overflow_policy " << FLAGS_statsd_overflow_policy << ", fall back to drop_newest";
+  }
+  blockTimeoutMs = FLAGS_statsd_block_timeout_ms;
+  selfMetricsIntervalMs = FLAGS_statsd_self_metrics_interval_ms;
+  selfMetricsNamespace = FLAGS_statsd_self_metrics_namespace;
+  errorLogIntervalMs = FLAGS_statsd_error_log_interval_ms;
+  threadBufferSize = FLAGS_statsd_thread_buffer_size;
+  threadBufferMaxAgeMs = FLAGS_statsd_thread_buffer_max_age_ms;
+  adaptiveSampling = FLAGS_statsd_adaptive_sampling;
+  outputFormat = STATSD;
+  if (!ParseOutputFormat(FLAGS_statsd_output_format, &outputFormat)) {
+    LOG(ERROR) << "Unknown statsd_output_format " << FLAGS_statsd_output_format << ", fall back to statsd";
+  }
+}
+
 NonBlockingSender* NonBlockingSender::Instance() {
-  static NonBlockingSender* INSTANCE = new NonBlockingSender();
+  static NonBlockingSender* INSTANCE = new NonBlockingSender(Options());
   return INSTANCE;
 }
 
-NonBlockingSender::NonBlockingSender() {
+NonBlockingSender::NonBlockingSender(const Options& options)
+    : options_(options), stopping_(false), spill_(NULL), spilledSinceFlush_(false), spilledMetrics_(0),
+      metricQueue_(options.queueCapacity, options.maxMetricSize), staging_(NULL), stagedPacked_(0),
+      shedder_(NULL), encoder_(NULL), droppedMetrics_(0), workerParked_(false), sentPackets_(0), sentBytes_(0),
+      sentLines_(0), sendErrors_(0), peakQueueSize_(0), latencySamples_(0), latencySumUs_(0), latencyMaxUs_(0),
+      intervalPeakQueueSize_(0), intervalMaxLatencyUs_(0), lastLatencySumUs_(0),
+      unhealthyLog_(options.errorLogIntervalMs), sendErrorLog_(options.errorLogIntervalMs),
+      resolveLog_(options.errorLogIntervalMs) {
   d = new SocketData;
+  d->writer = NULL;
+  if (options_.overflowPolicy == SPILL_TO_AGGREGATE) {
+    spill_ = new SpillData;
+  }
+  if (options_.threadBufferSize > 0) {
+    // the metric size prefix has to fit too
+    size_t chunkSize = std::max<size_t>(options_.threadBufferSize, sizeof(uint32) + 1);
+    staging_ = new ThreadStaging(chunkSize, static_cast<size_t>(options_.queueCapacity) * options_.maxMetricSize);
+    options_.threadBufferMaxAgeMs = std::max(options_.threadBufferMaxAgeMs, 1);
+  }
+  if (options_.adaptiveSampling) {
+    shedder_ = new LoadShedder(options_.shedding);
+  }
+  if (options_.outputFormat == LINE_PROTOCOL) {
+    encoder_ = new LineProtocolEncoder();
+  }
 
-  bool success = initSocket(FLAGS_statsd_host, FLAGS_statsd_port);
+  bool success = initSocket();
+  socketHealthy_.store(success);
   if (!success) {
-    socketHealthy_ = false;
     LOG(ERROR) << "Fail to init socket, please check network connection of this host. Error message: "
     << d->errmsg;
-  } else {
-    socketHealthy_ = true;
   }
 
   worker_.Start(::NewCallback(this, &NonBlockingSender::working));
 }
 
 NonBlockingSender::~NonBlockingSender() {
+  Stop();
+
   // close socket
+  delete d->writer;
   if (d->sock >= 0) {
     close(d->sock);
-    d->sock = -1;
-    delete d;
-    d = NULL;
+  }
+  delete d;
+  d = NULL;
+  delete spill_;
+  spill_ = NULL;
+  delete staging_;
+  staging_ = NULL;
+  delete shedder_;
+  shedder_ = NULL;
+  delete encoder_;
+  encoder_ = NULL;
+}
+
+void NonBlockingSender::Stop() {
+  if (!stopping_.exchange(true)) {
+    notifyWorker();
+    worker_.Join();
   }
 }
 
+void NonBlockingSender::waitForMetrics() {
+  if (!metricQueue_.Empty() || (staging_ != NULL && (staging_->HasReady() || stagedPacked_ < staged_.size()))) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(wakeupMutex_);
+  workerParked_.store(true);
+  // pairs with the fence in Send(): either we see the new metric or the producer sees us parked
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (metricQueue_.Empty() && (staging_ == NULL || !staging_->HasReady())) {
+    // partial thread buffers are only collected by the worker, wake up to do it in time
+    int parkMs = staging_ != NULL ? std::min(MAX_PARK_MS, options_.threadBufferMaxAgeMs) : MAX_PARK_MS;
+    wakeup_.wait_for(lock, std::chrono::milliseconds(parkMs));
+  }
+  workerParked_.store(false);
+}
+
 void NonBlockingSender::working() {
-  while (true) {
-    bool success = blockingSend(this->metricQueue_.Take());
-    if (!success) {
-      LOG(ERROR) << "Fail to send metric. Error message: " << d->errmsg;
+  MetricPacker packer(options_.maxPacketSize);
+  std::vector<uint32> stamps;
+  SenderStats last = SenderStats();
+  SenderStats lastCheck = SenderStats();
+  int64 nextCheckMs = 0;
+  int64 nextSelfMetricsMs = nowMillis() + options_.selfMetricsIntervalMs;
+  int64 nextResolveMs = nowMillis() + resolveDelayMs();
+  int64 nextSweepMs = 0;
+  int64 lastAsyncErrors = 0;
+  // once stopping, keep going until the queue and the spill table are empty
+  bool draining = false;
+  while (!draining) {
+    draining = stopping_.load();
+    if (!draining) {
+      waitForMetrics();
+    }
+
+    if (!draining && nowMillis() >= nextResolveMs) {
+      refreshSocket();
+      nextResolveMs = nowMillis() + resolveDelayMs();
+    }
+
+    size_t queued = metricQueue_.Size();
+    if (queued > intervalPeakQueueSize_) {
+      intervalPeakQueueSize_ = queued;
+      if (queued > peakQueueSize_.load(std::memory_order_relaxed)) {
+        peakQueueSize_.store(queued, std::memory_order_relaxed);
+      }
+    }
+    if (encoder_ != NULL) {
+      encoder_->StartBatch();
     }
+    // drain whatever got queued meanwhile, so one datagram carries many metrics
+    int64 unencoded = 0;
+    while (packer.Size() < MAX_PACKETS_PER_BATCH &&
+           metricQueue_.ConsumeTagged([this, &packer, &stamps, &unencoded](const char* data, size_t size,
+                                                                            uint32 stamp) {
+             unencoded += !pack(&packer, encoder_, data, size);
+             if (stamp != 0) {
+               stamps.push_back(stamp);
+             }
+           })) {
+    }
+    if (staging_ != NULL) {
+      // once stopping producers are gone, so wait for buffers being written to
+      if (draining || nowMillis() >= nextSweepMs) {
+        staging_->Sweep(draining);
+        nextSweepMs = nowMillis() + options_.threadBufferMaxAgeMs;
+      }
+      consumeStaged(&packer, &stamps);
+    }
+    if (shedder_ != NULL && nowMillis() >= nextCheckMs) {
+      checkLoad(&lastCheck);
+      nextCheckMs = nowMillis() + shedder_->GetOptions().checkIntervalMs;
+    }
+    if (options_.selfMetricsIntervalMs > 0 && nowMillis() >= nextSelfMetricsMs) {
+      emitSelfMetrics(&packer, &last);
+      nextSelfMetricsMs = nowMillis() + options_.selfMetricsIntervalMs;
+    }
+    if (spill_ != NULL && (draining || nowMillis() >= spill_->nextFlushMs)) {
+      flushSpill(&packer);
+    }
+    if (unencoded > 0) {
+      droppedMetrics_.fetch_add(unencoded, std::memory_order_relaxed);
+    }
+    packer.Finish();
+    if (draining && (!metricQueue_.Empty() ||
+                     (staging_ != NULL && (staging_->HasReady() || stagedPacked_ < staged_.size())))) {
+      draining = false;
+    }
+    if (packer.Size() == 0 || !d->connected) {
+      // nowhere to send them, still accounted for like the lines Send() refuses
+      droppedMetrics_.fetch_add(packer.Metrics(), std::memory_order_relaxed);
+      packer.Clear();
+      stamps.clear();
+      continue;
+    }
+
+    size_t bytes = 0;
+    size_t sent = d->writer->Write(packer, &bytes);
+    if (d->writer->Mode() != options_.sendMode) {
+      LOG(ERROR) << "statsd_send_mode " << SendModeName(options_.sendMode) << " is not available, fall back to "
+                 << SendModeName(d->writer->Mode()) << ". Error message: " << d->writer->LastError();
+      options_.sendMode = d->writer->Mode();
+    }
+    // io_uring reports failed sends of earlier batches as their completions come in
+    int64 asyncErrors = d->writer->AsyncErrors() - lastAsyncErrors;
+    lastAsyncErrors += asyncErrors;
+    sentPackets_.fetch_sub(asyncErrors, std::memory_order_relaxed);
+    sendErrors_.fetch_add(asyncErrors, std::memory_order_relaxed);
+    if (sent < packer.Size() || asyncErrors > 0) {
+      sendErrors_.fetch_add(packer.Size() - sent, std::memory_order_relaxed);
+      if (d->unixSocket) {
+        // the agent may have come back on a new socket file, reconnect right away
+        nextResolveMs = 0;
+      }
+      int64 suppressed = 0;
+      if (sendErrorLog_.Allow(&suppressed)) {
+        LOG(ERROR) << "Fail to send " << packer.Size() - sent + asyncErrors << " datagrams. Error message: "
+                   << d->writer->LastError() << " (" << suppressed << " similar errors suppressed)";
+      }
+    }
+    sentPackets_.fetch_add(sent, std::memory_order_relaxed);
+    sentBytes_.fetch_add(bytes, std::memory_order_relaxed);
+    sentLines_.fetch_add(packer.Metrics(), std::memory_order_relaxed);
+    recordLatency(stamps);
+    stamps.clear();
+    packer.Clear();
   }
 }
 
+void NonBlockingSender::consumeStaged(MetricPacker* packer, std::vector<uint32>* stamps) {
+  if (stagedPacked_ == staged_.size()) {
+    staged_.clear();
+    stagedPacked_ = 0;
+  }
+  staging_->TakeReady(&staged_);
+  // whole chunks, a batch may go over MAX_PACKETS_PER_BATCH by one chunk
+  while (stagedPacked_ < staged_.size() && packer->Size() < MAX_PACKETS_PER_BATCH) {
+    ThreadStaging::Chunk* chunk = staged_[stagedPacked_++];
+    int64 unencoded = 0;
+    ThreadStaging::ForEach(chunk, [this, packer, &unencoded](const char* data, size_t size) {
+      unencoded += !pack(packer, encoder_, data, size);
+    });
+    if (unencoded > 0) {
+      droppedMetrics_.fetch_add(unencoded, std::memory_order_relaxed);
+    }
+    if (chunk->stamp != 0) {
+      stamps->push_back(chunk->stamp);
+    }
+    staging_->Release(chunk);
+  }
+}
+
+void NonBlockingSender::flushSpill(MetricPacker* packer) {
+  spill_->nextFlushMs = nowMillis() + spill_->aggregator.FlushIntervalMs();
+  if (!spilledSinceFlush_.exchange(false)) {
+    return;
+  }
+  spill_->target.packer = packer;
+  spill_->target.encoder = encoder_;
+  spill_->aggregator.Flush();
+  spill_->target.packer = NULL;
+  droppedMetrics_.fetch_add(spill_->target.unencoded, std::memory_order_relaxed);
+  spill_->target.unencoded = 0;
+}
+
+void NonBlockingSender::recordLatency(const std::vector<uint32>& stamps) {
+  if (stamps.empty()) {
+    return;
+  }
+  uint32 now = nowMicros32();
+  int64 sum = 0;
+  int64 max = 0;
+  for (size_t i = 0; i < stamps.size(); i++) {
+    int64 latency = static_cast<uint32>(now - stamps[i]);
+    sum += latency;
+    max = latency > max ? latency : max;
+  }
+  latencySamples_.fetch_add(stamps.size(), std::memory_order_relaxed);
+  latencySumUs_.fetch_add(sum, std::memory_order_relaxed);
+  if (max > latencyMaxUs_.load(std::memory_order_relaxed)) {
+    latencyMaxUs_.store(max, std::memory_order_relaxed);
+  }
+  intervalMaxLatencyUs_ = max > intervalMaxLatencyUs_ ? max : intervalMaxLatencyUs_;
+}
+
+void NonBlockingSender::checkLoad(SenderStats* last) {
+  SenderStats now = Stats();
+  // staged bytes count against the same limit as the queue, see Options::threadBufferSize
+  double backlog = static_cast<double>(now.queueSize) / QueueCapacity();
+  if (staging_ != NULL) {
+    double limit = static_cast<double>(options_.queueCapacity) * options_.maxMetricSize;
+    backlog = std::max(backlog, now.stagedBytes / limit);
+  }
+  int64 samples = now.latencySamples - last->latencySamples;
+  double meanLatencyMs = samples == 0 ? 0 :
+      (now.meanLatencyUs * now.latencySamples - last->meanLatencyUs * last->latencySamples) / samples / 1000;
+  int64 errors = now.sendErrors - last->sendErrors;
+  int64 written = now.sentPackets - last->sentPackets + errors;
+  double errorRatio = written <= 0 ? 0 : static_cast<double>(errors) / written;
+  int level = shedder_->Level();
+  shedder_->Update(backlog, meanLatencyMs, errorRatio);
+  if (shedder_->Level() != level) {
+    LOG(INFO) << "statsd adaptive sampling " << (shedder_->Level() > level ? "lowers" : "raises")
+              << " the rate of high volume metrics to " << shedder_->RateFactor() << " (backlog " << backlog
+              << ", latency " << meanLatencyMs << "ms, refused " << errorRatio << ")";
+  }
+  *last = now;
+}
+
+void NonBlockingSender::emitSelfMetrics(MetricPacker* packer, SenderStats* last) {
+  SenderStats now = Stats();
+  const std::string& ns = options_.selfMetricsNamespace;
+  char line[512];
+  struct {
+    const char* name;
+    int64 delta;
+  } counters[] = {
+    {"enqueued", now.enqueued - last->enqueued},
+    {"dropped", now.dropped - last->dropped},
+    {"sent_lines", now.sentLines - last->sentLines},
+    {"sent_datagrams", now.sentPackets - last->sentPackets},
+    {"sent_bytes", now.sentBytes - last->sentBytes},
+    {"send_errors", now.sendErrors - last->sendErrors},
+    {"shed", now.shed - last->shed},
+  };
+  for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+    int size = snprintf(line, sizeof(line), "%s.%s:%lld|c", ns.c_str(), counters[i].name,
+                        static_cast<long long>(counters[i].delta));
+    pack(packer, encoder_, line, size);
+  }
+
+  int64 samples = now.latencySamples - last->latencySamples;
+  double meanLatencyUs = samples == 0 ? 0 :
+      static_cast<double>(latencySumUs_.load(std::memory_order_relaxed) - lastLatencySumUs_) / samples;
+  struct {
+    const char* name;
+    double value;
+  } gauges[] = {
+    {"queue_size", static_cast<double>(now.queueSize)},
+    {"queue_peak", static_cast<double>(intervalPeakQueueSize_)},
+    {"staged_bytes", static_cast<double>(now.stagedBytes)},
+    {"latency_us.mean", meanLatencyUs},
+    {"latency_us.max", static_cast<double>(intervalMaxLatencyUs_)},
+    {"sample_rate_factor", now.sampleRateFactor},
+  };
+  for (size_t i = 0; i < sizeof(gauges) / sizeof(gauges[0]); i++) {
+    int size = snprintf(line, sizeof(line), "%s.%s:%.5g|g", ns.c_str(), gauges[i].name, gauges[i].value);
+    pack(packer, encoder_, line, size);
+  }
+
+  lastLatencySumUs_ = latencySumUs_.load(std::memory_order_relaxed);
+  intervalPeakQueueSize_ = 0;
+  intervalMaxLatencyUs_ = 0;
+  *last = now;
+}
+
+SenderStats NonBlockingSender::Stats() const {
+  SenderStats stats;
+  stats.enqueued = static_cast<int64>(metricQueue_.Pushed()) + (staging_ != NULL ? staging_->Accepted() : 0);
+  stats.dropped = droppedMetrics_.load(std::memory_order_relaxed);
+  stats.spilled = spilledMetrics_.load(std::memory_order_relaxed);
+  stats.sentLines = sentLines_.load(std::memory_order_relaxed);
+  stats.sentPackets = sentPackets_.load(std::memory_order_relaxed);
+  stats.sentBytes = sentBytes_.load(std::memory_order_relaxed);
+  stats.sendErrors = sendErrors_.load(std::memory_order_relaxed);
+  stats.shed = shedder_ != NULL ? shedder_->ShedLines() : 0;
+  stats.sampleRateFactor = shedder_ != NULL ? shedder_->RateFactor() : 1;
+  stats.queueSize = metricQueue_.Size();
+  stats.stagedBytes = staging_ != NULL ? staging_->PendingBytes() : 0;
+  stats.peakQueueSize = peakQueueSize_.load(std::memory_order_relaxed);
+  stats.latencySamples = latencySamples_.load(std::memory_order_relaxed);
+  int64 latencySum = latencySumUs_.load(std::memory_order_relaxed);
+  stats.meanLatencyUs = stats.latencySamples == 0 ? 0 : static_cast<double>(latencySum) / stats.latencySamples;
+  stats.maxLatencyUs = latencyMaxUs_.load(std::memory_order_relaxed);
+  return stats;
+}
+
 void NonBlockingSender::Send(const std::string& message) {
-  if ( socketHealthy_ ) {
-    metricQueue_.Put(message);
+  Send(message.data(), message.size());
+}
+
+void NonBlockingSender::Send(const char* message, size_t size) {
+  static thread_local uint32 sends = 0;
+  if (socketHealthy_.load(std::memory_order_relaxed)) {
+    if (shedder_ != NULL && !shedder_->Admit(&message, &size)) {
+      return;
+    }
+    uint32 stamp = 0;
+    if (++sends % LATENCY_SAMPLE_EVERY == 0) {
+      stamp = nowMicros32() | STAMPED;
+    }
+    if (staging_ != NULL && size <= staging_->MaxMetricSize()) {
+      int64 dropped = 0;
+      bool handedOver = staging_->Add(message, size, stamp, &dropped);
+      if (dropped > 0) {
+        droppedMetrics_.fetch_add(dropped, std::memory_order_relaxed);
+      }
+      // a partial buffer waits for the worker's next sweep
+      if (!handedOver) {
+        return;
+      }
+    } else if (!metricQueue_.TryPush(message, size, stamp) && !pushFull(message, size, stamp)) {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (workerParked_.load(std::memory_order_relaxed)) {
+      notifyWorker();
+    }
   } else {
-    LOG(ERROR) << "Socket is not healthy, can not send message!";
+    droppedMetrics_.fetch_add(1, std::memory_order_relaxed);
+    int64 suppressed = 0;
+    if (unhealthyLog_.Allow(&suppressed)) {
+      LOG(ERROR) << "Socket is not healthy, can not send message! (" << suppressed << " more suppressed)";
+    }
   }
 }
 
-bool NonBlockingSender::initSocket(const std::string& host, int port) {
-  d->host = host;
-  d->port = port;
-  d->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if (d->sock == -1) {
-    snprintf(d->errmsg, sizeof(d->errmsg), "could not create socket, err=%m");
+void NonBlockingSender::notifyWorker() {
+  std::lock_guard<std::mutex> lock(wakeupMutex_);
+  wakeup_.notify_one();
+}
+
+bool NonBlockingSender::pushFull(const char* message, size_t size, uint32 stamp) {
+  if (size > metricQueue_.SlotSize()) {
+    droppedMetrics_.fetch_add(1, std::memory_order_relaxed);
     return false;
   }
+  switch (options_.overflowPolicy) {
+    case DROP_OLDEST:
+      for (int i = 0; i < MAX_EVICTIONS; i++) {
+        if (metricQueue_.Consume([](const char*, size_t) {})) {
+          droppedMetrics_.fetch_add(1, std::memory_order_relaxed);
+        }
+        if (metricQueue_.TryPush(message, size, stamp)) {
+          return true;
+        }
+      }
+      break;
+    case BLOCK: {
+      int64 deadline = nowMillis() + options_.blockTimeoutMs;
+      for (int i = 0; nowMillis() < deadline; i++) {
+        notifyWorker();
+        if (i < BLOCK_SPINS) {
+          std::this_thread::yield();
+        } else {
+          usleep(BLOCK_SLEEP_US);
+        }
+        if (metricQueue_.TryPush(message, size, stamp)) {
+          return true;
+        }
+      }
+      break;
+    }
+    case SPILL_TO_AGGREGATE:
+      if (spill(message, size)) {
+        return false;
+      }
+      break;
+    default:
+      break;
+  }
+  droppedMetrics_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
 
-  memset(&d->server, 0, sizeof(d->server));
-  d->server.sin_family = AF_INET;
-  d->server.sin_port = htons(d->port);
+bool NonBlockingSender::spill(const char* message, size_t size) {
+  // only counters, key:value|c or key:value|c|@rate
+  const char* end = message + size;
+  const char* colon = static_cast<const char*>(memchr(message, ':', size));
+  if (colon == NULL) {
+    return false;
+  }
+  const char* bar = static_cast<const char*>(memchr(colon, '|', end - colon));
+  if (bar == NULL || bar + 1 == end || bar[1] != 'c' || (bar + 2 != end && bar[2] != '|')) {
+    return false;
+  }
+  char number[MAX_NUMBER_SIZE];
+  size_t length = std::min(static_cast<size_t>(bar - colon - 1), sizeof(number) - 1);
+  memcpy(number, colon + 1, length);
+  number[length] = '\0';
+  char* parsed = NULL;
+  double value = strtod(number, &parsed);
+  if (parsed == number) {
+    return false;
+  }
+  float rate = 1.0;
+  if (bar + 4 <= end && bar[2] == '|' && bar[3] == '@') {
+    length = std::min(static_cast<size_t>(end - bar - 4), sizeof(number) - 1);
+    memcpy(number, bar + 4, length);
+    number[length] = '\0';
+    rate = strtof(number, NULL);
+  }
 
-  int ret = inet_aton(d->host.c_str(), &d->server.sin_addr);
-  if (ret == 0) {
-    // host must be a domain, get it from internet
-    struct addrinfo hints, *result = NULL;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
+  static thread_local std::string key;
+  key.assign(message, colon - message);
+  spill_->aggregator.Count(key, llround(value), rate);
+  spilledMetrics_.fetch_add(1, std::memory_order_relaxed);
+  spilledSinceFlush_.store(true, std::memory_order_relaxed);
+  return true;
+}
 
-    ret = getaddrinfo(d->host.c_str(), NULL, &hints, &result);
-    if (ret) {
-      snprintf(d->errmsg, sizeof(d->errmsg), "getaddrinfo fail, error=%d, msg=%s", ret, gai_strerror(ret));
+bool NonBlockingSender::initSocket() {
+  d->host = options_.host;
+  d->port = options_.port;
+  d->connected = false;
+  struct in_addr ignored;
+  d->numeric = inet_aton(d->host.c_str(), &ignored) != 0;
+  d->unixSocket = d->host.compare(0, sizeof(UNIX_PREFIX) - 1, UNIX_PREFIX) == 0;
+  if (d->unixSocket) {
+    std::string path = d->host.substr(sizeof(UNIX_PREFIX) - 1);
+    memset(&d->unixServer, 0, sizeof(d->unixServer));
+    d->unixServer.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(d->unixServer.sun_path)) {
+      d->sock = -1;
+      snprintf(d->errmsg, sizeof(d->errmsg), "invalid unix socket path %s", path.c_str());
       return false;
     }
-    struct sockaddr_in* host_addr = (struct sockaddr_in*) result->ai_addr;
-    memcpy(&d->server.sin_addr, &host_addr->sin_addr, sizeof(struct in_addr));
-    freeaddrinfo(result);
+    memcpy(d->unixServer.sun_path, path.c_str(), path.size());
+    d->sock = socket(AF_UNIX, SOCK_DGRAM, 0);
+    // UDP_SEGMENT is udp only, a unix socket would take the padded super buffer as one datagram
+    if (options_.sendMode == SEND_GSO) {
+      options_.sendMode = SEND_MMSG;
+    }
+    // unlike udp a unix socket blocks when the reader falls behind, let the writer give up instead
+    if (d->sock != -1) {
+      fcntl(d->sock, F_SETFL, fcntl(d->sock, F_GETFL) | O_NONBLOCK);
+    }
+  } else {
+    d->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
   }
+  if (d->sock == -1) {
+    snprintf(d->errmsg, sizeof(d->errmsg), "could not create socket, err=%m");
+    return false;
+  }
+  // connected, so the kernel looks up the route once instead of on every send
+  d->writer = new DatagramWriter(d->sock, NULL, 0, options_.sendMode);
+  return connectSocket();
+}
 
+bool NonBlockingSender::connectSocket() {
+  if (d->unixSocket) {
+    if (connect(d->sock, (struct sockaddr*) &d->unixServer, sizeof(d->unixServer)) != 0) {
+      snprintf(d->errmsg, sizeof(d->errmsg), "connect %s fail, err=%m", d->unixServer.sun_path);
+      return false;
+    }
+    d->connected = true;
+    return true;
+  }
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(d->port);
+  std::string error;
+  if (!options_.resolver(d->host, &server.sin_addr, &error)) {
+    snprintf(d->errmsg, sizeof(d->errmsg), "%s", error.c_str());
+    return false;
+  }
+  if (d->connected && server.sin_addr.s_addr == d->server.sin_addr.s_addr) {
+    return true;
+  }
+  // connecting again atomically swaps the destination of the next send
+  if (connect(d->sock, (struct sockaddr*) &server, sizeof(server)) != 0) {
+    snprintf(d->errmsg, sizeof(d->errmsg), "connect fail, err=%m");
+    return false;
+  }
+  if (d->connected) {
+    char from[INET_ADDRSTRLEN], to[INET_ADDRSTRLEN];
+    LOG(INFO) << "statsd host " << d->host << " moved from "
+              << inet_ntop(AF_INET, &d->server.sin_addr, from, sizeof(from)) << " to "
+              << inet_ntop(AF_INET, &server.sin_addr, to, sizeof(to));
+  }
+  d->server = server;
+  d->connected = true;
   return true;
 }
 
-bool NonBlockingSender::blockingSend(const std::string& message) {
-  int ret = sendto(d->sock, message.data(), message.size(), 0, (struct sockaddr *) &d->server,
-      sizeof(d->server));
-  if (ret == -1) {
-    snprintf(d->errmsg, sizeof(d->errmsg), "sendto server fail, host=%s:%d, err=%m", d->host.c_str(),
-        d->port);
-    return false;
+int64 NonBlockingSender::resolveDelayMs() const {
+  int64 interval = options_.resolveIntervalMs > 0 ? options_.resolveIntervalMs : std::numeric_limits<int32>::max();
+  if (!socketHealthy_.load() && interval > UNHEALTHY_RETRY_MS) {
+    interval = UNHEALTHY_RETRY_MS;
   }
+  return interval;
+}
 
-  // For manual test sending messages singletonly
-  // std::cout<<"========"<<message<<"\n";
+void NonBlockingSender::refreshSocket() {
+  bool healthy = socketHealthy_.load();
+  if (d->sock < 0 || (healthy && d->numeric)) {
+    return;
+  }
+  if (connectSocket()) {
+    if (!healthy) {
+      LOG(INFO) << "statsd socket recovered, sending to " << d->host;
+      socketHealthy_.store(true);
+    }
+    return;
+  }
+  // keep the address we have, if any
+  int64 suppressed = 0;
+  if (resolveLog_.Allow(&suppressed)) {
+    LOG(ERROR) << "Fail to connect statsd host " << d->host
+               << (healthy ? ", keep sending to the previous address" : "") << ". Error message: " << d->errmsg
+               << " (" << suppressed << " similar errors suppressed)";
+  }
+}
 
+bool ResolveHost(const std::string& host, struct in_addr* addr, std::string* error) {
+  if (inet_aton(host.c_str(), addr) != 0) {
+    return true;
+  }
+  // host must be a domain, get it from internet
+  struct addrinfo hints, *result = NULL;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  int ret = getaddrinfo(host.c_str(), NULL, &hints, &result);
+  if (ret) {
+    char errmsg[256];
+    snprintf(errmsg, sizeof(errmsg), "getaddrinfo fail, error=%d, msg=%s", ret, gai_strerror(ret));
+    *error = errmsg;
+    return false;
+  }
+  struct sockaddr_in* host_addr = (struct sockaddr_in*) result->ai_addr;
+  memcpy(addr, &host_addr->sin_addr, sizeof(struct in_addr));
+  freeaddrinfo(result);
   return true;
 }
 }
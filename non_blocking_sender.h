@@ -3,34 +3,268 @@
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <vector>
+#include "base/common/gflags.h"
 #include "base/thread/thread.h"
-#include "base/thread/blocking_queue.h"
 #include "./abstract_sender.h"
+#include "./datagram_writer.h"
+#include "./line_protocol.h"
+#include "./load_shedder.h"
+#include "./log_rate_limiter.h"
+#include "./metric_ring.h"
+#include "./thread_staging.h"
 
 namespace base {
 namespace statsd {
+DECLARE_string(statsd_host);
+DECLARE_int32(statsd_port);
 
 struct SocketData;
+struct SpillData;
+
+/**
+ * Resolve host into an IPv4 address, dotted quads are taken as they are and names go through
+ * getaddrinfo. Blocks on DNS, so it only runs on the sender's worker and in its constructor.
+ * @param error
+ *     why it failed, if it did
+ */
+bool ResolveHost(const std::string& host, struct in_addr* addr, std::string* error);
+typedef bool (*HostResolver)(const std::string& host, struct in_addr* addr, std::string* error);
+
+/**
+ * What Send() does when the queue is full
+ * DROP_NEWEST:        discard the metric being sent
+ * DROP_OLDEST:        discard the oldest queued metric to make room
+ * BLOCK:              wait up to blockTimeoutMs for room, then discard the metric being sent
+ * SPILL_TO_AGGREGATE: fold counters into an in-process Aggregator, flushed by the worker,
+ *                     and discard any other metric
+ * Every discarded metric is counted in DroppedMetrics(). Only BLOCK ever makes Send() wait.
+ */
+enum OverflowPolicy {
+  DROP_NEWEST,
+  DROP_OLDEST,
+  BLOCK,
+  SPILL_TO_AGGREGATE,
+};
+
+/**
+ * Parse "drop_newest", "drop_oldest", "block" or "spill", return false on unknown names
+ */
+bool ParseOverflowPolicy(const std::string& name, OverflowPolicy* policy);
+const char* OverflowPolicyName(OverflowPolicy policy);
+
+/**
+ * Point in time view of the sender pipeline, counters are totals since the sender started.
+ */
+struct SenderStats {
+  // metrics accepted by Send() and queued, or staged in a thread buffer
+  int64 enqueued;
+  // metrics discarded: by the overflow policy, longer than a queue slot, socket unhealthy or not
+  // converting to the output format
+  int64 dropped;
+  // counters folded into the aggregate table by SPILL_TO_AGGREGATE instead of being queued
+  int64 spilled;
+  // metrics packed into datagrams and handed to the socket
+  int64 sentLines;
+  int64 sentPackets;
+  int64 sentBytes;
+  // datagrams the socket refused
+  int64 sendErrors;
+  // metrics not sent by adaptive sampling, the ones sent instead carry the lowered rate
+  int64 shed;
+  // what adaptive sampling currently multiplies the rate of high volume metrics by, 1 when not shedding
+  double sampleRateFactor;
+
+  size_t queueSize;
+  // bytes of thread buffers handed to the worker and not sent yet
+  size_t stagedBytes;
+  // deepest backlog the worker found when waking up
+  size_t peakQueueSize;
+
+  // enqueue to wire latency, measured on one in LATENCY_SAMPLE_EVERY metrics
+  int64 latencySamples;
+  double meanLatencyUs;
+  int64 maxLatencyUs;
+};
 
 class NonBlockingSender: public AbstractSender {
  public:
+  struct Options {
+    /**
+     * Defaults from the --statsd_* flags
+     */
+    Options();
+
+    /**
+     * host name or address, or unix:///path to a unix datagram socket in which case port is ignored
+     */
+    std::string host;
+    int port;
+    /**
+     * how often the worker resolves host again, and reconnects if its address changed.
+     * A sender without address retries every second at least. Unix sockets are reconnected
+     * every time, and right after a failed send.
+     */
+    int resolveIntervalMs;
+    HostResolver resolver;
+    /**
+     * max udp payload when packing metrics into datagrams
+     */
+    int maxPacketSize;
+    SendMode sendMode;
+    /**
+     * max metrics waiting in the queue, and max bytes of a single one
+     */
+    int queueCapacity;
+    int maxMetricSize;
+    OverflowPolicy overflowPolicy;
+    /**
+     * how long BLOCK waits for room
+     */
+    int blockTimeoutMs;
+    /**
+     * emit Stats() under selfMetricsNamespace this often, 0 disables it
+     */
+    int selfMetricsIntervalMs;
+    std::string selfMetricsNamespace;
+    int errorLogIntervalMs;
+    /**
+     * bytes of each producer thread's staging buffer, 0 disables staging. Metrics are then
+     * appended to the calling thread's buffer and handed to the worker a whole buffer at a
+     * time, once full or at least every threadBufferMaxAgeMs. Staged metrics bypass the queue,
+     * when staged bytes waiting for the worker would exceed queueCapacity * maxMetricSize new
+     * metrics are dropped whatever the overflow policy.
+     */
+    int threadBufferSize;
+    int threadBufferMaxAgeMs;
+    /**
+     * lower the sample rate of high volume counters and timers while the sender falls behind,
+     * see load_shedder.h, and recover it once the load is gone
+     */
+    bool adaptiveSampling;
+    LoadShedder::Options shedding;
+    /**
+     * statsd lines, or InfluxDB line protocol points stamped by the worker, see line_protocol.h.
+     * Metrics which do not convert to a point are dropped
+     */
+    OutputFormat outputFormat;
+  };
+
+  /**
+   * Shared instance with default Options
+   */
   static NonBlockingSender* Instance();
-  void Send(const std::string& message);
- private:
-  NonBlockingSender();
+
+  explicit NonBlockingSender(const Options& options);
+
+  /**
+   * Send what is still queued and stop the worker, see Stop()
+   */
   ~NonBlockingSender();
 
+  /**
+   * Send what is still queued and join the worker, so the counters are final. Nothing may be
+   * sent afterwards. Idempotent, the destructor calls it.
+   */
+  void Stop();
+
+  void Send(const std::string& message);
+  void Send(const char* message, size_t size);
+
+  /**
+   * Number of datagrams and payload bytes successfully written to the socket so far.
+   */
+  int64 SentPackets() const { return sentPackets_.load(std::memory_order_relaxed); }
+  int64 SentBytes() const { return sentBytes_.load(std::memory_order_relaxed); }
+
+  /**
+   * Metrics discarded by the overflow policy, or because they were longer than a queue slot
+   * or did not convert to the output format.
+   */
+  int64 DroppedMetrics() const { return droppedMetrics_.load(std::memory_order_relaxed); }
+
+  OverflowPolicy Policy() const { return options_.overflowPolicy; }
+
+  /**
+   * Queue capacity in metrics (--statsd_queue_capacity) and how many are waiting right now.
+   */
+  size_t QueueCapacity() const { return metricQueue_.Capacity(); }
+  size_t QueueSize() const { return metricQueue_.Size(); }
+
+  /**
+   * All of the above and more in one go. The sender also emits them as metrics itself
+   * under --statsd_self_metrics_namespace when --statsd_self_metrics_interval_ms is set.
+   */
+  SenderStats Stats() const;
+
+  // Send() stamps one in this many metrics to measure how long they wait before hitting the wire
+  static const uint32 LATENCY_SAMPLE_EVERY = 64;
+
  private:
-  bool initSocket(const std::string& host, int port);
-  bool blockingSend(const std::string& message);
+  bool initSocket();
+  bool connectSocket();
+  void refreshSocket();
+  int64 resolveDelayMs() const;
+  bool pushFull(const char* message, size_t size, uint32 stamp);
+  bool spill(const char* message, size_t size);
+  void notifyWorker();
+  void flushSpill(MetricPacker* packer);
+  void consumeStaged(MetricPacker* packer, std::vector<uint32>* stamps);
   void working();
+  void waitForMetrics();
+  void recordLatency(const std::vector<uint32>& stamps);
+  void emitSelfMetrics(MetricPacker* packer, SenderStats* last);
+  void checkLoad(SenderStats* last);
 
  private:
+  Options options_;
   thread::Thread worker_;
+  std::atomic<bool> stopping_;
   struct SocketData* d;
-  thread::BlockingQueue<std::string> metricQueue_;
-  bool socketHealthy_;
+  // only with SPILL_TO_AGGREGATE
+  struct SpillData* spill_;
+  std::atomic<bool> spilledSinceFlush_;
+  std::atomic<int64> spilledMetrics_;
+  MetricRing metricQueue_;
+  // only with a threadBufferSize, staged_ are the chunks taken from it and not packed yet, worker only
+  ThreadStaging* staging_;
+  std::vector<ThreadStaging::Chunk*> staged_;
+  size_t stagedPacked_;
+  // only with adaptiveSampling
+  LoadShedder* shedder_;
+  // only with LINE_PROTOCOL, worker only
+  LineProtocolEncoder* encoder_;
+  // whether the socket is connected to a resolved address, producers drop metrics until it is
+  std::atomic<bool> socketHealthy_;
+  std::atomic<int64> droppedMetrics_;
+
+  // parks the worker while the queue is empty, producers only notify if it is actually parked
+  std::mutex wakeupMutex_;
+  std::condition_variable wakeup_;
+  std::atomic<bool> workerParked_;
+
+  // written by the worker only, atomic so Stats() can read them from any thread
+  std::atomic<int64> sentPackets_;
+  std::atomic<int64> sentBytes_;
+  std::atomic<int64> sentLines_;
+  std::atomic<int64> sendErrors_;
+  std::atomic<size_t> peakQueueSize_;
+  std::atomic<int64> latencySamples_;
+  std::atomic<int64> latencySumUs_;
+  std::atomic<int64> latencyMaxUs_;
+  // worker only, reset on every self metrics emission
+  size_t intervalPeakQueueSize_;
+  int64 intervalMaxLatencyUs_;
+  int64 lastLatencySumUs_;
+
+  // errors repeat for every metric or batch while the network is down, log them once in a while
+  LogRateLimiter unhealthyLog_;
+  LogRateLimiter sendErrorLog_;
+  LogRateLimiter resolveLog_;
 
   DISALLOW_COPY_AND_ASSIGN(NonBlockingSender);
 };
@@ -0,0 +1,362 @@
+#include "./non_blocking_sender.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/testing/gtest.h"
+#include "./log_rate_limiter.h"
+#include "./datagram_sink.h"
+
+namespace base {
+namespace statsd {
+
+// sink.Lines() stops moving once the last datagram got through
+static void waitForQuiet(const DatagramSink& sink) {
+  int64 lines = -1;
+  while (lines != sink.Lines()) {
+    lines = sink.Lines();
+    usleep(50 * 1000);
+  }
+}
+
+static NonBlockingSender::Options tinyQueue(const DatagramSink& sink, OverflowPolicy policy) {
+  NonBlockingSender::Options options;
+  options.host = "127.0.0.1";
+  options.port = sink.Port();
+  options.queueCapacity = 4;
+  options.overflowPolicy = policy;
+  return options;
+}
+
+TEST(NonBlockingSenderTest, StatsCountThePipeline) {
+  DatagramSink sink;
+  NonBlockingSender::Options options;
+  options.host = "127.0.0.1";
+  options.port = sink.Port();
+  NonBlockingSender instance(options);
+  NonBlockingSender* sender = &instance;
+  SenderStats before = sender->Stats();
+
+  const int metrics = 10 * NonBlockingSender::LATENCY_SAMPLE_EVERY;
+  std::string metric = "stats.test:1|c";
+  for (int i = 0; i < metrics; i++) {
+    sender->Send(metric);
+  }
+  std::string tooLong(4096, 'x');
+  sender->Send(tooLong);
+
+  SenderStats after = sender->Stats();
+  for (int i = 0; i < 200 && after.sentLines - before.sentLines < metrics; i++) {
+    usleep(10 * 1000);
+    after = sender->Stats();
+  }
+  ASSERT_EQ(after.enqueued - before.enqueued, metrics);
+  ASSERT_EQ(after.dropped - before.dropped, 1);
+  ASSERT_EQ(after.sentLines - before.sentLines, metrics);
+  ASSERT_GT(after.sentPackets, before.sentPackets);
+  ASSERT_GE(after.sentBytes - before.sentBytes, static_cast<int64>(metrics * metric.size()));
+  ASSERT_EQ(after.sendErrors, before.sendErrors);
+  ASSERT_EQ(after.queueSize, 0u);
+  ASSERT_GE(after.peakQueueSize, 1u);
+  // every producer thread stamps one in LATENCY_SAMPLE_EVERY of its metrics
+  ASSERT_GE(after.latencySamples - before.latencySamples, 9);
+  ASSERT_GE(after.maxLatencyUs, 0);
+  ASSERT_LE(after.meanLatencyUs, static_cast<double>(after.maxLatencyUs));
+}
+
+TEST(NonBlockingSenderTest, IoUringDeliversEveryMetric) {
+  const int metrics = 20000;
+  DatagramSink sink;
+  NonBlockingSender::Options options;
+  options.host = "127.0.0.1";
+  options.port = sink.Port();
+  options.sendMode = SEND_URING;
+  options.queueCapacity = metrics;
+  NonBlockingSender sender(options);
+  for (int i = 0; i < metrics; i++) {
+    sender.Send("uring.requests:1|c");
+  }
+  for (int i = 0; i < 200 && sink.Lines() < metrics; i++) {
+    usleep(10 * 1000);
+  }
+  ASSERT_EQ(sink.Counters()["uring.requests"], metrics);
+  ASSERT_EQ(sender.Stats().sendErrors, 0);
+}
+
+// fails the first 3 times, then resolves to loopback
+static std::atomic<int> resolutions(0);
+static bool flakyResolver(const std::string&, struct in_addr* addr, std::string* error) {
+  if (resolutions.fetch_add(1) < 3) {
+    *error = "not yet";
+    return false;
+  }
+  return ResolveHost("127.0.0.1", addr, error);
+}
+
+TEST(NonBlockingSenderTest, ThreadBuffersDeliverEveryMetric) {
+  const int threads = 8;
+  const int perThread = 20000;
+  DatagramSink sink;
+  NonBlockingSender::Options options;
+  options.host = "127.0.0.1";
+  options.port = sink.Port();
+  options.threadBufferSize = 4096;
+  options.queueCapacity = threads * perThread;
+  SenderStats stats;
+  {
+    NonBlockingSender sender(options);
+    std::vector<std::thread> producers;
+    for (int t = 0; t < threads; t++) {
+      producers.push_back(std::thread([&sender]() {
+        for (int i = 0; i < perThread; i++) {
+          sender.Send("staged.requests:1|c");
+        }
+      }));
+    }
+    for (size_t t = 0; t < producers.size(); t++) {
+      producers[t].join();
+    }
+    // a thread gone quiet with a partial buffer, only the worker's sweep sends it
+    sender.Send("staged.last:1|c");
+    for (int i = 0; i < 200 && sink.Counters()["staged.last"] == 0; i++) {
+      usleep(10 * 1000);
+    }
+    ASSERT_EQ(sink.Counters()["staged.last"], 1);
+    stats = sender.Stats();
+  }
+  waitForQuiet(sink);
+  ASSERT_EQ(stats.enqueued, threads * perThread + 1);
+  ASSERT_EQ(stats.dropped, 0);
+  // nothing went through the queue
+  ASSERT_EQ(stats.peakQueueSize, 0u);
+  ASSERT_EQ(sink.Counters()["staged.requests"], threads * perThread);
+  ASSERT_EQ(sink.MalformedLines(), 0);
+}
+
+TEST(NonBlockingSenderTest, RecoversFromUnresolvedHost) {
+  DatagramSink sink;
+  NonBlockingSender::Options options;
+  options.host = "statsd.flaky";
+  options.port = sink.Port();
+  options.resolveIntervalMs = 10;
+  options.resolver = flakyResolver;
+  options.selfMetricsIntervalMs = 0;
+  NonBlockingSender sender(options);
+
+  sender.Send("recover.before:1|c");
+  ASSERT_EQ(sender.DroppedMetrics(), 1);
+  int64 sends = 1;
+  for (int i = 0; i < 200 && sink.Lines() == 0; i++) {
+    sender.Send("recover.after:1|c");
+    sends++;
+    usleep(10 * 1000);
+  }
+  ASSERT_GE(resolutions.load(), 4);
+  ASSERT_GT(sink.Counters()["recover.after"], 0);
+  ASSERT_EQ(sink.Counters().count("recover.before"), 0u);
+
+  // every metric was either sent or counted as dropped, whether before or after the recovery
+  sender.Stop();
+  SenderStats stats = sender.Stats();
+  ASSERT_EQ(stats.sendErrors, 0);
+  ASSERT_EQ(stats.sentLines + stats.dropped, sends);
+}
+
+TEST(NonBlockingSenderTest, UnixDatagramSocket) {
+  const int metrics = 1000;
+  std::string path = "/tmp/non_blocking_sender_test." + std::to_string(getpid()) + ".sock";
+  unlink(path.c_str());
+  NonBlockingSender::Options options;
+  options.host = "unix://" + path;
+  options.resolveIntervalMs = 10;
+  NonBlockingSender sender(options);
+  // nobody listens yet
+  sender.Send("unix.early:1|c");
+  ASSERT_EQ(sender.DroppedMetrics(), 1);
+
+  DatagramSink sink(path);
+  ASSERT_EQ(sink.Host(), options.host);
+  for (int i = 0; i < 200 && sink.Lines() == 0; i++) {
+    sender.Send("unix.probe:1|c");
+    usleep(10 * 1000);
+  }
+  ASSERT_GT(sink.Lines(), 0);
+
+  int64 dropped = sender.DroppedMetrics();
+  for (int i = 0; i < metrics; i++) {
+    sender.Send("unix.requests,tag=v:2|c");
+  }
+  waitForQuiet(sink);
+  ASSERT_EQ(sender.DroppedMetrics(), dropped);
+  ASSERT_EQ(sink.Counters()["unix.requests,tag=v"], 2 * metrics);
+  ASSERT_EQ(sink.MalformedLines(), 0);
+}
+
+TEST(NonBlockingSenderTest, AdaptiveSamplingFollowsASlowSink) {
+  std::string path = "/tmp/non_blocking_sender_test.slow." + std::to_string(getpid()) + ".sock";
+  DatagramSink sink(path, 4096);
+  NonBlockingSender::Options options;
+  options.host = sink.Host();
+  options.resolveIntervalMs = 10;
+  options.adaptiveSampling = true;
+  options.shedding.checkIntervalMs = 10;
+  options.shedding.recoverChecks = 3;
+  options.shedding.minKeyHits = 10;
+  NonBlockingSender sender(options);
+
+  // the sink reads a datagram every 2ms, the worker falls behind or the socket refuses its datagrams
+  sink.SetReadDelayUs(2000);
+  double lowest = 1;
+  for (int i = 0; i < 2000 && lowest > 0.1; i++) {
+    for (int j = 0; j < 100; j++) {
+      sender.Send("slow.requests:1|c");
+      sender.Send("slow.level:1|g");
+    }
+    lowest = std::min(lowest, sender.Stats().sampleRateFactor);
+    usleep(1000);
+  }
+  ASSERT_LE(lowest, 0.1);
+  SenderStats stats = sender.Stats();
+  ASSERT_GT(stats.shed, 0);
+
+  // once the sink keeps up the rate climbs back to 1, one level every 3 calm checks
+  sink.SetReadDelayUs(0);
+  for (int i = 0; i < 500 && sender.Stats().sampleRateFactor < 1; i++) {
+    sender.Send("slow.requests:1|c");
+    usleep(10 * 1000);
+  }
+  ASSERT_EQ(sender.Stats().sampleRateFactor, 1);
+  waitForQuiet(sink);
+  std::map<std::string, int64> types = sink.LinesByType();
+  ASSERT_GT(types["c"], 0);
+  ASSERT_GT(types["g"], 0);
+  ASSERT_EQ(sink.MalformedLines(), 0);
+}
+
+TEST(NonBlockingSenderTest, LineProtocolPoints) {
+  const int metrics = 1000;
+  DatagramSink sink;
+  NonBlockingSender::Options options;
+  options.host = "127.0.0.1";
+  options.port = sink.Port();
+  options.outputFormat = LINE_PROTOCOL;
+  options.queueCapacity = 4 * metrics;
+  NonBlockingSender sender(options);
+  for (int i = 0; i < metrics; i++) {
+    sender.Send("points.requests,host=a:2|c");
+    sender.Send("points.load,host=a:0.5|g");
+  }
+  sender.Send("points.broken:x|g");
+  waitForQuiet(sink);
+  ASSERT_EQ(sink.Counters()["points.requests,host=a"], 2 * metrics);
+  std::map<std::string, int64> fields = sink.LinesByType();
+  ASSERT_EQ(fields["count"], metrics);
+  ASSERT_EQ(fields["value"], metrics);
+  ASSERT_EQ(sink.MalformedLines(), 0);
+  ASSERT_EQ(sender.DroppedMetrics(), 1);
+}
+
+TEST(NonBlockingSenderTest, ParsesOverflowPolicies) {
+  OverflowPolicy policies[] = {DROP_NEWEST, DROP_OLDEST, BLOCK, SPILL_TO_AGGREGATE};
+  for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+    OverflowPolicy parsed = DROP_NEWEST;
+    ASSERT_TRUE(ParseOverflowPolicy(OverflowPolicyName(policies[i]), &parsed));
+    ASSERT_EQ(parsed, policies[i]);
+  }
+  OverflowPolicy parsed = BLOCK;
+  ASSERT_FALSE(ParseOverflowPolicy("drop_all", &parsed));
+  ASSERT_EQ(parsed, BLOCK);
+}
+
+class OverflowPolicyTest : public testing::TestWithParam<OverflowPolicy> {
+};
+
+TEST_P(OverflowPolicyTest, EveryMetricIsSentOrCounted) {
+  const int metrics = 20000;
+  DatagramSink sink;
+  SenderStats stats;
+  {
+    NonBlockingSender sender(tinyQueue(sink, GetParam()));
+    for (int i = 0; i < metrics; i++) {
+      sender.Send("overflow.gauge:1|g");
+    }
+    stats = sender.Stats();
+    for (int i = 0; i < 500 && stats.sentLines + stats.dropped < metrics; i++) {
+      usleep(10 * 1000);
+      stats = sender.Stats();
+    }
+  }
+  ASSERT_EQ(stats.sentLines + stats.dropped, metrics);
+  if (GetParam() == DROP_NEWEST || GetParam() == DROP_OLDEST) {
+    ASSERT_GT(stats.dropped, 0);
+  }
+  ASSERT_EQ(stats.spilled, 0);
+}
+
+INSTANTIATE_TEST_CASE_P(Policies, OverflowPolicyTest,
+                        testing::Values(DROP_NEWEST, DROP_OLDEST, BLOCK, SPILL_TO_AGGREGATE));
+
+TEST(NonBlockingSenderTest, DropOldestKeepsTheNewest) {
+  DatagramSink sink;
+  {
+    NonBlockingSender sender(tinyQueue(sink, DROP_OLDEST));
+    for (int i = 0; i < 20000; i++) {
+      sender.Send("overflow.old:1|c");
+    }
+    sender.Send("overflow.newest:1|c");
+  }
+  waitForQuiet(sink);
+  ASSERT_EQ(sink.Counters()["overflow.newest"], 1);
+}
+
+TEST(NonBlockingSenderTest, BlockWaitsForRoom) {
+  const int metrics = 20000;
+  DatagramSink sink;
+  NonBlockingSender::Options options = tinyQueue(sink, BLOCK);
+  options.blockTimeoutMs = 5000;
+  NonBlockingSender sender(options);
+  for (int i = 0; i < metrics; i++) {
+    sender.Send("overflow.block:1|c");
+  }
+  while (sender.QueueSize() > 0) {
+    usleep(1000);
+  }
+  ASSERT_EQ(sender.DroppedMetrics(), 0);
+}
+
+TEST(NonBlockingSenderTest, SpillFoldsCountersIntoAggregates) {
+  const int metrics = 5000;
+  DatagramSink sink;
+  SenderStats stats;
+  {
+    NonBlockingSender sender(tinyQueue(sink, SPILL_TO_AGGREGATE));
+    for (int i = 0; i < metrics; i++) {
+      sender.Send(i % 2 == 0 ? "overflow.spill:1|c" : "overflow.spill:4|c|@0.5");
+    }
+    stats = sender.Stats();
+  }
+  waitForQuiet(sink);
+  ASSERT_GT(stats.spilled, 0);
+  ASSERT_EQ(stats.dropped, 0);
+  // both kinds of line count 2500 times, 1 and 4 / 0.5
+  ASSERT_EQ(sink.Counters()["overflow.spill"], 2500 + 2500 * 8);
+}
+
+TEST(LogRateLimiterTest, AllowsOncePerInterval) {
+  LogRateLimiter limiter(200);
+  int64 suppressed = -1;
+  ASSERT_TRUE(limiter.Allow(&suppressed));
+  ASSERT_EQ(suppressed, 0);
+  for (int i = 0; i < 5; i++) {
+    ASSERT_FALSE(limiter.Allow(&suppressed));
+  }
+  usleep(250 * 1000);
+  ASSERT_TRUE(limiter.Allow(&suppressed));
+  ASSERT_EQ(suppressed, 5);
+  ASSERT_FALSE(limiter.Allow(&suppressed));
+}
+}
+}
@@ -0,0 +1,24 @@
+#include "./sampler.h"
+
+#include <time.h>
+#include <atomic>
+
+namespace base {
+namespace statsd {
+DEFINE_bool(statsd_client_side_sampling, true,
+            "drop calls with sampleRate < 1 in the client with that probability, as statsd expects");
+
+uint64 SeedSampler() {
+  static std::atomic<uint64> sequence(0);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  // splitmix64 of time, thread and a process wide sequence, never 0
+  uint64 z = (static_cast<uint64>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec) ^
+      reinterpret_cast<uintptr_t>(&ts) ^ (sequence.fetch_add(1) * 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z = z ^ (z >> 31);
+  return z == 0 ? 1 : z;
+}
+}
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "base/common/basic_types.h"
+#include "base/common/gflags.h"
+
+namespace base {
+namespace statsd {
+DECLARE_bool(statsd_client_side_sampling);
+
+// Rates this close to 1 are sent unannotated, so they are never dropped either
+static const float FULL_SAMPLE_RATE = 0.9999;
+
+/**
+ * Next number of a per thread xorshift64* generator, seeded on first use.
+ */
+uint64 SeedSampler();
+
+inline uint64 NextRandom() {
+  static thread_local uint64 state = 0;
+  if (state == 0) {
+    state = SeedSampler();
+  }
+  state ^= state >> 12;
+  state ^= state << 25;
+  state ^= state >> 27;
+  return state * 2685821657736338717ULL;
+}
+
+/**
+ * Whether a call made with sampleRate should be sent, i.e. true with probability sampleRate.
+ * Meant to run before any rendering, so a dropped call costs a few nanoseconds.
+ * Always true if --statsd_client_side_sampling is off.
+ */
+inline bool Sampled(float sampleRate) {
+  if (sampleRate >= FULL_SAMPLE_RATE || !FLAGS_statsd_client_side_sampling) {
+    return true;
+  }
+  // top 24 bits against the rate scaled to 2^24, exact for any float rate
+  return static_cast<float>(NextRandom() >> 40) < sampleRate * 16777216.0f;
+}
+}
+}
@@ -0,0 +1,34 @@
+#include "./scoped_timer.h"
+
+#include "./sampler.h"
+
+namespace base {
+
+ScopedTimer::ScopedTimer(const TimerHandle& timer, float sampleRate)
+    : timer_(&timer), client_(NULL), sampleRate_(sampleRate), running_(statsd::Sampled(sampleRate)),
+      startTicks_(running_ ? statsd::MonotonicClock::Ticks() : 0) {
+}
+
+ScopedTimer::ScopedTimer(const InfluxedStatsdClient& client, const std::string& key, float sampleRate)
+    : timer_(NULL), client_(&client), sampleRate_(sampleRate), running_(statsd::Sampled(sampleRate)),
+      startTicks_(0) {
+  if (running_) {
+    key_ = key;
+    startTicks_ = statsd::MonotonicClock::Ticks();
+  }
+}
+
+int64 ScopedTimer::Stop() {
+  if (!running_) {
+    return 0;
+  }
+  int64 us = ElapsedMicros();
+  running_ = false;
+  if (timer_ != NULL) {
+    timer_->timeMicros(us, sampleRate_);
+  } else {
+    client_->timeMicros(key_, us, sampleRate_);
+  }
+  return us;
+}
+}
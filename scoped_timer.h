@@ -0,0 +1,66 @@
+#pragma once
+
+#include <string>
+#include "base/common/basic_types.h"
+#include "./influxed_statsd_client.h"
+#include "./monotonic_clock.h"
+
+namespace base {
+
+/**
+ * Times its own lifetime on statsd::MonotonicClock and records it as fractional milliseconds
+ * when it goes out of scope:
+ *
+ *   {
+ *     ScopedTimer timer(lookupTimer);
+ *     cache.Lookup(key);
+ *   }
+ *
+ * Sampling is decided up front, so a sampled out timer does not even read the clock. Starting and
+ * stopping costs two clock reads, a few nanoseconds with the TSC, plus sending the metric.
+ * Not thread safe, meant to live on the stack of the timed code.
+ */
+class ScopedTimer {
+ public:
+  /**
+   * Record into a handle, the cheapest way. The handle must outlive the timer.
+   */
+  explicit ScopedTimer(const TimerHandle& timer, float sampleRate = 1.0);
+
+  /**
+   * Record under client.TimeMicros(key), the client must outlive the timer.
+   */
+  ScopedTimer(const InfluxedStatsdClient& client, const std::string& key, float sampleRate = 1.0);
+
+  ~ScopedTimer() { Stop(); }
+
+  /**
+   * Record now instead of at destruction, only the first call records.
+   * @return the recorded microseconds, 0 if sampled out or already stopped
+   */
+  int64 Stop();
+
+  /**
+   * Do not record anything, e.g. on an error path timed separately
+   */
+  void Cancel() { running_ = false; }
+
+  /**
+   * Microseconds since the start, 0 if sampled out
+   */
+  int64 ElapsedMicros() const {
+    return running_ ? statsd::MonotonicClock::TicksToMicros(statsd::MonotonicClock::Ticks() - startTicks_) : 0;
+  }
+
+ private:
+  const TimerHandle* timer_;
+  const InfluxedStatsdClient* client_;
+  std::string key_;
+  float sampleRate_;
+  bool running_;
+  int64 startTicks_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedTimer);
+};
+}
+// end namespace
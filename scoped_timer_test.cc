@@ -0,0 +1,101 @@
+#include "./scoped_timer.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include "base/testing/gtest.h"
+#include "./dummy_sender.h"
+#include "./monotonic_clock.h"
+#include "./sampler.h"
+
+namespace base {
+namespace statsd {
+
+// "key:1.25|ms" gives 1250
+static int64 recordedMicros(const std::string& message, const std::string& key) {
+  EXPECT_EQ(message.compare(0, key.size() + 1, key + ":"), 0) << message;
+  EXPECT_NE(message.find("|ms"), std::string::npos) << message;
+  return static_cast<int64>(strtod(message.c_str() + key.size() + 1, NULL) * 1000 + 0.5);
+}
+
+TEST(MonotonicClockTest, MeasuresSleeps) {
+  int64 start = MonotonicClock::Ticks();
+  usleep(20 * 1000);
+  int64 elapsed = MonotonicClock::Ticks() - start;
+  ASSERT_GT(elapsed, 0);
+  ASSERT_GE(MonotonicClock::TicksToMicros(elapsed), 19000);
+  ASSERT_LT(MonotonicClock::TicksToMicros(elapsed), 500000);
+  ASSERT_NEAR(MonotonicClock::TicksToNanos(elapsed) / 1000.0, MonotonicClock::TicksToMicros(elapsed), 1);
+}
+
+TEST(MonotonicClockTest, NeverGoesBack) {
+  int64 last = MonotonicClock::Ticks();
+  for (int i = 0; i < 100000; i++) {
+    int64 now = MonotonicClock::Ticks();
+    ASSERT_GE(now, last);
+    last = now;
+  }
+}
+
+TEST(ScopedTimerTest, RecordsFractionalMillisOnHandle) {
+  DummySender sender;
+  TimerHandle timer = InfluxedStatsdClient(&sender).Ns("ns").Timer("lookup");
+  {
+    ScopedTimer scoped(timer);
+    usleep(1500);
+  }
+  ASSERT_EQ(sender.messages_.size(), 1u);
+  int64 us = recordedMicros(sender.message_, "ns.lookup");
+  ASSERT_GE(us, 1400);
+  ASSERT_LT(us, 500000);
+}
+
+TEST(ScopedTimerTest, RecordsOnClientAndKey) {
+  DummySender sender;
+  InfluxedStatsdClient client = InfluxedStatsdClient(&sender).Tags({ {"dc", "sh"} });
+  std::string key = "lookup";
+  {
+    // the key may be a temporary, the client may not
+    ScopedTimer scoped(client, key + ".hit");
+  }
+  ASSERT_EQ(sender.messages_.size(), 1u);
+  ASSERT_GE(recordedMicros(sender.message_, "lookup.hit,dc=sh"), 0);
+}
+
+TEST(ScopedTimerTest, StopRecordsOnce) {
+  DummySender sender;
+  TimerHandle timer = InfluxedStatsdClient(&sender).Timer("lookup");
+  {
+    ScopedTimer scoped(timer);
+    usleep(1000);
+    int64 us = scoped.Stop();
+    ASSERT_GE(us, 900);
+    ASSERT_EQ(recordedMicros(sender.message_, "lookup"), us);
+    ASSERT_EQ(scoped.Stop(), 0);
+    ASSERT_EQ(scoped.ElapsedMicros(), 0);
+  }
+  ASSERT_EQ(sender.messages_.size(), 1u);
+}
+
+TEST(ScopedTimerTest, CancelRecordsNothing) {
+  DummySender sender;
+  TimerHandle timer = InfluxedStatsdClient(&sender).Timer("lookup");
+  {
+    ScopedTimer scoped(timer);
+    scoped.Cancel();
+  }
+  ASSERT_TRUE(sender.messages_.empty());
+}
+
+TEST(ScopedTimerTest, SampledOutRecordsNothing) {
+  DummySender sender;
+  TimerHandle timer = InfluxedStatsdClient(&sender).Timer("lookup");
+  for (int i = 0; i < 10000; i++) {
+    ScopedTimer scoped(timer, 0.1);
+  }
+  ASSERT_NEAR(sender.messages_.size(), 1000, 200);
+  // the rate is still sent along, so statsd scales the timer count back up
+  ASSERT_NE(sender.message_.find("|@0.1"), std::string::npos);
+}
+}
+}  // namespace base
@@ -0,0 +1,148 @@
+// Compares how datagrams are handed to the kernel: syscalls and sender cpu time per 10k metrics
+// sent to a loopback udp socket or a unix datagram socket, each drained by a reader thread.
+// The io_uring_sqpoll cpu time leaves out the kernel thread doing the sends.
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include "base/common/gflags.h"
+#include "base/common/basic_types.h"
+#include "./datagram_writer.h"
+#include "./metric_packer.h"
+
+DEFINE_int32(packet_size, 1432, "datagram payload size");
+DEFINE_int32(rounds, 200, "rounds of 10k metrics per mode");
+DEFINE_string(unix_socket, "/tmp/statsd_sender_benchmark.sock", "path of the unix datagram socket");
+
+namespace base {
+namespace statsd {
+
+static const int METRICS_PER_ROUND = 10000;
+
+// only the sending thread, not the readers
+static int64 cpuNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+struct Endpoint {
+  const char* transport;
+  int receiver;
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  int family;
+};
+
+static Endpoint bindLoopback() {
+  Endpoint endpoint;
+  endpoint.transport = "udp";
+  endpoint.family = AF_INET;
+  endpoint.receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  struct sockaddr_in* addr = (struct sockaddr_in*) &endpoint.addr;
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  bind(endpoint.receiver, (struct sockaddr*) addr, sizeof(*addr));
+  endpoint.addrLen = sizeof(*addr);
+  getsockname(endpoint.receiver, (struct sockaddr*) addr, &endpoint.addrLen);
+  return endpoint;
+}
+
+static Endpoint bindUnix(const std::string& path) {
+  Endpoint endpoint;
+  endpoint.transport = "unix";
+  endpoint.family = AF_UNIX;
+  endpoint.receiver = socket(AF_UNIX, SOCK_DGRAM, 0);
+  struct sockaddr_un* addr = (struct sockaddr_un*) &endpoint.addr;
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strncpy(addr->sun_path, path.c_str(), sizeof(addr->sun_path) - 1);
+  unlink(path.c_str());
+  bind(endpoint.receiver, (struct sockaddr*) addr, sizeof(*addr));
+  endpoint.addrLen = sizeof(*addr);
+  return endpoint;
+}
+
+static void benchmarkMode(SendMode mode, const Endpoint& endpoint) {
+  MetricPacker packer(FLAGS_packet_size);
+  for (int i = 0; i < METRICS_PER_ROUND; i++) {
+    char metric[128];
+    int size = snprintf(metric, sizeof(metric), "bench.requests,host=web%d,dc=sh:1|c", i % 100);
+    packer.Add(metric, size);
+  }
+  packer.Finish();
+
+  // connected like NonBlockingSender's socket
+  int sock = socket(endpoint.family, SOCK_DGRAM, endpoint.family == AF_INET ? IPPROTO_UDP : 0);
+  connect(sock, (const struct sockaddr*) &endpoint.addr, endpoint.addrLen);
+  DatagramWriter writer(sock, NULL, 0, mode);
+  int64 datagrams = 0;
+  int64 start = cpuNanos();
+  for (int round = 0; round < FLAGS_rounds; round++) {
+    datagrams += writer.Write(packer, NULL);
+  }
+  int64 elapsed = cpuNanos() - start;
+  close(sock);
+
+  printf("%-5s %-15s %8d datagrams/10k metrics %10.1f syscalls/10k metrics %8.1f cpu ns/metric%s\n",
+         endpoint.transport, SendModeName(mode), static_cast<int>(datagrams / FLAGS_rounds),
+         static_cast<double>(writer.Syscalls()) / FLAGS_rounds,
+         static_cast<double>(elapsed) / FLAGS_rounds / METRICS_PER_ROUND,
+         writer.Mode() != mode ? " (fell back to sendmmsg)" : "");
+  if (writer.AsyncErrors() > 0) {
+    printf("      %lld datagrams failed: %s\n", (long long) writer.AsyncErrors(), writer.LastError());
+  }
+}
+}
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  base::statsd::Endpoint endpoints[] = {
+    base::statsd::bindLoopback(),
+    base::statsd::bindUnix(FLAGS_unix_socket),
+  };
+
+  // a unix socket blocks its sender once the reader falls behind, so keep both drained
+  std::atomic<bool> stopped(false);
+  std::thread readers[2];
+  for (int i = 0; i < 2; i++) {
+    int receiver = endpoints[i].receiver;
+    struct timeval timeout = {0, 50 * 1000};
+    setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    readers[i] = std::thread([receiver, &stopped]() {
+      char buf[65536];
+      while (!stopped.load()) {
+        recv(receiver, buf, sizeof(buf), 0);
+      }
+    });
+  }
+
+  for (int i = 0; i < 2; i++) {
+    base::statsd::benchmarkMode(base::statsd::SEND_TO, endpoints[i]);
+    base::statsd::benchmarkMode(base::statsd::SEND_MMSG, endpoints[i]);
+    // UDP_SEGMENT is udp only
+    if (endpoints[i].family == AF_INET) {
+      base::statsd::benchmarkMode(base::statsd::SEND_GSO, endpoints[i]);
+    }
+    base::statsd::benchmarkMode(base::statsd::SEND_URING, endpoints[i]);
+    base::statsd::benchmarkMode(base::statsd::SEND_URING_SQPOLL, endpoints[i]);
+  }
+
+  stopped.store(true);
+  for (int i = 0; i < 2; i++) {
+    readers[i].join();
+    close(endpoints[i].receiver);
+  }
+  unlink(FLAGS_unix_socket.c_str());
+  return 0;
+}
@@ -0,0 +1,201 @@
+#include "./sharded_sender.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include "base/common/logging.h"
+#include "./hash_bytes.h"
+
+namespace base {
+namespace statsd {
+
+// Stripe of the calling thread in the reader counts, so threads sending at once rarely share a line
+static int readerStripe(int stripes) {
+  static std::atomic<int> nextStripe(0);
+  static thread_local int stripe = nextStripe.fetch_add(1, std::memory_order_relaxed);
+  return stripe % stripes;
+}
+
+ShardedSender::ReadGuard::ReadGuard(const ShardedSender* sender) {
+  uint64 period = sender->period_.load();
+  count_ = &sender->readers_[period & 1][readerStripe(READER_STRIPES)].count;
+  // before loading ring_, pairs with waitForReaders()
+  count_->fetch_add(1);
+}
+
+ShardedSender::ReadGuard::~ReadGuard() {
+  count_->fetch_sub(1, std::memory_order_release);
+}
+
+ShardedSender::ShardedSender(const NonBlockingSender::Options& options, int virtualNodes)
+    : options_(options), virtualNodes_(virtualNodes), ring_(new Ring), unroutedMetrics_(0), period_(0),
+      retiredDropped_(0) {
+  CHECK(virtualNodes > 0) << "virtual nodes must be positive";
+  for (int p = 0; p < 2; p++) {
+    for (int i = 0; i < READER_STRIPES; i++) {
+      readers_[p][i].count.store(0);
+    }
+  }
+}
+
+ShardedSender::~ShardedSender() {
+  delete ring_.load();
+}
+
+bool ShardedSender::ParseEndpoint(const std::string& endpoint, std::string* host, int* port) {
+  size_t colon = endpoint.rfind(':');
+  if (colon == std::string::npos || colon == 0 || colon + 1 == endpoint.size()) {
+    return false;
+  }
+  char* end = NULL;
+  long parsed = strtol(endpoint.c_str() + colon + 1, &end, 10);
+  if (*end != '\0' || parsed <= 0 || parsed > 65535) {
+    return false;
+  }
+  *host = endpoint.substr(0, colon);
+  *port = static_cast<int>(parsed);
+  return true;
+}
+
+bool ShardedSender::AddEndpoint(const std::string& endpoint) {
+  NonBlockingSender::Options options = options_;
+  if (!ParseEndpoint(endpoint, &options.host, &options.port)) {
+    LOG(ERROR) << "Invalid statsd endpoint " << endpoint << ", expected host:port";
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Ring* current = ring_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < current->endpoints.size(); i++) {
+    if (current->endpoints[i]->name == endpoint) {
+      return false;
+    }
+  }
+
+  Endpoint* added = new Endpoint;
+  added->name = endpoint;
+  added->sender.reset(new NonBlockingSender(options));
+  endpoints_.push_back(std::unique_ptr<Endpoint>(added));
+
+  std::unique_ptr<Ring> ring(new Ring(*current));
+  ring->endpoints.push_back(added);
+  for (int i = 0; i < virtualNodes_; i++) {
+    std::string point = endpoint + "#" + std::to_string(i);
+    ring->points.push_back(std::make_pair(HashBytes(point.data(), point.size()), added));
+  }
+  std::sort(ring->points.begin(), ring->points.end());
+  publish(ring.release());
+  return true;
+}
+
+bool ShardedSender::RemoveEndpoint(const std::string& endpoint) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Ring* current = ring_.load(std::memory_order_relaxed);
+  Endpoint* removed = NULL;
+  std::unique_ptr<Ring> ring(new Ring);
+  for (size_t i = 0; i < current->endpoints.size(); i++) {
+    if (current->endpoints[i]->name == endpoint) {
+      removed = current->endpoints[i];
+    } else {
+      ring->endpoints.push_back(current->endpoints[i]);
+    }
+  }
+  if (removed == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < current->points.size(); i++) {
+    if (current->points[i].second != removed) {
+      ring->points.push_back(current->points[i]);
+    }
+  }
+  publish(ring.release());
+
+  // no Send() routes to it anymore, flush and retire it
+  for (size_t i = 0; i < endpoints_.size(); i++) {
+    if (endpoints_[i].get() == removed) {
+      removed->sender->Stop();
+      retiredDropped_ += removed->sender->DroppedMetrics();
+      endpoints_.erase(endpoints_.begin() + i);
+      break;
+    }
+  }
+  return true;
+}
+
+void ShardedSender::publish(const Ring* ring) {
+  const Ring* replaced = ring_.exchange(ring);
+  waitForReaders();
+  delete replaced;
+}
+
+void ShardedSender::waitForReaders() {
+  // A reader may have read the period just before a flip and count itself in the old parity only
+  // after we found it empty, then it loads the new ring_. It could still be counted there during
+  // the next publish() though, so wait for both parities in turn.
+  for (int flip = 0; flip < 2; flip++) {
+    uint64 period = period_.fetch_add(1);
+    for (int i = 0; i < READER_STRIPES; i++) {
+      while (readers_[period & 1][i].count.load() != 0) {
+        std::this_thread::yield();
+      }
+    }
+  }
+}
+
+std::vector<std::string> ShardedSender::Endpoints() const {
+  ReadGuard guard(this);
+  const Ring* ring = ring_.load();
+  std::vector<std::string> names;
+  for (size_t i = 0; i < ring->endpoints.size(); i++) {
+    names.push_back(ring->endpoints[i]->name);
+  }
+  return names;
+}
+
+ShardedSender::Endpoint* ShardedSender::route(const Ring* ring, const char* key, size_t size) const {
+  if (ring->points.empty()) {
+    return NULL;
+  }
+  const char* colon = static_cast<const char*>(memchr(key, ':', size));
+  if (colon != NULL) {
+    size = colon - key;
+  }
+  std::pair<uint64, Endpoint*> point(HashBytes(key, size), NULL);
+  auto found = std::lower_bound(ring->points.begin(), ring->points.end(), point);
+  if (found == ring->points.end()) {
+    found = ring->points.begin();
+  }
+  return found->second;
+}
+
+void ShardedSender::Send(const std::string& message) {
+  Send(message.data(), message.size());
+}
+
+void ShardedSender::Send(const char* message, size_t size) {
+  ReadGuard guard(this);
+  Endpoint* endpoint = route(ring_.load(), message, size);
+  if (endpoint == NULL) {
+    unroutedMetrics_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  endpoint->sender->Send(message, size);
+}
+
+std::string ShardedSender::EndpointFor(const std::string& key) const {
+  ReadGuard guard(this);
+  Endpoint* endpoint = route(ring_.load(), key.data(), key.size());
+  return endpoint == NULL ? std::string() : endpoint->name;
+}
+
+int64 ShardedSender::DroppedMetrics() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  int64 dropped = unroutedMetrics_.load(std::memory_order_relaxed) + retiredDropped_;
+  for (size_t i = 0; i < endpoints_.size(); i++) {
+    dropped += endpoints_[i]->sender->DroppedMetrics();
+  }
+  return dropped;
+}
+}
+}
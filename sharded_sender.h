@@ -0,0 +1,127 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+#include "base/common/basic_types.h"
+#include "./abstract_sender.h"
+#include "./non_blocking_sender.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Spreads metrics over several statsd nodes, routing each metric by a consistent hash of its
+ * rendered key (everything before the first ':', so ns, key and tags), so the same series always
+ * lands on the same node.
+ *
+ * Every endpoint gets its own NonBlockingSender, hence its own queue, worker and batching buffers.
+ * Endpoints sit on a hash ring at virtualNodes points each, adding or removing one only moves the
+ * keys between it and its ring neighbours, about 1/N of them.
+ *
+ * Send() is lock free: it reads an immutable ring published by AddEndpoint()/RemoveEndpoint(),
+ * announcing itself in a per-thread-striped reader count. Publishing waits out a grace period,
+ * until every Send() that could still hold the replaced ring has returned, then frees that ring
+ * and stops and deletes the sender of a removed endpoint, after it sent what it still queued.
+ * Endpoints churning with service discovery therefore keep no threads or queues behind.
+ *
+ * Thread safe.
+ */
+class ShardedSender: public AbstractSender {
+ public:
+  /**
+   * @param options
+   *     used for every endpoint's sender, host and port excepted
+   * @param virtualNodes
+   *     ring points per endpoint, more of them spread keys more evenly
+   */
+  explicit ShardedSender(const NonBlockingSender::Options& options, int virtualNodes = 160);
+  ~ShardedSender();
+
+  /**
+   * Add a "host:port" endpoint, return false if it is malformed or already there
+   */
+  bool AddEndpoint(const std::string& endpoint);
+  /**
+   * Stop routing to an endpoint, return false if it is not there. Returns once its sender sent
+   * what it still queued and stopped.
+   */
+  bool RemoveEndpoint(const std::string& endpoint);
+  std::vector<std::string> Endpoints() const;
+
+  void Send(const std::string& message);
+  void Send(const char* message, size_t size);
+
+  /**
+   * Endpoint a rendered key is routed to, empty if there is none
+   */
+  std::string EndpointFor(const std::string& key) const;
+
+  /**
+   * Metrics dropped by every endpoint's sender, plus those sent while there was no endpoint
+   */
+  int64 DroppedMetrics() const;
+
+  /**
+   * Split "host:port", return false unless both parts are there and the port is valid
+   */
+  static bool ParseEndpoint(const std::string& endpoint, std::string* host, int* port);
+
+ private:
+  struct Endpoint {
+    std::string name;
+    std::unique_ptr<NonBlockingSender> sender;
+  };
+
+  // points sorted by hash
+  struct Ring {
+    std::vector<std::pair<uint64, Endpoint*> > points;
+    std::vector<Endpoint*> endpoints;
+  };
+
+  static const int READER_STRIPES = 16;
+  static const size_t CACHE_LINE = 64;
+
+  struct ReaderCount {
+    std::atomic<int64> count;
+    char pad[CACHE_LINE - sizeof(std::atomic<int64>)];
+  };
+
+  // Counts a reader of ring_ in the stripe of its thread, for the grace period it started in
+  class ReadGuard {
+   public:
+    explicit ReadGuard(const ShardedSender* sender);
+    ~ReadGuard();
+
+   private:
+    std::atomic<int64>* count_;
+  };
+
+  Endpoint* route(const Ring* ring, const char* key, size_t size) const;
+  // replace ring_ and free the previous one once no reader can hold it, mutex_ held
+  void publish(const Ring* ring);
+  void waitForReaders();
+
+ private:
+  NonBlockingSender::Options options_;
+  int virtualNodes_;
+  std::atomic<const Ring*> ring_;
+  std::atomic<int64> unroutedMetrics_;
+
+  // readers by parity of the grace period they started in, flipped twice by waitForReaders()
+  std::atomic<uint64> period_;
+  mutable ReaderCount readers_[2][READER_STRIPES];
+
+  // serializes AddEndpoint() and RemoveEndpoint(), owns the endpoints on ring_
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<Endpoint> > endpoints_;
+  // metrics dropped by the senders of removed endpoints
+  int64 retiredDropped_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShardedSender);
+};
+}
+}
@@ -0,0 +1,176 @@
+#include "./sharded_sender.h"
+
+#include <dirent.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/testing/gtest.h"
+#include "./datagram_sink.h"
+
+namespace base {
+namespace statsd {
+
+static int liveThreads() {
+  DIR* dir = opendir("/proc/self/task");
+  int threads = 0;
+  while (dir != NULL && readdir(dir) != NULL) {
+    threads++;
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+  // "." and ".."
+  return threads - 2;
+}
+
+class ShardedSenderTest : public testing::Test {
+ protected:
+  void SetUp() {
+    for (int i = 0; i < 4; i++) {
+      sinks_.push_back(std::unique_ptr<DatagramSink>(new DatagramSink()));
+      endpoints_.push_back("127.0.0.1:" + std::to_string(sinks_.back()->Port()));
+    }
+  }
+
+  static std::string key(int i) {
+    return "sharded.key" + std::to_string(i) + ",tag=v";
+  }
+
+  std::vector<std::unique_ptr<DatagramSink> > sinks_;
+  std::vector<std::string> endpoints_;
+};
+
+TEST_F(ShardedSenderTest, ParsesEndpoints) {
+  std::string host;
+  int port = 0;
+  ASSERT_TRUE(ShardedSender::ParseEndpoint("statsd-1.local:8125", &host, &port));
+  ASSERT_EQ(host, "statsd-1.local");
+  ASSERT_EQ(port, 8125);
+  ASSERT_FALSE(ShardedSender::ParseEndpoint("statsd-1.local", &host, &port));
+  ASSERT_FALSE(ShardedSender::ParseEndpoint(":8125", &host, &port));
+  ASSERT_FALSE(ShardedSender::ParseEndpoint("statsd:", &host, &port));
+  ASSERT_FALSE(ShardedSender::ParseEndpoint("statsd:70000", &host, &port));
+  ASSERT_FALSE(ShardedSender::ParseEndpoint("statsd:81x", &host, &port));
+}
+
+TEST_F(ShardedSenderTest, SameSeriesAlwaysLandsOnSameSink) {
+  const int keys = 300;
+  const int rounds = 10;
+  {
+    ShardedSender sender((NonBlockingSender::Options()));
+    for (int i = 0; i < 3; i++) {
+      ASSERT_TRUE(sender.AddEndpoint(endpoints_[i]));
+    }
+    ASSERT_FALSE(sender.AddEndpoint(endpoints_[0]));
+    ASSERT_FALSE(sender.AddEndpoint("no-port"));
+    ASSERT_EQ(sender.Endpoints().size(), 3u);
+
+    for (int r = 0; r < rounds; r++) {
+      for (int i = 0; i < keys; i++) {
+        sender.Send(key(i) + ":1|c");
+      }
+      usleep(1000);
+    }
+    ASSERT_EQ(sender.DroppedMetrics(), 0);
+  }
+  usleep(100 * 1000);
+
+  int total = 0;
+  for (int s = 0; s < 3; s++) {
+    std::map<std::string, double> counters = sinks_[s]->Counters();
+    // every sink gets a fair share of the series
+    ASSERT_GT(counters.size(), keys / 3 / 2);
+    for (auto it = counters.begin(); it != counters.end(); ++it) {
+      ASSERT_EQ(it->second, rounds) << it->first;
+      total++;
+    }
+  }
+  // and no series shows up on two sinks
+  ASSERT_EQ(total, keys);
+  ASSERT_EQ(sinks_[3]->Lines(), 0);
+}
+
+TEST_F(ShardedSenderTest, AddingOrRemovingMovesFewKeys) {
+  const int keys = 10000;
+  ShardedSender sender((NonBlockingSender::Options()));
+  for (int i = 0; i < 3; i++) {
+    sender.AddEndpoint(endpoints_[i]);
+  }
+  std::vector<std::string> before;
+  for (int i = 0; i < keys; i++) {
+    before.push_back(sender.EndpointFor(key(i)));
+  }
+
+  ASSERT_TRUE(sender.AddEndpoint(endpoints_[3]));
+  int moved = 0;
+  for (int i = 0; i < keys; i++) {
+    std::string now = sender.EndpointFor(key(i));
+    if (now != before[i]) {
+      // only towards the new endpoint
+      ASSERT_EQ(now, endpoints_[3]);
+      moved++;
+    }
+  }
+  // a quarter of the keys is expected to move
+  ASSERT_GT(moved, keys / 8);
+  ASSERT_LT(moved, keys * 3 / 8);
+
+  ASSERT_TRUE(sender.RemoveEndpoint(endpoints_[3]));
+  ASSERT_FALSE(sender.RemoveEndpoint(endpoints_[3]));
+  for (int i = 0; i < keys; i++) {
+    ASSERT_EQ(sender.EndpointFor(key(i)), before[i]);
+  }
+
+  // keys of a removed endpoint only move to the remaining ones
+  ASSERT_TRUE(sender.RemoveEndpoint(endpoints_[0]));
+  for (int i = 0; i < keys; i++) {
+    if (before[i] != endpoints_[0]) {
+      ASSERT_EQ(sender.EndpointFor(key(i)), before[i]);
+    } else {
+      ASSERT_NE(sender.EndpointFor(key(i)), endpoints_[0]);
+    }
+  }
+}
+
+TEST_F(ShardedSenderTest, ChurningEndpointsLeavesNoSendersBehind) {
+  ShardedSender sender((NonBlockingSender::Options()));
+  ASSERT_TRUE(sender.AddEndpoint(endpoints_[0]));
+  std::atomic<bool> stopping(false);
+  std::atomic<int64> sent(0);
+  // keeps routing through the rings being replaced
+  std::thread producer([&]() {
+    for (int i = 0; !stopping.load(); i++) {
+      sender.Send(key(i % 100) + ":1|c");
+      sent.fetch_add(1);
+    }
+  });
+  while (sent.load() == 0) {
+    usleep(1000);
+  }
+  int threads = liveThreads();
+
+  for (int round = 0; round < 50; round++) {
+    ASSERT_TRUE(sender.AddEndpoint(endpoints_[1 + round % 3]));
+    ASSERT_TRUE(sender.AddEndpoint(endpoints_[1 + (round + 1) % 3]));
+    ASSERT_TRUE(sender.RemoveEndpoint(endpoints_[1 + round % 3]));
+    ASSERT_TRUE(sender.RemoveEndpoint(endpoints_[1 + (round + 1) % 3]));
+    // every removed endpoint's worker is gone
+    ASSERT_LE(liveThreads(), threads);
+  }
+  ASSERT_EQ(sender.Endpoints(), std::vector<std::string>(1, endpoints_[0]));
+  stopping.store(true);
+  producer.join();
+}
+
+TEST_F(ShardedSenderTest, CountsMetricsWithoutEndpoint) {
+  ShardedSender sender((NonBlockingSender::Options()));
+  ASSERT_EQ(sender.EndpointFor("key"), "");
+  sender.Send("key:1|c");
+  ASSERT_EQ(sender.DroppedMetrics(), 1);
+}
+}
+}
@@ -0,0 +1,100 @@
+// Reader of the shared memory ring ShmSender producers write to: forwards every metric found in it
+// to statsd through a NonBlockingSender, configured by the usual --statsd_* flags.
+//
+//   shm_forwarder --statsd_shm_path=/dev/shm/statsd_client.ring --statsd_host=127.0.0.1 --statsd_port=8125
+//
+// Run one per ring. The ring keeps its cursors, so a restarted forwarder resumes where the previous
+// one stopped. Overflows of the producers and slots abandoned by crashed ones are reported as
+// counters under --statsd_self_metrics_namespace.
+#include <signal.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string>
+#include "base/common/gflags.h"
+#include "./non_blocking_sender.h"
+#include "./shm_ring.h"
+#include "./shm_sender.h"
+
+DEFINE_int32(shm_poll_us, 200, "how long the forwarder sleeps once the ring is empty");
+DEFINE_int32(shm_stuck_ms, 1000, "how long a slot may stay claimed by a producer before it is skipped as abandoned");
+DEFINE_int32(shm_report_interval_ms, 10000, "how often overflows and abandoned slots are reported, 0 never");
+
+namespace base {
+namespace statsd {
+DECLARE_string(statsd_self_metrics_namespace);
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int) {
+  stopping = 1;
+}
+
+static int64 nowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// counter of the growth of a ring total since the last report
+static void report(NonBlockingSender* sender, const char* name, uint64 total, uint64* last) {
+  if (total == *last) {
+    return;
+  }
+  std::string line = FLAGS_statsd_self_metrics_namespace + ".shm_" + name + ":" + std::to_string(total - *last);
+  sender->Send(line + "|c");
+  *last = total;
+}
+
+static int run() {
+  ShmSender::Options options;
+  std::string error;
+  ShmRing* ring = ShmRing::Attach(options.path, &error);
+  if (ring == NULL) {
+    // no producer created it yet, take the geometry they would
+    ring = ShmRing::Open(options.path, options.slots, options.slotSize, &error, options.mode);
+  }
+  if (ring == NULL) {
+    fprintf(stderr, "can not open %s: %s\n", options.path.c_str(), error.c_str());
+    return 1;
+  }
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  NonBlockingSender::Options senderOptions;
+  // the ring is the buffer, rather wait for room than drop what it absorbed
+  senderOptions.overflowPolicy = BLOCK;
+  NonBlockingSender* sender = new NonBlockingSender(senderOptions);
+  // the overflows before we started were reported by whoever read the ring then
+  uint64 lastOverflows = ring->Overflows();
+  uint64 lastAbandoned = ring->Abandoned();
+  int64 nextReportMs = nowMillis() + FLAGS_shm_report_interval_ms;
+  int64 forwarded = 0;
+  while (!stopping) {
+    bool consumed = false;
+    while (ring->Consume([sender](const char* data, size_t size) { sender->Send(data, size); })) {
+      consumed = true;
+      forwarded++;
+    }
+    if (!consumed && !ring->SkipStuck(FLAGS_shm_stuck_ms)) {
+      usleep(FLAGS_shm_poll_us);
+    }
+    if (FLAGS_shm_report_interval_ms > 0 && nowMillis() >= nextReportMs) {
+      report(sender, "overflows", ring->Overflows(), &lastOverflows);
+      report(sender, "abandoned", ring->Abandoned(), &lastAbandoned);
+      nextReportMs = nowMillis() + FLAGS_shm_report_interval_ms;
+    }
+  }
+  // sends what it still queues
+  delete sender;
+  fprintf(stderr, "forwarded %lld metrics, %llu left in %s\n", static_cast<long long>(forwarded),
+          static_cast<unsigned long long>(ring->Size()), options.path.c_str());
+  delete ring;
+  return 0;
+}
+}
+}
+
+int main(int argc, char** argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  return base::statsd::run();
+}
@@ -0,0 +1,334 @@
+#include "./shm_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include "base/common/logging.h"
+
+namespace base {
+namespace statsd {
+
+// Processes share the cursors through the mapping, so their atomics must not hide a lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "shared memory rings need lock free 64 bit atomics");
+
+// "STATSDRG", and the layout version, bumped whenever the header or slots change
+static const uint64 MAGIC = 0x4752445354415453ULL;
+static const uint32 VERSION = 2;
+static const size_t CACHE_LINE = 64;
+// The slots start on their own page
+static const size_t HEADER_SIZE = 4096;
+
+struct ShmRing::Header {
+  // MAGIC once the ring is initialized, written last
+  std::atomic<uint64> magic;
+  uint32 version;
+  uint32 slotSize;
+  uint64 slots;
+  uint64 stride;
+  char pad0[CACHE_LINE - 32];
+  // next position producers claim
+  std::atomic<uint64> head;
+  char pad1[CACHE_LINE - sizeof(std::atomic<uint64>)];
+  // next position the reader consumes
+  std::atomic<uint64> tail;
+  char pad2[CACHE_LINE - sizeof(std::atomic<uint64>)];
+  std::atomic<uint64> overflows;
+  std::atomic<uint64> abandoned;
+};
+
+// The geometry at the start of the header, as read from the file before mapping it
+struct Geometry {
+  uint64 magic;
+  uint32 version;
+  uint32 slotSize;
+  uint64 slots;
+  uint64 stride;
+};
+
+static int64 nowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Slot header, sequence and size, then the metric
+static const size_t SLOT_HEADER_SIZE = 16;
+
+// A slot's seq is its position while claimed, then the position plus one once published, and the
+// position of the next lap once consumed or skipped. While a producer copies the metric in, it is
+// this bit, the producer's pid and the low half of the position, which no other state reaches.
+static const uint64 WRITING = 1ULL << 63;
+
+static bool isWriting(uint64 seq, uint64 pos) {
+  return (seq & WRITING) != 0 && static_cast<uint32>(seq) == static_cast<uint32>(pos);
+}
+
+static bool writerAlive(uint64 seq) {
+  pid_t pid = static_cast<pid_t>((seq & ~WRITING) >> 32);
+  return kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+static size_t strideOf(size_t slotSize) {
+  return (SLOT_HEADER_SIZE + slotSize + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+}
+
+static std::string errnoMessage(const char* what, const std::string& path) {
+  char message[512];
+  snprintf(message, sizeof(message), "%s %s fail, err=%s", what, path.c_str(), strerror(errno));
+  return message;
+}
+
+ShmRing* ShmRing::Open(const std::string& path, size_t slots, size_t slotSize, std::string* error, int mode) {
+  CHECK(slots > 0 && slotSize > 0) << "shared memory ring needs slots of at least one byte";
+  CHECK((mode & ~0777) == 0 && (mode & S_IWOTH) == 0) << "shared memory ring mode must not be world writable";
+  return map(path, slots, slotSize, true, mode, error);
+}
+
+ShmRing* ShmRing::Attach(const std::string& path, std::string* error) {
+  return map(path, 0, 0, false, 0, error);
+}
+
+ShmRing* ShmRing::map(const std::string& path, size_t slots, size_t slotSize, bool create, int mode,
+                      std::string* error) {
+  static_assert(sizeof(Header) <= HEADER_SIZE, "shared memory ring header does not fit its page");
+  static_assert(sizeof(Slot) == SLOT_HEADER_SIZE, "shared memory ring slot header changed, bump VERSION");
+  // never through a symlink someone else planted
+  int flags = O_RDWR | O_CLOEXEC | O_NOFOLLOW;
+  int fd = create ? open(path.c_str(), flags | O_CREAT | O_EXCL, mode) : -1;
+  bool created = fd >= 0;
+  if (fd < 0 && (!create || errno == EEXIST)) {
+    fd = open(path.c_str(), flags);
+  }
+  if (fd < 0) {
+    *error = errnoMessage("open", path);
+    return NULL;
+  }
+  // exactly mode, the umask may have taken some bits
+  if (created && fchmod(fd, mode) != 0) {
+    *error = errnoMessage("fchmod", path);
+    close(fd);
+    return NULL;
+  }
+  // held while checking and initializing. The mapping keeps the file open, so it is released
+  // explicitly, a crash releases it with the process
+  if (flock(fd, LOCK_EX) != 0) {
+    *error = errnoMessage("flock", path);
+    close(fd);
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    *error = errnoMessage("fstat", path);
+    close(fd);
+    return NULL;
+  }
+  if ((st.st_mode & S_IWOTH) != 0) {
+    *error = path + " is writable by any local user, refusing it as a shared memory ring";
+    close(fd);
+    return NULL;
+  }
+  Geometry found;
+  memset(&found, 0, sizeof(found));
+  bool valid = static_cast<size_t>(st.st_size) >= HEADER_SIZE &&
+      pread(fd, &found, sizeof(found), 0) == static_cast<ssize_t>(sizeof(found)) && found.magic == MAGIC &&
+      found.version == VERSION && found.slots > 0 && (found.slots & (found.slots - 1)) == 0 &&
+      found.stride == strideOf(found.slotSize) &&
+      static_cast<size_t>(st.st_size) == HEADER_SIZE + found.slots * found.stride;
+
+  size_t rounded = 1;
+  while (rounded < slots) {
+    rounded <<= 1;
+  }
+  bool initialize = false;
+  if (valid) {
+    if (create && (found.slots != rounded || found.slotSize != slotSize)) {
+      char message[512];
+      snprintf(message, sizeof(message), "%s holds a ring of %llu slots of %u bytes, not %zu of %zu", path.c_str(),
+               static_cast<unsigned long long>(found.slots), found.slotSize, rounded, slotSize);
+      *error = message;
+      close(fd);
+      return NULL;
+    }
+  } else if (!create) {
+    *error = path + " holds no initialized ring";
+    close(fd);
+    return NULL;
+  } else {
+    initialize = true;
+    found.slots = rounded;
+    found.slotSize = static_cast<uint32>(slotSize);
+    found.stride = strideOf(slotSize);
+  }
+
+  size_t size = HEADER_SIZE + found.slots * found.stride;
+  // truncating first zeroes whatever a crashed initialization left behind
+  if (initialize && (ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)) {
+    *error = errnoMessage("ftruncate", path);
+    close(fd);
+    return NULL;
+  }
+  void* base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED) {
+    *error = errnoMessage("mmap", path);
+    close(fd);
+    return NULL;
+  }
+  if (initialize) {
+    Header* header = new (base) Header;
+    header->version = VERSION;
+    header->slotSize = found.slotSize;
+    header->slots = found.slots;
+    header->stride = found.stride;
+    header->head.store(0, std::memory_order_relaxed);
+    header->tail.store(0, std::memory_order_relaxed);
+    header->overflows.store(0, std::memory_order_relaxed);
+    header->abandoned.store(0, std::memory_order_relaxed);
+    char* slotsBase = static_cast<char*>(base) + HEADER_SIZE;
+    for (uint64 i = 0; i < found.slots; i++) {
+      Slot* s = new (slotsBase + i * found.stride) Slot;
+      s->seq.store(i, std::memory_order_relaxed);
+      s->size = 0;
+    }
+    header->magic.store(MAGIC, std::memory_order_release);
+  }
+  flock(fd, LOCK_UN);
+  close(fd);
+  return new ShmRing(path, static_cast<char*>(base), size);
+}
+
+ShmRing::ShmRing(const std::string& path, char* base, size_t mappedSize)
+    : path_(path), base_(base), mappedSize_(mappedSize), header_(reinterpret_cast<Header*>(base)),
+      slots_(base + HEADER_SIZE), stride_(header_->stride), slotSize_(header_->slotSize), mask_(header_->slots - 1),
+      pid_(static_cast<uint32>(getpid())), stuckPos_(0), stuckSinceMs_(-1) {}
+
+uint64 ShmRing::writingSeq(uint64 pos, uint32 pid) {
+  return WRITING | static_cast<uint64>(pid) << 32 | static_cast<uint32>(pos);
+}
+
+ShmRing::~ShmRing() {
+  munmap(base_, mappedSize_);
+}
+
+ShmRing::Slot* ShmRing::claim(uint64* pos) {
+  uint64 head = header_->head.load(std::memory_order_relaxed);
+  while (true) {
+    Slot* s = slot(head);
+    uint64 seq = s->seq.load(std::memory_order_acquire);
+    int64 diff = static_cast<int64>(seq) - static_cast<int64>(head);
+    if (diff == 0) {
+      if (header_->head.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+        *pos = head;
+        return s;
+      }
+    } else if (diff < 0) {
+      // the slot one lap ahead is still in use, ring is full
+      return NULL;
+    } else {
+      head = header_->head.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+bool ShmRing::beginWrite(Slot* s, uint64 pos, uint32 pid) {
+  uint64 claimed = pos;
+  return s->seq.compare_exchange_strong(claimed, writingSeq(pos, pid), std::memory_order_acquire,
+                                        std::memory_order_relaxed);
+}
+
+bool ShmRing::publish(Slot* s, uint64 pos, const char* data, size_t size) {
+  // the slot is ours before a byte is copied, unless the reader gave up waiting for us and
+  // another producer may already be writing it
+  if (!beginWrite(s, pos, pid_)) {
+    return false;
+  }
+  memcpy(payload(s), data, size);
+  s->size = static_cast<uint32>(size);
+  // the reader only takes a slot back from a dead writer, fails if it took us for one
+  uint64 writing = writingSeq(pos, pid_);
+  return s->seq.compare_exchange_strong(writing, pos + 1, std::memory_order_release, std::memory_order_relaxed);
+}
+
+bool ShmRing::TryPush(const char* data, size_t size) {
+  uint64 pos = 0;
+  Slot* s = size <= slotSize_ ? claim(&pos) : NULL;
+  if (s == NULL) {
+    header_->overflows.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  return publish(s, pos, data, size);
+}
+
+uint64 ShmRing::tail() const {
+  return header_->tail.load(std::memory_order_relaxed);
+}
+
+void ShmRing::consumed(Slot* s, uint64 pos) {
+  s->seq.store(pos + mask_ + 1, std::memory_order_release);
+  header_->tail.store(pos + 1, std::memory_order_release);
+}
+
+bool ShmRing::SkipStuck(int64 stuckMs) {
+  uint64 pos = tail();
+  Slot* s = slot(pos);
+  uint64 seq = s->seq.load(std::memory_order_acquire);
+  bool writing = isWriting(seq, pos);
+  if (!writing && static_cast<int64>(seq - pos) > 1) {
+    // a previous reader died between releasing the slot and moving the tail
+    header_->tail.store(pos + 1, std::memory_order_release);
+    return false;
+  }
+  if (!writing && (seq != pos || header_->head.load(std::memory_order_acquire) <= pos)) {
+    // published, or not claimed at all
+    stuckSinceMs_ = -1;
+    return false;
+  }
+  int64 now = nowMillis();
+  if (stuckSinceMs_ < 0 || stuckPos_ != pos) {
+    stuckPos_ = pos;
+    stuckSinceMs_ = now;
+  }
+  if (now - stuckSinceMs_ < stuckMs) {
+    return false;
+  }
+  // a live writer would go on copying into the slot of the next lap
+  if (writing && writerAlive(seq)) {
+    return false;
+  }
+  stuckSinceMs_ = -1;
+  // release it for the next lap, unless its producer moved on after all
+  if (!s->seq.compare_exchange_strong(seq, pos + mask_ + 1, std::memory_order_acq_rel)) {
+    return false;
+  }
+  header_->tail.store(pos + 1, std::memory_order_release);
+  header_->abandoned.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+size_t ShmRing::Size() const {
+  uint64 tail = header_->tail.load(std::memory_order_acquire);
+  uint64 head = header_->head.load(std::memory_order_acquire);
+  return head > tail ? static_cast<size_t>(head - tail) : 0;
+}
+
+uint64 ShmRing::Claimed() const {
+  return header_->head.load(std::memory_order_relaxed);
+}
+
+uint64 ShmRing::Overflows() const {
+  return header_->overflows.load(std::memory_order_relaxed);
+}
+
+uint64 ShmRing::Abandoned() const {
+  return header_->abandoned.load(std::memory_order_relaxed);
+}
+}
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <stddef.h>
+#include <atomic>
+#include <string>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * MetricRing's bounded queue of fixed-size slots, laid out in a memory mapped file so producers
+ * in any number of processes hand metrics to one reader process, e.g. shm_forwarder, without a
+ * single syscall per metric.
+ *
+ * The file starts with a header page holding the geometry, the cursors and the counters shared
+ * by every process, then the slots. A ring is created and initialized under an flock, its magic
+ * number written last, so a process crashing half way leaves a file the next Open() initializes
+ * again, and nobody attaches to it meanwhile. The cursors live in the file too: a restarted
+ * reader resumes where the previous one stopped, restarted producers append after what is queued.
+ *
+ * A producer which dies between claiming a slot and publishing it would stall the reader forever,
+ * so the reader skips a slot claimed for longer than stuckMs, see SkipStuck(). A producer takes its
+ * slot with a CAS, marking it as being written by its pid, before copying a byte: one which was
+ * merely that slow loses its metric instead of overwriting the slot. A slot caught being written is
+ * only skipped once its writer is dead, a stopped producer stalls the reader until it resumes, so
+ * producers and reader must share a pid namespace.
+ *
+ * Any process which can write the file can put metrics in front of the forwarder, under the name of
+ * the service it relays for, so the file is created owner only by default, its mode set exactly
+ * whatever the umask, and a ring any local user may write to is refused, as is a symlink.
+ *
+ * Producers are lock free, a single reader at a time.
+ */
+class ShmRing {
+ public:
+  static const int DEFAULT_MODE = 0600;
+
+  /**
+   * Map the ring at path, creating the file if needed and initializing it unless it already
+   * holds a ring, which must then have the same geometry.
+   * @param slots
+   *     rounded up to a power of two
+   * @param slotSize
+   *     max bytes of a single metric
+   * @param mode
+   *     permissions of the file if it is created, never world writable, e.g. 0660 to let a
+   *     forwarder of the same group read it
+   * @return NULL, and why in error, if it can not
+   */
+  static ShmRing* Open(const std::string& path, size_t slots, size_t slotSize, std::string* error,
+                       int mode = DEFAULT_MODE);
+
+  /**
+   * Map the existing ring at path whatever its geometry, for the reader
+   */
+  static ShmRing* Attach(const std::string& path, std::string* error);
+
+  /**
+   * Unmap the ring, the file and what is queued in it stay
+   */
+  ~ShmRing();
+
+  /**
+   * Copy a metric into the next free slot, counting it in Overflows() if the ring is full
+   * or the metric is longer than SlotSize()
+   */
+  bool TryPush(const char* data, size_t size);
+
+  /**
+   * Reader only: pop the oldest metric and pass it to consume(const char* data, size_t size),
+   * the bytes are only valid during the call.
+   * @return false if the ring is empty, or its oldest slot is claimed and not published yet
+   */
+  template <typename Consumer>
+  bool Consume(Consumer consume);
+
+  /**
+   * Reader only, when Consume() returns false: skip the oldest slot if a producer claimed it
+   * at least stuckMs ago, as measured by consecutive calls, and never published it. A slot whose
+   * producer started writing it is only skipped if that process is gone.
+   * @return whether a slot was skipped, counted in Abandoned()
+   */
+  bool SkipStuck(int64 stuckMs);
+
+  size_t Capacity() const { return mask_ + 1; }
+  size_t SlotSize() const { return slotSize_; }
+  const std::string& Path() const { return path_; }
+
+  /**
+   * Metrics queued right now, a snapshot
+   */
+  size_t Size() const;
+  /**
+   * Totals over the life of the file, shared by every process: slots claimed by TryPush(),
+   * metrics it rejected, and claimed slots the reader gave up waiting for. Claimed() - Abandoned()
+   * metrics were published.
+   */
+  uint64 Claimed() const;
+  uint64 Overflows() const;
+  uint64 Abandoned() const;
+
+ private:
+  friend class ShmRingPeer;
+  struct Header;
+  struct Slot {
+    std::atomic<uint64> seq;
+    uint32 size;
+    uint32 unused;
+  };
+
+  ShmRing(const std::string& path, char* base, size_t mappedSize);
+  // seq of a slot the process pid is writing
+  static uint64 writingSeq(uint64 pos, uint32 pid);
+  static ShmRing* map(const std::string& path, size_t slots, size_t slotSize, bool create, int mode,
+                      std::string* error);
+
+  Slot* slot(uint64 pos) const {
+    return reinterpret_cast<Slot*>(slots_ + (pos & mask_) * stride_);
+  }
+  char* payload(Slot* s) const { return reinterpret_cast<char*>(s) + sizeof(Slot); }
+  // TryPush() in two steps, claim() gives NULL if the ring is full
+  Slot* claim(uint64* pos);
+  bool publish(Slot* s, uint64 pos, const char* data, size_t size);
+  // the CAS publish() starts with, false if the reader skipped the slot
+  bool beginWrite(Slot* s, uint64 pos, uint32 pid);
+  uint64 tail() const;
+  void consumed(Slot* s, uint64 pos);
+
+ private:
+  std::string path_;
+  char* base_;
+  size_t mappedSize_;
+  Header* header_;
+  char* slots_;
+  size_t stride_;
+  size_t slotSize_;
+  uint64 mask_;
+  // cached, getpid() is a syscall
+  uint32 pid_;
+
+  // reader only, the claimed slot SkipStuck() is waiting for and since when
+  uint64 stuckPos_;
+  int64 stuckSinceMs_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShmRing);
+};
+
+template <typename Consumer>
+bool ShmRing::Consume(Consumer consume) {
+  uint64 pos = tail();
+  Slot* s = slot(pos);
+  if (s->seq.load(std::memory_order_acquire) != pos + 1) {
+    return false;
+  }
+  // a size written by a crashing producer is never trusted past the slot
+  size_t size = s->size < slotSize_ ? s->size : slotSize_;
+  consume(static_cast<const char*>(payload(s)), size);
+  consumed(s, pos);
+  return true;
+}
+}
+}
@@ -0,0 +1,287 @@
+#include "./shm_ring.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+class ShmRingPeer {
+ public:
+  // a producer which dies between claiming a slot and publishing it
+  static uint64 ClaimOnly(ShmRing* ring) {
+    uint64 pos = 0;
+    EXPECT_TRUE(ring->claim(&pos) != NULL);
+    return pos;
+  }
+  static bool Publish(ShmRing* ring, uint64 pos, const std::string& metric) {
+    return ring->publish(ring->slot(pos), pos, metric.data(), metric.size());
+  }
+  // a producer pid which stops half way through copying its metric
+  static uint64 ClaimAndBeginWrite(ShmRing* ring, pid_t pid) {
+    uint64 pos = ClaimOnly(ring);
+    EXPECT_TRUE(ring->beginWrite(ring->slot(pos), pos, static_cast<uint32>(pid)));
+    return pos;
+  }
+};
+
+// the pid of a process which exited
+static pid_t deadPid() {
+  pid_t pid = fork();
+  if (pid == 0) {
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+  return pid;
+}
+
+static std::string ringPath(const char* name) {
+  std::string path = "/tmp/shm_ring_test." + std::string(name) + "." + std::to_string(getpid());
+  unlink(path.c_str());
+  return path;
+}
+
+static std::vector<std::string> drain(ShmRing* ring) {
+  std::vector<std::string> metrics;
+  while (ring->Consume([&metrics](const char* data, size_t size) { metrics.push_back(std::string(data, size)); })) {
+  }
+  return metrics;
+}
+
+TEST(ShmRingTest, PushAndConsumeAcrossMappings) {
+  std::string path = ringPath("mappings");
+  std::string error;
+  ShmRing* producer = ShmRing::Open(path, 6, 32, &error);
+  ASSERT_TRUE(producer != NULL) << error;
+  ASSERT_EQ(producer->Capacity(), 8u);
+  ShmRing* reader = ShmRing::Attach(path, &error);
+  ASSERT_TRUE(reader != NULL) << error;
+  ASSERT_EQ(reader->Capacity(), 8u);
+  ASSERT_EQ(reader->SlotSize(), 32u);
+
+  for (int i = 0; i < 10; i++) {
+    std::string metric = "shm.m" + std::to_string(i) + ":1|c";
+    ASSERT_EQ(producer->TryPush(metric.data(), metric.size()), i < 8);
+  }
+  std::string tooLong(33, 'x');
+  ASSERT_FALSE(producer->TryPush(tooLong.data(), tooLong.size()));
+  // counted in the file, every mapping sees them
+  ASSERT_EQ(reader->Overflows(), 3u);
+  ASSERT_EQ(reader->Size(), 8u);
+
+  std::vector<std::string> metrics = drain(reader);
+  ASSERT_EQ(metrics.size(), 8u);
+  for (size_t i = 0; i < metrics.size(); i++) {
+    ASSERT_EQ(metrics[i], "shm.m" + std::to_string(i) + ":1|c");
+  }
+  ASSERT_TRUE(producer->TryPush("again:1|c", 9));
+  ASSERT_EQ(drain(reader), std::vector<std::string>(1, "again:1|c"));
+  ASSERT_EQ(producer->Claimed(), 9u);
+  delete producer;
+  delete reader;
+  unlink(path.c_str());
+}
+
+TEST(ShmRingTest, ReopeningKeepsWhatIsQueued) {
+  std::string path = ringPath("reopen");
+  std::string error;
+  ShmRing* ring = ShmRing::Open(path, 16, 64, &error);
+  ASSERT_TRUE(ring != NULL) << error;
+  ring->TryPush("first:1|c", 9);
+  ring->TryPush("second:1|c", 10);
+  ASSERT_EQ(drain(ring).size(), 2u);
+  ring->TryPush("third:1|c", 9);
+  delete ring;
+
+  // a restarted process resumes after what the previous reader consumed
+  ring = ShmRing::Open(path, 16, 64, &error);
+  ASSERT_TRUE(ring != NULL) << error;
+  ASSERT_EQ(drain(ring), std::vector<std::string>(1, "third:1|c"));
+  delete ring;
+
+  // another geometry is not clobbered
+  ASSERT_TRUE(ShmRing::Open(path, 32, 64, &error) == NULL);
+  ASSERT_NE(error.find("holds a ring of 16 slots of 64 bytes"), std::string::npos) << error;
+  unlink(path.c_str());
+}
+
+TEST(ShmRingTest, InitializesAgainAfterACrashedInitialization) {
+  std::string path = ringPath("crashed");
+  std::string error;
+  ASSERT_TRUE(ShmRing::Attach(path, &error) == NULL);
+  // a creator which died before writing the magic number leaves a file of zeroes
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+  ASSERT_EQ(ftruncate(fd, 4096 + 16 * 64), 0);
+  close(fd);
+  ASSERT_TRUE(ShmRing::Attach(path, &error) == NULL);
+  ASSERT_NE(error.find("holds no initialized ring"), std::string::npos) << error;
+
+  ShmRing* ring = ShmRing::Open(path, 16, 48, &error);
+  ASSERT_TRUE(ring != NULL) << error;
+  ASSERT_TRUE(ring->TryPush("ok:1|c", 6));
+  ASSERT_EQ(drain(ring), std::vector<std::string>(1, "ok:1|c"));
+  delete ring;
+  unlink(path.c_str());
+}
+
+TEST(ShmRingTest, OnlyTheOwnerMayWrite) {
+  std::string path = ringPath("mode");
+  std::string error;
+  mode_t umask0 = umask(0);
+  ShmRing* ring = ShmRing::Open(path, 8, 32, &error);
+  umask(umask0);
+  ASSERT_TRUE(ring != NULL) << error;
+  delete ring;
+  struct stat st;
+  ASSERT_EQ(stat(path.c_str(), &st), 0);
+  ASSERT_EQ(st.st_mode & 0777, 0600u);
+
+  // the mode asked for, whatever the umask
+  unlink(path.c_str());
+  umask0 = umask(077);
+  ring = ShmRing::Open(path, 8, 32, &error, 0660);
+  umask(umask0);
+  ASSERT_TRUE(ring != NULL) << error;
+  delete ring;
+  ASSERT_EQ(stat(path.c_str(), &st), 0);
+  ASSERT_EQ(st.st_mode & 0777, 0660u);
+
+  // a ring anyone could inject metrics into
+  ASSERT_EQ(chmod(path.c_str(), 0666), 0);
+  ASSERT_TRUE(ShmRing::Open(path, 8, 32, &error) == NULL);
+  ASSERT_NE(error.find("writable by any local user"), std::string::npos) << error;
+  ASSERT_TRUE(ShmRing::Attach(path, &error) == NULL);
+
+  // nor through a symlink
+  ASSERT_EQ(chmod(path.c_str(), 0600), 0);
+  std::string link = path + ".link";
+  unlink(link.c_str());
+  ASSERT_EQ(symlink(path.c_str(), link.c_str()), 0);
+  ASSERT_TRUE(ShmRing::Open(link, 8, 32, &error) == NULL);
+  ASSERT_TRUE(ShmRing::Attach(link, &error) == NULL);
+  unlink(link.c_str());
+  unlink(path.c_str());
+}
+
+TEST(ShmRingTest, SkipsSlotsOfDeadProducers) {
+  std::string path = ringPath("stuck");
+  std::string error;
+  ShmRing* ring = ShmRing::Open(path, 8, 32, &error);
+  ASSERT_TRUE(ring != NULL) << error;
+  uint64 stuck = ShmRingPeer::ClaimOnly(ring);
+  ASSERT_TRUE(ring->TryPush("after:1|c", 9));
+  // published behind the stuck slot, so not visible yet
+  ASSERT_TRUE(drain(ring).empty());
+  ASSERT_FALSE(ring->SkipStuck(50));
+  usleep(60 * 1000);
+  ASSERT_TRUE(ring->SkipStuck(50));
+  ASSERT_EQ(ring->Abandoned(), 1u);
+  ASSERT_EQ(ring->Claimed() - ring->Abandoned(), 1u);
+  ASSERT_EQ(drain(ring), std::vector<std::string>(1, "after:1|c"));
+
+  // a producer that was only slow loses its metric rather than overwriting the slot
+  ASSERT_FALSE(ShmRingPeer::Publish(ring, stuck, "late:1|c"));
+  ASSERT_TRUE(ring->TryPush("next:1|c", 8));
+  ASSERT_EQ(drain(ring), std::vector<std::string>(1, "next:1|c"));
+  ASSERT_FALSE(ring->SkipStuck(0));
+  delete ring;
+  unlink(path.c_str());
+}
+
+TEST(ShmRingTest, LateProducerDoesNotOverwriteTheNextLap) {
+  std::string path = ringPath("lap");
+  std::string error;
+  ShmRing* ring = ShmRing::Open(path, 2, 32, &error);
+  ASSERT_TRUE(ring != NULL) << error;
+  uint64 stuck = ShmRingPeer::ClaimOnly(ring);
+  ASSERT_EQ(stuck, 0u);
+  ASSERT_TRUE(ring->SkipStuck(0));
+  ASSERT_TRUE(ring->TryPush("one:1|c", 7));
+  // position 2, the slot of the skipped position 0
+  ASSERT_TRUE(ring->TryPush("good:1|c", 8));
+  ASSERT_FALSE(ShmRingPeer::Publish(ring, stuck, "evil:999|c"));
+  std::vector<std::string> expected;
+  expected.push_back("one:1|c");
+  expected.push_back("good:1|c");
+  ASSERT_EQ(drain(ring), expected);
+  delete ring;
+  unlink(path.c_str());
+}
+
+TEST(ShmRingTest, SkipsASlotBeingWrittenOnlyOnceItsWriterIsDead) {
+  std::string path = ringPath("writing");
+  std::string error;
+  ShmRing* ring = ShmRing::Open(path, 4, 32, &error);
+  ASSERT_TRUE(ring != NULL) << error;
+  // a live writer may still be copying, its slot is not handed to the next lap
+  ShmRingPeer::ClaimAndBeginWrite(ring, getpid());
+  ASSERT_TRUE(ring->TryPush("after:1|c", 9));
+  ASSERT_FALSE(ring->SkipStuck(0));
+  ASSERT_FALSE(ring->SkipStuck(0));
+  ASSERT_TRUE(drain(ring).empty());
+  ASSERT_EQ(ring->Abandoned(), 0u);
+  delete ring;
+  unlink(path.c_str());
+
+  ring = ShmRing::Open(path, 4, 32, &error);
+  ASSERT_TRUE(ring != NULL) << error;
+  ShmRingPeer::ClaimAndBeginWrite(ring, deadPid());
+  ASSERT_TRUE(ring->TryPush("after:1|c", 9));
+  ASSERT_TRUE(ring->SkipStuck(0));
+  ASSERT_EQ(ring->Abandoned(), 1u);
+  ASSERT_EQ(drain(ring), std::vector<std::string>(1, "after:1|c"));
+  ASSERT_TRUE(ring->TryPush("next:1|c", 8));
+  ASSERT_EQ(drain(ring), std::vector<std::string>(1, "next:1|c"));
+  delete ring;
+  unlink(path.c_str());
+}
+
+TEST(ShmRingTest, ConcurrentProducers) {
+  const int threads = 4;
+  const int perThread = 50000;
+  std::string path = ringPath("concurrent");
+  std::string error;
+  ShmRing* ring = ShmRing::Open(path, 1024, 32, &error);
+  ASSERT_TRUE(ring != NULL) << error;
+  std::vector<std::thread> producers;
+  for (int t = 0; t < threads; t++) {
+    producers.push_back(std::thread([ring, t]() {
+      for (int i = 0; i < perThread;) {
+        std::string metric = "t" + std::to_string(t) + ":" + std::to_string(i) + "|c";
+        if (ring->TryPush(metric.data(), metric.size())) {
+          i++;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }));
+  }
+  // each producer's metrics come in order
+  std::vector<int> next(threads, 0);
+  int consumed = 0;
+  while (consumed < threads * perThread) {
+    if (!ring->Consume([&next, &consumed](const char* data, size_t size) {
+          std::string metric(data, size);
+          int t = atoi(metric.c_str() + 1);
+          EXPECT_EQ(atoi(metric.c_str() + metric.find(':') + 1), next[t]++);
+          consumed++;
+        })) {
+      std::this_thread::yield();
+    }
+  }
+  for (size_t t = 0; t < producers.size(); t++) {
+    producers[t].join();
+  }
+  ASSERT_EQ(ring->Size(), 0u);
+  ASSERT_EQ(ring->Abandoned(), 0u);
+  delete ring;
+  unlink(path.c_str());
+}
+}
+}
@@ -0,0 +1,69 @@
+#include "./shm_sender.h"
+
+#include <stdlib.h>
+#include "base/common/gflags.h"
+#include "base/common/logging.h"
+
+namespace base {
+namespace statsd {
+DECLARE_int32(statsd_max_metric_size);
+DECLARE_int32(statsd_error_log_interval_ms);
+
+DEFINE_string(statsd_shm_path, "/dev/shm/statsd_client.ring", "file of the shared memory ring shm_forwarder reads");
+DEFINE_int32(statsd_shm_slots, 65536, "metrics the shared memory ring holds, rounded up to a power of 2");
+DEFINE_string(statsd_shm_mode, "0600",
+              "permissions, in octal, of the shared memory ring file when this process creates it. Never world "
+              "writable, 0660 lets a forwarder of the same group read it");
+
+ShmSender::Options::Options() {
+  path = FLAGS_statsd_shm_path;
+  slots = FLAGS_statsd_shm_slots;
+  slotSize = FLAGS_statsd_max_metric_size;
+  char* end = NULL;
+  long parsed = strtol(FLAGS_statsd_shm_mode.c_str(), &end, 8);
+  if (FLAGS_statsd_shm_mode.empty() || *end != '\0' || (parsed & ~0770L) != 0) {
+    LOG(ERROR) << "Invalid --statsd_shm_mode " << FLAGS_statsd_shm_mode << ", the ring is created 0600";
+    parsed = ShmRing::DEFAULT_MODE;
+  }
+  mode = static_cast<int>(parsed);
+}
+
+ShmSender* ShmSender::Instance() {
+  static ShmSender* INSTANCE = new ShmSender(Options());
+  return INSTANCE;
+}
+
+ShmSender::ShmSender(const Options& options)
+    : options_(options), ring_(NULL), droppedMetrics_(0), unhealthyLog_(FLAGS_statsd_error_log_interval_ms) {
+  std::string error;
+  ring_ = ShmRing::Open(options_.path, options_.slots, options_.slotSize, &error, options_.mode);
+  if (ring_ == NULL) {
+    LOG(ERROR) << "Fail to open statsd shared memory ring, every metric will be dropped. Error message: " << error;
+  }
+}
+
+ShmSender::~ShmSender() {
+  delete ring_;
+  ring_ = NULL;
+}
+
+void ShmSender::Send(const std::string& message) {
+  Send(message.data(), message.size());
+}
+
+void ShmSender::Send(const char* message, size_t size) {
+  if (ring_ != NULL) {
+    if (!ring_->TryPush(message, size)) {
+      droppedMetrics_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+  droppedMetrics_.fetch_add(1, std::memory_order_relaxed);
+  int64 suppressed = 0;
+  if (unhealthyLog_.Allow(&suppressed)) {
+    LOG(ERROR) << "Shared memory ring " << options_.path << " is not available, can not send message! ("
+               << suppressed << " more suppressed)";
+  }
+}
+}
+}
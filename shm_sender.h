@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include "base/common/basic_types.h"
+#include "./abstract_sender.h"
+#include "./log_rate_limiter.h"
+#include "./shm_ring.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Hands metrics to a local agent through a shared memory ring, see shm_ring.h, for paths where
+ * even the syscalls of a sender's worker are too much on the machine. Send() copies the metric
+ * into the ring and that is all: no syscall, no wakeup. A separate reader process, shm_forwarder,
+ * polls the ring and sends what it finds to statsd.
+ *
+ * A metric is dropped if the ring is full or the metric longer than a slot, which is counted both
+ * here and in the ring, so the forwarder reports the overflows of every producer.
+ *
+ * Thread safe, and any number of processes may send into the same ring.
+ */
+class ShmSender: public AbstractSender {
+ public:
+  struct Options {
+    /**
+     * Defaults from the --statsd_shm_* flags, and --statsd_max_metric_size
+     */
+    Options();
+
+    /**
+     * file holding the ring, best on a tmpfs such as /dev/shm. Created if needed, a ring already
+     * there must have the same geometry
+     */
+    std::string path;
+    int slots;
+    int slotSize;
+    /**
+     * permissions of the file if this process creates it, owner only by default. Any local user
+     * who can write the ring can send metrics in the name of this service
+     */
+    int mode;
+  };
+
+  /**
+   * Shared instance with default Options
+   */
+  static ShmSender* Instance();
+
+  explicit ShmSender(const Options& options);
+
+  /**
+   * Unmap the ring, metrics in it stay for the forwarder
+   */
+  ~ShmSender();
+
+  void Send(const std::string& message);
+  void Send(const char* message, size_t size);
+
+  /**
+   * Whether the ring could be opened, if not every metric is dropped
+   */
+  bool Healthy() const { return ring_ != NULL; }
+
+  /**
+   * Metrics this sender dropped, because the ring was full, the metric too long or the ring unavailable
+   */
+  int64 DroppedMetrics() const { return droppedMetrics_.load(std::memory_order_relaxed); }
+
+  /**
+   * The ring, NULL if it could not be opened
+   */
+  ShmRing* Ring() const { return ring_; }
+
+ private:
+  Options options_;
+  ShmRing* ring_;
+  std::atomic<int64> droppedMetrics_;
+  LogRateLimiter unhealthyLog_;
+
+  DISALLOW_COPY_AND_ASSIGN(ShmSender);
+};
+}
+}
@@ -0,0 +1,84 @@
+#include "./shm_sender.h"
+
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string>
+#include "base/testing/gtest.h"
+#include "./datagram_sink.h"
+#include "./non_blocking_sender.h"
+
+namespace base {
+namespace statsd {
+
+static ShmSender::Options ringAt(const std::string& path) {
+  ShmSender::Options options;
+  options.path = path;
+  options.slots = 1024;
+  options.slotSize = 64;
+  return options;
+}
+
+TEST(ShmSenderTest, ForwardsMetricsOfAnotherProcess) {
+  const int metrics = 5000;
+  std::string path = "/tmp/shm_sender_test." + std::to_string(getpid());
+  unlink(path.c_str());
+  ShmSender reader(ringAt(path));
+  ASSERT_TRUE(reader.Healthy());
+  ShmRing* ring = reader.Ring();
+
+  pid_t child = fork();
+  ASSERT_GE(child, 0);
+  if (child == 0) {
+    // the producer process, waits for room rather than overflowing so every metric arrives
+    ShmSender sender(ringAt(path));
+    for (int i = 0; i < metrics; i++) {
+      while (sender.Ring()->Size() == sender.Ring()->Capacity()) {
+        usleep(100);
+      }
+      sender.Send("shm.forwarded:1|c");
+    }
+    sender.Send(std::string(65, 'x'));
+    _exit(sender.DroppedMetrics() == 1 ? 0 : 1);
+  }
+
+  // what shm_forwarder does
+  DatagramSink sink;
+  NonBlockingSender::Options options;
+  options.host = "127.0.0.1";
+  options.port = sink.Port();
+  options.overflowPolicy = BLOCK;
+  NonBlockingSender forwarder(options);
+  int status = -1;
+  bool exited = false;
+  int forwarded = 0;
+  while (!exited || ring->Size() > 0) {
+    if (!exited) {
+      exited = waitpid(child, &status, WNOHANG) == child;
+    }
+    if (!ring->Consume([&forwarder](const char* data, size_t size) { forwarder.Send(data, size); })) {
+      usleep(100);
+      continue;
+    }
+    forwarded++;
+  }
+  ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ASSERT_EQ(forwarded, metrics);
+  ASSERT_EQ(ring->Claimed(), static_cast<uint64>(metrics));
+  ASSERT_EQ(ring->Overflows(), 1u);
+
+  for (int i = 0; i < 200 && sink.Counters()["shm.forwarded"] < metrics; i++) {
+    usleep(10 * 1000);
+  }
+  ASSERT_EQ(sink.Counters()["shm.forwarded"], metrics);
+  unlink(path.c_str());
+}
+
+TEST(ShmSenderTest, DropsEverythingWithoutARing) {
+  ShmSender sender(ringAt("/nonexistent/dir/statsd.ring"));
+  ASSERT_FALSE(sender.Healthy());
+  sender.Send("shm.lost:1|c");
+  sender.Send("shm.lost:1|c");
+  ASSERT_EQ(sender.DroppedMetrics(), 2);
+}
+}
+}
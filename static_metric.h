@@ -0,0 +1,301 @@
+#pragma once
+
+#include <stddef.h>
+#include "base/common/basic_types.h"
+#include "./abstract_sender.h"
+#include "./metric_formatter.h"
+#include "./non_blocking_sender.h"
+#include "./sampler.h"
+#if __cplusplus >= 202002L
+#include <utility>
+#endif
+
+/**
+ * Metrics whose namespace, key and tags are known at compile time. The whole "ns.key,tag=value:"
+ * prefix is a static constant, so sending only formats the value:
+ *
+ *   typedef StaticCounter<STATSD_STR("rpc"), STATSD_STR("requests"),
+ *                         StaticTag<STATSD_STR("dc"), STATSD_STR("sh")> > RpcRequests;
+ *   RpcRequests requests;
+ *   requests.Inc();
+ *
+ * or with C++20, statsd::Counter<"rpc", "requests", statsd::Tag<"dc", "sh">>.
+ *
+ * Names and values containing ',', '=', ':', '|' or a newline, empty keys and tags not sorted by
+ * name fail to compile. Tags must come sorted because that is how InfluxedStatsdClient renders
+ * them, so both report the same series. Static metrics go straight to the sender, they are
+ * never aggregated.
+ */
+
+/**
+ * A string literal of up to 64 characters as a statsd::Chars type
+ */
+#define STATSD_STR(s) ::base::statsd::TakeUntilNul< ::base::statsd::Chars<>, STATSD_CHARS_64(s, 0)>::type
+
+#define STATSD_CHARS_4(s, i) ::base::statsd::CharAt(s, (i)), ::base::statsd::CharAt(s, (i) + 1), \
+    ::base::statsd::CharAt(s, (i) + 2), ::base::statsd::CharAt(s, (i) + 3)
+#define STATSD_CHARS_16(s, i) STATSD_CHARS_4(s, i), STATSD_CHARS_4(s, (i) + 4), STATSD_CHARS_4(s, (i) + 8), \
+    STATSD_CHARS_4(s, (i) + 12)
+#define STATSD_CHARS_64(s, i) STATSD_CHARS_16(s, i), STATSD_CHARS_16(s, (i) + 16), STATSD_CHARS_16(s, (i) + 32), \
+    STATSD_CHARS_16(s, (i) + 48)
+
+namespace base {
+namespace statsd {
+
+static const size_t MAX_STATIC_STRING = 64;
+
+/**
+ * i-th character of a string literal, '\0' past its end. Strings longer than STATSD_STR takes
+ * hit the throw, which is not a constant expression and fails the compilation.
+ */
+template <size_t N>
+constexpr char CharAt(const char (&s)[N], size_t i) {
+  return N > MAX_STATIC_STRING + 1 ? throw "STATSD_STR takes at most 64 characters" : i < N ? s[i] : '\0';
+}
+
+/**
+ * A compile time string
+ */
+template <char... C>
+struct Chars {
+  static const size_t SIZE = sizeof...(C);
+  static constexpr char VALUE[sizeof...(C) + 1] = {C..., '\0'};
+};
+template <char... C>
+constexpr char Chars<C...>::VALUE[sizeof...(C) + 1];
+
+// Out followed by In up to its first '\0'
+template <typename Out, char... In>
+struct TakeUntilNul;
+template <char... Out>
+struct TakeUntilNul<Chars<Out...> > {
+  typedef Chars<Out...> type;
+};
+template <char... Out, char... Rest>
+struct TakeUntilNul<Chars<Out...>, '\0', Rest...> {
+  typedef Chars<Out...> type;
+};
+template <char... Out, char C, char... Rest>
+struct TakeUntilNul<Chars<Out...>, C, Rest...> {
+  typedef typename TakeUntilNul<Chars<Out..., C>, Rest...>::type type;
+};
+
+template <typename... Strings>
+struct Concat;
+template <>
+struct Concat<> {
+  typedef Chars<> type;
+};
+template <char... A>
+struct Concat<Chars<A...> > {
+  typedef Chars<A...> type;
+};
+template <char... A, char... B, typename... Rest>
+struct Concat<Chars<A...>, Chars<B...>, Rest...> {
+  typedef typename Concat<Chars<A..., B...>, Rest...>::type type;
+};
+
+/**
+ * Whether a string can go into a statsd line as a namespace, key, tag name or tag value
+ */
+template <typename String>
+struct ValidName;
+template <>
+struct ValidName<Chars<> > {
+  static const bool value = true;
+};
+template <char C, char... Rest>
+struct ValidName<Chars<C, Rest...> > {
+  static const bool value = C != ',' && C != '=' && C != ':' && C != '|' && C != '\n' &&
+      ValidName<Chars<Rest...> >::value;
+};
+
+// same order as std::string comparison, which compares unsigned chars
+constexpr bool NameLess(const char* a, const char* b) {
+  return *a == *b ? *a != '\0' && NameLess(a + 1, b + 1)
+                  : static_cast<unsigned char>(*a) < static_cast<unsigned char>(*b);
+}
+
+/**
+ * A tag of a static metric, both name and value made with STATSD_STR
+ */
+template <typename Name, typename Value>
+struct StaticTag {
+  static_assert(Name::SIZE > 0, "tag names can not be empty");
+  static_assert(ValidName<Name>::value, "tag names can not contain ',', '=', ':', '|' or a newline");
+  static_assert(ValidName<Value>::value, "tag values can not contain ',', '=', ':', '|' or a newline");
+  typedef Name NameType;
+  // ",name=value"
+  typedef typename Concat<Chars<','>, Name, Chars<'='>, Value>::type Rendered;
+};
+
+template <typename... Tags>
+struct SortedTags {
+  static const bool value = true;
+};
+template <typename A, typename B, typename... Rest>
+struct SortedTags<A, B, Rest...> {
+  static const bool value = NameLess(A::NameType::VALUE, B::NameType::VALUE) && SortedTags<B, Rest...>::value;
+};
+
+// "ns." or nothing for an empty namespace
+template <typename Ns>
+struct NsPrefix {
+  typedef typename Concat<Ns, Chars<'.'> >::type type;
+};
+template <>
+struct NsPrefix<Chars<> > {
+  typedef Chars<> type;
+};
+
+/**
+ * Shared by StaticCounter, StaticGauge and StaticTimer
+ */
+template <typename Ns, typename Name, typename... Tags>
+class StaticMetric {
+  static_assert(Name::SIZE > 0, "metric keys can not be empty");
+  static_assert(ValidName<Ns>::value, "namespaces can not contain ',', '=', ':', '|' or a newline");
+  static_assert(ValidName<Name>::value, "metric keys can not contain ',', '=', ':', '|' or a newline");
+  static_assert(SortedTags<Tags...>::value, "tags must be sorted by name, without repeated names");
+
+ public:
+  // "ns.key,tag=value"
+  typedef typename Concat<typename NsPrefix<Ns>::type, Name, typename Tags::Rendered...>::type KeyChars;
+  typedef typename Concat<KeyChars, Chars<':'> >::type Prefix;
+
+  /**
+   * Rendered key, ns + "." + key + tags
+   */
+  static const char* Key() { return KeyChars::VALUE; }
+
+ protected:
+  explicit StaticMetric(AbstractSender* sender) : sender_(sender) {}
+
+  template <size_t TYPE_SIZE>
+  void send(const char* value, size_t size, const char (&type)[TYPE_SIZE], float sampleRate) const {
+    // room for the longest sample rate too, longer lines would move to the heap
+    char buffer[Prefix::SIZE + MAX_NUMBER_SIZE * 2 + TYPE_SIZE + 2];
+    MetricFormatter line(buffer, sizeof(buffer));
+    line.Append(Prefix::VALUE, Prefix::SIZE);
+    line.Append(value, size);
+    line.Append('|');
+    line.Append(type, TYPE_SIZE - 1);
+    line.AppendSampleRate(sampleRate);
+    sender_->Send(line.Data(), line.Size());
+  }
+
+ protected:
+  AbstractSender* sender_;
+};
+
+/**
+ * Counter declared at compile time, see the top of this file
+ */
+template <typename Ns, typename Name, typename... Tags>
+class StaticCounter: public StaticMetric<Ns, Name, Tags...> {
+ public:
+  explicit StaticCounter(AbstractSender* sender = NonBlockingSender::Instance())
+      : StaticMetric<Ns, Name, Tags...>(sender) {}
+
+  /**
+   * Same as InfluxedStatsdClient::Count(key, value, sampleRate)
+   */
+  void Count(int64 value, float sampleRate = 1.0) const {
+    if (!Sampled(sampleRate)) {
+      return;
+    }
+    char buf[MAX_NUMBER_SIZE];
+    size_t size = FormatInt64(value, buf);
+    this->send(buf, size, "c", sampleRate);
+  }
+  void Inc(float sampleRate = 1.0) const { Count(1, sampleRate); }
+  void Dec(float sampleRate = 1.0) const { Count(-1, sampleRate); }
+};
+
+template <typename Ns, typename Name, typename... Tags>
+class StaticGauge: public StaticMetric<Ns, Name, Tags...> {
+ public:
+  explicit StaticGauge(AbstractSender* sender = NonBlockingSender::Instance())
+      : StaticMetric<Ns, Name, Tags...>(sender) {}
+
+  /**
+   * Same as InfluxedStatsdClient::Gauge(key, value, sampleRate)
+   */
+  void Set(double value, float sampleRate = 1.0) const {
+    if (!Sampled(sampleRate)) {
+      return;
+    }
+    char buf[MAX_NUMBER_SIZE];
+    size_t size = FormatG5(value, buf);
+    this->send(buf, size, "g", sampleRate);
+  }
+};
+
+template <typename Ns, typename Name, typename... Tags>
+class StaticTimer: public StaticMetric<Ns, Name, Tags...> {
+ public:
+  explicit StaticTimer(AbstractSender* sender = NonBlockingSender::Instance())
+      : StaticMetric<Ns, Name, Tags...>(sender) {}
+
+  /**
+   * Same as InfluxedStatsdClient::Time(key, ms, sampleRate)
+   */
+  void Time(int64 ms, float sampleRate = 1.0) const {
+    if (!Sampled(sampleRate)) {
+      return;
+    }
+    char buf[MAX_NUMBER_SIZE];
+    size_t size = FormatInt64(ms, buf);
+    this->send(buf, size, "ms", sampleRate);
+  }
+
+  /**
+   * Same as InfluxedStatsdClient::TimeMicros(key, us, sampleRate)
+   */
+  void TimeMicros(int64 us, float sampleRate = 1.0) const {
+    if (!Sampled(sampleRate)) {
+      return;
+    }
+    char buf[MAX_NUMBER_SIZE];
+    size_t size = FormatMicrosAsMillis(us, buf);
+    this->send(buf, size, "ms", sampleRate);
+  }
+};
+
+#if __cplusplus >= 202002L
+
+/**
+ * A string literal usable as a template argument
+ */
+template <size_t N>
+struct Literal {
+  constexpr Literal(const char (&s)[N]) {
+    for (size_t i = 0; i < N; i++) {
+      data[i] = s[i];
+    }
+  }
+  char data[N];
+};
+
+template <Literal S, typename Indexes>
+struct LiteralChars;
+template <Literal S, size_t... I>
+struct LiteralChars<S, std::index_sequence<I...> > {
+  typedef Chars<S.data[I]...> type;
+};
+template <Literal S>
+using Str = typename LiteralChars<S, std::make_index_sequence<sizeof(S.data) - 1> >::type;
+
+template <Literal Name, Literal Value>
+using Tag = StaticTag<Str<Name>, Str<Value> >;
+
+template <Literal Ns, Literal Key, typename... Tags>
+using Counter = StaticCounter<Str<Ns>, Str<Key>, Tags...>;
+template <Literal Ns, Literal Key, typename... Tags>
+using Gauge = StaticGauge<Str<Ns>, Str<Key>, Tags...>;
+template <Literal Ns, Literal Key, typename... Tags>
+using Timer = StaticTimer<Str<Ns>, Str<Key>, Tags...>;
+#endif
+}
+}
+// end namespace
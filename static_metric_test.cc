@@ -0,0 +1,97 @@
+#include "./static_metric.h"
+
+#include <string>
+#include <type_traits>
+#include "base/testing/gtest.h"
+#include "./dummy_sender.h"
+#include "./influxed_statsd_client.h"
+#include "./sampler.h"
+
+namespace base {
+namespace statsd {
+
+typedef StaticTag<STATSD_STR("dc"), STATSD_STR("sh")> DcTag;
+typedef StaticTag<STATSD_STR("host"), STATSD_STR("web01")> HostTag;
+typedef StaticCounter<STATSD_STR("rpc"), STATSD_STR("requests"), DcTag, HostTag> RpcRequests;
+typedef StaticGauge<STATSD_STR("rpc"), STATSD_STR("queue"), DcTag> RpcQueue;
+typedef StaticTimer<STATSD_STR("rpc"), STATSD_STR("latency")> RpcLatency;
+
+// rejected at compile time
+static_assert(!ValidName<STATSD_STR("a,b")>::value, "comma");
+static_assert(!ValidName<STATSD_STR("a|b")>::value, "pipe");
+static_assert(ValidName<STATSD_STR("a.b_c-d")>::value, "plain");
+static_assert(!SortedTags<HostTag, DcTag>::value, "unsorted");
+static_assert(!SortedTags<DcTag, StaticTag<STATSD_STR("dc"), STATSD_STR("bj")> >::value, "repeated");
+static_assert(SortedTags<StaticTag<STATSD_STR("d"), STATSD_STR("")>, DcTag>::value, "prefix first");
+static_assert(STATSD_STR("")::SIZE == 0, "empty");
+
+class StaticMetricTest: public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    FLAGS_statsd_client_side_sampling = false;
+  }
+  virtual void TearDown() {
+    FLAGS_statsd_client_side_sampling = true;
+  }
+  DummySender sender;
+};
+
+TEST_F(StaticMetricTest, RendersKeyAtCompileTime) {
+  ASSERT_EQ(std::string(RpcRequests::Key()), "rpc.requests,dc=sh,host=web01");
+  ASSERT_EQ(std::string(RpcRequests::Prefix::VALUE), "rpc.requests,dc=sh,host=web01:");
+  ASSERT_EQ(RpcRequests::Prefix::SIZE, sizeof("rpc.requests,dc=sh,host=web01:") - 1);
+  ASSERT_EQ(std::string(StaticCounter<STATSD_STR(""), STATSD_STR("requests")>::Key()), "requests");
+}
+
+TEST_F(StaticMetricTest, Counter) {
+  RpcRequests requests(&sender);
+  requests.Inc();
+  ASSERT_EQ(sender.message_, "rpc.requests,dc=sh,host=web01:1|c");
+  requests.Dec();
+  ASSERT_EQ(sender.message_, "rpc.requests,dc=sh,host=web01:-1|c");
+  requests.Count(42, 0.5);
+  ASSERT_EQ(sender.message_, "rpc.requests,dc=sh,host=web01:42|c|@0.5");
+}
+
+TEST_F(StaticMetricTest, GaugeAndTimer) {
+  RpcQueue(&sender).Set(3.25);
+  ASSERT_EQ(sender.message_, "rpc.queue,dc=sh:3.25|g");
+  RpcLatency latency(&sender);
+  latency.Time(12);
+  ASSERT_EQ(sender.message_, "rpc.latency:12|ms");
+  latency.TimeMicros(1250);
+  ASSERT_EQ(sender.message_, "rpc.latency:1.25|ms");
+}
+
+TEST_F(StaticMetricTest, SameLinesAsTheClient) {
+  InfluxedStatsdClient client = InfluxedStatsdClient(&sender).Ns("rpc").Tags({ {"host", "web01"}, {"dc", "sh"} });
+  client.Count("requests", 7, 0.25);
+  std::string expected = sender.message_;
+  RpcRequests(&sender).Count(7, 0.25);
+  ASSERT_EQ(sender.message_, expected);
+
+  InfluxedStatsdClient(&sender).Ns("rpc").Tags({ {"dc", "sh"} }).Gauge("queue", 0.1);
+  expected = sender.message_;
+  RpcQueue(&sender).Set(0.1);
+  ASSERT_EQ(sender.message_, expected);
+}
+
+TEST_F(StaticMetricTest, ClientSideSampling) {
+  FLAGS_statsd_client_side_sampling = true;
+  RpcRequests requests(&sender);
+  for (int i = 0; i < 1000; i++) {
+    requests.Inc(0.0);
+  }
+  ASSERT_TRUE(sender.messages_.empty());
+}
+
+#if __cplusplus >= 202002L
+TEST_F(StaticMetricTest, LiteralTemplateArguments) {
+  static_assert(std::is_same<Counter<"rpc", "requests", Tag<"dc", "sh">, Tag<"host", "web01">>, RpcRequests>::value,
+                "same type as the STATSD_STR spelling");
+  Timer<"rpc", "latency">(&sender).Time(3);
+  ASSERT_EQ(sender.message_, "rpc.latency:3|ms");
+}
+#endif
+}
+}  // namespace base
@@ -0,0 +1,138 @@
+#include "./tag_set.h"
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include "base/common/logging.h"
+
+namespace base {
+namespace statsd {
+DEFINE_int32(statsd_max_tag_sets, 100000,
+             "distinct tag sets interned for the life of the process, further ones are not shared");
+
+// independently locked shards of the table, so threads deriving different sets rarely meet
+static const size_t SHARDS = 64;
+static const size_t CACHE_LINE = 64;
+
+namespace {
+struct TagShard {
+  std::mutex mutex;
+  // by hash of the canonical tags
+  std::unordered_multimap<size_t, std::shared_ptr<const TagSet> > sets;
+  char pad[CACHE_LINE];
+};
+
+struct TagTable {
+  TagShard shards[SHARDS];
+  std::atomic<uint32> nextSetId;
+  // sets in every shard
+  std::atomic<size_t> interned;
+  std::atomic<bool> fullLogged;
+
+  TagTable() : nextSetId(0), interned(0), fullLogged(false) {}
+};
+}
+
+static TagTable& table() {
+  static TagTable* TABLE = new TagTable();
+  return *TABLE;
+}
+
+static size_t hashTags(const TAGS& tags) {
+  std::hash<std::string> hash;
+  size_t h = 0;
+  for (size_t i = 0; i < tags.size(); i++) {
+    // names and values hashed apart, so {a=b} and {b=a} differ
+    h = h * 31 + hash(tags[i].first);
+    h = h * 31 + hash(tags[i].second);
+  }
+  return h;
+}
+
+// sort by name and keep the last value given for each name
+static TAGS canonicalize(TAGS tags) {
+  std::stable_sort(tags.begin(), tags.end(), [](const TAG& a, const TAG& b) { return a.first < b.first; });
+  size_t kept = 0;
+  for (size_t i = 0; i < tags.size(); i++) {
+    if (i + 1 < tags.size() && tags[i + 1].first == tags[i].first) {
+      continue;
+    }
+    if (kept != i) {
+      tags[kept] = tags[i];
+    }
+    kept++;
+  }
+  tags.resize(kept);
+  return tags;
+}
+
+TagSet::TagSet(uint32 id, const TAGS& canonicalTags) : id_(id), tags_(canonicalTags) {
+  for (size_t i = 0; i < tags_.size(); i++) {
+    rendered_ += ",";
+    rendered_ += tags_[i].first;
+    rendered_ += "=";
+    rendered_ += tags_[i].second;
+  }
+}
+
+std::shared_ptr<const TagSet> TagSet::Empty() {
+  static std::shared_ptr<const TagSet>* EMPTY = new std::shared_ptr<const TagSet>(Of(TAGS()));
+  return *EMPTY;
+}
+
+std::shared_ptr<const TagSet> TagSet::Of(const TAGS& tags) {
+  return intern(canonicalize(tags));
+}
+
+std::shared_ptr<const TagSet> TagSet::intern(const TAGS& canonical) {
+  TagTable* t = &table();
+  size_t hash = hashTags(canonical);
+  TagShard* shard = &t->shards[hash % SHARDS];
+  std::lock_guard<std::mutex> lock(shard->mutex);
+  auto range = shard->sets.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second->Tags() == canonical) {
+      return it->second;
+    }
+  }
+
+  // id 0 is the empty set
+  std::shared_ptr<const TagSet> set(new TagSet(canonical.empty() ? 0 : ++t->nextSetId, canonical));
+  // reserve a place in the table, shards fill it concurrently
+  if (t->interned.fetch_add(1) >= static_cast<size_t>(FLAGS_statsd_max_tag_sets) && !canonical.empty()) {
+    t->interned.fetch_sub(1);
+    if (!t->fullLogged.exchange(true)) {
+      LOG(ERROR) << "More than " << FLAGS_statsd_max_tag_sets << " distinct tag sets, are tag values unbounded? "
+                 << "Further tag sets are not interned, e.g. " << set->Rendered();
+    }
+    return set;
+  }
+  shard->sets.insert(std::make_pair(hash, set));
+  return set;
+}
+
+std::shared_ptr<const TagSet> TagSet::With(const TAG& tag) const {
+  // already sorted, so only the new tag needs a place
+  TAGS tags;
+  tags.reserve(tags_.size() + 1);
+  size_t i = 0;
+  for (; i < tags_.size() && tags_[i].first < tag.first; i++) {
+    tags.push_back(tags_[i]);
+  }
+  tags.push_back(tag);
+  if (i < tags_.size() && tags_[i].first == tag.first) {
+    i++;
+  }
+  for (; i < tags_.size(); i++) {
+    tags.push_back(tags_[i]);
+  }
+  return intern(tags);
+}
+
+size_t TagSet::Interned() {
+  return table().interned.load();
+}
+}
+}
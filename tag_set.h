@@ -0,0 +1,77 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "base/common/basic_types.h"
+#include "base/common/gflags.h"
+
+namespace base {
+
+typedef std::pair<std::string, std::string> TAG;
+typedef std::vector<TAG> TAGS;
+
+namespace statsd {
+DECLARE_int32(statsd_max_tag_sets);
+
+/**
+ * Immutable, canonical set of influxdb tags: sorted by tag name and holding one value per name,
+ * the last one given. Its ",name=value,..." rendering is computed once and shared.
+ *
+ * Sets are interned in a process wide table: equal sets, whatever the order their tags came in,
+ * are one and the same object with one Id(), which gives aggregation and hashing a cheap series
+ * identity. The table is split in shards locked apart, picked by a hash of the tags, so threads
+ * deriving sets rarely wait on each other, and a lookup compares the tags of the set it finds.
+ * Interned sets live as long as the process, so past --statsd_max_tag_sets distinct sets new ones
+ * are built standalone instead, with an id of their own but shared by nobody.
+ *
+ * Thread safe. Looking a set up or building one locks one shard, using one takes no lock.
+ */
+class TagSet {
+ public:
+  /**
+   * The empty set, Id() 0
+   */
+  static std::shared_ptr<const TagSet> Empty();
+
+  /**
+   * Canonical set of tags, in any order, later duplicates of a name win
+   */
+  static std::shared_ptr<const TagSet> Of(const TAGS& tags);
+
+  /**
+   * This set plus tag, which replaces any tag of the same name
+   */
+  std::shared_ptr<const TagSet> With(const TAG& tag) const;
+
+  uint32 Id() const { return id_; }
+
+  /**
+   * Tags sorted by name
+   */
+  const TAGS& Tags() const { return tags_; }
+
+  /**
+   * ",name=value" for every tag, "" for the empty set
+   */
+  const std::string& Rendered() const { return rendered_; }
+
+  /**
+   * Number of distinct sets in the table
+   */
+  static size_t Interned();
+
+ private:
+  TagSet(uint32 id, const TAGS& canonicalTags);
+  static std::shared_ptr<const TagSet> intern(const TAGS& canonicalTags);
+
+ private:
+  uint32 id_;
+  TAGS tags_;
+  std::string rendered_;
+
+  DISALLOW_COPY_AND_ASSIGN(TagSet);
+};
+}
+}
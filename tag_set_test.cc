@@ -0,0 +1,97 @@
+#include "./tag_set.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+TEST(TagSetTest, EmptySet) {
+  ASSERT_EQ(TagSet::Empty()->Id(), 0u);
+  ASSERT_EQ(TagSet::Empty()->Rendered(), "");
+  ASSERT_EQ(TagSet::Of(TAGS()), TagSet::Empty());
+}
+
+TEST(TagSetTest, CanonicalOrder) {
+  std::shared_ptr<const TagSet> set = TagSet::Of({ {"host", "web01"}, {"dc", "sh"}, {"az", "1"} });
+  ASSERT_EQ(set->Rendered(), ",az=1,dc=sh,host=web01");
+  ASSERT_EQ(set->Tags().front().first, "az");
+  ASSERT_NE(set->Id(), 0u);
+
+  // interned: any order gives the very same set
+  std::shared_ptr<const TagSet> same = TagSet::Of({ {"dc", "sh"}, {"az", "1"}, {"host", "web01"} });
+  ASSERT_EQ(same, set);
+  ASSERT_EQ(same->Id(), set->Id());
+  ASSERT_NE(TagSet::Of({ {"dc", "bj"}, {"az", "1"}, {"host", "web01"} })->Id(), set->Id());
+}
+
+TEST(TagSetTest, LastValueWins) {
+  ASSERT_EQ(TagSet::Of({ {"dc", "sh"}, {"host", "a"}, {"dc", "bj"} })->Rendered(), ",dc=bj,host=a");
+  std::shared_ptr<const TagSet> set = TagSet::Of({ {"dc", "sh"} });
+  ASSERT_EQ(set->With({"dc", "bj"})->Rendered(), ",dc=bj");
+  ASSERT_EQ(set->With({"az", "1"}), TagSet::Of({ {"az", "1"}, {"dc", "sh"} }));
+  // the set itself never changes
+  ASSERT_EQ(set->Rendered(), ",dc=sh");
+}
+
+TEST(TagSetTest, NamesAndValuesDoNotMix) {
+  ASSERT_NE(TagSet::Of({ {"a", "b"} }), TagSet::Of({ {"b", "a"} }));
+  ASSERT_NE(TagSet::Of({ {"a", "b"}, {"c", "d"} }), TagSet::Of({ {"a", "d"}, {"c", "b"} }));
+}
+
+TEST(TagSetTest, StopsInterningPastTheLimit) {
+  int32 limit = FLAGS_statsd_max_tag_sets;
+  TagSet::Of({ {"limit", "before"} });
+  FLAGS_statsd_max_tag_sets = TagSet::Interned();
+  std::shared_ptr<const TagSet> first = TagSet::Of({ {"limit", "after"} });
+  std::shared_ptr<const TagSet> second = TagSet::Of({ {"limit", "after"} });
+  // still usable, with distinct ids, just not shared
+  ASSERT_EQ(first->Rendered(), ",limit=after");
+  ASSERT_NE(first, second);
+  ASSERT_NE(first->Id(), second->Id());
+  ASSERT_EQ(TagSet::Interned(), static_cast<size_t>(FLAGS_statsd_max_tag_sets));
+  // known sets are still found
+  ASSERT_EQ(TagSet::Of({ {"limit", "before"} }), TagSet::Of({ {"limit", "before"} }));
+  FLAGS_statsd_max_tag_sets = limit;
+}
+
+TEST(TagSetTest, ConcurrentInterning) {
+  std::vector<std::thread> threads;
+  std::vector<std::vector<uint32> > ids(8);
+  for (size_t t = 0; t < ids.size(); t++) {
+    threads.push_back(std::thread([t, &ids]() {
+      for (int i = 0; i < 1000; i++) {
+        std::string value = std::to_string(i);
+        ids[t].push_back(TagSet::Of({ {"concurrent", value}, {"t", "x"} })->Id());
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+  for (size_t t = 1; t < ids.size(); t++) {
+    ASSERT_EQ(ids[t], ids[0]);
+  }
+}
+
+TEST(TagSetTest, LimitHoldsAcrossShards) {
+  int32 limit = FLAGS_statsd_max_tag_sets;
+  FLAGS_statsd_max_tag_sets = TagSet::Interned() + 100;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; t++) {
+    threads.push_back(std::thread([t]() {
+      for (int i = 0; i < 50; i++) {
+        TagSet::Of({ {"shards", std::to_string(t * 50 + i)} });
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++) {
+    threads[t].join();
+  }
+  ASSERT_EQ(TagSet::Interned(), static_cast<size_t>(FLAGS_statsd_max_tag_sets));
+  FLAGS_statsd_max_tag_sets = limit;
+}
+}
+}  // namespace base
@@ -0,0 +1,386 @@
+#include "./tcp_sender.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "base/common/closure.h"
+#include "base/common/gflags.h"
+#include "base/common/logging.h"
+#include "./metric_packer.h"
+#include "./sampler.h"
+
+namespace base {
+namespace statsd {
+DECLARE_int32(statsd_max_metric_size);
+DECLARE_int32(statsd_error_log_interval_ms);
+
+DEFINE_int32(statsd_tcp_queue_capacity, 65536, "max metrics waiting for the tcp connection, further ones are dropped");
+DEFINE_int32(statsd_tcp_max_write_bytes, 256 * 1024, "max bytes the tcp sender coalesces into one batch");
+DEFINE_int32(statsd_tcp_reconnect_min_ms, 100, "first delay before reconnecting a broken tcp connection");
+DEFINE_int32(statsd_tcp_reconnect_max_ms, 10000, "max delay between two tcp reconnect attempts");
+DEFINE_int32(statsd_tcp_connect_timeout_ms, 1000, "tcp connect timeout");
+DEFINE_int32(statsd_tcp_close_timeout_ms, 1000, "how long a closing tcp sender keeps sending what is queued");
+
+// Batches are packed into chunks of this size, each chunk is one iovec plus one for its newline
+static const size_t CHUNK_SIZE = 16 * 1024;
+static const int MAX_IOVECS = 64;
+// The worker checks for shutdown at least this often
+static const int MAX_PARK_MS = 100;
+static const char NEWLINE = '\n';
+
+static int64 nowMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+TcpSender::Options::Options() {
+  host = FLAGS_statsd_host;
+  port = FLAGS_statsd_port;
+  queueCapacity = FLAGS_statsd_tcp_queue_capacity;
+  maxMetricSize = FLAGS_statsd_max_metric_size;
+  maxWriteBytes = FLAGS_statsd_tcp_max_write_bytes;
+  reconnectMinMs = FLAGS_statsd_tcp_reconnect_min_ms;
+  reconnectMaxMs = FLAGS_statsd_tcp_reconnect_max_ms;
+  connectTimeoutMs = FLAGS_statsd_tcp_connect_timeout_ms;
+  closeTimeoutMs = FLAGS_statsd_tcp_close_timeout_ms;
+  resolver = ResolveHost;
+  outputFormat = STATSD;
+  if (!ParseOutputFormat(FLAGS_statsd_output_format, &outputFormat)) {
+    LOG(ERROR) << "Unknown statsd_output_format " << FLAGS_statsd_output_format << ", fall back to statsd";
+  }
+}
+
+TcpSender::TcpSender(const Options& options)
+    : options_(options), stopping_(false), metricQueue_(options.queueCapacity, options.maxMetricSize),
+      sock_(-1), reconnectAttempts_(0), reconnectDelayMs_(0), workerParked_(false), connected_(false), connects_(0),
+      sentLines_(0), sentBytes_(0), partialWrites_(0), droppedMetrics_(0),
+      errorLog_(FLAGS_statsd_error_log_interval_ms) {
+  errmsg_[0] = '\0';
+  worker_.Start(::NewCallback(this, &TcpSender::working));
+}
+
+TcpSender::~TcpSender() {
+  Stop();
+}
+
+void TcpSender::Stop() {
+  if (stopping_.exchange(true)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(wakeupMutex_);
+    wakeup_.notify_one();
+  }
+  worker_.Join();
+}
+
+void TcpSender::Send(const std::string& message) {
+  Send(message.data(), message.size());
+}
+
+void TcpSender::Send(const char* message, size_t size) {
+  if (!metricQueue_.TryPush(message, size)) {
+    droppedMetrics_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (workerParked_.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(wakeupMutex_);
+    wakeup_.notify_one();
+  }
+}
+
+void TcpSender::waitForMetrics(int timeoutMs) {
+  if (!metricQueue_.Empty() || stopping_.load()) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(wakeupMutex_);
+  workerParked_.store(true);
+  // pairs with the fence in Send(): either we see the new metric or the producer sees us parked
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (metricQueue_.Empty() && !stopping_.load()) {
+    wakeup_.wait_for(lock, std::chrono::milliseconds(timeoutMs));
+  }
+  workerParked_.store(false);
+}
+
+void TcpSender::working() {
+  MetricPacker batch(CHUNK_SIZE);
+  LineProtocolEncoder points;
+  LineProtocolEncoder* encoder = options_.outputFormat == LINE_PROTOCOL ? &points : NULL;
+  Cursor cursor = {0, 0};
+  bool pending = false;
+  int64 nextConnectMs = 0;
+  int64 stableAtMs = 0;
+  int64 closeDeadlineMs = 0;
+  while (true) {
+    if (stopping_.load()) {
+      if (closeDeadlineMs == 0) {
+        closeDeadlineMs = nowMillis() + options_.closeTimeoutMs;
+      }
+      if ((!pending && metricQueue_.Empty()) || nowMillis() >= closeDeadlineMs) {
+        break;
+      }
+    }
+
+    if (sock_ < 0) {
+      int64 wait = nextConnectMs - nowMillis();
+      if (wait > 0) {
+        std::unique_lock<std::mutex> lock(wakeupMutex_);
+        wakeup_.wait_for(lock, std::chrono::milliseconds(std::min<int64>(wait, MAX_PARK_MS)));
+        continue;
+      }
+      if (!connectSocket()) {
+        nextConnectMs = nextReconnectMs();
+        int64 suppressed = 0;
+        if (errorLog_.Allow(&suppressed)) {
+          LOG(ERROR) << "Fail to connect statsd tcp " << options_.host << ":" << options_.port << ", retry in "
+                     << nextConnectMs - nowMillis() << "ms. Error message: " << errmsg_ << " (" << suppressed
+                     << " similar errors suppressed)";
+        }
+        continue;
+      }
+      stableAtMs = nowMillis() + reconnectDelayMs_;
+    }
+
+    if (!pending) {
+      waitForMetrics(MAX_PARK_MS);
+      if (encoder != NULL) {
+        encoder->StartBatch();
+      }
+      int64 unencoded = 0;
+      while (batch.Size() * CHUNK_SIZE < static_cast<size_t>(options_.maxWriteBytes) &&
+             metricQueue_.Consume([&batch, encoder, &unencoded](const char* data, size_t size) {
+               if (encoder == NULL) {
+                 batch.Add(data, size);
+               } else if (encoder->Encode(data, size)) {
+                 batch.Add(encoder->Data(), encoder->Size());
+               } else {
+                 unencoded++;
+               }
+             })) {
+      }
+      if (unencoded > 0) {
+        droppedMetrics_.fetch_add(unencoded, std::memory_order_relaxed);
+      }
+      batch.Finish();
+      if (batch.Size() == 0) {
+        continue;
+      }
+      pending = true;
+      cursor.packet = 0;
+      cursor.offset = 0;
+      // a server which went away while we were idle is only noticed by reading
+      if (peerClosed()) {
+        disconnect("connection closed by peer");
+        nextConnectMs = nextReconnectMs();
+        continue;
+      }
+    }
+
+    if (!writeBatch(batch, &cursor)) {
+      rewindToLine(batch, &cursor);
+      disconnect(errmsg_);
+      nextConnectMs = nextReconnectMs();
+      continue;
+    }
+    if (cursor.packet == batch.Size()) {
+      // the connection works, rather than accepting what it drops a moment later
+      if (reconnectAttempts_ > 0 && nowMillis() >= stableAtMs) {
+        reconnectAttempts_ = 0;
+        reconnectDelayMs_ = 0;
+      }
+      sentLines_.fetch_add(batch.Metrics(), std::memory_order_relaxed);
+      batch.Clear();
+      pending = false;
+    }
+  }
+  // the close timeout ran out, what did not make it is dropped
+  int64 abandoned = 0;
+  if (pending) {
+    size_t written = completeLines(batch, cursor);
+    sentLines_.fetch_add(written, std::memory_order_relaxed);
+    abandoned += batch.Metrics() - written;
+  }
+  while (metricQueue_.Consume([](const char*, size_t) {})) {
+    abandoned++;
+  }
+  if (abandoned > 0) {
+    droppedMetrics_.fetch_add(abandoned, std::memory_order_relaxed);
+    LOG(ERROR) << "Fail to send " << abandoned << " metrics to statsd tcp " << options_.host << ":" << options_.port
+               << " within " << options_.closeTimeoutMs << "ms of closing";
+  }
+  if (sock_ >= 0) {
+    close(sock_);
+    sock_ = -1;
+    connected_.store(false);
+  }
+}
+
+bool TcpSender::connectSocket() {
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_port = htons(options_.port);
+  std::string error;
+  if (!options_.resolver(options_.host, &server.sin_addr, &error)) {
+    snprintf(errmsg_, sizeof(errmsg_), "%s", error.c_str());
+    return false;
+  }
+
+  int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (sock < 0) {
+    snprintf(errmsg_, sizeof(errmsg_), "could not create socket, err=%m");
+    return false;
+  }
+  fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+  // batches are already coalesced, no need for Nagle to wait for more
+  int one = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  int ret = connect(sock, (struct sockaddr*) &server, sizeof(server));
+  if (ret != 0 && errno == EINPROGRESS) {
+    struct pollfd pfd = {sock, POLLOUT, 0};
+    ret = poll(&pfd, 1, options_.connectTimeoutMs);
+    if (ret == 0) {
+      errno = ETIMEDOUT;
+      ret = -1;
+    } else if (ret > 0) {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &len);
+      errno = err;
+      ret = err == 0 ? 0 : -1;
+    }
+  }
+  if (ret != 0) {
+    snprintf(errmsg_, sizeof(errmsg_), "connect fail, err=%m");
+    close(sock);
+    return false;
+  }
+
+  sock_ = sock;
+  connects_.fetch_add(1, std::memory_order_relaxed);
+  connected_.store(true);
+  return true;
+}
+
+int64 TcpSender::nextReconnectMs() {
+  reconnectDelayMs_ = std::min<int64>(options_.reconnectMaxMs,
+                                      static_cast<int64>(options_.reconnectMinMs) << std::min(reconnectAttempts_, 20));
+  reconnectAttempts_++;
+  // jitter, so a fleet does not reconnect in lockstep after the server restarts
+  return nowMillis() + reconnectDelayMs_ / 2 + static_cast<int64>(NextRandom() % (reconnectDelayMs_ / 2 + 1));
+}
+
+void TcpSender::disconnect(const char* why) {
+  int64 suppressed = 0;
+  if (errorLog_.Allow(&suppressed)) {
+    LOG(ERROR) << "Statsd tcp connection to " << options_.host << ":" << options_.port << " broken: " << why
+               << " (" << suppressed << " similar errors suppressed)";
+  }
+  close(sock_);
+  sock_ = -1;
+  connected_.store(false);
+}
+
+bool TcpSender::peerClosed() {
+  char byte;
+  ssize_t ret = recv(sock_, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+bool TcpSender::writeBatch(const MetricPacker& batch, Cursor* cursor) {
+  while (cursor->packet < batch.Size()) {
+    struct iovec iov[MAX_IOVECS];
+    int count = 0;
+    size_t requested = 0;
+    for (size_t p = cursor->packet; p < batch.Size() && count + 2 <= MAX_IOVECS; p++) {
+      const std::string& packet = batch.Packet(p);
+      size_t offset = p == cursor->packet ? cursor->offset : 0;
+      if (offset < packet.size()) {
+        iov[count].iov_base = const_cast<char*>(packet.data() + offset);
+        iov[count].iov_len = packet.size() - offset;
+        requested += iov[count++].iov_len;
+      }
+      iov[count].iov_base = const_cast<char*>(&NEWLINE);
+      iov[count].iov_len = 1;
+      requested += iov[count++].iov_len;
+    }
+
+    // writev, but without SIGPIPE on a broken connection
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    ssize_t ret = sendmsg(sock_, &msg, MSG_NOSIGNAL);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        // socket buffer full, wait a bit and let the worker check for shutdown
+        struct pollfd pfd = {sock_, POLLOUT, 0};
+        poll(&pfd, 1, MAX_PARK_MS);
+        return true;
+      }
+      snprintf(errmsg_, sizeof(errmsg_), "sendmsg fail, err=%m");
+      return false;
+    }
+    if (static_cast<size_t>(ret) < requested) {
+      partialWrites_.fetch_add(1, std::memory_order_relaxed);
+    }
+    sentBytes_.fetch_add(ret, std::memory_order_relaxed);
+
+    size_t written = ret;
+    while (written > 0) {
+      size_t remaining = batch.Packet(cursor->packet).size() - cursor->offset + 1;
+      if (written >= remaining) {
+        written -= remaining;
+        cursor->packet++;
+        cursor->offset = 0;
+      } else {
+        cursor->offset += written;
+        written = 0;
+      }
+    }
+  }
+  return true;
+}
+
+void TcpSender::rewindToLine(const MetricPacker& batch, Cursor* cursor) {
+  if (cursor->packet >= batch.Size() || cursor->offset == 0) {
+    return;
+  }
+  // back to the start of the line being written, a line is complete once its newline is out
+  const std::string& packet = batch.Packet(cursor->packet);
+  size_t end = std::min(cursor->offset, packet.size());
+  size_t newline = packet.rfind(NEWLINE, end - 1);
+  cursor->offset = newline == std::string::npos ? 0 : newline + 1;
+}
+
+size_t TcpSender::completeLines(const MetricPacker& batch, const Cursor& cursor) {
+  size_t lines = 0;
+  for (size_t p = 0; p < cursor.packet && p < batch.Size(); p++) {
+    const std::string& packet = batch.Packet(p);
+    // the newline written after the packet ends its last line
+    lines += std::count(packet.begin(), packet.end(), NEWLINE) + 1;
+  }
+  if (cursor.packet < batch.Size()) {
+    const std::string& packet = batch.Packet(cursor.packet);
+    lines += std::count(packet.begin(), packet.begin() + std::min(cursor.offset, packet.size()), NEWLINE);
+  }
+  return lines;
+}
+}
+}
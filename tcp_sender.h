@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include "base/common/basic_types.h"
+#include "base/thread/thread.h"
+#include "./abstract_sender.h"
+#include "./line_protocol.h"
+#include "./log_rate_limiter.h"
+#include "./metric_ring.h"
+#include "./non_blocking_sender.h"
+
+namespace base {
+namespace statsd {
+
+class MetricPacker;
+
+/**
+ * Sends newline delimited metrics over a TCP connection, for metrics which must not be lost
+ * on the way, e.g. billing counters.
+ *
+ * Send() only copies the metric into a bounded queue, like NonBlockingSender, and drops it if the
+ * queue is full. A worker thread coalesces queued metrics into batches of up to maxWriteBytes and
+ * writes each batch with as few gather writes as the socket accepts, resuming partial writes.
+ * While disconnected metrics wait in the queue, and the worker reconnects with exponential
+ * backoff, whether connecting failed or a connection broke. The backoff only starts over once a
+ * batch was written on a connection which outlived the delay before it, so a server which accepts
+ * connections and resets them is not hammered. After a broken connection the batch is resent from
+ * the first line which was not completely written, so a line is never split across connections,
+ * though lines the kernel accepted just before the connection broke may be lost or, rarely, sent
+ * twice.
+ *
+ * Thread safe.
+ */
+class TcpSender: public AbstractSender {
+ public:
+  struct Options {
+    /**
+     * Defaults from --statsd_host, --statsd_port and the --statsd_tcp_* flags
+     */
+    Options();
+
+    std::string host;
+    int port;
+    int queueCapacity;
+    int maxMetricSize;
+    /**
+     * max bytes coalesced into one batch
+     */
+    int maxWriteBytes;
+    /**
+     * reconnect delays double from min to max, with jitter
+     */
+    int reconnectMinMs;
+    int reconnectMaxMs;
+    int connectTimeoutMs;
+    /**
+     * how long the destructor keeps trying to send what is queued
+     */
+    int closeTimeoutMs;
+    HostResolver resolver;
+    /**
+     * statsd lines, or InfluxDB line protocol points for a line protocol socket listener
+     */
+    OutputFormat outputFormat;
+  };
+
+  explicit TcpSender(const Options& options);
+  ~TcpSender();
+
+  /**
+   * Send what is queued for up to closeTimeoutMs, count whatever is left as dropped, and join the
+   * worker, so the counters are final. Nothing may be sent afterwards. Idempotent, the destructor
+   * calls it.
+   */
+  void Stop();
+
+  void Send(const std::string& message);
+  void Send(const char* message, size_t size);
+
+  bool Connected() const { return connected_.load(std::memory_order_relaxed); }
+  /**
+   * Successful connects so far, the first one included
+   */
+  int64 Connects() const { return connects_.load(std::memory_order_relaxed); }
+  int64 SentLines() const { return sentLines_.load(std::memory_order_relaxed); }
+  int64 SentBytes() const { return sentBytes_.load(std::memory_order_relaxed); }
+  /**
+   * Writes the socket only took part of
+   */
+  int64 PartialWrites() const { return partialWrites_.load(std::memory_order_relaxed); }
+  /**
+   * Metrics rejected by Send() because the queue was full or the metric longer than maxMetricSize,
+   * not sent because they did not convert to the output format, or still queued or partly written
+   * when closeTimeoutMs ran out
+   */
+  int64 DroppedMetrics() const { return droppedMetrics_.load(std::memory_order_relaxed); }
+  size_t QueueCapacity() const { return metricQueue_.Capacity(); }
+  size_t QueueSize() const { return metricQueue_.Size(); }
+
+ private:
+  // position in the batch being written: packet, then offset in it, size() meaning its newline
+  struct Cursor {
+    size_t packet;
+    size_t offset;
+  };
+
+  void working();
+  void waitForMetrics(int timeoutMs);
+  bool connectSocket();
+  void disconnect(const char* why);
+  bool peerClosed();
+  bool writeBatch(const MetricPacker& batch, Cursor* cursor);
+  void rewindToLine(const MetricPacker& batch, Cursor* cursor);
+  // lines of batch written up to and including their newline
+  static size_t completeLines(const MetricPacker& batch, const Cursor& cursor);
+  // when to try connecting again, exponential in reconnectAttempts_ with jitter
+  int64 nextReconnectMs();
+
+ private:
+  Options options_;
+  thread::Thread worker_;
+  std::atomic<bool> stopping_;
+  MetricRing metricQueue_;
+
+  // worker only
+  int sock_;
+  // failed connects and broken connections since the last stable one, and the last delay
+  int reconnectAttempts_;
+  int64 reconnectDelayMs_;
+  char errmsg_[256];
+
+  std::mutex wakeupMutex_;
+  std::condition_variable wakeup_;
+  std::atomic<bool> workerParked_;
+
+  std::atomic<bool> connected_;
+  std::atomic<int64> connects_;
+  std::atomic<int64> sentLines_;
+  std::atomic<int64> sentBytes_;
+  std::atomic<int64> partialWrites_;
+  std::atomic<int64> droppedMetrics_;
+
+  LogRateLimiter errorLog_;
+
+  DISALLOW_COPY_AND_ASSIGN(TcpSender);
+};
+}
+}
@@ -0,0 +1,179 @@
+#include "./tcp_sender.h"
+
+#include <unistd.h>
+#include <memory>
+#include <string>
+#include "base/testing/gtest.h"
+#include "./tcp_sink.h"
+
+namespace base {
+namespace statsd {
+
+static TcpSender::Options toSink(int port) {
+  TcpSender::Options options;
+  options.host = "127.0.0.1";
+  options.port = port;
+  options.queueCapacity = 1 << 20;
+  options.reconnectMinMs = 10;
+  options.reconnectMaxMs = 100;
+  return options;
+}
+
+// until the sink has got lines, or 5s went by
+static void waitForLines(const TcpSink& sink, int64 lines) {
+  for (int i = 0; i < 500 && sink.Lines() < lines; i++) {
+    usleep(10 * 1000);
+  }
+}
+
+TEST(TcpSenderTest, DeliversEveryMetric) {
+  const int metrics = 200000;
+  TcpSink sink;
+  TcpSender sender(toSink(sink.Port()));
+  for (int i = 0; i < metrics; i++) {
+    sender.Send(i % 2 == 0 ? "tcp.even:1|c" : "tcp.odd,tag=v:3|c");
+  }
+  waitForLines(sink, metrics);
+  ASSERT_EQ(sender.DroppedMetrics(), 0);
+  ASSERT_EQ(sink.Lines(), metrics);
+  ASSERT_EQ(sink.MalformedLines(), 0);
+  ASSERT_EQ(sink.Counters()["tcp.even"], metrics / 2);
+  ASSERT_EQ(sink.Counters()["tcp.odd,tag=v"], 3 * metrics / 2);
+  ASSERT_EQ(sender.Connects(), 1);
+  ASSERT_EQ(sink.Connections(), 1);
+}
+
+TEST(TcpSenderTest, LineProtocolPoints) {
+  const int metrics = 10000;
+  TcpSink sink;
+  TcpSender::Options options = toSink(sink.Port());
+  options.outputFormat = LINE_PROTOCOL;
+  TcpSender sender(options);
+  for (int i = 0; i < metrics; i++) {
+    sender.Send("tcp.points,tag=v:3|c");
+  }
+  waitForLines(sink, metrics);
+  ASSERT_EQ(sink.Lines(), metrics);
+  ASSERT_EQ(sink.MalformedLines(), 0);
+  ASSERT_EQ(sink.Counters()["tcp.points,tag=v"], 3 * metrics);
+  ASSERT_EQ(sender.DroppedMetrics(), 0);
+}
+
+TEST(TcpSenderTest, ResumesPartialWrites) {
+  const int metrics = 500000;
+  TcpSink sink;
+  sink.Pause(true);
+  TcpSender sender(toSink(sink.Port()));
+  // several MB, far more than the socket buffers hold
+  std::string metric = "tcp.partial,host=web01,dc=sh,service=billing:1|c";
+  for (int i = 0; i < metrics; i++) {
+    sender.Send(metric);
+  }
+  for (int i = 0; i < 500 && sender.PartialWrites() == 0; i++) {
+    usleep(10 * 1000);
+  }
+  sink.Pause(false);
+  waitForLines(sink, metrics);
+  ASSERT_GT(sender.PartialWrites(), 0);
+  ASSERT_EQ(sink.Lines(), metrics);
+  ASSERT_EQ(sink.MalformedLines(), 0);
+  ASSERT_EQ(sink.Counters()["tcp.partial,host=web01,dc=sh,service=billing"], metrics);
+}
+
+TEST(TcpSenderTest, QueuesWhileDisconnectedAndReconnects) {
+  int port = 0;
+  {
+    // grab a free port, nobody listens there once the sink is gone
+    TcpSink probe;
+    port = probe.Port();
+  }
+  TcpSender sender(toSink(port));
+  for (int i = 0; i < 1000; i++) {
+    sender.Send("tcp.queued:1|c");
+  }
+  usleep(100 * 1000);
+  ASSERT_FALSE(sender.Connected());
+  ASSERT_EQ(sender.QueueSize() + sender.SentLines(), 1000u);
+
+  TcpSink sink(port);
+  waitForLines(sink, 1000);
+  ASSERT_TRUE(sender.Connected());
+  ASSERT_EQ(sink.Counters()["tcp.queued"], 1000);
+
+  // the server goes away, later metrics reach the next connection
+  sink.DropConnections();
+  usleep(50 * 1000);
+  for (int i = 0; i < 1000; i++) {
+    sender.Send("tcp.after:1|c");
+  }
+  waitForLines(sink, 2000);
+  ASSERT_EQ(sender.Connects(), 2);
+  ASSERT_EQ(sink.Counters()["tcp.after"], 1000);
+  ASSERT_EQ(sink.MalformedLines(), 0);
+}
+
+TEST(TcpSenderTest, BacksOffFromAServerResettingConnections) {
+  TcpSink sink;
+  sink.RejectConnections(true);
+  TcpSender::Options options = toSink(sink.Port());
+  options.reconnectMaxMs = 10000;
+  TcpSender sender(options);
+  for (int i = 0; i < 50; i++) {
+    sender.Send("tcp.rejected:1|c");
+    usleep(10 * 1000);
+  }
+  // delays of 10, 20, 40... with jitter, reconnecting after each 10ms made 50
+  ASSERT_GE(sink.Connections(), 2);
+  ASSERT_LE(sink.Connections(), 10);
+
+  // lines written to a connection reset a moment later are lost, later ones get through
+  sink.RejectConnections(false);
+  for (int i = 0; i < 10; i++) {
+    sender.Send("tcp.accepted:1|c");
+  }
+  for (int i = 0; i < 500 && sink.Counters()["tcp.accepted"] < 10; i++) {
+    usleep(10 * 1000);
+  }
+  ASSERT_EQ(sink.Counters()["tcp.accepted"], 10);
+  ASSERT_TRUE(sender.Connected());
+}
+
+TEST(TcpSenderTest, FlushesQueueOnClose) {
+  TcpSink sink;
+  {
+    TcpSender sender(toSink(sink.Port()));
+    for (int i = 0; i < 10000; i++) {
+      sender.Send("tcp.close:1|c");
+    }
+  }
+  waitForLines(sink, 10000);
+  ASSERT_EQ(sink.Counters()["tcp.close"], 10000);
+}
+
+TEST(TcpSenderTest, CountsWhatTheCloseTimeoutAbandons) {
+  const int metrics = 500000;
+  TcpSink sink;
+  sink.Pause(true);
+  TcpSender::Options options = toSink(sink.Port());
+  options.closeTimeoutMs = 100;
+  TcpSender sender(options);
+  for (int i = 0; i < metrics; i++) {
+    sender.Send("tcp.abandoned,host=web01,dc=sh,service=billing:1|c");
+  }
+  for (int i = 0; i < 500 && sender.PartialWrites() == 0; i++) {
+    usleep(10 * 1000);
+  }
+  // the peer reads nothing while we close, far from everything fits its buffers
+  sender.Stop();
+  ASSERT_GT(sender.DroppedMetrics(), 0);
+  ASSERT_EQ(sender.SentLines() + sender.DroppedMetrics(), metrics);
+
+  // lines counted as sent are whole on the wire, the cut one is not
+  sink.Pause(false);
+  waitForLines(sink, sender.SentLines());
+  usleep(100 * 1000);
+  ASSERT_EQ(sink.Lines(), sender.SentLines());
+  ASSERT_EQ(sink.MalformedLines(), 0);
+}
+}
+}
@@ -0,0 +1,175 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string.h>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "base/common/basic_types.h"
+#include "base/common/closure.h"
+#include "base/common/logging.h"
+#include "base/thread/thread.h"
+#include "./datagram_sink.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * In-process stand-in for a statsd TCP listener on loopback, for tests and load tests. It reads
+ * newline delimited metrics from any number of connections into a MetricLineCounter, and can
+ * pause reading or drop its connections to exercise a sender's partial writes and reconnects.
+ */
+class TcpSink {
+ public:
+  /**
+   * Listen on port, 0 picks an ephemeral one
+   */
+  explicit TcpSink(int port = 0)
+      : stopped_(false), paused_(false), dropRequested_(false), rejecting_(false), connections_(0) {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK(listener_ >= 0) << "could not create sink socket";
+    int one = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    CHECK(bind(listener_, (struct sockaddr*) &addr, sizeof(addr)) == 0) << "could not bind sink port " << port;
+    CHECK(listen(listener_, 16) == 0) << "could not listen";
+    socklen_t len = sizeof(addr);
+    getsockname(listener_, (struct sockaddr*) &addr, &len);
+    port_ = ntohs(addr.sin_port);
+    receiver_.Start(::NewCallback(this, &TcpSink::receiving));
+  }
+
+  ~TcpSink() {
+    Stop();
+  }
+
+  int Port() const { return port_; }
+
+  /**
+   * Close the listener and every connection
+   */
+  void Stop() {
+    if (!stopped_.exchange(true)) {
+      receiver_.Join();
+      for (size_t i = 0; i < clients_.size(); i++) {
+        close(clients_[i].fd);
+      }
+      clients_.clear();
+      close(listener_);
+    }
+  }
+
+  /**
+   * Stop reading, so senders fill the socket buffers and hit partial writes
+   */
+  void Pause(bool paused) { paused_.store(paused); }
+
+  /**
+   * Reset every open connection, unread bytes are lost
+   */
+  void DropConnections() { dropRequested_.store(true); }
+
+  /**
+   * Reset connections as soon as they are accepted, like a proxy whose upstream is down
+   */
+  void RejectConnections(bool rejecting) { rejecting_.store(rejecting); }
+
+  int64 Connections() const { return connections_.load(); }
+  int64 Lines() const { return received_.Lines(); }
+  int64 MalformedLines() const { return received_.MalformedLines(); }
+  std::map<std::string, double> Counters() const { return received_.Counters(); }
+
+ private:
+  struct Client {
+    int fd;
+    // trailing bytes of a line not terminated yet
+    std::string partial;
+  };
+
+  // RST instead of FIN, like a crashing server
+  static void reset(int fd) {
+    struct linger linger = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    close(fd);
+  }
+
+  void receiving() {
+    char buf[65536];
+    while (!stopped_.load()) {
+      if (dropRequested_.exchange(false)) {
+        for (size_t i = 0; i < clients_.size(); i++) {
+          reset(clients_[i].fd);
+        }
+        clients_.clear();
+      }
+
+      std::vector<struct pollfd> fds(1 + clients_.size());
+      fds[0].fd = listener_;
+      fds[0].events = POLLIN;
+      for (size_t i = 0; i < clients_.size(); i++) {
+        fds[i + 1].fd = clients_[i].fd;
+        fds[i + 1].events = paused_.load() ? 0 : POLLIN;
+      }
+      if (poll(&fds[0], fds.size(), 20) <= 0) {
+        continue;
+      }
+      if (fds[0].revents & POLLIN) {
+        int fd = accept(listener_, NULL, NULL);
+        if (fd >= 0 && rejecting_.load()) {
+          reset(fd);
+          connections_.fetch_add(1);
+        } else if (fd >= 0) {
+          Client client;
+          client.fd = fd;
+          clients_.push_back(client);
+          connections_.fetch_add(1);
+        }
+      }
+      for (size_t i = clients_.size(); i-- > 0;) {
+        if (i + 1 >= fds.size() || fds[i + 1].revents == 0) {
+          continue;
+        }
+        ssize_t ret = recv(clients_[i].fd, buf, sizeof(buf), 0);
+        if (ret <= 0) {
+          // an unterminated last line is discarded, as statsd does
+          close(clients_[i].fd);
+          clients_.erase(clients_.begin() + i);
+          continue;
+        }
+        std::string& partial = clients_[i].partial;
+        partial.append(buf, ret);
+        size_t complete = partial.rfind('\n');
+        if (complete != std::string::npos) {
+          received_.Add(partial.data(), complete);
+          partial.erase(0, complete + 1);
+        }
+      }
+    }
+  }
+
+ private:
+  int listener_;
+  int port_;
+  thread::Thread receiver_;
+  std::atomic<bool> stopped_;
+  std::atomic<bool> paused_;
+  std::atomic<bool> dropRequested_;
+  std::atomic<bool> rejecting_;
+  std::atomic<int64> connections_;
+  // receiving thread only
+  std::vector<Client> clients_;
+  MetricLineCounter received_;
+
+  DISALLOW_COPY_AND_ASSIGN(TcpSink);
+};
+}
+}
@@ -0,0 +1,240 @@
+#include "./thread_staging.h"
+
+#include <algorithm>
+#include <thread>
+#include <utility>
+#include "base/common/logging.h"
+
+namespace base {
+namespace statsd {
+
+static std::atomic<uint64> nextStagingId(1);
+
+struct ThreadStaging::Buffer {
+  Buffer() : active(NULL), free(NULL), released(NULL), accepted(0), outstanding(0), exited(false), orphaned(false) {
+    busy.clear();
+  }
+  ~Buffer() {
+    delete active;
+    deleteList(free);
+    deleteList(released.load());
+  }
+
+  static void deleteList(Chunk* chunk) {
+    while (chunk != NULL) {
+      Chunk* next = chunk->next;
+      delete chunk;
+      chunk = next;
+    }
+  }
+
+  void lock() {
+    while (busy.test_and_set(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+  bool tryLock() { return !busy.test_and_set(std::memory_order_acquire); }
+  void unlock() { busy.clear(std::memory_order_release); }
+
+  // taken by the owner thread on every Add() and by Sweep()
+  std::atomic_flag busy;
+  // chunk being filled, under busy
+  Chunk* active;
+  // empty chunks to fill next, under busy
+  Chunk* free;
+  // chunks Release() gave back, a stack pushed by the consumer and taken whole into free
+  std::atomic<Chunk*> released;
+  // written by the owner thread only, under busy
+  std::atomic<int64> accepted;
+  // chunks handed over and not released yet
+  std::atomic<int> outstanding;
+  // set once the owner thread exited, the buffer is dropped once it has nothing left
+  std::atomic<bool> exited;
+  // set once the ThreadStaging is gone, the owner thread drops it from its cache
+  std::atomic<bool> orphaned;
+};
+
+struct ThreadStaging::BufferCache {
+  ~BufferCache() {
+    for (size_t i = 0; i < entries.size(); i++) {
+      entries[i].second->exited.store(true, std::memory_order_release);
+    }
+  }
+  std::vector<std::pair<uint64, std::shared_ptr<Buffer> > > entries;
+};
+
+thread_local ThreadStaging::BufferCache ThreadStaging::bufferCache_;
+
+ThreadStaging::Chunk::Chunk(Buffer* owner, size_t capacity)
+    : owner(owner), next(NULL), data(new char[capacity]), size(0), metrics(0), stamp(0) {}
+
+ThreadStaging::Chunk::~Chunk() {
+  delete[] data;
+}
+
+ThreadStaging::ThreadStaging(size_t chunkSize, size_t maxPendingBytes)
+    : id_(nextStagingId.fetch_add(1)), chunkSize_(chunkSize), maxPendingBytes_(maxPendingBytes), ready_(NULL),
+      pendingBytes_(0), allocatedChunks_(0), retiredAccepted_(0) {
+  CHECK(chunkSize > sizeof(uint32)) << "staging chunks must hold at least one byte of metric";
+}
+
+ThreadStaging::~ThreadStaging() {
+  std::vector<Chunk*> chunks;
+  TakeReady(&chunks);
+  for (size_t i = 0; i < chunks.size(); i++) {
+    Release(chunks[i]);
+  }
+  std::lock_guard<std::mutex> lock(buffersMutex_);
+  for (size_t i = 0; i < buffers_.size(); i++) {
+    buffers_[i]->orphaned.store(true, std::memory_order_release);
+  }
+  buffers_.clear();
+}
+
+ThreadStaging::Buffer* ThreadStaging::localBuffer() {
+  std::vector<std::pair<uint64, std::shared_ptr<Buffer> > >& entries = bufferCache_.entries;
+  for (size_t i = 0; i < entries.size(); i++) {
+    if (entries[i].first == id_) {
+      return entries[i].second.get();
+    }
+  }
+  // first metric of this thread, the time to forget buffers of stagings gone meanwhile
+  for (size_t i = 0; i < entries.size();) {
+    if (entries[i].second->orphaned.load(std::memory_order_acquire)) {
+      entries.erase(entries.begin() + i);
+    } else {
+      i++;
+    }
+  }
+  std::shared_ptr<Buffer> buffer(new Buffer());
+  {
+    std::lock_guard<std::mutex> lock(buffersMutex_);
+    buffers_.push_back(buffer);
+  }
+  entries.push_back(std::make_pair(id_, buffer));
+  return buffer.get();
+}
+
+ThreadStaging::Chunk* ThreadStaging::takeChunk(Buffer* buffer) {
+  if (buffer->free == NULL) {
+    buffer->free = buffer->released.exchange(NULL, std::memory_order_acquire);
+  }
+  Chunk* chunk = buffer->free;
+  if (chunk == NULL) {
+    allocatedChunks_.fetch_add(1, std::memory_order_relaxed);
+    return new Chunk(buffer, chunkSize_);
+  }
+  buffer->free = chunk->next;
+  chunk->next = NULL;
+  return chunk;
+}
+
+void ThreadStaging::push(Chunk* chunk) {
+  chunk->owner->outstanding.fetch_add(1, std::memory_order_relaxed);
+  chunk->next = ready_.load(std::memory_order_relaxed);
+  while (!ready_.compare_exchange_weak(chunk->next, chunk, std::memory_order_release, std::memory_order_relaxed)) {
+  }
+}
+
+bool ThreadStaging::Add(const char* data, size_t size, uint32 stamp, int64* dropped) {
+  Buffer* buffer = localBuffer();
+  buffer->lock();
+  Chunk* chunk = buffer->active;
+  bool handedOver = false;
+  if (chunk != NULL && chunk->size + sizeof(uint32) + size > chunkSize_) {
+    // past maxPendingBytes the consumer is far behind: keep the chunk for later and drop the new
+    // metric. A plain load first, producers of a full pipeline get here on every metric
+    bool full = pendingBytes_.load(std::memory_order_relaxed) + chunk->size > maxPendingBytes_;
+    if (!full && pendingBytes_.fetch_add(chunk->size, std::memory_order_relaxed) + chunk->size > maxPendingBytes_) {
+      pendingBytes_.fetch_sub(chunk->size, std::memory_order_relaxed);
+      full = true;
+    }
+    if (full) {
+      buffer->unlock();
+      (*dropped)++;
+      return false;
+    }
+    push(chunk);
+    handedOver = true;
+    chunk = NULL;
+  }
+  if (chunk == NULL) {
+    chunk = buffer->active = takeChunk(buffer);
+  }
+  uint32 length = static_cast<uint32>(size);
+  memcpy(chunk->data + chunk->size, &length, sizeof(length));
+  memcpy(chunk->data + chunk->size + sizeof(length), data, size);
+  chunk->size += sizeof(length) + size;
+  chunk->metrics++;
+  if (chunk->stamp == 0) {
+    chunk->stamp = stamp;
+  }
+  buffer->accepted.store(buffer->accepted.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  buffer->unlock();
+  return handedOver;
+}
+
+void ThreadStaging::Sweep(bool wait) {
+  std::lock_guard<std::mutex> lock(buffersMutex_);
+  for (size_t i = 0; i < buffers_.size();) {
+    Buffer* buffer = buffers_[i].get();
+    bool exited = buffer->exited.load(std::memory_order_acquire);
+    if (wait) {
+      buffer->lock();
+    } else if (!buffer->tryLock()) {
+      // appending right now, it will be swept next time
+      i++;
+      continue;
+    }
+    Chunk* chunk = buffer->active;
+    if (chunk != NULL && chunk->size > 0) {
+      buffer->active = NULL;
+      pendingBytes_.fetch_add(chunk->size, std::memory_order_relaxed);
+      push(chunk);
+    }
+    buffer->unlock();
+
+    if (exited && buffer->outstanding.load(std::memory_order_acquire) == 0) {
+      retiredAccepted_ += buffer->accepted.load(std::memory_order_relaxed);
+      buffers_.erase(buffers_.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void ThreadStaging::TakeReady(std::vector<Chunk*>* chunks) {
+  Chunk* chunk = ready_.exchange(NULL, std::memory_order_acquire);
+  size_t first = chunks->size();
+  for (; chunk != NULL; chunk = chunk->next) {
+    chunks->push_back(chunk);
+  }
+  // the stack gives the newest first
+  std::reverse(chunks->begin() + first, chunks->end());
+}
+
+void ThreadStaging::Release(Chunk* chunk) {
+  pendingBytes_.fetch_sub(chunk->size, std::memory_order_relaxed);
+  Buffer* owner = chunk->owner;
+  chunk->size = 0;
+  chunk->metrics = 0;
+  chunk->stamp = 0;
+  // kept however many there are, so a thread never allocates twice for the same backlog
+  chunk->next = owner->released.load(std::memory_order_relaxed);
+  while (!owner->released.compare_exchange_weak(chunk->next, chunk, std::memory_order_release,
+                                                std::memory_order_relaxed)) {
+  }
+  // last, Sweep() may free the owner as soon as nothing is outstanding
+  owner->outstanding.fetch_sub(1, std::memory_order_release);
+}
+
+int64 ThreadStaging::Accepted() const {
+  std::lock_guard<std::mutex> lock(buffersMutex_);
+  int64 accepted = retiredAccepted_;
+  for (size_t i = 0; i < buffers_.size(); i++) {
+    accepted += buffers_[i]->accepted.load(std::memory_order_relaxed);
+  }
+  return accepted;
+}
+}
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <string.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "base/common/basic_types.h"
+
+namespace base {
+namespace statsd {
+
+/**
+ * Per thread staging buffers of rendered metrics, handed to one consumer a whole chunk at a time.
+ *
+ * Add() appends a metric to a chunk owned by the calling thread, behind a lock only the
+ * consumer's Sweep() ever contends for, so producers no longer meet on a shared queue for
+ * every metric. A full chunk is pushed onto a lock-free stack with one CAS and the consumer
+ * takes the whole stack with one exchange. Sweep() hands over the partial chunks of threads
+ * which went quiet, so no metric waits for its thread to send again, and forgets the buffers
+ * of threads which exited.
+ *
+ * Consumed chunks go back to a free list of the thread they came from and are never freed before
+ * it exits: a thread holds as many chunks as it ever had handed over at once, one more at most,
+ * and once it has them nothing is allocated however its chunks are swept and released.
+ */
+class ThreadStaging {
+ public:
+  struct Buffer;
+
+  /**
+   * Metrics of one thread, each one a uint32 size followed by its bytes
+   */
+  struct Chunk {
+    Chunk(Buffer* owner, size_t capacity);
+    ~Chunk();
+
+    Buffer* owner;
+    Chunk* next;
+    char* data;
+    size_t size;
+    size_t metrics;
+    // first latency stamp given to Add() since the chunk was last empty, 0 if none
+    uint32 stamp;
+
+    DISALLOW_COPY_AND_ASSIGN(Chunk);
+  };
+
+  /**
+   * @param chunkSize
+   *     bytes of each thread's chunk, size prefixes included
+   * @param maxPendingBytes
+   *     bytes handed over and not released yet past which a full chunk is not handed over: the new
+   *     metric is dropped and the full chunk kept
+   */
+  ThreadStaging(size_t chunkSize, size_t maxPendingBytes);
+
+  /**
+   * Frees the chunks still handed over, buffers of live threads go away with their thread
+   */
+  ~ThreadStaging();
+
+  /**
+   * Append a metric of at most MaxMetricSize() bytes to the calling thread's chunk, handing
+   * the chunk over first if the metric does not fit.
+   * @param dropped
+   *     incremented by one when the new metric is dropped because of maxPendingBytes, the full
+   *     chunk is kept
+   * @return whether a chunk was handed over, the consumer may want to wake up
+   */
+  bool Add(const char* data, size_t size, uint32 stamp, int64* dropped);
+
+  size_t MaxMetricSize() const { return chunkSize_ - sizeof(uint32); }
+
+  /**
+   * Hand over every partial chunk, skipping the ones whose thread is appending right now
+   * unless wait is set, and forget the buffers of exited threads. Consumer only.
+   */
+  void Sweep(bool wait);
+
+  /**
+   * Append the chunks handed over since the last call to chunks, oldest first. Consumer only.
+   */
+  void TakeReady(std::vector<Chunk*>* chunks);
+  bool HasReady() const { return ready_.load(std::memory_order_relaxed) != NULL; }
+
+  /**
+   * Pass every metric of chunk to consume(const char* data, size_t size)
+   */
+  template <typename Consumer>
+  static void ForEach(const Chunk* chunk, Consumer consume);
+
+  /**
+   * Give a chunk returned by TakeReady() back to its thread
+   */
+  void Release(Chunk* chunk);
+
+  /**
+   * Chunks allocated so far, by every thread
+   */
+  int64 AllocatedChunks() const { return allocatedChunks_.load(std::memory_order_relaxed); }
+
+  /**
+   * Metrics ever added and not dropped, and bytes handed over but not released yet
+   */
+  int64 Accepted() const;
+  size_t PendingBytes() const { return pendingBytes_.load(std::memory_order_relaxed); }
+
+ private:
+  struct BufferCache;
+  Buffer* localBuffer();
+  Chunk* takeChunk(Buffer* buffer);
+  void push(Chunk* chunk);
+
+ private:
+  uint64 id_;
+  size_t chunkSize_;
+  size_t maxPendingBytes_;
+  std::atomic<Chunk*> ready_;
+  std::atomic<size_t> pendingBytes_;
+  std::atomic<int64> allocatedChunks_;
+  // metrics accepted by buffers which are gone
+  int64 retiredAccepted_;
+
+  mutable std::mutex buffersMutex_;
+  std::vector<std::shared_ptr<Buffer> > buffers_;
+
+  // buffers of the calling thread, one per ThreadStaging it has added to
+  static thread_local BufferCache bufferCache_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThreadStaging);
+};
+
+template <typename Consumer>
+void ThreadStaging::ForEach(const Chunk* chunk, Consumer consume) {
+  size_t offset = 0;
+  while (offset < chunk->size) {
+    uint32 size;
+    memcpy(&size, chunk->data + offset, sizeof(size));
+    consume(static_cast<const char*>(chunk->data + offset + sizeof(size)), static_cast<size_t>(size));
+    offset += sizeof(size) + size;
+  }
+}
+}
+}
@@ -0,0 +1,168 @@
+#include "./thread_staging.h"
+
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "base/testing/gtest.h"
+
+namespace base {
+namespace statsd {
+
+// every metric of the chunks handed over so far, chunks released
+static std::vector<std::string> drain(ThreadStaging* staging, std::vector<uint32>* stamps = NULL) {
+  std::vector<ThreadStaging::Chunk*> chunks;
+  staging->TakeReady(&chunks);
+  std::vector<std::string> metrics;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    ThreadStaging::ForEach(chunks[i], [&metrics](const char* data, size_t size) {
+      metrics.push_back(std::string(data, size));
+    });
+    if (stamps != NULL) {
+      stamps->push_back(chunks[i]->stamp);
+    }
+    staging->Release(chunks[i]);
+  }
+  return metrics;
+}
+
+TEST(ThreadStagingTest, HandsOverFullChunksInOrder) {
+  // 3 metrics of 4 + 10 bytes per chunk
+  ThreadStaging staging(3 * 14, 1 << 20);
+  ASSERT_EQ(staging.MaxMetricSize(), 38u);
+  int64 dropped = 0;
+  int handedOver = 0;
+  for (int i = 0; i < 10; i++) {
+    std::string metric = "m" + std::to_string(i) + ":12345|c";
+    handedOver += staging.Add(metric.data(), metric.size(), 0, &dropped);
+  }
+  ASSERT_EQ(handedOver, 3);
+  ASSERT_TRUE(staging.HasReady());
+  ASSERT_EQ(staging.PendingBytes(), 9u * 14);
+  std::vector<std::string> metrics = drain(&staging);
+  ASSERT_EQ(metrics.size(), 9u);
+  for (size_t i = 0; i < metrics.size(); i++) {
+    ASSERT_EQ(metrics[i], "m" + std::to_string(i) + ":12345|c");
+  }
+  ASSERT_EQ(staging.PendingBytes(), 0u);
+  ASSERT_EQ(dropped, 0);
+
+  // the 10th waits for a sweep
+  ASSERT_FALSE(staging.HasReady());
+  staging.Sweep(false);
+  metrics = drain(&staging);
+  ASSERT_EQ(metrics.size(), 1u);
+  ASSERT_EQ(metrics[0], "m9:12345|c");
+  ASSERT_EQ(staging.Accepted(), 10);
+}
+
+TEST(ThreadStagingTest, QuietThreadsDoNotAllocateOnceWarm) {
+  ThreadStaging staging(1024, 1 << 20);
+  int64 dropped = 0;
+  std::string metric = "quiet:1|c";
+  // a low rate thread, swept by age before its chunk fills, the consumer at times two sweeps behind
+  for (int round = 0; round < 100; round++) {
+    staging.Add(metric.data(), metric.size(), 0, &dropped);
+    staging.Sweep(true);
+    if (round % 2 == 0) {
+      ASSERT_EQ(drain(&staging).size(), 1u);
+      continue;
+    }
+    staging.Add(metric.data(), metric.size(), 0, &dropped);
+    staging.Sweep(true);
+    ASSERT_EQ(drain(&staging).size(), 2u);
+  }
+  // the two chunks of the largest backlog, however often they were swept
+  ASSERT_EQ(staging.AllocatedChunks(), 2);
+  ASSERT_EQ(dropped, 0);
+}
+
+TEST(ThreadStagingTest, KeepsTheFirstStamp) {
+  ThreadStaging staging(64, 1 << 20);
+  int64 dropped = 0;
+  staging.Add("a:1|c", 5, 0, &dropped);
+  staging.Add("a:1|c", 5, 7, &dropped);
+  staging.Add("a:1|c", 5, 9, &dropped);
+  staging.Sweep(true);
+  std::vector<uint32> stamps;
+  ASSERT_EQ(drain(&staging, &stamps).size(), 3u);
+  ASSERT_EQ(stamps, std::vector<uint32>(1, 7));
+
+  // a reused chunk starts unstamped
+  staging.Add("a:1|c", 5, 0, &dropped);
+  staging.Sweep(true);
+  stamps.clear();
+  drain(&staging, &stamps);
+  ASSERT_EQ(stamps, std::vector<uint32>(1, 0));
+}
+
+TEST(ThreadStagingTest, DropsNewMetricsPastMaxPendingBytes) {
+  // one full chunk may wait for the consumer, not two
+  ThreadStaging staging(32, 40);
+  int64 dropped = 0;
+  for (int i = 0; i < 12; i++) {
+    staging.Add("d:1|c", 5, 0, &dropped);
+  }
+  // 3 metrics per chunk: the first chunk is handed over, the second one is kept full
+  ASSERT_EQ(dropped, 6);
+  ASSERT_EQ(staging.Accepted(), 6);
+  ASSERT_EQ(drain(&staging).size(), 3u);
+  staging.Add("d:1|c", 5, 0, &dropped);
+  ASSERT_EQ(dropped, 6);
+  staging.Sweep(true);
+  ASSERT_EQ(drain(&staging).size(), 4u);
+}
+
+TEST(ThreadStagingTest, CollectsBuffersOfExitedThreads) {
+  ThreadStaging staging(1024, 1 << 20);
+  std::thread producer([&staging]() {
+    int64 dropped = 0;
+    staging.Add("gone:1|c", 8, 0, &dropped);
+  });
+  producer.join();
+  staging.Sweep(false);
+  ASSERT_EQ(drain(&staging), std::vector<std::string>(1, "gone:1|c"));
+  // the buffer is forgotten once nothing of it is left, its metrics still count
+  staging.Sweep(false);
+  ASSERT_EQ(staging.Accepted(), 1);
+}
+
+TEST(ThreadStagingTest, ConcurrentProducers) {
+  const int threads = 8;
+  const int perThread = 20000;
+  ThreadStaging staging(256, 64 << 20);
+  std::vector<std::thread> producers;
+  for (int t = 0; t < threads; t++) {
+    producers.push_back(std::thread([&staging, t]() {
+      int64 dropped = 0;
+      for (int i = 0; i < perThread; i++) {
+        std::string metric = "t" + std::to_string(t) + ":" + std::to_string(i) + "|c";
+        staging.Add(metric.data(), metric.size(), 0, &dropped);
+      }
+      ASSERT_EQ(dropped, 0);
+    }));
+  }
+  // consume while they produce, each thread's metrics come in order
+  std::vector<int> next(threads, 0);
+  bool producing = true;
+  while (producing) {
+    producing = staging.Accepted() < threads * perThread;
+    staging.Sweep(!producing);
+    std::vector<std::string> metrics = drain(&staging);
+    for (size_t i = 0; i < metrics.size(); i++) {
+      int t = atoi(metrics[i].c_str() + 1);
+      int value = atoi(metrics[i].c_str() + metrics[i].find(':') + 1);
+      ASSERT_EQ(value, next[t]++);
+    }
+  }
+  for (size_t t = 0; t < producers.size(); t++) {
+    producers[t].join();
+  }
+  staging.Sweep(true);
+  for (int t = 0; t < threads; t++) {
+    ASSERT_EQ(next[t], perThread);
+  }
+  ASSERT_TRUE(drain(&staging).empty());
+}
+}
+}  // namespace base
@@ -0,0 +1,315 @@
+#include "./uring_writer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#endif
+
+namespace base {
+namespace statsd {
+
+// how long the SQPOLL kernel thread keeps spinning after the last submission
+static const unsigned SQ_THREAD_IDLE_MS = 100;
+// how long the destructor waits for writes in flight
+static const int CLOSE_WAIT_MS = 100;
+
+#if defined(__linux__)
+
+struct UringData {
+  int ringFd;
+  bool sqpoll;
+  // set up completely
+  bool ready;
+
+  void* sqRing;
+  size_t sqRingSize;
+  void* cqRing;
+  size_t cqRingSize;
+  struct io_uring_sqe* sqes;
+  size_t sqesSize;
+
+  // shared with the kernel
+  unsigned* sqTail;
+  unsigned* sqMask;
+  unsigned* sqFlags;
+  unsigned* sqArray;
+  unsigned* cqHead;
+  unsigned* cqTail;
+  unsigned* cqMask;
+  struct io_uring_cqe* cqes;
+};
+
+UringWriter* UringWriter::Create(int sock, size_t slotSize, size_t slots, bool sqpoll, std::string* error) {
+  UringWriter* writer = new UringWriter(slotSize, slots);
+  if (!writer->init(sock, sqpoll, error)) {
+    delete writer;
+    return NULL;
+  }
+  return writer;
+}
+
+UringWriter::UringWriter(size_t slotSize, size_t slots) {
+  d = new UringData;
+  memset(d, 0, sizeof(*d));
+  d->ringFd = -1;
+  slotSize_ = slotSize;
+  slots_ = slots;
+  buffers_ = NULL;
+  unsubmitted_ = 0;
+  failedCompletions_ = 0;
+  syscalls_ = 0;
+  errmsg_[0] = '\0';
+}
+
+bool UringWriter::init(int sock, bool sqpoll, std::string* error) {
+  char errmsg[256];
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  if (sqpoll) {
+    params.flags |= IORING_SETUP_SQPOLL;
+    params.sq_thread_idle = SQ_THREAD_IDLE_MS;
+  }
+  // the completion queue is twice as large, so it can never overflow with one sqe per slot
+  d->ringFd = syscall(__NR_io_uring_setup, slots_, &params);
+  if (d->ringFd < 0) {
+    snprintf(errmsg, sizeof(errmsg), "io_uring_setup fail, err=%m");
+    *error = errmsg;
+    return false;
+  }
+  d->sqpoll = sqpoll;
+
+  d->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  d->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (singleMmap) {
+    d->sqRingSize = d->cqRingSize = std::max(d->sqRingSize, d->cqRingSize);
+  }
+  d->sqRing = mmap(NULL, d->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d->ringFd,
+                   IORING_OFF_SQ_RING);
+  if (d->sqRing == MAP_FAILED) {
+    d->sqRing = NULL;
+    snprintf(errmsg, sizeof(errmsg), "mmap io_uring submission queue fail, err=%m");
+    *error = errmsg;
+    return false;
+  }
+  if (singleMmap) {
+    d->cqRing = d->sqRing;
+  } else {
+    d->cqRing = mmap(NULL, d->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d->ringFd,
+                     IORING_OFF_CQ_RING);
+    if (d->cqRing == MAP_FAILED) {
+      d->cqRing = NULL;
+      snprintf(errmsg, sizeof(errmsg), "mmap io_uring completion queue fail, err=%m");
+      *error = errmsg;
+      return false;
+    }
+  }
+  d->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  void* sqes = mmap(NULL, d->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d->ringFd,
+                    IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    snprintf(errmsg, sizeof(errmsg), "mmap io_uring sqes fail, err=%m");
+    *error = errmsg;
+    return false;
+  }
+  d->sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+  char* sq = static_cast<char*>(d->sqRing);
+  char* cq = static_cast<char*>(d->cqRing);
+  d->sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+  d->sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+  d->sqFlags = reinterpret_cast<unsigned*>(sq + params.sq_off.flags);
+  d->sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+  d->cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+  d->cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+  d->cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+  d->cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+  // registered once, so the kernel neither maps the buffers nor looks the socket up per write
+  void* buffers = mmap(NULL, slotSize_ * slots_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buffers == MAP_FAILED) {
+    snprintf(errmsg, sizeof(errmsg), "could not allocate io_uring buffers, err=%m");
+    *error = errmsg;
+    return false;
+  }
+  buffers_ = static_cast<char*>(buffers);
+  struct iovec iov;
+  iov.iov_base = buffers_;
+  iov.iov_len = slotSize_ * slots_;
+  if (syscall(__NR_io_uring_register, d->ringFd, IORING_REGISTER_BUFFERS, &iov, 1) != 0) {
+    snprintf(errmsg, sizeof(errmsg), "register io_uring buffers fail, err=%m");
+    *error = errmsg;
+    return false;
+  }
+  if (syscall(__NR_io_uring_register, d->ringFd, IORING_REGISTER_FILES, &sock, 1) != 0) {
+    snprintf(errmsg, sizeof(errmsg), "register io_uring socket fail, err=%m");
+    *error = errmsg;
+    return false;
+  }
+
+  freeSlots_.reserve(slots_);
+  for (size_t i = slots_; i > 0; i--) {
+    freeSlots_.push_back(static_cast<uint32>(i - 1));
+  }
+  d->ready = true;
+  return true;
+}
+
+UringWriter::~UringWriter() {
+  if (d->ready) {
+    flush(false);
+    for (int i = 0; i < CLOSE_WAIT_MS && InFlight() > 0; i++) {
+      Reap();
+      if (InFlight() > 0) {
+        usleep(1000);
+      }
+    }
+  }
+  if (d->sqes != NULL) {
+    munmap(d->sqes, d->sqesSize);
+  }
+  if (d->cqRing != NULL && d->cqRing != d->sqRing) {
+    munmap(d->cqRing, d->cqRingSize);
+  }
+  if (d->sqRing != NULL) {
+    munmap(d->sqRing, d->sqRingSize);
+  }
+  // the kernel cancels what is left and keeps the registered pages pinned until it is done with them
+  if (d->ringFd >= 0) {
+    close(d->ringFd);
+  }
+  if (buffers_ != NULL) {
+    munmap(buffers_, slotSize_ * slots_);
+  }
+  delete d;
+  d = NULL;
+}
+
+int UringWriter::enter(unsigned toSubmit, unsigned minComplete, unsigned flags) {
+  while (true) {
+    syscalls_++;
+    int ret = syscall(__NR_io_uring_enter, d->ringFd, toSubmit, minComplete, flags, NULL, 0);
+    if (ret >= 0) {
+      return ret;
+    }
+    if (errno != EINTR) {
+      snprintf(errmsg_, sizeof(errmsg_), "io_uring_enter fail, err=%m");
+      return -1;
+    }
+  }
+}
+
+bool UringWriter::flush(bool waitForOne) {
+  unsigned flags = waitForOne ? IORING_ENTER_GETEVENTS : 0;
+  unsigned minComplete = waitForOne ? 1 : 0;
+  if (d->sqpoll) {
+    // the kernel thread picks sqes up by itself unless it went to sleep, the fence orders the tail
+    // store before the flags load
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (unsubmitted_ > 0 && (__atomic_load_n(d->sqFlags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP)) {
+      flags |= IORING_ENTER_SQ_WAKEUP;
+    }
+    unsubmitted_ = 0;
+    return flags == 0 || enter(0, minComplete, flags) >= 0;
+  }
+  if (unsubmitted_ == 0 && !waitForOne) {
+    return true;
+  }
+  int ret = enter(unsubmitted_, minComplete, flags);
+  if (ret < 0) {
+    return false;
+  }
+  unsubmitted_ -= ret;
+  return true;
+}
+
+void UringWriter::Reap() {
+  unsigned head = *d->cqHead;
+  unsigned tail = __atomic_load_n(d->cqTail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    const struct io_uring_cqe* cqe = &d->cqes[head & *d->cqMask];
+    if (cqe->res < 0) {
+      failedCompletions_++;
+      errno = -cqe->res;
+      snprintf(errmsg_, sizeof(errmsg_), "io_uring write fail, err=%m");
+    }
+    freeSlots_.push_back(static_cast<uint32>(cqe->user_data));
+    head++;
+  }
+  __atomic_store_n(d->cqHead, head, __ATOMIC_RELEASE);
+}
+
+size_t UringWriter::Submit(const MetricPacker& packer, size_t begin, size_t end, size_t* bytes) {
+  Reap();
+  size_t submitted = 0;
+  for (size_t i = begin; i < end; i++) {
+    // every buffer is in flight, hand the queued ones over and wait for one to come back
+    bool failed = false;
+    while (freeSlots_.empty() && !failed) {
+      failed = !flush(true);
+      Reap();
+    }
+    if (failed) {
+      break;
+    }
+    uint32 slot = freeSlots_.back();
+    freeSlots_.pop_back();
+    const std::string& packet = packer.Packet(i);
+    char* buffer = buffers_ + slot * slotSize_;
+    memcpy(buffer, packet.data(), packet.size());
+
+    // the kernel only reads the tail, so a plain load of our own last store is fine
+    unsigned tail = *d->sqTail;
+    unsigned index = tail & *d->sqMask;
+    struct io_uring_sqe* sqe = &d->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->flags = IOSQE_FIXED_FILE;
+    // index into the registered files
+    sqe->fd = 0;
+    sqe->addr = reinterpret_cast<uint64>(buffer);
+    sqe->len = packet.size();
+    sqe->buf_index = 0;
+    sqe->user_data = slot;
+    d->sqArray[index] = index;
+    __atomic_store_n(d->sqTail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted_++;
+    submitted++;
+    *bytes += packet.size();
+  }
+  // queued sqes that could not be submitted now go with the next call
+  flush(false);
+  return submitted;
+}
+
+#else
+
+struct UringData {
+};
+
+UringWriter* UringWriter::Create(int, size_t, size_t, bool, std::string* error) {
+  *error = "io_uring is linux only";
+  return NULL;
+}
+
+UringWriter::~UringWriter() {
+}
+
+size_t UringWriter::Submit(const MetricPacker&, size_t, size_t, size_t* bytes) {
+  *bytes = 0;
+  return 0;
+}
+
+void UringWriter::Reap() {
+}
+
+#endif
+}
+}
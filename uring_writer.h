@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include "base/common/basic_types.h"
+#include "./metric_packer.h"
+
+namespace base {
+namespace statsd {
+
+struct UringData;
+
+/**
+ * Writes datagrams to a connected socket through an io_uring. Packets are copied into buffers
+ * registered with the kernel and submitted as IORING_OP_WRITE_FIXED on a registered file, and
+ * completions are reaped by later calls instead of being waited for. Talks to the kernel with raw
+ * syscalls, no liburing needed. Linux only, not thread safe.
+ */
+class UringWriter {
+ public:
+  /**
+   * Set up a ring of `slots` send buffers of slotSize bytes each for sock.
+   * @param sqpoll
+   *     let a kernel thread poll the submission queue, so submitting needs no syscall while it is awake
+   * @return NULL and why in error when the kernel, seccomp or RLIMIT_MEMLOCK do not allow it
+   */
+  static UringWriter* Create(int sock, size_t slotSize, size_t slots, bool sqpoll, std::string* error);
+
+  /**
+   * Waits a little for the writes still in flight, then tears the ring down. The socket stays open.
+   */
+  ~UringWriter();
+
+  /**
+   * Copy packets [begin, end) of packer into free buffers and submit them. Only waits when every
+   * buffer is in flight. Every packet must fit in SlotSize().
+   *
+   * @param bytes
+   *     receives payload bytes of the submitted datagrams
+   * @return number of datagrams submitted, LastError() tells why if it is short.
+   */
+  size_t Submit(const MetricPacker& packer, size_t begin, size_t end, size_t* bytes);
+
+  /**
+   * Reap what completed so far without waiting.
+   */
+  void Reap();
+
+  size_t SlotSize() const { return slotSize_; }
+  size_t InFlight() const { return slots_ - freeSlots_.size(); }
+
+  /**
+   * Submitted writes the kernel completed with an error, LastError() has the latest one
+   */
+  int64 FailedCompletions() const { return failedCompletions_; }
+  const char* LastError() const { return errmsg_; }
+
+  /**
+   * Number of io_uring_enter calls so far
+   */
+  int64 Syscalls() const { return syscalls_; }
+
+ private:
+  UringWriter(size_t slotSize, size_t slots);
+  bool init(int sock, bool sqpoll, std::string* error);
+  int enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+  bool flush(bool waitForOne);
+
+ private:
+  struct UringData* d;
+  size_t slotSize_;
+  size_t slots_;
+  char* buffers_;
+  std::vector<uint32> freeSlots_;
+  // sqes queued but not handed to the kernel yet
+  unsigned unsubmitted_;
+  int64 failedCompletions_;
+  int64 syscalls_;
+  char errmsg_[1024];
+
+  DISALLOW_COPY_AND_ASSIGN(UringWriter);
+};
+}
+}
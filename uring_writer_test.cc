@@ -0,0 +1,197 @@
+#include "./uring_writer.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+#include "base/testing/gtest.h"
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#endif
+
+namespace base {
+namespace statsd {
+
+// false where the kernel has no io_uring, or seccomp or a sysctl forbids it
+static bool uringAvailable() {
+#if defined(__linux__)
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = syscall(__NR_io_uring_setup, 1, &params);
+  if (fd >= 0) {
+    close(fd);
+    return true;
+  }
+  return errno != ENOSYS && errno != EPERM;
+#else
+  return false;
+#endif
+}
+
+class UringWriterTest: public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    available = uringAvailable();
+    if (!available) {
+      printf("io_uring is not available here, skipped\n");
+      return;
+    }
+    receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    ASSERT_GE(receiver, 0);
+    struct timeval timeout = {1, 0};
+    setsockopt(receiver, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT_EQ(bind(receiver, (struct sockaddr*) &addr, sizeof(addr)), 0);
+    socklen_t len = sizeof(addr);
+    getsockname(receiver, (struct sockaddr*) &addr, &len);
+
+    // io_uring only writes to connected sockets
+    sender = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    ASSERT_GE(sender, 0);
+    ASSERT_EQ(connect(sender, (struct sockaddr*) &addr, sizeof(addr)), 0);
+  }
+  virtual void TearDown() {
+    if (available) {
+      close(receiver);
+      close(sender);
+    }
+  }
+
+  UringWriter* newWriter(size_t slots) {
+    std::string error;
+    UringWriter* writer = UringWriter::Create(sender, 256, slots, false, &error);
+    EXPECT_TRUE(writer != NULL) << error;
+    return writer;
+  }
+
+  std::vector<std::string> receiveAll(size_t n) {
+    std::vector<std::string> received;
+    char buf[65536];
+    for (size_t i = 0; i < n; i++) {
+      ssize_t ret = recv(receiver, buf, sizeof(buf), 0);
+      // io_uring completion work run on this thread interrupts a recv with a timeout
+      if (ret < 0 && errno == EINTR) {
+        i--;
+        continue;
+      }
+      if (ret < 0) {
+        break;
+      }
+      received.push_back(std::string(buf, ret));
+    }
+    // io_uring does not order independent writes
+    std::sort(received.begin(), received.end());
+    return received;
+  }
+
+  // until every write came back, or 1s went by
+  static void reapAll(UringWriter* writer) {
+    for (int i = 0; i < 1000 && writer->InFlight() > 0; i++) {
+      writer->Reap();
+      if (writer->InFlight() > 0) {
+        usleep(1000);
+      }
+    }
+  }
+
+  static MetricPacker* pack(int packets) {
+    MetricPacker* packer = new MetricPacker(64);
+    for (int i = 0; i < packets; i++) {
+      // one line per packet
+      packer->Add("uring.key" + std::to_string(i) + ":" + std::string(40, '1') + "|c");
+    }
+    packer->Finish();
+    return packer;
+  }
+
+  static std::vector<std::string> packets(const MetricPacker& packer) {
+    std::vector<std::string> expected;
+    for (size_t i = 0; i < packer.Size(); i++) {
+      expected.push_back(packer.Packet(i));
+    }
+    std::sort(expected.begin(), expected.end());
+    return expected;
+  }
+
+  bool available;
+  int receiver;
+  int sender;
+  struct sockaddr_in addr;
+};
+
+TEST_F(UringWriterTest, ReapsCompletionsLazily) {
+  if (!available) {
+    return;
+  }
+  std::unique_ptr<UringWriter> writer(newWriter(8));
+  ASSERT_TRUE(writer != NULL);
+  std::unique_ptr<MetricPacker> packer(pack(5));
+  ASSERT_EQ(packer->Size(), 5u);
+
+  size_t bytes = 0;
+  ASSERT_EQ(writer->Submit(*packer, 0, packer->Size(), &bytes), 5u);
+  ASSERT_EQ(bytes, 5 * packer->Packet(0).size());
+  // one io_uring_enter for the whole batch, and nothing waited for
+  ASSERT_EQ(writer->Syscalls(), 1);
+  ASSERT_EQ(writer->InFlight(), 5u);
+  ASSERT_EQ(receiveAll(5), packets(*packer));
+
+  // completions are only taken when asked for
+  ASSERT_EQ(writer->InFlight(), 5u);
+  reapAll(writer.get());
+  ASSERT_EQ(writer->InFlight(), 0u);
+  ASSERT_EQ(writer->FailedCompletions(), 0);
+  ASSERT_EQ(writer->Syscalls(), 1);
+}
+
+TEST_F(UringWriterTest, WaitsForASlotWhenEveryOneIsInFlight) {
+  if (!available) {
+    return;
+  }
+  const size_t slots = 4;
+  std::unique_ptr<UringWriter> writer(newWriter(slots));
+  ASSERT_TRUE(writer != NULL);
+  std::unique_ptr<MetricPacker> packer(pack(20));
+
+  size_t bytes = 0;
+  ASSERT_EQ(writer->Submit(*packer, 0, packer->Size(), &bytes), packer->Size());
+  ASSERT_LE(writer->InFlight(), slots);
+  // every buffer came back at least once through a waiting io_uring_enter
+  ASSERT_GT(writer->Syscalls(), 1);
+  ASSERT_EQ(receiveAll(packer->Size()), packets(*packer));
+  reapAll(writer.get());
+  ASSERT_EQ(writer->InFlight(), 0u);
+  ASSERT_EQ(writer->FailedCompletions(), 0);
+}
+
+TEST_F(UringWriterTest, CountsFailedCompletions) {
+  if (!available) {
+    return;
+  }
+  std::unique_ptr<UringWriter> writer(newWriter(8));
+  ASSERT_TRUE(writer != NULL);
+  std::unique_ptr<MetricPacker> packer(pack(1));
+  // nobody listens anymore, the port unreachable of one write fails a later one
+  close(receiver);
+  receiver = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  for (int i = 0; i < 100 && writer->FailedCompletions() == 0; i++) {
+    size_t bytes = 0;
+    ASSERT_EQ(writer->Submit(*packer, 0, 1, &bytes), 1u);
+    reapAll(writer.get());
+  }
+  ASSERT_GT(writer->FailedCompletions(), 0);
+  ASSERT_NE(std::string(writer->LastError()).find("io_uring write fail"), std::string::npos);
+  ASSERT_EQ(writer->InFlight(), 0u);
+}
+}
+}